@@ -0,0 +1,59 @@
+/*
+* Copyright (c) 2017 Calvin Rose
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to
+* deal in the Software without restriction, including without limitation the
+* rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+* sell copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*/
+
+#ifndef JANETUI_H
+#define JANETUI_H
+
+/* Native API of janetui, for C code that feeds the controls without
+ * going through a Janet VM. Metrics made with ui/metric can be written
+ * from any thread. A native thread that outlives the Janet value it got
+ * a metric from retains the metric and releases it when done. */
+
+#include <stdint.h>
+#include <janet/janet.h>
+
+#ifndef JANETUI_API
+#if defined(JANETUI_DLL_IMPORT)
+#define JANETUI_API __declspec(dllimport)
+#elif defined(_WIN32)
+#define JANETUI_API __declspec(dllexport)
+#else
+#define JANETUI_API __attribute__((visibility("default")))
+#endif
+#endif
+
+typedef struct JanetUIMetric JanetUIMetric;
+
+/* The metric in argument n, or a panic */
+JANETUI_API JanetUIMetric *janetui_getmetric(const Janet *argv, int32_t n);
+JANETUI_API void janetui_metric_retain(JanetUIMetric *m);
+JANETUI_API void janetui_metric_release(JanetUIMetric *m);
+JANETUI_API int janetui_metric_is_float(const JanetUIMetric *m);
+
+/* Writers convert the value to the type of the metric */
+JANETUI_API void janetui_metric_set_int(JanetUIMetric *m, int64_t value);
+JANETUI_API void janetui_metric_set_float(JanetUIMetric *m, double value);
+JANETUI_API void janetui_metric_add_int(JanetUIMetric *m, int64_t delta);
+JANETUI_API void janetui_metric_add_float(JanetUIMetric *m, double delta);
+JANETUI_API double janetui_metric_value(const JanetUIMetric *m);
+
+#endif
@@ -22,38 +22,249 @@
 
 #include <janet/janet.h>
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <regex.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#endif
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Some paths use GTK, cairo and pango directly, below libui: idle
+ * priorities, partial invalidation, the map signal of lazy pages,
+ * scroll events, and rasterizing on worker threads. They are built
+ * where libui uses its GTK backend, and the Windows and macOS backends
+ * get the portable fallbacks next to each of them. */
+#if !defined(_WIN32) && !defined(__APPLE__)
+#define UI_GTK
+#endif
+#ifdef UI_GTK
+#include <cairo.h>
+#include <pango/pangocairo.h>
+#include <gtk/gtk.h>
+#endif
 #include "ui.h"
+#include "janetui.h"
+
+/* USDT probes for bpftrace and perf, in the janetui provider. A probe
+ * is a single nop until a tracer attaches to it, so they stay in
+ * release builds. Controls are identified by their type name and
+ * native handle, and handlers by the type name of their control and
+ * their event slot, or an empty name and slot -1 for timers and
+ * ui/queue-main. Probes are left out where sys/sdt.h is missing, or
+ * with -DJANETUI_NO_SDT.
+ *
+ *   handler__entry(type, slot), handler__return(type, slot)
+ *   timer__fire(), queue__run()
+ *   control__create(type, handle), control__destroy(type, handle)
+ *   main__step__entry(wait), main__step__return(pending)
+ *
+ * For example, to count events by control:
+ *   bpftrace -e 'usdt:./build/janetui.so:janetui:handler__entry
+ *                { @[str(arg0), arg1] = count(); }' -p PID */
+#if !defined(JANETUI_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define UI_SDT
+#endif
+#endif
+#ifdef UI_SDT
+#define UI_PROBE0(name) DTRACE_PROBE(janetui, name)
+#define UI_PROBE1(name, a) DTRACE_PROBE1(janetui, name, a)
+#define UI_PROBE2(name, a, b) DTRACE_PROBE2(janetui, name, a, b)
+/* Tracers raise the semaphore of a probe while attached, so arguments
+ * that take work to compute are only computed then. Every probe of the
+ * provider needs one. */
+#define UI_PROBE_SEMAPHORE(name) \
+    volatile unsigned short janetui_##name##_semaphore __attribute__((unused, section(".probes")))
+#define UI_PROBE_ENABLED(name) __builtin_expect(janetui_##name##_semaphore != 0, 0)
+UI_PROBE_SEMAPHORE(handler__entry);
+UI_PROBE_SEMAPHORE(handler__return);
+UI_PROBE_SEMAPHORE(timer__fire);
+UI_PROBE_SEMAPHORE(queue__run);
+UI_PROBE_SEMAPHORE(control__create);
+UI_PROBE_SEMAPHORE(control__destroy);
+UI_PROBE_SEMAPHORE(main__step__entry);
+UI_PROBE_SEMAPHORE(main__step__return);
+#else
+#define UI_PROBE0(name) ((void) 0)
+#define UI_PROBE1(name, a) ((void)(a))
+#define UI_PROBE2(name, a, b) ((void)(a), (void)(b))
+#define UI_PROBE_ENABLED(name) 0
+#endif
+
+/* Run fn from the main loop until it returns 0. On GTK it runs when the
+ * loop is idle at a GLib priority; elsewhere it is a 0 ms libui timer,
+ * so the priority is only a hint. */
+#ifdef UI_GTK
+#define UI_IDLE_REDRAW (GDK_PRIORITY_REDRAW - 1)
+#define UI_IDLE_DEFAULT G_PRIORITY_DEFAULT_IDLE
+#define UI_IDLE_LOW G_PRIORITY_LOW
+#else
+#define UI_IDLE_REDRAW 0
+#define UI_IDLE_DEFAULT 0
+#define UI_IDLE_LOW 0
+#endif
+
+static void ui_idle_add(int priority, int (*fn)(void *data), void *data) {
+#ifdef UI_GTK
+    g_idle_add_full(priority, (GSourceFunc) fn, data, NULL);
+#else
+    (void) priority;
+    uiTimer(0, fn, data);
+#endif
+}
 
 /* Types */
 #define UI_FLAG_DESTROYED 1
-typedef struct {
+#define UI_FLAG_ALIAS 2
+#define UI_FLAG_ROOTED 4
+#define UI_FLAG_HELD 8
+#define UI_MAX_SLOTS 5
+#define UI_MAX_SIGNALS 2
+typedef struct UIControlWrapper UIControlWrapper;
+struct UIControlWrapper {
     uiControl *control;
     uint32_t flags;
-} UIControlWrapper;
-static const JanetAbstractType control_td = {"ui/control", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
-static const JanetAbstractType window_td = {"ui/window", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
-static const JanetAbstractType button_td = {"ui/button", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
-static const JanetAbstractType box_td = {"ui/box", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
-static const JanetAbstractType checkbox_td = {"ui/checkbox", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
-static const JanetAbstractType entry_td = {"ui/entry", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
-static const JanetAbstractType label_td = {"ui/label", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
-static const JanetAbstractType tab_td = {"ui/tab", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
-static const JanetAbstractType group_td = {"ui/group", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
-static const JanetAbstractType spinbox_td = {"ui/spinbox", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
-static const JanetAbstractType slider_td = {"ui/slider", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
-static const JanetAbstractType progress_bar_td = {"ui/progress-bar", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
-static const JanetAbstractType separator_td = {"ui/separator", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
-static const JanetAbstractType combobox_td = {"ui/combobox", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
-static const JanetAbstractType editable_combobox_td = {"ui/editable-combobox", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
-static const JanetAbstractType radio_buttons_td = {"ui/radio-buttons", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
-static const JanetAbstractType date_time_picker_td = {"ui/date-time-picker", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
-static const JanetAbstractType multiline_entry_td = {"ui/multiline-entry", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
-static const JanetAbstractType menu_item_td = {"ui/menu-item", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
-static const JanetAbstractType menu_td = {"ui/menu", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+    /* Wrapper of the container this control was added to */
+    UIControlWrapper *parent;
+    /* Wrappers of the controls added to this one, in order */
+    UIControlWrapper **children;
+    int32_t child_count;
+    int32_t child_capacity;
+    /* Handler data for each event slot of the control */
+    void *handlers[UI_MAX_SLOTS];
+    /* Free native state owned by the wrapper once the control is
+     * destroyed, or NULL */
+    void (*release)(UIControlWrapper *w);
+    /* Construction state libui cannot report, kept for ui/snapshot.
+     * Kind is the constructor variant. State holds the appended items
+     * of choice controls, or the range of spinboxes and sliders. */
+    int32_t kind;
+    JanetArray *state;
+    /* How the control was placed in its parent, kept with the control
+     * so it follows it through inserts and deletes: the stretchy flag
+     * of a box child, or the page name of a tab page */
+    int32_t stretchy;
+    JanetString page_name;
+    /* One more than the index of the wrapper in the root registry, or
+     * 0 if it is not a root */
+    int32_t root;
+    /* GTK signals of the native widget connected to the wrapper, or 0 */
+    unsigned long signals[UI_MAX_SIGNALS];
+};
+static int control_gc(void *p, size_t len);
+static int control_gcmark(void *p, size_t len);
+static int area_gcmark(void *p, size_t len);
+static int virtual_list_gcmark(void *p, size_t len);
+static const JanetAbstractType control_td = {"ui/control", control_gc, control_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType window_td = {"ui/window", control_gc, control_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType button_td = {"ui/button", control_gc, control_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType box_td = {"ui/box", control_gc, control_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType checkbox_td = {"ui/checkbox", control_gc, control_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType entry_td = {"ui/entry", control_gc, control_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType label_td = {"ui/label", control_gc, control_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType tab_td = {"ui/tab", control_gc, control_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType group_td = {"ui/group", control_gc, control_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType spinbox_td = {"ui/spinbox", control_gc, control_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType slider_td = {"ui/slider", control_gc, control_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType progress_bar_td = {"ui/progress-bar", control_gc, control_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType separator_td = {"ui/separator", control_gc, control_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType combobox_td = {"ui/combobox", control_gc, control_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType editable_combobox_td = {"ui/editable-combobox", control_gc, control_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType radio_buttons_td = {"ui/radio-buttons", control_gc, control_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType date_time_picker_td = {"ui/date-time-picker", control_gc, control_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType multiline_entry_td = {"ui/multiline-entry", control_gc, control_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType menu_item_td = {"ui/menu-item", control_gc, control_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType menu_td = {"ui/menu", control_gc, control_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType area_td = {"ui/area", control_gc, area_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType virtual_list_td = {"ui/virtual-list", control_gc, virtual_list_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType file_view_td = {"ui/file-view", control_gc, virtual_list_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType text_view_td = {"ui/text-view", control_gc, virtual_list_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType tree_view_td = {"ui/tree-view", control_gc, virtual_list_gcmark, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType graph_view_td = {"ui/graph-view", control_gc, area_gcmark, NULL, NULL, NULL, NULL, NULL};
+
+#define UI_NUM_CONTROL_TYPES 26
+static const JanetAbstractType *const control_types[UI_NUM_CONTROL_TYPES] = {
+    &control_td,
+    &window_td,
+    &button_td,
+    &box_td,
+    &checkbox_td,
+    &entry_td,
+    &label_td,
+    &tab_td,
+    &group_td,
+    &spinbox_td,
+    &slider_td,
+    &progress_bar_td,
+    &separator_td,
+    &combobox_td,
+    &editable_combobox_td,
+    &radio_buttons_td,
+    &date_time_picker_td,
+    &multiline_entry_td,
+    &menu_item_td,
+    &menu_td,
+    &area_td,
+    &virtual_list_td,
+    &file_view_td,
+    &text_view_td,
+    &tree_view_td,
+    &graph_view_td
+};
+
+/* Get the index of a control type in control_types, or -1 if the
+ * type is not a control type */
+static int control_type_index(const JanetAbstractType *at) {
+    for (int i = 0; i < UI_NUM_CONTROL_TYPES; i++) {
+        if (control_types[i] == at) return i;
+    }
+    return -1;
+}
+
+/* Memory accounting, reported by ui/memory-report */
+typedef struct {
+    int64_t controls[UI_NUM_CONTROL_TYPES];
+    int64_t destroyed_wrappers;
+    int64_t collected_controls;
+    int64_t unreachable_controls;
+    int64_t handlers;
+    int64_t rooted_handlers;
+    int64_t timers;
+    int64_t queued;
+    int64_t suspended_fibers;
+    int64_t image_source_bytes;
+    int64_t image_cache_bytes;
+    int64_t filter_index_bytes;
+    int64_t tile_bytes;
+    int64_t file_index_bytes;
+    int64_t idle_tasks;
+    int64_t stream_loads;
+    int64_t metric_bindings;
+    int64_t scene_bytes;
+    int64_t text_view_bytes;
+    int64_t tree_view_bytes;
+    int64_t graph_view_bytes;
+    int64_t tasks;
+} UIMemoryStats;
+static JANET_THREAD_LOCAL UIMemoryStats ui_mem;
 
 /* Helpers */
 
@@ -65,84 +276,726 @@ static void *janet_getuitype(const Janet *argv, int32_t n, const JanetAbstractTy
     return uicw->control;
 }
 
-/* Cast a Janet into a uiControl structure. Returns a pointer to
- * the uiControl, or panics if cast fails. */
-static uiControl *janet_getcontrol(const Janet *argv, int32_t n) {
+/* Get the wrapper of a control that is not destroyed, or panic */
+static UIControlWrapper *janet_getcontrolwrapper(const Janet *argv, int32_t n) {
     Janet x = argv[n];
     if (!janet_checktype(x, JANET_ABSTRACT)) {
         janet_panicf("expected ui control, got %v", x);
     }
     UIControlWrapper *abst = janet_unwrap_abstract(x);
-    const JanetAbstractType *at = janet_abstract_type(abst);
-    if (at == &control_td ||
-            at == &window_td ||
-            at == &button_td ||
-            at == &box_td ||
-            at == &checkbox_td ||
-            at == &entry_td ||
-            at == &label_td ||
-            at == &tab_td ||
-            at == &group_td ||
-            at == &spinbox_td ||
-            at == &slider_td ||
-            at == &progress_bar_td ||
-            at == &separator_td ||
-            at == &combobox_td ||
-            at == &editable_combobox_td ||
-            at == &radio_buttons_td ||
-            at == &date_time_picker_td ||
-            at == &multiline_entry_td ||
-            at == &menu_item_td ||
-            at == &menu_td) {
+    if (control_type_index(janet_abstract_type(abst)) >= 0) {
         if (abst->flags & UI_FLAG_DESTROYED) {
             janet_panic("ui control already destoryed");
         }
-        return uiControl(abst->control);
+        return abst;
     }
     janet_panicf("expected ui control, got %v", x);
     return NULL;
 }
 
+/* Cast a Janet into a uiControl structure. Returns a pointer to
+ * the uiControl, or panics if cast fails. */
+static uiControl *janet_getcontrol(const Janet *argv, int32_t n) {
+    return uiControl(janet_getcontrolwrapper(argv, n)->control);
+}
+
+/* Wrapper cache. Maps native control pointers to their wrappers, so a
+ * control found through libui, such as a parent, comes back as the
+ * same typed wrapper it was created with. The map is weak: wrappers
+ * are removed when their control is destroyed or when they are
+ * collected. Open addressing with linear probing, and deletion by
+ * shifting entries back, so there are no tombstones. */
+
+typedef struct {
+    void *control;
+    UIControlWrapper *wrapper;
+} UIWrapperEntry;
+
+static JANET_THREAD_LOCAL UIWrapperEntry *wrapper_map = NULL;
+static JANET_THREAD_LOCAL int32_t wrapper_count = 0;
+static JANET_THREAD_LOCAL int32_t wrapper_capacity = 0;
+
+static uint32_t wrapper_slot(void *control, int32_t capacity) {
+    uint64_t h = (uint64_t)(uintptr_t) control;
+    h = (h >> 4) * UINT64_C(0x9E3779B97F4A7C15);
+    return (uint32_t)(h >> 32) & (uint32_t)(capacity - 1);
+}
+
+static void wrapper_cache_put(UIControlWrapper *w) {
+    if (4 * (wrapper_count + 1) > 3 * wrapper_capacity) {
+        int32_t newcap = wrapper_capacity ? 2 * wrapper_capacity : 64;
+        UIWrapperEntry *map = calloc(newcap, sizeof(UIWrapperEntry));
+        if (NULL == map) janet_panic("out of memory");
+        for (int32_t i = 0; i < wrapper_capacity; i++) {
+            if (NULL == wrapper_map[i].control) continue;
+            uint32_t j = wrapper_slot(wrapper_map[i].control, newcap);
+            while (NULL != map[j].control) j = (j + 1) & (newcap - 1);
+            map[j] = wrapper_map[i];
+        }
+        free(wrapper_map);
+        wrapper_map = map;
+        wrapper_capacity = newcap;
+    }
+    uint32_t i = wrapper_slot(w->control, wrapper_capacity);
+    while (NULL != wrapper_map[i].control && wrapper_map[i].control != (void *) w->control) {
+        i = (i + 1) & (wrapper_capacity - 1);
+    }
+    if (NULL == wrapper_map[i].control) wrapper_count++;
+    wrapper_map[i].control = w->control;
+    wrapper_map[i].wrapper = w;
+}
+
+static UIControlWrapper *wrapper_cache_get(void *control) {
+    if (0 == wrapper_count) return NULL;
+    uint32_t i = wrapper_slot(control, wrapper_capacity);
+    while (NULL != wrapper_map[i].control) {
+        if (wrapper_map[i].control == control) return wrapper_map[i].wrapper;
+        i = (i + 1) & (wrapper_capacity - 1);
+    }
+    return NULL;
+}
+
+/* Remove a wrapper, unless its control's entry already belongs to a
+ * newer wrapper. Safe to call from a GC callback. */
+static void wrapper_cache_remove(UIControlWrapper *w) {
+    if (0 == wrapper_count) return;
+    uint32_t mask = (uint32_t)(wrapper_capacity - 1);
+    uint32_t i = wrapper_slot(w->control, wrapper_capacity);
+    while (wrapper_map[i].control != (void *) w->control) {
+        if (NULL == wrapper_map[i].control) return;
+        i = (i + 1) & mask;
+    }
+    if (wrapper_map[i].wrapper != w) return;
+    wrapper_count--;
+    /* Shift back later entries of the probe run */
+    uint32_t j = i;
+    for (;;) {
+        wrapper_map[i].control = NULL;
+        for (;;) {
+            j = (j + 1) & mask;
+            if (NULL == wrapper_map[j].control) return;
+            uint32_t home = wrapper_slot(wrapper_map[j].control, wrapper_capacity);
+            /* Move j to i if its home is not cyclically in (i, j] */
+            if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) break;
+        }
+        wrapper_map[i] = wrapper_map[j];
+        i = j;
+    }
+}
+
 /* Wrap a pointer to a uiXxx object into an abstract */
 static Janet janet_ui_handle_to_control(void *handle, const JanetAbstractType *atype) {
     UIControlWrapper *abst = janet_abstract(atype, sizeof(UIControlWrapper));
+    memset(abst, 0, sizeof(UIControlWrapper));
+    abst->control = handle;
+    wrapper_cache_put(abst);
+    ui_mem.controls[control_type_index(atype)]++;
+    UI_PROBE2(control__create, atype->name, handle);
+    return janet_wrap_abstract(abst);
+}
+
+/* Get the wrapper of a control found through libui. Controls whose
+ * wrapper was collected while the control lived on get an alias,
+ * which is not counted as a separate control and never owns it. */
+static Janet janet_ui_handle_to_wrapper(void *handle) {
+    UIControlWrapper *abst = wrapper_cache_get(handle);
+    if (NULL != abst) return janet_wrap_abstract(abst);
+    abst = janet_abstract(&control_td, sizeof(UIControlWrapper));
+    memset(abst, 0, sizeof(UIControlWrapper));
     abst->control = handle;
-    abst->flags = 0;
+    abst->flags = UI_FLAG_ALIAS;
+    wrapper_cache_put(abst);
     return janet_wrap_abstract(abst);
 }
 
+/* Registry of rooted wrappers in creation order, so controls can be
+ * addressed by a path from their root. Entries of destroyed roots are
+ * NULL and never reused. */
+static JANET_THREAD_LOCAL UIControlWrapper **ui_roots = NULL;
+static JANET_THREAD_LOCAL int32_t ui_root_count = 0;
+static JANET_THREAD_LOCAL int32_t ui_root_capacity = 0;
+
+/* Keep a wrapper, and so everything it marks, alive until its control
+ * is destroyed. Used for top level windows and menus, which are not
+ * reachable from any other control. */
+static void janet_ui_root_wrapper(UIControlWrapper *w) {
+    if (ui_root_count == ui_root_capacity) {
+        int32_t newcap = ui_root_capacity ? 2 * ui_root_capacity : 16;
+        UIControlWrapper **roots = realloc(ui_roots, sizeof(UIControlWrapper *) * newcap);
+        if (NULL == roots) janet_panic("out of memory");
+        ui_roots = roots;
+        ui_root_capacity = newcap;
+    }
+    ui_roots[ui_root_count++] = w;
+    w->root = ui_root_count;
+    w->flags |= UI_FLAG_ROOTED;
+    janet_gcroot(janet_wrap_abstract(w));
+}
+
+/* An alias has no owner that keeps it reachable, so it is a GC root
+ * while it holds children. Otherwise its children, and the handler
+ * data libui still calls, could be collected under the native parent. */
+static void janet_ui_hold_alias(UIControlWrapper *w, int hold) {
+    if (!(w->flags & UI_FLAG_ALIAS) || hold == !!(w->flags & UI_FLAG_HELD)) return;
+    if (hold) {
+        w->flags |= UI_FLAG_HELD;
+        janet_gcroot(janet_wrap_abstract(w));
+    } else {
+        w->flags &= ~UI_FLAG_HELD;
+        janet_gcunroot(janet_wrap_abstract(w));
+    }
+}
+
+#ifdef UI_GTK
+/* Connect a signal of the widget of a control to a callback taking the
+ * wrapper. The connection is recorded so it can be dropped if the
+ * wrapper is collected while the widget lives on. */
+static void janet_ui_connect(UIControlWrapper *w, const char *signal, GCallback callback) {
+    for (int i = 0; i < UI_MAX_SIGNALS; i++) {
+        if (0 != w->signals[i]) continue;
+        w->signals[i] = g_signal_connect(GTK_WIDGET(uiControlHandle(w->control)), signal, callback, w);
+        return;
+    }
+}
+#endif
+
+/* Disconnect the signals of a control whose widget is still alive */
+static void janet_ui_disconnect(UIControlWrapper *w) {
+    for (int i = 0; i < UI_MAX_SIGNALS; i++) {
+        if (0 == w->signals[i]) continue;
+#ifdef UI_GTK
+        g_signal_handler_disconnect(GTK_WIDGET(uiControlHandle(w->control)), w->signals[i]);
+#endif
+        w->signals[i] = 0;
+    }
+}
+
+/* Track that child was added to parent at index, or at the end if
+ * index is negative. Aliases are tracked too, so the children of a
+ * container are always in the same order as its native children. */
+static void janet_ui_add_child(UIControlWrapper *parent, UIControlWrapper *child, int32_t index) {
+    if (parent->child_count == parent->child_capacity) {
+        int32_t newcap = parent->child_capacity ? 2 * parent->child_capacity : 4;
+        UIControlWrapper **children = realloc(parent->children, sizeof(UIControlWrapper *) * newcap);
+        if (NULL == children) janet_panic("out of memory");
+        parent->children = children;
+        parent->child_capacity = newcap;
+    }
+    if (index < 0 || index > parent->child_count) index = parent->child_count;
+    memmove(parent->children + index + 1, parent->children + index,
+            sizeof(UIControlWrapper *) * (parent->child_count - index));
+    parent->children[index] = child;
+    parent->child_count++;
+    child->parent = parent;
+    janet_ui_hold_alias(parent, 1);
+}
+
+/* Track that the child at index was removed from parent */
+static void janet_ui_remove_child(UIControlWrapper *parent, int32_t index) {
+    if (index < 0 || index >= parent->child_count) return;
+    UIControlWrapper *child = parent->children[index];
+    child->parent = NULL;
+    child->stretchy = 0;
+    child->page_name = NULL;
+    parent->child_count--;
+    memmove(parent->children + index, parent->children + index + 1,
+            sizeof(UIControlWrapper *) * (parent->child_count - index));
+    if (0 == parent->child_count) janet_ui_hold_alias(parent, 0);
+}
+
+/* Record construction state */
+static void janet_ui_state_push(UIControlWrapper *w, Janet x) {
+    if (NULL == w->state) w->state = janet_array(4);
+    janet_array_push(w->state, x);
+}
+
+/* Track that the only child of a single child container was replaced */
+static void janet_ui_set_child(UIControlWrapper *parent, UIControlWrapper *child) {
+    while (parent->child_count) janet_ui_remove_child(parent, 0);
+    if (NULL != child) janet_ui_add_child(parent, child, -1);
+}
+
+static void task_cancel_control(uiControl *control);
+
+/* Mark a wrapper's control, and the controls it contains, as destroyed */
+static void janet_ui_mark_destroyed(UIControlWrapper *w) {
+    for (int32_t i = 0; i < w->child_count; i++) {
+        w->children[i]->parent = NULL;
+        janet_ui_mark_destroyed(w->children[i]);
+    }
+    free(w->children);
+    w->children = NULL;
+    w->child_count = w->child_capacity = 0;
+    janet_ui_hold_alias(w, 0);
+    for (int i = 0; i < UI_MAX_SLOTS; i++) w->handlers[i] = NULL;
+    /* The signals went with the widget */
+    for (int i = 0; i < UI_MAX_SIGNALS; i++) w->signals[i] = 0;
+    w->flags |= UI_FLAG_DESTROYED;
+    wrapper_cache_remove(w);
+    if (!(w->flags & UI_FLAG_ALIAS)) {
+        ui_mem.controls[control_type_index(janet_abstract_type(w))]--;
+        UI_PROBE2(control__destroy, janet_abstract_type(w)->name, w->control);
+        task_cancel_control(w->control);
+        if (NULL != w->release) w->release(w);
+    }
+    ui_mem.destroyed_wrappers++;
+    if (w->flags & UI_FLAG_ROOTED) {
+        w->flags &= ~UI_FLAG_ROOTED;
+        ui_roots[w->root - 1] = NULL;
+        w->root = 0;
+        janet_gcunroot(janet_wrap_abstract(w));
+    }
+}
+
+static int control_gcmark(void *p, size_t len) {
+    (void) len;
+    UIControlWrapper *w = (UIControlWrapper *)p;
+    if (NULL != w->parent) janet_mark(janet_wrap_abstract(w->parent));
+    for (int32_t i = 0; i < w->child_count; i++) {
+        janet_mark(janet_wrap_abstract(w->children[i]));
+    }
+    for (int i = 0; i < UI_MAX_SLOTS; i++) {
+        if (NULL != w->handlers[i]) janet_mark(janet_wrap_abstract(w->handlers[i]));
+    }
+    if (NULL != w->state) janet_mark(janet_wrap_array(w->state));
+    if (NULL != w->page_name) janet_mark(janet_wrap_string(w->page_name));
+    return 0;
+}
+
+/* Destroy a control found unreachable by the GC, from the main loop
+ * rather than in the middle of a collection */
+static void control_destroy_queued(void *data) {
+    uiControlDestroy(uiControl(data));
+}
+
+/* Children mark their parents and parents mark their children, so a
+ * tree of wrappers is always collected together. The root of the tree
+ * queues the destruction of the native controls, and the wrappers
+ * below it only need to update counters. An unparented widget is never
+ * shown and its signals are disconnected first, so nothing calls into
+ * the freed wrappers before it is destroyed. Never touch other
+ * wrappers here, as they may have been freed already in the same
+ * collection. The wrapper's own flags and parent are checked first:
+ * libui is only asked for the parent of a control the bindings never
+ * parented, whose memory is still ours. */
+static int control_gc(void *p, size_t len) {
+    (void) len;
+    UIControlWrapper *w = (UIControlWrapper *)p;
+    const JanetAbstractType *at = janet_abstract_type(w);
+    wrapper_cache_remove(w);
+    if (w->flags & UI_FLAG_DESTROYED) {
+        ui_mem.destroyed_wrappers--;
+    } else if (w->flags & UI_FLAG_ALIAS) {
+        /* Not the owner */
+    } else if (NULL != w->parent) {
+        /* Destroyed along with the root of its tree */
+        ui_mem.controls[control_type_index(at)]--;
+        UI_PROBE2(control__destroy, at->name, w->control);
+        if (NULL != w->release) w->release(w);
+    } else if (at != &window_td && at != &menu_td && at != &menu_item_td &&
+               NULL == uiControlParent(w->control)) {
+        janet_ui_disconnect(w);
+        uiQueueMain(control_destroy_queued, w->control);
+        ui_mem.controls[control_type_index(at)]--;
+        ui_mem.collected_controls++;
+        UI_PROBE2(control__destroy, at->name, w->control);
+        if (NULL != w->release) w->release(w);
+    } else {
+        /* Parented outside of the bindings, so it cannot be freed. The
+         * widget outlives the wrapper, so it must not call back into it. */
+        janet_ui_disconnect(w);
+        ui_mem.unreachable_controls++;
+    }
+    free(w->children);
+    return 0;
+}
+
+/* Handler data passed to libui callbacks. Handlers of controls keep a
+ * reference to the control wrapper. If registered with
+ * UI_HANDLER_ARGS they are called with the wrapper, reused for every
+ * event, and the new value for events that have one. */
+#define UI_HANDLER_ARGS 1
+typedef struct {
+    Janet function;
+    Janet control;
+    uint32_t flags;
+} UIHandler;
+
+static int handler_gc(void *p, size_t len) {
+    (void) p;
+    (void) len;
+    ui_mem.handlers--;
+    return 0;
+}
+
+static int handler_gcmark(void *p, size_t len) {
+    (void) len;
+    UIHandler *h = (UIHandler *)p;
+    janet_mark(h->function);
+    janet_mark(h->control);
+    return 0;
+}
+
+static const JanetAbstractType handler_td = {"ui/handler", handler_gc, handler_gcmark, NULL, NULL, NULL, NULL, NULL};
+
+static UIHandler *janet_ui_new_handler(Janet function) {
+    UIHandler *h = janet_abstract(&handler_td, sizeof(UIHandler));
+    h->function = function;
+    h->control = janet_wrap_nil();
+    h->flags = 0;
+    ui_mem.handlers++;
+    return h;
+}
+
 /* Convert a function or cfunction to a handle for
- * libui callbacks */
+ * libui callbacks that are not owned by a control. The
+ * handle is a GC root until released. */
 static void *janet_ui_to_handler_data(Janet handler) {
-    const Janet *tup = janet_tuple_n(&handler, 1);
-    janet_gcroot(janet_wrap_tuple(tup));
-    return (void *)tup;
+    UIHandler *h = janet_ui_new_handler(handler);
+    janet_gcroot(janet_wrap_abstract(h));
+    ui_mem.rooted_handlers++;
+    return h;
+}
+
+/* Release handler data that libui will not call again */
+static void janet_ui_release_handler_data(void *data) {
+    janet_gcunroot(janet_wrap_abstract(data));
+    ui_mem.rooted_handlers--;
+}
+
+/* Convert the arguments of an on-* function, (on-x control handler
+ * &opt with-args), to a handle for libui callbacks. The handle is
+ * kept alive by the control wrapper in the given event slot,
+ * replacing any handler registered before. */
+static void *janet_ui_to_control_handler_data(int32_t argc, const Janet *argv, int slot) {
+    UIControlWrapper *w = janet_getcontrolwrapper(argv, 0);
+    if (!janet_checktypes(argv[1], JANET_TFLAG_CALLABLE)) {
+        janet_panic_type(argv[1], 1, JANET_TFLAG_CALLABLE);
+    }
+    UIHandler *h = janet_ui_new_handler(argv[1]);
+    h->control = argv[0];
+    if (argc == 3 && janet_truthy(argv[2])) {
+        h->flags |= UI_HANDLER_ARGS;
+    }
+    w->handlers[slot] = h;
+    return h;
 }
 
 /* Get the function or cfunction from a libui callback
  * handle data pointer */
 static Janet janet_ui_from_handler_data(void *data) {
-    const Janet *tup = (const Janet *)data;
-    return tup[0];
+    return ((UIHandler *)data)->function;
 }
 
-/* Generic handler */
-static int janet_ui_handler(void *data) {
-    Janet funcv = janet_ui_from_handler_data(data);
-    /* Tuple should already be GC root */
-    if (janet_checktype(funcv, JANET_FUNCTION)) {
-        janet_call(janet_unwrap_function(funcv), 0, NULL);
-    } else if (janet_checktype(funcv, JANET_CFUNCTION)) {
-        JanetCFunction cfunc = janet_unwrap_cfunction(funcv);
-        cfunc(0, NULL);
+/* Check if a handler wants the new value, so callbacks only fetch
+ * it from the control when needed. */
+static int janet_ui_handler_wants_value(void *data) {
+    return ((UIHandler *)data)->flags & UI_HANDLER_ARGS;
+}
+
+/* Callback dispatch. Handlers run in fibers taken from a small pool,
+ * so errors never unwind through toolkit frames and handlers can
+ * yield. Cfunctions and other callables are called from a Janet
+ * trampoline, so their panics stop in the fiber too. Every fiber owned
+ * by the pool, running or suspended, is a GC root.
+ *
+ * A handler that yields a number of seconds is resumed after that
+ * long, or on the next main loop iteration for 0. Yielding anything
+ * else is reported to ui/on-error like an error, and the handler is
+ * not resumed. */
+
+#define UI_FIBER_POOL_SIZE 16
+static JANET_THREAD_LOCAL JanetFiber *fiber_pool[UI_FIBER_POOL_SIZE];
+static JANET_THREAD_LOCAL int32_t fiber_pool_count = 0;
+static JANET_THREAD_LOCAL void *error_handler = NULL;
+static JANET_THREAD_LOCAL JanetFunction *call_trampoline = NULL;
+
+#define UI_CALL_MAX_ARGS 8
+static const char call_trampoline_source[] = "(fn [f & args] (f ;args))";
+
+/* Get a fiber ready to call fn, or NULL if fn does not take argc
+ * arguments. */
+static JanetFiber *fiber_pool_take(JanetFunction *fn, int32_t argc, const Janet *argv) {
+    if (fiber_pool_count > 0) {
+        JanetFiber *fiber = fiber_pool[fiber_pool_count - 1];
+        if (NULL == janet_fiber_reset(fiber, fn, argc, argv)) return NULL;
+        fiber_pool_count--;
+        return fiber;
+    }
+    JanetFiber *fiber = janet_fiber(fn, 64, argc, argv);
+    if (NULL == fiber) return NULL;
+    janet_gcroot(janet_wrap_fiber(fiber));
+    return fiber;
+}
+
+/* Get a fiber ready to call any callable, or NULL if it cannot be
+ * called with argc arguments */
+static JanetFiber *ui_fiber_take(Janet funcv, int32_t argc, const Janet *argv) {
+    if (janet_checktype(funcv, JANET_FUNCTION)) return fiber_pool_take(janet_unwrap_function(funcv), argc, argv);
+    if (argc >= UI_CALL_MAX_ARGS) return NULL;
+    if (NULL == call_trampoline) {
+        Janet out;
+        if (janet_dostring(janet_core_env(NULL), call_trampoline_source, "janetui", &out) ||
+                !janet_checktype(out, JANET_FUNCTION)) {
+            return NULL;
+        }
+        janet_gcroot(out);
+        call_trampoline = janet_unwrap_function(out);
+    }
+    Janet call[UI_CALL_MAX_ARGS];
+    call[0] = funcv;
+    for (int32_t i = 0; i < argc; i++) call[i + 1] = argv[i];
+    return fiber_pool_take(call_trampoline, argc + 1, call);
+}
+
+/* Return a fiber to the pool. Only fibers that ran to completion are
+ * reused; any other fiber is dropped, since it may still be suspended
+ * or in an error state. */
+static void fiber_pool_give(JanetFiber *fiber) {
+    if (fiber_pool_count < UI_FIBER_POOL_SIZE && janet_fiber_status(fiber) == JANET_STATUS_DEAD) {
+        fiber_pool[fiber_pool_count++] = fiber;
+    } else {
+        janet_gcunroot(janet_wrap_fiber(fiber));
+    }
+}
+
+/* Report an error from a handler to the error handler set with
+ * ui/on-error, or print it. The fiber is NULL if the handler could
+ * not be called at all. */
+static void ui_report_error(JanetFiber *fiber, Janet err) {
+    if (NULL != error_handler) {
+        Janet funcv = janet_ui_from_handler_data(error_handler);
+        Janet args[2] = {err, fiber ? janet_wrap_fiber(fiber) : janet_wrap_nil()};
+        Janet out;
+        JanetFiber *ef = ui_fiber_take(funcv, 2, args);
+        if (NULL != ef) {
+            JanetSignal sig = janet_continue(ef, janet_wrap_nil(), &out);
+            if (sig == JANET_SIGNAL_OK) {
+                fiber_pool_give(ef);
+                return;
+            }
+            /* Never recurse into a failing error handler */
+            janet_stacktrace(ef, out);
+            fiber_pool_give(ef);
+        }
+    }
+    if (NULL != fiber) {
+        janet_stacktrace(fiber, err);
+    } else {
+        fprintf(stderr, "error: %s\n", (const char *) janet_to_string(err));
+    }
+}
+
+static void ui_fiber_finish(JanetFiber *fiber, JanetSignal sig, Janet out);
+
+static void ui_fiber_resume(JanetFiber *fiber) {
+    Janet out;
+    ui_mem.suspended_fibers--;
+    JanetSignal sig = janet_continue(fiber, janet_wrap_nil(), &out);
+    ui_fiber_finish(fiber, sig, out);
+}
+
+static int ui_fiber_resume_timer(void *data) {
+    ui_fiber_resume((JanetFiber *) data);
+    return 0;
+}
+
+static void ui_fiber_resume_queued(void *data) {
+    ui_fiber_resume((JanetFiber *) data);
+}
+
+/* Handle the signal a handler fiber stopped with. A fiber that yields
+ * a number of seconds is resumed by a timer after that long, or on the
+ * next main loop iteration if the number is 0. Yielding anything else
+ * is an error, and the fiber is not resumed. */
+static void ui_fiber_finish(JanetFiber *fiber, JanetSignal sig, Janet out) {
+    if (sig == JANET_SIGNAL_OK) {
+        fiber_pool_give(fiber);
+    } else if (sig == JANET_SIGNAL_YIELD) {
+        double secs = janet_checktype(out, JANET_NUMBER) ? janet_unwrap_number(out) : -1.0;
+        if (!(secs >= 0)) {
+            ui_report_error(fiber, janet_wrap_string(janet_formatc(
+                                "expected ui handler to yield a number of seconds, got %v", out)));
+            fiber_pool_give(fiber);
+            return;
+        }
+        ui_mem.suspended_fibers++;
+        if (secs > 0) {
+            uiTimer(secs < INT32_MAX / 1000 ? (int)(secs * 1000) : INT32_MAX, ui_fiber_resume_timer, fiber);
+        } else {
+            uiQueueMain(ui_fiber_resume_queued, fiber);
+        }
     } else {
-        printf("called invalid handler\n");
+        ui_report_error(fiber, out);
+        fiber_pool_give(fiber);
+    }
+}
+
+/* Call a function, cfunction or other callable in a pooled fiber. If
+ * result is not NULL it is set to what the function returned, or nil
+ * if it did not return. Returns the signal the fiber stopped with;
+ * errors have already been reported. */
+static JanetSignal janet_ui_call(Janet funcv, int32_t argc, const Janet *args, Janet *result) {
+    if (NULL != result) *result = janet_wrap_nil();
+    if (!janet_checktypes(funcv, JANET_TFLAG_CALLABLE)) {
+        ui_report_error(NULL, janet_wrap_string(janet_formatc("expected ui handler to be callable, got %v", funcv)));
+        return JANET_SIGNAL_ERROR;
+    }
+    Janet out;
+    JanetFiber *fiber = ui_fiber_take(funcv, argc, args);
+    if (NULL == fiber) {
+        ui_report_error(NULL, janet_cstringv("arity mismatch in ui handler"));
+        return JANET_SIGNAL_ERROR;
+    }
+    JanetSignal sig = janet_continue(fiber, janet_wrap_nil(), &out);
+    if (NULL != result && sig == JANET_SIGNAL_OK) *result = out;
+    ui_fiber_finish(fiber, sig, out);
+    return sig;
+}
+
+/* Tracing */
+
+/* ui/trace-start streams Chrome trace events for main loop activity to
+ * a file, which loads in chrome://tracing or Perfetto. Spans are
+ * complete events on a single track for the UI thread, so handlers
+ * nest inside the main-step that ran them. */
+
+static JANET_THREAD_LOCAL FILE *trace_file = NULL;
+static JANET_THREAD_LOCAL uint64_t trace_start = 0;
+static JANET_THREAD_LOCAL int64_t trace_events = 0;
+
+static uint64_t ui_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+/* Write a span from begin to now. Names must not need JSON escaping.
+ * The slot is omitted if negative. */
+static void ui_trace_span(const char *cat, const char *name, int slot, uint64_t begin) {
+    uint64_t end = ui_now_us();
+    /* Clip spans that began before the trace did */
+    if (begin < trace_start) begin = trace_start;
+    fprintf(trace_file, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":1,\"tid\":1",
+            trace_events++ ? ",\n" : "", name, cat,
+            (unsigned long long)(begin - trace_start), (unsigned long long)(end - begin));
+    if (slot >= 0) fprintf(trace_file, ",\"args\":{\"slot\":%d}", slot);
+    fputs("}", trace_file);
+}
+
+static Janet janet_ui_trace_start(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    const char *path = janet_getcstring(argv, 0);
+    if (NULL != trace_file) janet_panic("trace already started");
+    trace_file = fopen(path, "w");
+    if (NULL == trace_file) janet_panicf("could not open %s: %s", path, strerror(errno));
+    trace_start = ui_now_us();
+    trace_events = 0;
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", trace_file);
+    fputs("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"ui\"}}", trace_file);
+    trace_events++;
+    return janet_wrap_nil();
+}
+
+/* Finish the trace file. Returns the number of events written, or nil
+ * if no trace was started. */
+static Janet janet_ui_trace_stop(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 0);
+    (void) argv;
+    if (NULL == trace_file) return janet_wrap_nil();
+    fputs("\n]}\n", trace_file);
+    int failed = fclose(trace_file);
+    trace_file = NULL;
+    if (failed) janet_panic("could not write trace");
+    return janet_wrap_number((double) trace_events);
+}
+
+static JANET_THREAD_LOCAL JanetBuffer *record_buffer = NULL;
+static void ui_record_event(UIHandler *h, int has_value, Janet value);
+
+/* Event slot of a control's handler, or -1 */
+static int handler_slot(UIControlWrapper *w, void *data) {
+    int slot = -1;
+    for (int i = 0; i < UI_MAX_SLOTS; i++) {
+        if (w->handlers[i] == data) slot = i;
+    }
+    return slot;
+}
+
+/* Call a handler, with the value of the event if has_value is set.
+ * If result is not NULL it is set to what the handler returned, or
+ * nil if it did not return. */
+static int janet_ui_dispatch(void *data, int has_value, Janet value, Janet *result) {
+    UIHandler *h = (UIHandler *)data;
+    Janet args[2];
+    int32_t argc = 0;
+    if (NULL != record_buffer && !janet_checktype(h->control, JANET_NIL)) {
+        ui_record_event(h, has_value, value);
     }
+    if (h->flags & UI_HANDLER_ARGS) {
+        args[argc++] = h->control;
+        if (has_value) args[argc++] = value;
+    }
+    const char *probe_type = "";
+    int probe_slot = -1;
+    /* Finding the slot walks the handlers, so only when probed */
+    if ((UI_PROBE_ENABLED(handler__entry) || UI_PROBE_ENABLED(handler__return)) &&
+            !janet_checktype(h->control, JANET_NIL)) {
+        UIControlWrapper *w = janet_unwrap_abstract(h->control);
+        probe_type = janet_abstract_type(w)->name;
+        probe_slot = handler_slot(w, data);
+    }
+    UI_PROBE2(handler__entry, probe_type, probe_slot);
+    /* Handler should already be GC root */
+    if (NULL == trace_file || janet_checktype(h->control, JANET_NIL)) {
+        janet_ui_call(h->function, argc, args, result);
+        UI_PROBE2(handler__return, probe_type, probe_slot);
+        return 1;
+    }
+    uint64_t begin = ui_now_us();
+    janet_ui_call(h->function, argc, args, result);
+    UI_PROBE2(handler__return, probe_type, probe_slot);
+    /* The handler may have stopped the trace */
+    if (NULL == trace_file) return 1;
+    UIControlWrapper *w = janet_unwrap_abstract(h->control);
+    ui_trace_span("handler", janet_abstract_type(w)->name, handler_slot(w, data), begin);
     return 1;
 }
 
-static void janet_ui_handler_void(void *data) {
+/* Generic handler */
+static int janet_ui_handler(void *data) {
+    return janet_ui_dispatch(data, 0, janet_wrap_nil(), NULL);
+}
+
+/* Handler for events with a new value */
+static int janet_ui_handler_value(void *data, Janet value) {
+    return janet_ui_dispatch(data, 1, value, NULL);
+}
+
+/* Take ownership of text returned by libui */
+static Janet janet_ui_take_text(char *text) {
+    Janet ret = janet_cstringv(text);
+    uiFreeText(text);
+    return ret;
+}
+
+/* Handler for ui/queue-main, which runs once */
+static void janet_ui_queued_handler(void *data) {
+    uint64_t begin = ui_now_us();
+    UI_PROBE0(queue__run);
+    ui_mem.queued--;
     janet_ui_handler(data);
+    janet_ui_release_handler_data(data);
+    if (NULL != trace_file) ui_trace_span("queue-main", "queue-main", -1, begin);
+}
+
+/* Handler for ui/timer */
+static int janet_ui_timer_handler(void *data) {
+    uint64_t begin = ui_now_us();
+    UI_PROBE0(timer__fire);
+    int ret = janet_ui_handler(data);
+    if (NULL != trace_file) ui_trace_span("timer", "timer", -1, begin);
+    return ret;
 }
 
 static void assert_callable(const Janet *argv, int32_t n) {
@@ -178,8 +1031,13 @@ static Janet janet_ui_quit(int32_t argc, Janet *argv) {
     return janet_wrap_nil();
 }
 
+static void ui_pool_stop(void);
+static void task_pool_stop(void);
+
 static Janet janet_ui_uninit(int32_t argc, Janet *argv) {
     assert_inited();
+    task_pool_stop();
+    ui_pool_stop();
     uiUninit();
     return janet_wrap_nil();
 }
@@ -194,7 +1052,11 @@ static Janet janet_ui_mainstep(int32_t argc, Janet *argv) {
     assert_inited();
     janet_fixarity(argc, 1);
     int32_t step = janet_getinteger(argv, 0);
-    uiMainStep(step);
+    uint64_t begin = ui_now_us();
+    UI_PROBE1(main__step__entry, step);
+    int pending = uiMainStep(step);
+    UI_PROBE1(main__step__return, pending);
+    if (NULL != trace_file) ui_trace_span("main", "main-step", -1, begin);
     return janet_wrap_nil();
 }
 
@@ -209,7 +1071,8 @@ static Janet janet_ui_queue_main(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 1);
     assert_callable(argv, 0);
     void *handle = janet_ui_to_handler_data(argv[0]);
-    uiQueueMain(janet_ui_handler_void, handle);
+    ui_mem.queued++;
+    uiQueueMain(janet_ui_queued_handler, handle);
     return janet_wrap_nil();
 }
 
@@ -222,108 +1085,880 @@ static Janet janet_ui_on_should_quit(int32_t argc, Janet *argv) {
     return janet_wrap_nil();
 }
 
+static Janet janet_ui_on_error(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    if (NULL != error_handler) {
+        janet_ui_release_handler_data(error_handler);
+        error_handler = NULL;
+    }
+    if (!janet_checktype(argv[0], JANET_NIL)) {
+        janet_getfunction(argv, 0);
+        error_handler = janet_ui_to_handler_data(argv[0]);
+    }
+    return janet_wrap_nil();
+}
+
+static Janet janet_ui_memory_report(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 0);
+    (void) argv;
+    JanetTable *controls = janet_table(UI_NUM_CONTROL_TYPES);
+    int64_t total = 0;
+    for (int i = 0; i < UI_NUM_CONTROL_TYPES; i++) {
+        if (ui_mem.controls[i] == 0) continue;
+        /* Skip the "ui/" prefix of the type name */
+        janet_table_put(controls, janet_ckeywordv(control_types[i]->name + 3),
+                janet_wrap_number((double) ui_mem.controls[i]));
+        total += ui_mem.controls[i];
+    }
+    JanetTable *bytes = janet_table(10);
+    janet_table_put(bytes, janet_ckeywordv("image-sources"), janet_wrap_number((double) ui_mem.image_source_bytes));
+    janet_table_put(bytes, janet_ckeywordv("image-caches"), janet_wrap_number((double) ui_mem.image_cache_bytes));
+    janet_table_put(bytes, janet_ckeywordv("filter-indices"), janet_wrap_number((double) ui_mem.filter_index_bytes));
+    janet_table_put(bytes, janet_ckeywordv("tiles"), janet_wrap_number((double) ui_mem.tile_bytes));
+    janet_table_put(bytes, janet_ckeywordv("file-indices"), janet_wrap_number((double) ui_mem.file_index_bytes));
+    janet_table_put(bytes, janet_ckeywordv("scenes"), janet_wrap_number((double) ui_mem.scene_bytes));
+    janet_table_put(bytes, janet_ckeywordv("text-views"), janet_wrap_number((double) ui_mem.text_view_bytes));
+    janet_table_put(bytes, janet_ckeywordv("tree-views"), janet_wrap_number((double) ui_mem.tree_view_bytes));
+    janet_table_put(bytes, janet_ckeywordv("graph-views"), janet_wrap_number((double) ui_mem.graph_view_bytes));
+    JanetTable *report = janet_table(20);
+    janet_table_put(report, janet_ckeywordv("controls"), janet_wrap_table(controls));
+    janet_table_put(report, janet_ckeywordv("controls-total"), janet_wrap_number((double) total));
+    janet_table_put(report, janet_ckeywordv("destroyed-wrappers"), janet_wrap_number((double) ui_mem.destroyed_wrappers));
+    janet_table_put(report, janet_ckeywordv("collected-controls"), janet_wrap_number((double) ui_mem.collected_controls));
+    janet_table_put(report, janet_ckeywordv("unreachable-controls"), janet_wrap_number((double) ui_mem.unreachable_controls));
+    janet_table_put(report, janet_ckeywordv("handlers"), janet_wrap_number((double) ui_mem.handlers));
+    janet_table_put(report, janet_ckeywordv("rooted-handlers"), janet_wrap_number((double) ui_mem.rooted_handlers));
+    janet_table_put(report, janet_ckeywordv("timers"), janet_wrap_number((double) ui_mem.timers));
+    janet_table_put(report, janet_ckeywordv("queued"), janet_wrap_number((double) ui_mem.queued));
+    janet_table_put(report, janet_ckeywordv("idle-tasks"), janet_wrap_number((double) ui_mem.idle_tasks));
+    janet_table_put(report, janet_ckeywordv("stream-loads"), janet_wrap_number((double) ui_mem.stream_loads));
+    janet_table_put(report, janet_ckeywordv("metric-bindings"), janet_wrap_number((double) ui_mem.metric_bindings));
+    janet_table_put(report, janet_ckeywordv("tasks"), janet_wrap_number((double) ui_mem.tasks));
+    janet_table_put(report, janet_ckeywordv("suspended-fibers"), janet_wrap_number((double) ui_mem.suspended_fibers));
+    janet_table_put(report, janet_ckeywordv("pooled-fibers"), janet_wrap_integer(fiber_pool_count));
+    janet_table_put(report, janet_ckeywordv("cached-wrappers"), janet_wrap_integer(wrapper_count));
+    janet_table_put(report, janet_ckeywordv("bytes"), janet_wrap_table(bytes));
+    janet_table_put(report, janet_ckeywordv("bytes-total"), janet_wrap_number((double)
+                (ui_mem.image_source_bytes + ui_mem.image_cache_bytes + ui_mem.filter_index_bytes +
+                 ui_mem.tile_bytes + ui_mem.file_index_bytes + ui_mem.scene_bytes +
+                 ui_mem.text_view_bytes + ui_mem.tree_view_bytes + ui_mem.graph_view_bytes)));
+    return janet_wrap_table(report);
+}
+
 static Janet janet_ui_timer(int32_t argc, Janet *argv) {
     int32_t milliseconds;
     janet_fixarity(argc, 2);
     milliseconds = janet_getinteger(argv, 0);
     assert_callable(argv, 1);
     void *handle = janet_ui_to_handler_data(argv[1]);
-    uiTimer(milliseconds, janet_ui_handler, handle);
+    ui_mem.timers++;
+    uiTimer(milliseconds, janet_ui_timer_handler, handle);
     return janet_wrap_nil();
 }
 
-static Janet janet_ui_open_file(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
-    uiWindow *window = janet_getuitype(argv, 0, &window_td);
-    char *str = uiOpenFile(window);
-    if (NULL != str) return janet_cstringv(str);
-    return janet_wrap_nil();
-}
+/* Idle Scheduling */
 
-static Janet janet_ui_save_file(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
-    uiWindow *window = janet_getuitype(argv, 0, &window_td);
-    char *str = uiSaveFile(window);
-    if (NULL != str) return janet_cstringv(str);
-    return janet_wrap_nil();
+/* ui/schedule-idle runs long UI work in slices from a GLib idle
+ * source, which runs below input and redraws. Each idle iteration runs
+ * steps of the highest priority task, round robin among equal
+ * priorities, until the budget is spent, so the window stays
+ * responsive. A task is a fiber, resumed until it finishes, with each
+ * yield ending a step, or a function called until it returns a falsey
+ * value. Queued tasks are GC roots. */
+
+#define UI_IDLE_DEFAULT_BUDGET 4000
+
+typedef struct {
+    Janet work;
+    int32_t priority;
+    /* Order among tasks of equal priority */
+    uint64_t seq;
+    int queued;
+    uint64_t steps;
+    uint64_t time_us;
+} UIIdleTask;
+
+static int idle_task_gcmark(void *p, size_t len) {
+    (void) len;
+    janet_mark(((UIIdleTask *)p)->work);
+    return 0;
 }
 
-static Janet janet_ui_message_box(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 3);
-    uiWindow *window = janet_getuitype(argv, 0, &window_td);
-    const uint8_t *title = janet_getstring(argv, 1);
-    const uint8_t *description = janet_getstring(argv, 2);
-    uiMsgBox(window, (const char *)title, (const char *)description);
-    return janet_wrap_nil();
+static const JanetAbstractType idle_task_td = {"ui/idle-task", NULL, idle_task_gcmark, NULL, NULL, NULL, NULL, NULL};
+
+static JANET_THREAD_LOCAL UIIdleTask **idle_tasks = NULL;
+static JANET_THREAD_LOCAL int32_t idle_count = 0;
+static JANET_THREAD_LOCAL int32_t idle_capacity = 0;
+static JANET_THREAD_LOCAL uint64_t idle_seq = 0;
+static JANET_THREAD_LOCAL uint64_t idle_budget_us = UI_IDLE_DEFAULT_BUDGET;
+static JANET_THREAD_LOCAL int idle_scheduled = 0;
+
+static void idle_remove(UIIdleTask *t) {
+    for (int32_t i = 0; i < idle_count; i++) {
+        if (idle_tasks[i] != t) continue;
+        idle_tasks[i] = idle_tasks[--idle_count];
+        t->queued = 0;
+        janet_gcunroot(janet_wrap_abstract(t));
+        ui_mem.idle_tasks--;
+        return;
+    }
 }
 
-static Janet janet_ui_message_box_error(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 3);
-    uiWindow *window = janet_getuitype(argv, 0, &window_td);
-    const uint8_t *title = janet_getstring(argv, 1);
-    const uint8_t *description = janet_getstring(argv, 2);
-    uiMsgBoxError(window, (const char *)title, (const char *)description);
-    return janet_wrap_nil();
+static UIIdleTask *idle_next(void) {
+    UIIdleTask *best = idle_tasks[0];
+    for (int32_t i = 1; i < idle_count; i++) {
+        UIIdleTask *t = idle_tasks[i];
+        if (t->priority > best->priority || (t->priority == best->priority && t->seq < best->seq)) best = t;
+    }
+    return best;
 }
 
-/* Generic controls */
+/* Run one step of a task. Returns 1 if it has more work. */
+static int idle_task_step(UIIdleTask *t) {
+    Janet out;
+    if (janet_checktype(t->work, JANET_FIBER)) {
+        JanetFiber *fiber = janet_unwrap_fiber(t->work);
+        JanetFiberStatus status = janet_fiber_status(fiber);
+        if (status == JANET_STATUS_DEAD || status == JANET_STATUS_ERROR) return 0;
+        JanetSignal sig = janet_continue(fiber, janet_wrap_nil(), &out);
+        if (sig == JANET_SIGNAL_YIELD) return 1;
+        if (sig != JANET_SIGNAL_OK) ui_report_error(fiber, out);
+        return 0;
+    }
+    janet_ui_call(t->work, 0, NULL, &out);
+    return janet_truthy(out);
+}
 
-static Janet janet_ui_destroy(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
-    uiControl *c = janet_getcontrol(argv, 0);
-    uiControlDestroy(c);
-    return janet_wrap_nil();
+static int idle_run(void *data) {
+    (void) data;
+    uint64_t begin = ui_now_us();
+    while (idle_count > 0) {
+        UIIdleTask *t = idle_next();
+        uint64_t start = ui_now_us();
+        int more = idle_task_step(t);
+        uint64_t now = ui_now_us();
+        t->steps++;
+        t->time_us += now - start;
+        /* The step may have cancelled its own task */
+        if (t->queued) {
+            if (more) t->seq = idle_seq++;
+            else idle_remove(t);
+        }
+        if (now - begin >= idle_budget_us) break;
+    }
+    if (NULL != trace_file) ui_trace_span("idle", "idle", -1, begin);
+    if (idle_count > 0) return 1;
+    idle_scheduled = 0;
+    return 0;
 }
 
-static Janet janet_ui_parent(int32_t argc, Janet *argv) {
-    uiControl *c, *d;
+static Janet janet_ui_schedule_idle(int32_t argc, Janet *argv) {
     janet_arity(argc, 1, 2);
-    c = janet_getcontrol(argv, 0);
-    if (argc == 2) {
-        d = janet_getcontrol(argv, 1);
-        uiControlSetParent(c, d);
-        return argv[0];
+    assert_inited();
+    if (!janet_checktype(argv[0], JANET_FIBER)) assert_callable(argv, 0);
+    int32_t priority = argc == 2 ? janet_getinteger(argv, 1) : 0;
+    if (idle_count == idle_capacity) {
+        int32_t newcap = idle_capacity ? 2 * idle_capacity : 8;
+        UIIdleTask **tasks = realloc(idle_tasks, sizeof(UIIdleTask *) * newcap);
+        if (NULL == tasks) janet_panic("out of memory");
+        idle_tasks = tasks;
+        idle_capacity = newcap;
+    }
+    UIIdleTask *t = janet_abstract(&idle_task_td, sizeof(UIIdleTask));
+    t->work = argv[0];
+    t->priority = priority;
+    t->seq = idle_seq++;
+    t->queued = 1;
+    t->steps = 0;
+    t->time_us = 0;
+    janet_gcroot(janet_wrap_abstract(t));
+    idle_tasks[idle_count++] = t;
+    ui_mem.idle_tasks++;
+    if (!idle_scheduled) {
+        idle_scheduled = 1;
+        ui_idle_add(UI_IDLE_DEFAULT, idle_run, NULL);
     }
-    return janet_ui_handle_to_control(uiControlParent(c), &control_td);
+    return janet_wrap_abstract(t);
 }
 
-static Janet janet_ui_top_level(int32_t argc, Janet *argv) {
+/* Cancel a task. Returns true if it was still queued. */
+static Janet janet_ui_cancel_idle(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 1);
-    uiControl *c = janet_getcontrol(argv, 0);
-    return janet_wrap_boolean(uiControlToplevel(c));
+    UIIdleTask *t = janet_getabstract(argv, 0, &idle_task_td);
+    if (!t->queued) return janet_wrap_false();
+    idle_remove(t);
+    return janet_wrap_true();
 }
 
-static Janet janet_ui_visible(int32_t argc, Janet *argv) {
+static Janet janet_ui_idle_task_info(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 1);
-    uiControl *c = janet_getcontrol(argv, 0);
-    return janet_wrap_boolean(uiControlVisible(c));
+    UIIdleTask *t = janet_getabstract(argv, 0, &idle_task_td);
+    JanetKV *st = janet_struct_begin(4);
+    janet_struct_put(st, janet_ckeywordv("queued"), janet_wrap_boolean(t->queued));
+    janet_struct_put(st, janet_ckeywordv("priority"), janet_wrap_integer(t->priority));
+    janet_struct_put(st, janet_ckeywordv("steps"), janet_wrap_number((double) t->steps));
+    janet_struct_put(st, janet_ckeywordv("time"), janet_wrap_number(t->time_us / 1e6));
+    return janet_wrap_struct(janet_struct_end(st));
 }
 
-static Janet janet_ui_enabled(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
-    uiControl *c = janet_getcontrol(argv, 0);
-    return janet_wrap_boolean(uiControlEnabled(c));
+/* Get or set the time spent on tasks per idle iteration, in milliseconds */
+static Janet janet_ui_idle_budget(int32_t argc, Janet *argv) {
+    janet_arity(argc, 0, 1);
+    if (argc == 1) {
+        double ms = janet_getnumber(argv, 0);
+        if (ms <= 0) janet_panic("expected positive budget");
+        idle_budget_us = (uint64_t)(ms * 1000);
+    }
+    return janet_wrap_number(idle_budget_us / 1000.0);
 }
 
-static Janet janet_ui_show(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
-    uiControl *c = janet_getcontrol(argv, 0);
-    uiControlShow(c);
-    return argv[0];
-}
+/* Worker Pool */
 
-static Janet janet_ui_hide(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
-    uiControl *c = janet_getcontrol(argv, 0);
-    uiControlHide(c);
-    return argv[0];
-}
+/* Native jobs, such as resampling images, rendering area tiles and
+ * reading streamed files, run on a fixed set of threads started on
+ * first use. Jobs never touch the Janet VM. */
+typedef struct UIJob UIJob;
+struct UIJob {
+    UIJob *next;
+    void (*run)(UIJob *job);
+};
 
-static Janet janet_ui_enable(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
-    uiControl *c = janet_getcontrol(argv, 0);
-    uiControlEnable(c);
-    return argv[0];
+#define UI_POOL_MAX_THREADS 16
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static UIJob *pool_head = NULL;
+static UIJob *pool_tail = NULL;
+static int pool_threads = 0;
+static int pool_stopping = 0;
+static pthread_t pool_handles[UI_POOL_MAX_THREADS];
+
+/* Workers run until the pool is stopped and the queue is empty */
+static void *ui_pool_worker(void *arg) {
+    (void) arg;
+    for (;;) {
+        pthread_mutex_lock(&pool_lock);
+        while (NULL == pool_head && !pool_stopping) pthread_cond_wait(&pool_cond, &pool_lock);
+        if (NULL == pool_head) {
+            pthread_mutex_unlock(&pool_lock);
+            break;
+        }
+        UIJob *job = pool_head;
+        pool_head = job->next;
+        if (NULL == pool_head) pool_tail = NULL;
+        pthread_mutex_unlock(&pool_lock);
+        job->run(job);
+    }
+    return NULL;
+}
+
+/* Number of online processors, at least 1 */
+static long ui_cpu_count(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n;
+#else
+    return 1;
+#endif
+}
+
+/* Start the workers, one per online processor. Must be called with
+ * pool_lock held. */
+static void ui_pool_start(void) {
+    long n = ui_cpu_count();
+    if (n > UI_POOL_MAX_THREADS) n = UI_POOL_MAX_THREADS;
+    for (long i = 0; i < n; i++) {
+        if (pthread_create(pool_handles + pool_threads, NULL, ui_pool_worker, NULL)) break;
+        pool_threads++;
+    }
+}
+
+/* Queue a job. Returns 0 if no worker could be started, or the pool
+ * is stopped; callers then run the job themselves or drop it. */
+static int ui_pool_submit(UIJob *job) {
+    pthread_mutex_lock(&pool_lock);
+    if (0 == pool_threads && !pool_stopping) ui_pool_start();
+    if (0 == pool_threads || pool_stopping) {
+        pthread_mutex_unlock(&pool_lock);
+        return 0;
+    }
+    job->next = NULL;
+    if (pool_tail) pool_tail->next = job;
+    else pool_head = job;
+    pool_tail = job;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+    return 1;
+}
+
+/* Let the workers finish the queued jobs and join them */
+static void ui_pool_stop(void) {
+    pthread_mutex_lock(&pool_lock);
+    pool_stopping = 1;
+    pthread_cond_broadcast(&pool_cond);
+    int n = pool_threads;
+    pthread_mutex_unlock(&pool_lock);
+    for (int i = 0; i < n; i++) pthread_join(pool_handles[i], NULL);
+    pthread_mutex_lock(&pool_lock);
+    pool_threads = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* Metrics */
+
+/* A ui/metric is a numeric slot, an int64 or a double, that native code
+ * and worker threads write with atomic operations and no Janet VM.
+ * ui/bind-metric shows a metric in a label, through a printf style
+ * format, or in a progress bar. One timer samples every binding at the
+ * refresh rate and only touches a control when its displayed value
+ * changes, so a counter updated millions of times a second costs the
+ * UI thread one read per binding per refresh. Bound controls and their
+ * metrics are GC roots until they are unbound or destroyed, which the
+ * release hook of the control notices. The value lives outside the GC,
+ * shared by every Janet value of the metric and by native code through
+ * janetui.h. Metrics marshal as a reference, so one passed to
+ * ui/spawn-task is the same metric in the worker, where ui/metric/set,
+ * ui/metric/add and ui/metric/value are available. */
+
+#define UI_METRIC_DEFAULT_PERIOD 100
+#define UI_METRIC_TEXT_MAX 128
+
+typedef struct JanetUIMetric UIMetric;
+struct JanetUIMetric {
+    /* The int64 value, or the bits of the double value */
+    uint64_t bits;
+    int is_float;
+    /* The rest is protected by metric_lock */
+    int32_t refcount;
+    /* Identifies the metric when unmarshalling */
+    uint64_t id;
+    UIMetric *next;
+};
+
+/* The Janet value of a metric */
+typedef struct {
+    UIMetric *metric;
+} UIMetricRef;
+
+static pthread_mutex_t metric_lock = PTHREAD_MUTEX_INITIALIZER;
+static UIMetric *metric_list = NULL;
+static uint64_t metric_last_id = 0;
+
+/* A new metric with one reference, or NULL if out of memory */
+static UIMetric *ui_metric_new(int is_float) {
+    UIMetric *m = calloc(1, sizeof(UIMetric));
+    if (NULL == m) return NULL;
+    m->is_float = is_float;
+    m->refcount = 1;
+    pthread_mutex_lock(&metric_lock);
+    m->id = ++metric_last_id;
+    m->next = metric_list;
+    metric_list = m;
+    pthread_mutex_unlock(&metric_lock);
+    return m;
+}
+
+/* Retain the live metric with an id, or make a new one if it is gone,
+ * which nothing shows. Returns NULL if out of memory. */
+static UIMetric *ui_metric_find(uint64_t id, int is_float) {
+    pthread_mutex_lock(&metric_lock);
+    for (UIMetric *m = metric_list; NULL != m; m = m->next) {
+        if (m->id != id) continue;
+        m->refcount++;
+        pthread_mutex_unlock(&metric_lock);
+        return m;
+    }
+    pthread_mutex_unlock(&metric_lock);
+    return ui_metric_new(is_float);
+}
+
+static void ui_metric_retain(UIMetric *m) {
+    pthread_mutex_lock(&metric_lock);
+    m->refcount++;
+    pthread_mutex_unlock(&metric_lock);
+}
+
+static void ui_metric_release(UIMetric *m) {
+    pthread_mutex_lock(&metric_lock);
+    if (--m->refcount > 0) {
+        pthread_mutex_unlock(&metric_lock);
+        return;
+    }
+    UIMetric **p = &metric_list;
+    while (*p != m) p = &(*p)->next;
+    *p = m->next;
+    pthread_mutex_unlock(&metric_lock);
+    free(m);
+}
+
+static int metric_gc(void *p, size_t len) {
+    (void) len;
+    UIMetricRef *r = (UIMetricRef *)p;
+    if (NULL != r->metric) ui_metric_release(r->metric);
+    r->metric = NULL;
+    return 0;
+}
+
+static void metric_marshal(void *p, JanetMarshalContext *ctx) {
+    UIMetric *m = ((UIMetricRef *)p)->metric;
+    janet_marshal_abstract(ctx, p);
+    janet_marshal_int64(ctx, (int64_t) m->id);
+    janet_marshal_int(ctx, m->is_float);
+}
+
+static void *metric_unmarshal(JanetMarshalContext *ctx) {
+    UIMetricRef *r = janet_unmarshal_abstract(ctx, sizeof(UIMetricRef));
+    r->metric = NULL;
+    uint64_t id = (uint64_t) janet_unmarshal_int64(ctx);
+    int is_float = janet_unmarshal_int(ctx) != 0;
+    r->metric = ui_metric_find(id, is_float);
+    if (NULL == r->metric) janet_panic("out of memory");
+    return r;
+}
+
+static const JanetAbstractType metric_td = {
+    "ui/metric", metric_gc, NULL, NULL, NULL, metric_marshal, metric_unmarshal, NULL
+};
+
+static UIMetric *janet_getmetric(const Janet *argv, int32_t n) {
+    return ((UIMetricRef *) janet_getabstract(argv, n, &metric_td))->metric;
+}
+
+/* Writers. These may be called from any thread. */
+
+static void ui_metric_set(UIMetric *m, int64_t i, double d) {
+    uint64_t bits = (uint64_t) i;
+    if (m->is_float) memcpy(&bits, &d, sizeof(bits));
+    __atomic_store_n(&m->bits, bits, __ATOMIC_RELAXED);
+}
+
+static void ui_metric_add(UIMetric *m, int64_t i, double d) {
+    if (!m->is_float) {
+        __atomic_fetch_add(&m->bits, (uint64_t) i, __ATOMIC_RELAXED);
+        return;
+    }
+    uint64_t old = __atomic_load_n(&m->bits, __ATOMIC_RELAXED);
+    uint64_t bits;
+    do {
+        double value;
+        memcpy(&value, &old, sizeof(value));
+        value += d;
+        memcpy(&bits, &value, sizeof(bits));
+    } while (!__atomic_compare_exchange_n(&m->bits, &old, bits, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static double ui_metric_bits_value(const UIMetric *m, uint64_t bits) {
+    double value;
+    if (!m->is_float) return (double)(int64_t) bits;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/* A double as an int64, saturating, with NaN as 0 */
+static int64_t ui_metric_clamp(double d) {
+    return d != d ? 0 : d < -9.2e18 ? INT64_MIN : d > 9.2e18 ? INT64_MAX : (int64_t) d;
+}
+
+/* Native API */
+
+JanetUIMetric *janetui_getmetric(const Janet *argv, int32_t n) {
+    return janet_getmetric(argv, n);
+}
+
+void janetui_metric_retain(JanetUIMetric *m) {
+    ui_metric_retain(m);
+}
+
+void janetui_metric_release(JanetUIMetric *m) {
+    ui_metric_release(m);
+}
+
+int janetui_metric_is_float(const JanetUIMetric *m) {
+    return m->is_float;
+}
+
+void janetui_metric_set_int(JanetUIMetric *m, int64_t value) {
+    ui_metric_set(m, value, (double) value);
+}
+
+void janetui_metric_set_float(JanetUIMetric *m, double value) {
+    ui_metric_set(m, ui_metric_clamp(value), value);
+}
+
+void janetui_metric_add_int(JanetUIMetric *m, int64_t delta) {
+    ui_metric_add(m, delta, (double) delta);
+}
+
+void janetui_metric_add_float(JanetUIMetric *m, double delta) {
+    ui_metric_add(m, ui_metric_clamp(delta), delta);
+}
+
+double janetui_metric_value(const JanetUIMetric *m) {
+    return ui_metric_bits_value(m, __atomic_load_n(&m->bits, __ATOMIC_RELAXED));
+}
+
+typedef struct {
+    Janet control;
+    Janet metric;
+    /* Label format with one conversion, or NULL for progress bars */
+    char *format;
+    char conversion;
+    /* Metric value shown as a full progress bar */
+    double max;
+    uint64_t last_bits;
+    int sampled;
+    int last_value;
+    char last_text[UI_METRIC_TEXT_MAX];
+} UIMetricBinding;
+
+static JANET_THREAD_LOCAL UIMetricBinding *metric_bindings = NULL;
+static JANET_THREAD_LOCAL int32_t metric_binding_count = 0;
+static JANET_THREAD_LOCAL int32_t metric_binding_capacity = 0;
+static JANET_THREAD_LOCAL int metric_period_ms = UI_METRIC_DEFAULT_PERIOD;
+/* Period of the running sample timer, or 0 if it is not running */
+static JANET_THREAD_LOCAL int metric_timer_ms = 0;
+
+/* Check that a label format has exactly one numeric conversion and no
+ * length modifier, and compile it for an int64 or double argument.
+ * Returns the conversion character, or 0 if the format is invalid. */
+static char metric_format_compile(const uint8_t *fmt, int32_t len, char *out) {
+    char conversion = 0;
+    int32_t n = 0;
+    for (int32_t i = 0; i < len && fmt[i]; i++) {
+        out[n++] = (char) fmt[i];
+        if (fmt[i] != '%') continue;
+        if (i + 1 < len && fmt[i + 1] == '%') {
+            out[n++] = fmt[++i];
+            continue;
+        }
+        if (conversion) return 0;
+        while (i + 1 < len && strchr("-+ #0", fmt[i + 1]) && fmt[i + 1]) out[n++] = (char) fmt[++i];
+        while (i + 1 < len && fmt[i + 1] >= '0' && fmt[i + 1] <= '9') out[n++] = (char) fmt[++i];
+        if (i + 1 < len && fmt[i + 1] == '.') {
+            out[n++] = (char) fmt[++i];
+            while (i + 1 < len && fmt[i + 1] >= '0' && fmt[i + 1] <= '9') out[n++] = (char) fmt[++i];
+        }
+        if (i + 1 >= len || !fmt[i + 1] || !strchr("diouxXeEfFgGaA", fmt[i + 1])) return 0;
+        conversion = (char) fmt[++i];
+        if (strchr("diouxX", conversion)) {
+            out[n++] = 'l';
+            out[n++] = 'l';
+        }
+        out[n++] = conversion;
+    }
+    out[n] = '\0';
+    return conversion;
+}
+
+static void metric_unbind_at(int32_t i) {
+    UIMetricBinding *b = metric_bindings + i;
+    ((UIControlWrapper *) janet_unwrap_abstract(b->control))->release = NULL;
+    janet_gcunroot(b->control);
+    janet_gcunroot(b->metric);
+    free(b->format);
+    metric_bindings[i] = metric_bindings[--metric_binding_count];
+    ui_mem.metric_bindings--;
+}
+
+static void metric_binding_update(UIMetricBinding *b) {
+    UIMetric *m = ((UIMetricRef *) janet_unwrap_abstract(b->metric))->metric;
+    uint64_t bits = __atomic_load_n(&m->bits, __ATOMIC_RELAXED);
+    if (b->sampled && bits == b->last_bits) return;
+    b->sampled = 1;
+    b->last_bits = bits;
+    double value = ui_metric_bits_value(m, bits);
+    UIControlWrapper *w = janet_unwrap_abstract(b->control);
+    if (NULL == b->format) {
+        double scaled = value != value ? 0 : 100 * value / b->max;
+        int shown = scaled <= 0 ? 0 : scaled >= 100 ? 100 : (int)(scaled + 0.5);
+        if (shown == b->last_value) return;
+        b->last_value = shown;
+        uiProgressBarSetValue((uiProgressBar *) w->control, shown);
+        return;
+    }
+    char text[UI_METRIC_TEXT_MAX];
+    if (strchr("diouxX", b->conversion)) {
+        long long i = (long long)(int64_t) bits;
+        if (m->is_float) i = ui_metric_clamp(value);
+        snprintf(text, sizeof(text), b->format, i);
+    } else {
+        snprintf(text, sizeof(text), b->format, value);
+    }
+    if (!strcmp(text, b->last_text)) return;
+    memcpy(b->last_text, text, sizeof(text));
+    uiLabelSetText((uiLabel *) w->control, text);
+}
+
+/* Find the binding of a control, or -1 */
+static int32_t metric_binding_find(UIControlWrapper *w) {
+    for (int32_t i = 0; i < metric_binding_count; i++) {
+        if (janet_unwrap_abstract(metric_bindings[i].control) == w) return i;
+    }
+    return -1;
+}
+
+/* Release hook of bound controls, so destroying one unbinds it */
+static void metric_binding_release(UIControlWrapper *w) {
+    int32_t i = metric_binding_find(w);
+    if (i >= 0) metric_unbind_at(i);
+}
+
+static void metric_start_timer(void);
+
+static int metric_tick(void *data) {
+    (void) data;
+    uint64_t begin = ui_now_us();
+    for (int32_t i = 0; i < metric_binding_count; i++) metric_binding_update(metric_bindings + i);
+    if (NULL != trace_file) ui_trace_span("metric", "metrics", -1, begin);
+    if (metric_binding_count > 0 && metric_timer_ms == metric_period_ms) return 1;
+    /* Stop when nothing is bound, or restart at a new rate */
+    metric_timer_ms = 0;
+    metric_start_timer();
+    return 0;
+}
+
+static void metric_start_timer(void) {
+    if (metric_timer_ms || 0 == metric_binding_count) return;
+    metric_timer_ms = metric_period_ms;
+    uiTimer(metric_timer_ms, metric_tick, NULL);
+}
+
+static Janet janet_ui_metric(int32_t argc, Janet *argv) {
+    janet_arity(argc, 0, 2);
+    int is_float = 0;
+    if (argc >= 1) {
+        const uint8_t *kw = janet_getkeyword(argv, 0);
+        if (!janet_cstrcmp(kw, "float")) {
+            is_float = 1;
+        } else if (janet_cstrcmp(kw, "int")) {
+            janet_panicf("expected :int or :float, got %v", argv[0]);
+        }
+    }
+    int64_t i = argc == 2 && !is_float ? janet_getinteger64(argv, 1) : 0;
+    double d = argc == 2 && is_float ? janet_getnumber(argv, 1) : 0;
+    UIMetricRef *r = janet_abstract(&metric_td, sizeof(UIMetricRef));
+    r->metric = ui_metric_new(is_float);
+    if (NULL == r->metric) janet_panic("out of memory");
+    ui_metric_set(r->metric, i, d);
+    return janet_wrap_abstract(r);
+}
+
+static Janet janet_ui_metric_set(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    UIMetric *m = janet_getmetric(argv, 0);
+    if (m->is_float) ui_metric_set(m, 0, janet_getnumber(argv, 1));
+    else ui_metric_set(m, janet_getinteger64(argv, 1), 0);
+    return argv[0];
+}
+
+static Janet janet_ui_metric_add(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    UIMetric *m = janet_getmetric(argv, 0);
+    if (m->is_float) ui_metric_add(m, 0, janet_getnumber(argv, 1));
+    else ui_metric_add(m, janet_getinteger64(argv, 1), 0);
+    return argv[0];
+}
+
+static Janet janet_ui_metric_value(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UIMetric *m = janet_getmetric(argv, 0);
+    return janet_wrap_number(janetui_metric_value(m));
+}
+
+/* Also registered in task workers */
+static const JanetReg metric_cfuns[] = {
+    {"metric", janet_ui_metric, NULL},
+    {"metric/set", janet_ui_metric_set, NULL},
+    {"metric/add", janet_ui_metric_add, NULL},
+    {"metric/value", janet_ui_metric_value, NULL},
+    {NULL, NULL, NULL}
+};
+
+/* Show a metric in a label, with an optional format, or in a progress
+ * bar, with an optional value for a full bar. Replaces the control's
+ * previous binding. */
+static Janet janet_ui_bind_metric(int32_t argc, Janet *argv) {
+    janet_arity(argc, 2, 3);
+    UIControlWrapper *w = janet_getcontrolwrapper(argv, 0);
+    UIMetric *m = janet_getmetric(argv, 1);
+    const JanetAbstractType *at = janet_abstract_type(w);
+    if (w->flags & UI_FLAG_ALIAS) janet_panic("cannot bind a metric through ui/parent");
+    UIMetricBinding b;
+    memset(&b, 0, sizeof(b));
+    b.control = argv[0];
+    b.metric = argv[1];
+    b.last_value = -1;
+    b.max = 100;
+    if (at == &label_td) {
+        JanetByteView fmt;
+        fmt.bytes = (const uint8_t *)(m->is_float ? "%g" : "%d");
+        fmt.len = 2;
+        if (argc == 3) fmt = janet_getbytes(argv, 2);
+        /* Room for the added length modifier */
+        b.format = malloc((size_t) fmt.len + 3);
+        if (NULL == b.format) janet_panic("out of memory");
+        b.conversion = metric_format_compile(fmt.bytes, fmt.len, b.format);
+        if (!b.conversion) {
+            free(b.format);
+            janet_panicf("expected a format with one numeric conversion, got %v", argv[2]);
+        }
+    } else if (at == &progress_bar_td) {
+        if (argc == 3) b.max = janet_getnumber(argv, 2);
+        if (!(b.max > 0)) janet_panic("expected positive maximum");
+    } else {
+        janet_panicf("expected label or progress bar, got %v", argv[0]);
+    }
+    int32_t at_index = metric_binding_find(w);
+    if (at_index >= 0) metric_unbind_at(at_index);
+    if (metric_binding_count == metric_binding_capacity) {
+        int32_t newcap = metric_binding_capacity ? 2 * metric_binding_capacity : 8;
+        UIMetricBinding *bindings = realloc(metric_bindings, sizeof(UIMetricBinding) * newcap);
+        if (NULL == bindings) {
+            free(b.format);
+            janet_panic("out of memory");
+        }
+        metric_bindings = bindings;
+        metric_binding_capacity = newcap;
+    }
+    janet_gcroot(b.control);
+    janet_gcroot(b.metric);
+    metric_bindings[metric_binding_count] = b;
+    ui_mem.metric_bindings++;
+    w->release = metric_binding_release;
+    metric_binding_update(metric_bindings + metric_binding_count++);
+    metric_start_timer();
+    return argv[0];
+}
+
+/* Stop showing a metric in a control. Returns true if one was bound. */
+static Janet janet_ui_unbind_metric(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UIControlWrapper *w = janet_getcontrolwrapper(argv, 0);
+    int32_t i = metric_binding_find(w);
+    if (i < 0) return janet_wrap_false();
+    metric_unbind_at(i);
+    return janet_wrap_true();
+}
+
+/* Get or set how many times a second bound metrics are sampled */
+static Janet janet_ui_metric_refresh_rate(int32_t argc, Janet *argv) {
+    janet_arity(argc, 0, 1);
+    if (argc == 1) {
+        double hz = janet_getnumber(argv, 0);
+        if (!(hz > 0 && hz <= 1000)) janet_panic("expected refresh rate between 0 and 1000");
+        metric_period_ms = (int)(1000 / hz);
+        if (metric_period_ms < 1) metric_period_ms = 1;
+    }
+    return janet_wrap_number(1000.0 / metric_period_ms);
+}
+
+static Janet janet_ui_open_file(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    uiWindow *window = janet_getuitype(argv, 0, &window_td);
+    char *str = uiOpenFile(window);
+    if (NULL != str) return janet_cstringv(str);
+    return janet_wrap_nil();
+}
+
+static Janet janet_ui_save_file(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    uiWindow *window = janet_getuitype(argv, 0, &window_td);
+    char *str = uiSaveFile(window);
+    if (NULL != str) return janet_cstringv(str);
+    return janet_wrap_nil();
+}
+
+static Janet janet_ui_message_box(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 3);
+    uiWindow *window = janet_getuitype(argv, 0, &window_td);
+    const uint8_t *title = janet_getstring(argv, 1);
+    const uint8_t *description = janet_getstring(argv, 2);
+    uiMsgBox(window, (const char *)title, (const char *)description);
+    return janet_wrap_nil();
+}
+
+static Janet janet_ui_message_box_error(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 3);
+    uiWindow *window = janet_getuitype(argv, 0, &window_td);
+    const uint8_t *title = janet_getstring(argv, 1);
+    const uint8_t *description = janet_getstring(argv, 2);
+    uiMsgBoxError(window, (const char *)title, (const char *)description);
+    return janet_wrap_nil();
+}
+
+/* Generic controls */
+
+static Janet janet_ui_destroy(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UIControlWrapper *w = janet_getcontrolwrapper(argv, 0);
+    if (w->flags & UI_FLAG_ALIAS) janet_panic("cannot destroy a control through ui/parent");
+    if (NULL != uiControlParent(w->control)) janet_panic("cannot destroy a control that has a parent");
+    uiControlDestroy(w->control);
+    janet_ui_mark_destroyed(w);
+    return janet_wrap_nil();
+}
+
+static Janet janet_ui_parent(int32_t argc, Janet *argv) {
+    uiControl *c, *d;
+    janet_arity(argc, 1, 2);
+    c = janet_getcontrol(argv, 0);
+    if (argc == 2) {
+        UIControlWrapper *cw = janet_getcontrolwrapper(argv, 0);
+        UIControlWrapper *dw = janet_getcontrolwrapper(argv, 1);
+        d = uiControl(dw->control);
+        /* libui only sets the pointer, so the old parent would keep the
+         * control in its container and in its tracked children */
+        if (NULL != cw->parent || NULL != uiControlParent(c)) {
+            janet_panic("cannot set the parent of a control that has one");
+        }
+        if (cw == dw) janet_panic("cannot make a control its own parent");
+        uiControlSetParent(c, d);
+        /* Track the child even under an alias, so control_gc never has
+         * to ask libui about a parent it does not know is alive */
+        janet_ui_add_child(dw, cw, -1);
+        return argv[0];
+    }
+    d = uiControlParent(c);
+    if (NULL == d) return janet_wrap_nil();
+    return janet_ui_handle_to_wrapper(d);
+}
+
+static Janet janet_ui_top_level(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    uiControl *c = janet_getcontrol(argv, 0);
+    return janet_wrap_boolean(uiControlToplevel(c));
+}
+
+static Janet janet_ui_visible(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    uiControl *c = janet_getcontrol(argv, 0);
+    return janet_wrap_boolean(uiControlVisible(c));
+}
+
+static Janet janet_ui_enabled(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    uiControl *c = janet_getcontrol(argv, 0);
+    return janet_wrap_boolean(uiControlEnabled(c));
+}
+
+static Janet janet_ui_show(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    uiControl *c = janet_getcontrol(argv, 0);
+    uiControlShow(c);
+    return argv[0];
+}
+
+static Janet janet_ui_hide(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    uiControl *c = janet_getcontrol(argv, 0);
+    uiControlHide(c);
+    return argv[0];
+}
+
+static Janet janet_ui_enable(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    uiControl *c = janet_getcontrol(argv, 0);
+    uiControlEnable(c);
+    return argv[0];
 }
 
 static Janet janet_ui_disable(int32_t argc, Janet *argv) {
@@ -336,6 +1971,8 @@ static Janet janet_ui_disable(int32_t argc, Janet *argv) {
 /* Window */
 
 static int onClosing(uiWindow *w, void *data) {
+  /* libui destroys the window when this returns true */
+  janet_ui_mark_destroyed((UIControlWrapper *)data);
   uiQuit();
   return 1;
 }
@@ -353,8 +1990,12 @@ static Janet janet_ui_window(int32_t argc, Janet *argv) {
     if (argc >= 4) menuBar = janet_getboolean(argv, 3);
     uiWindow *window = uiNewWindow(title, width, height, menuBar);
     if (NULL == window) janet_panic("could not create windows");
-    uiWindowOnClosing(window, onClosing, NULL);
-    return janet_ui_handle_to_control(window, &window_td);
+    Janet ret = janet_ui_handle_to_control(window, &window_td);
+    UIControlWrapper *w = janet_unwrap_abstract(ret);
+    w->kind = menuBar;
+    janet_ui_root_wrapper(w);
+    uiWindowOnClosing(window, onClosing, w);
+    return ret;
 }
 
 static Janet janet_ui_window_title(int32_t argc, Janet *argv) {
@@ -365,7 +2006,7 @@ static Janet janet_ui_window_title(int32_t argc, Janet *argv) {
         uiWindowSetTitle(window, (const char *)newTitle);
         return argv[0];
     }
-    return janet_cstringv(uiWindowTitle(window));
+    return janet_ui_take_text(uiWindowTitle(window));
 }
 
 static Janet janet_ui_window_content_size(int32_t argc, Janet *argv) {
@@ -400,37 +2041,56 @@ static Janet janet_ui_window_fullscreen(int32_t argc, Janet *argv) {
     return janet_wrap_boolean(uiWindowFullscreen(window));
 }
 
+/* The window closes unless the handler returns false, so a handler
+ * can veto the close, also when it is replayed. Handlers that return
+ * nothing in particular, or yield, still close it. */
 static int window_closing_handler(uiWindow *window, void *data) {
     (void) window;
-    return janet_ui_handler(data);
+    UIControlWrapper *w = janet_unwrap_abstract(((UIHandler *)data)->control);
+    Janet out;
+    janet_ui_dispatch(data, 0, janet_wrap_nil(), &out);
+    int ret = !janet_checktype(out, JANET_BOOLEAN) || janet_unwrap_boolean(out);
+    /* The handler may have destroyed the window itself */
+    if (w->flags & UI_FLAG_DESTROYED) return 0;
+    if (ret) janet_ui_mark_destroyed(w);
+    return ret;
 }
 
 static void window_content_size_changed_handler(uiWindow *window, void *data) {
-    (void) window;
-    janet_ui_handler(data);
+    if (janet_ui_handler_wants_value(data)) {
+        int w = 0, h = 0;
+        uiWindowContentSize(window, &w, &h);
+        Janet *tup = janet_tuple_begin(2);
+        tup[0] = janet_wrap_integer(w);
+        tup[1] = janet_wrap_integer(h);
+        janet_ui_handler_value(data, janet_wrap_tuple(janet_tuple_end(tup)));
+    } else {
+        janet_ui_handler(data);
+    }
 }
 
 static Janet janet_ui_window_on_closing(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 2);
+    janet_arity(argc, 2, 3);
     uiWindow *window = janet_getuitype(argv, 0, &window_td);
     uiWindowOnClosing(window, window_closing_handler,
-            janet_ui_to_handler_data(argv[1]));
+            janet_ui_to_control_handler_data(argc, argv, 0));
     return argv[0];
 }
 
 static Janet janet_ui_window_on_content_size_changed(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 2);
+    janet_arity(argc, 2, 3);
     uiWindow *window = janet_getuitype(argv, 0, &window_td);
     uiWindowOnContentSizeChanged(window, window_content_size_changed_handler,
-            janet_ui_to_handler_data(argv[1]));
+            janet_ui_to_control_handler_data(argc, argv, 1));
     return argv[0];
 }
 
 static Janet janet_ui_window_set_child(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 2);
     uiWindow *window = janet_getuitype(argv, 0, &window_td);
-    uiControl *c = janet_getcontrol(argv, 1);
-    uiWindowSetChild(window, c);
+    UIControlWrapper *c = janet_getcontrolwrapper(argv, 1);
+    uiWindowSetChild(window, uiControl(c->control));
+    janet_ui_set_child(janet_unwrap_abstract(argv[0]), c);
     return argv[0];
 }
 
@@ -473,7 +2133,7 @@ static Janet janet_ui_button_text(int32_t argc, Janet *argv) {
         uiButtonSetText(button, (const char *)newText);
         return argv[0];
     }
-    return janet_cstringv(uiButtonText(button));
+    return janet_ui_take_text(uiButtonText(button));
 }
 
 static void button_click_handler(uiButton *button, void *data) {
@@ -482,10 +2142,10 @@ static void button_click_handler(uiButton *button, void *data) {
 }
 
 static Janet janet_ui_button_on_clicked(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 2);
+    janet_arity(argc, 2, 3);
     uiButton *button = janet_getuitype(argv, 0, &button_td);
     uiButtonOnClicked(button, button_click_handler,
-            janet_ui_to_handler_data(argv[1]));
+            janet_ui_to_control_handler_data(argc, argv, 0));
     return argv[0];
 }
 
@@ -504,16 +2164,20 @@ static Janet janet_ui_vertical_box(int32_t argc, Janet *argv) {
     (void) argv;
     assert_inited();
     uiBox *box = uiNewVerticalBox();
-    return janet_ui_handle_to_control(box, &box_td);
+    Janet ret = janet_ui_handle_to_control(box, &box_td);
+    ((UIControlWrapper *) janet_unwrap_abstract(ret))->kind = 1;
+    return ret;
 }
 
 static Janet janet_ui_box_append(int32_t argc, Janet *argv) {
     int stretchy = 0;
     janet_arity(argc, 2, 3);
     uiBox *box = janet_getuitype(argv, 0, &box_td);
-    uiControl *c = janet_getcontrol(argv, 1);
+    UIControlWrapper *c = janet_getcontrolwrapper(argv, 1);
     if (argc == 3) stretchy = janet_getboolean(argv, 2);
-    uiBoxAppend(box, c, stretchy);
+    uiBoxAppend(box, uiControl(c->control), stretchy);
+    janet_ui_add_child(janet_unwrap_abstract(argv[0]), c, -1);
+    c->stretchy = stretchy;
     return argv[0];
 }
 
@@ -521,7 +2185,11 @@ static Janet janet_ui_box_delete(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 2);
     uiBox *box = janet_getuitype(argv, 0, &box_td);
     int32_t index = janet_getinteger(argv, 1);
+    UIControlWrapper *w = janet_unwrap_abstract(argv[0]);
+    /* Every native child is tracked, in native order */
+    if (index < 0 || index >= w->child_count) janet_panicf("child %v out of range", argv[1]);
     uiBoxDelete(box, index);
+    janet_ui_remove_child(w, index);
     return argv[0];
 }
 
@@ -554,7 +2222,7 @@ static Janet janet_ui_checkbox_text(int32_t argc, Janet *argv) {
         uiCheckboxSetText(cbox, (const char *)text);
         return argv[0];
     }
-    return janet_cstringv(uiCheckboxText(cbox));
+    return janet_ui_take_text(uiCheckboxText(cbox));
 }
 
 static Janet janet_ui_checkbox_checked(int32_t argc, Janet *argv) {
@@ -569,15 +2237,17 @@ static Janet janet_ui_checkbox_checked(int32_t argc, Janet *argv) {
 }
 
 static void on_toggled_handler(uiCheckbox *c, void *data) {
-    (void) c;
-    janet_ui_handler(data);
+    if (janet_ui_handler_wants_value(data)) {
+        janet_ui_handler_value(data, janet_wrap_boolean(uiCheckboxChecked(c)));
+    } else {
+        janet_ui_handler(data);
+    }
 }
 
 static Janet janet_ui_checkbox_on_toggled(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 2);
+    janet_arity(argc, 2, 3);
     uiCheckbox *cbox = janet_getuitype(argv, 0, &checkbox_td);
-    assert_callable(argv, 1);
-    void *handle = janet_ui_to_handler_data(argv[1]);
+    void *handle = janet_ui_to_control_handler_data(argc, argv, 0);
     uiCheckboxOnToggled(cbox, on_toggled_handler, handle);
     return argv[0];
 }
@@ -595,14 +2265,18 @@ static Janet janet_ui_password_entry(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 0);
     (void) argv;
     assert_inited();
-    return janet_ui_handle_to_control(uiNewPasswordEntry(), &entry_td);
+    Janet ret = janet_ui_handle_to_control(uiNewPasswordEntry(), &entry_td);
+    ((UIControlWrapper *) janet_unwrap_abstract(ret))->kind = 1;
+    return ret;
 }
 
 static Janet janet_ui_search_entry(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 0);
     (void) argv;
     assert_inited();
-    return janet_ui_handle_to_control(uiNewSearchEntry(), &entry_td);
+    Janet ret = janet_ui_handle_to_control(uiNewSearchEntry(), &entry_td);
+    ((UIControlWrapper *) janet_unwrap_abstract(ret))->kind = 2;
+    return ret;
 }
 
 static Janet janet_ui_entry_text(int32_t argc, Janet *argv) {
@@ -613,7 +2287,7 @@ static Janet janet_ui_entry_text(int32_t argc, Janet *argv) {
         uiEntrySetText(entry, (const char *)text);
         return argv[0];
     }
-    return janet_cstringv(uiEntryText(entry));
+    return janet_ui_take_text(uiEntryText(entry));
 }
 
 static Janet janet_ui_entry_read_only(int32_t argc, Janet *argv) {
@@ -628,15 +2302,17 @@ static Janet janet_ui_entry_read_only(int32_t argc, Janet *argv) {
 }
 
 static void on_entry_changed(uiEntry *e, void *data) {
-    (void) e;
-    janet_ui_handler(data);
+    if (janet_ui_handler_wants_value(data)) {
+        janet_ui_handler_value(data, janet_ui_take_text(uiEntryText(e)));
+    } else {
+        janet_ui_handler(data);
+    }
 }
 
 static Janet janet_ui_entry_on_changed(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 2);
+    janet_arity(argc, 2, 3);
     uiEntry *entry = janet_getuitype(argv, 0, &entry_td);
-    assert_callable(argv, 1);
-    void *handle = janet_ui_to_handler_data(argv[1]);
+    void *handle = janet_ui_to_control_handler_data(argc, argv, 0);
     uiEntryOnChanged(entry, on_entry_changed, handle);
     return argv[0];
 }
@@ -659,7 +2335,7 @@ static Janet janet_ui_label_text(int32_t argc, Janet *argv) {
         uiLabelSetText(label, (const char *)text);
         return argv[0];
     }
-    return janet_cstringv(uiLabelText(label));
+    return janet_ui_take_text(uiLabelText(label));
 }
 
 /* Janet */
@@ -692,8 +2368,10 @@ static Janet janet_ui_tab_append(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 3);
     uiTab *tab = janet_getuitype(argv, 0, &tab_td);
     const uint8_t *name = janet_getstring(argv, 1);
-    uiControl *c = janet_getcontrol(argv, 2);
-    uiTabAppend(tab, (const char *)name, c);
+    UIControlWrapper *c = janet_getcontrolwrapper(argv, 2);
+    uiTabAppend(tab, (const char *)name, uiControl(c->control));
+    janet_ui_add_child(janet_unwrap_abstract(argv[0]), c, -1);
+    c->page_name = name;
     return argv[0];
 }
 
@@ -702,8 +2380,11 @@ static Janet janet_ui_tab_insert_at(int32_t argc, Janet *argv) {
     uiTab *tab = janet_getuitype(argv, 0, &tab_td);
     const uint8_t *name = janet_getstring(argv, 1);
     int32_t at = janet_getinteger(argv, 2);
-    uiControl *c = janet_getcontrol(argv, 3);
-    uiTabInsertAt(tab, (const char *)name, at, c);
+    UIControlWrapper *c = janet_getcontrolwrapper(argv, 3);
+    if (at < 0 || at > uiTabNumPages(tab)) janet_panicf("page %v out of range", argv[2]);
+    uiTabInsertAt(tab, (const char *)name, at, uiControl(c->control));
+    janet_ui_add_child(janet_unwrap_abstract(argv[0]), c, at);
+    c->page_name = name;
     return argv[0];
 }
 
@@ -711,29 +2392,118 @@ static Janet janet_ui_tab_delete(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 2);
     uiTab *tab = janet_getuitype(argv, 0, &tab_td);
     int32_t at = janet_getinteger(argv, 1);
+    if (at < 0 || at >= uiTabNumPages(tab)) janet_panicf("page %v out of range", argv[1]);
     uiTabDelete(tab, at);
+    janet_ui_remove_child(janet_unwrap_abstract(argv[0]), at);
     return argv[0];
 }
 
-/* Janet */
+/* Lazy pages. A page appended with ui/tab/append-lazy is an empty
+ * vertical box with the page builder in its first handler slot. The
+ * builder runs once, when GTK first maps the box because its tab was
+ * selected, or earlier from a low priority idle callback when
+ * prebuilding, and the control it returns fills the box. */
+
+static void lazy_page_build(UIControlWrapper *w) {
+    UIHandler *h = (UIHandler *) w->handlers[0];
+    if (NULL == h || (w->flags & UI_FLAG_DESTROYED)) return;
+    w->handlers[0] = NULL;
+    /* The map signal is only needed once */
+    janet_ui_disconnect(w);
+    Janet box = janet_wrap_abstract(w);
+    Janet page;
+    /* A builder that raised an error was reported already */
+    if (JANET_SIGNAL_ERROR == janet_ui_call(h->function, (h->flags & UI_HANDLER_ARGS) ? 1 : 0, &box, &page)) {
+        return;
+    }
+    UIControlWrapper *c = NULL;
+    if (janet_checktype(page, JANET_ABSTRACT)) {
+        c = janet_unwrap_abstract(page);
+        if (control_type_index(janet_abstract_type(c)) < 0 || (c->flags & UI_FLAG_DESTROYED) ||
+                NULL != uiControlParent(uiControl(c->control))) c = NULL;
+    }
+    if (NULL == c) {
+        ui_report_error(NULL, janet_cstringv("lazy page builder did not return an unparented control"));
+        return;
+    }
+    uiBoxAppend((uiBox *) w->control, uiControl(c->control), 1);
+    janet_ui_add_child(w, c, -1);
+    c->stretchy = 1;
+}
 
-static Janet janet_ui_group(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
-    assert_inited();
-    const uint8_t *title = janet_getstring(argv, 0);
-    uiGroup *group = uiNewGroup((const char *)title);
-    return janet_ui_handle_to_control(group, &group_td);
+#ifdef UI_GTK
+static void lazy_page_map(GtkWidget *widget, gpointer data) {
+    (void) widget;
+    lazy_page_build((UIControlWrapper *)data);
 }
+#endif
 
-static Janet janet_ui_group_title(int32_t argc, Janet *argv) {
-    janet_arity(argc, 1, 2);
+static int lazy_page_idle(void *data) {
+    lazy_page_build((UIControlWrapper *)data);
+    janet_gcunroot(janet_wrap_abstract(data));
+    return 0;
+}
+
+/* Set the builder of a box that fills it the first time it is shown.
+ * libui has no map event, so without GTK the box is filled from the
+ * main loop soon after, as if prebuilt. Not bound on its own; used by
+ * ui/tab/append-lazy and to restore unbuilt pages. */
+static Janet janet_ui_box_on_first_shown(int32_t argc, Janet *argv) {
+    janet_arity(argc, 2, 3);
+    uiBox *box = janet_getuitype(argv, 0, &box_td);
+    janet_ui_to_control_handler_data(argc, argv, 0);
+#ifdef UI_GTK
+    UIControlWrapper *w = janet_unwrap_abstract(argv[0]);
+    janet_ui_disconnect(w);
+    if (gtk_widget_get_mapped(GTK_WIDGET(uiControlHandle(uiControl(box))))) {
+        lazy_page_build(w);
+    } else {
+        janet_ui_connect(w, "map", G_CALLBACK(lazy_page_map));
+    }
+#else
+    (void) box;
+    janet_gcroot(argv[0]);
+    ui_idle_add(UI_IDLE_LOW, lazy_page_idle, janet_unwrap_abstract(argv[0]));
+#endif
+    return argv[0];
+}
+
+static Janet janet_ui_tab_append_lazy(int32_t argc, Janet *argv) {
+    janet_arity(argc, 3, 4);
+    janet_getuitype(argv, 0, &tab_td);
+    janet_getstring(argv, 1);
+    assert_callable(argv, 2);
+    Janet page = janet_ui_vertical_box(0, NULL);
+    Janet on_shown[2] = {page, argv[2]};
+    janet_ui_box_on_first_shown(2, on_shown);
+    Janet append[3] = {argv[0], argv[1], page};
+    janet_ui_tab_append(3, append);
+    if (argc == 4 && janet_truthy(argv[3])) {
+        janet_gcroot(page);
+        ui_idle_add(UI_IDLE_LOW, lazy_page_idle, janet_unwrap_abstract(page));
+    }
+    return argv[0];
+}
+
+/* Janet */
+
+static Janet janet_ui_group(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    assert_inited();
+    const uint8_t *title = janet_getstring(argv, 0);
+    uiGroup *group = uiNewGroup((const char *)title);
+    return janet_ui_handle_to_control(group, &group_td);
+}
+
+static Janet janet_ui_group_title(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
     uiGroup *group = janet_getuitype(argv, 0, &group_td);
     if (argc == 2) {
         const uint8_t *title = janet_getstring(argv, 1);
         uiGroupSetTitle(group, (const char *)title);
         return argv[0];
     }
-    return janet_cstringv(uiGroupTitle(group));
+    return janet_ui_take_text(uiGroupTitle(group));
 }
 
 static Janet janet_ui_group_margined(int32_t argc, Janet *argv) {
@@ -750,8 +2520,9 @@ static Janet janet_ui_group_margined(int32_t argc, Janet *argv) {
 static Janet janet_ui_group_set_child(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 2);
     uiGroup *group = janet_getuitype(argv, 0, &group_td);
-    uiControl *c = janet_getcontrol(argv, 1);
-    uiGroupSetChild(group, c);
+    UIControlWrapper *c = janet_getcontrolwrapper(argv, 1);
+    uiGroupSetChild(group, uiControl(c->control));
+    janet_ui_set_child(janet_unwrap_abstract(argv[0]), c);
     return janet_wrap_boolean(uiGroupMargined(group));
 }
 
@@ -763,7 +2534,10 @@ static Janet janet_ui_spinbox(int32_t argc, Janet *argv) {
     int32_t min = janet_getinteger(argv, 0);
     int32_t max = janet_getinteger(argv, 1);
     uiSpinbox *spinbox = uiNewSpinbox(min, max);
-    return janet_ui_handle_to_control(spinbox, &spinbox_td);
+    Janet ret = janet_ui_handle_to_control(spinbox, &spinbox_td);
+    janet_ui_state_push(janet_unwrap_abstract(ret), argv[0]);
+    janet_ui_state_push(janet_unwrap_abstract(ret), argv[1]);
+    return ret;
 }
 
 static Janet janet_ui_spinbox_value(int32_t argc, Janet *argv) {
@@ -778,15 +2552,17 @@ static Janet janet_ui_spinbox_value(int32_t argc, Janet *argv) {
 }
 
 static void spinbox_on_changed(uiSpinbox *sb, void *data) {
-    (void) sb;
-    janet_ui_handler(data);
+    if (janet_ui_handler_wants_value(data)) {
+        janet_ui_handler_value(data, janet_wrap_integer(uiSpinboxValue(sb)));
+    } else {
+        janet_ui_handler(data);
+    }
 }
 
 static Janet janet_ui_spinbox_on_changed(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 2);
+    janet_arity(argc, 2, 3);
     uiSpinbox *spinbox = janet_getuitype(argv, 0, &spinbox_td);
-    assert_callable(argv, 1);
-    void *handle = janet_ui_to_handler_data(argv[1]);
+    void *handle = janet_ui_to_control_handler_data(argc, argv, 0);
     uiSpinboxOnChanged(spinbox, spinbox_on_changed, handle);
     return argv[0];
 }
@@ -798,7 +2574,10 @@ static Janet janet_ui_slider(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 2);
     int32_t min = janet_getinteger(argv, 0);
     int32_t max = janet_getinteger(argv, 1);
-    return janet_ui_handle_to_control(uiNewSlider(min, max), &slider_td);
+    Janet ret = janet_ui_handle_to_control(uiNewSlider(min, max), &slider_td);
+    janet_ui_state_push(janet_unwrap_abstract(ret), argv[0]);
+    janet_ui_state_push(janet_unwrap_abstract(ret), argv[1]);
+    return ret;
 }
 
 static Janet janet_ui_slider_value(int32_t argc, Janet *argv) {
@@ -813,15 +2592,17 @@ static Janet janet_ui_slider_value(int32_t argc, Janet *argv) {
 }
 
 static void slider_on_changed(uiSlider *s, void *data) {
-    (void) s;
-    janet_ui_handler(data);
+    if (janet_ui_handler_wants_value(data)) {
+        janet_ui_handler_value(data, janet_wrap_integer(uiSliderValue(s)));
+    } else {
+        janet_ui_handler(data);
+    }
 }
 
 static Janet janet_ui_slider_on_changed(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 2);
+    janet_arity(argc, 2, 3);
     uiSlider *slider = janet_getuitype(argv, 0, &slider_td);
-    assert_callable(argv, 1);
-    void *handle = janet_ui_to_handler_data(argv[1]);
+    void *handle = janet_ui_to_control_handler_data(argc, argv, 0);
     uiSliderOnChanged(slider, slider_on_changed, handle);
     return argv[0];
 }
@@ -853,7 +2634,9 @@ static Janet janet_ui_horizontal_separator(int32_t argc, Janet *argv) {
 
 static Janet janet_ui_vertical_separator(int32_t argc, Janet *argv) {
     assert_inited();
-    return janet_ui_handle_to_control(uiNewVerticalSeparator(), &separator_td);
+    Janet ret = janet_ui_handle_to_control(uiNewVerticalSeparator(), &separator_td);
+    ((UIControlWrapper *) janet_unwrap_abstract(ret))->kind = 1;
+    return ret;
 }
 
 /* Combobox */
@@ -871,269 +2654,7707 @@ static Janet janet_ui_combobox_selected(int32_t argc, Janet *argv) {
         uiComboboxSetSelected(cbox, selected);
         return argv[0];
     }
-    return janet_wrap_integer(uiComboboxSelected(cbox));
+    return janet_wrap_integer(uiComboboxSelected(cbox));
+}
+
+static Janet janet_ui_combobox_append(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    uiCombobox *cbox = janet_getuitype(argv, 0, &combobox_td);
+    const uint8_t *text = janet_getstring(argv, 1);
+    uiComboboxAppend(cbox, (const char *)text);
+    janet_ui_state_push(janet_unwrap_abstract(argv[0]), argv[1]);
+    return argv[0];
+}
+
+static void combobox_on_selected(uiCombobox *c, void *data) {
+    if (janet_ui_handler_wants_value(data)) {
+        janet_ui_handler_value(data, janet_wrap_integer(uiComboboxSelected(c)));
+    } else {
+        janet_ui_handler(data);
+    }
+}
+
+static Janet janet_ui_combobox_on_selected(int32_t argc, Janet *argv) {
+    janet_arity(argc, 2, 3);
+    uiCombobox *cbox = janet_getuitype(argv, 0, &combobox_td);
+    void *handle = janet_ui_to_control_handler_data(argc, argv, 0);
+    uiComboboxOnSelected(cbox, combobox_on_selected, handle);
+    return argv[0];
+}
+
+/* Editable Combobox */
+
+static Janet janet_ui_editable_combobox(int32_t argc, Janet *argv) {
+    assert_inited();
+    return janet_ui_handle_to_control(uiNewEditableCombobox(), &editable_combobox_td);
+}
+
+static Janet janet_ui_editable_combobox_text(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    uiEditableCombobox *cbox = janet_getuitype(argv, 0, &editable_combobox_td);
+    if (argc == 2) {
+        const uint8_t *text = janet_getstring(argv, 1);
+        uiEditableComboboxSetText(cbox, (const char *)text);
+        return argv[0];
+    }
+    return janet_ui_take_text(uiEditableComboboxText(cbox));
+}
+
+static Janet janet_ui_editable_combobox_append(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    uiEditableCombobox *cbox = janet_getuitype(argv, 0, &editable_combobox_td);
+    const uint8_t *text = janet_getstring(argv, 1);
+    uiEditableComboboxAppend(cbox, (const char *)text);
+    janet_ui_state_push(janet_unwrap_abstract(argv[0]), argv[1]);
+    return argv[0];
+}
+
+static void editable_combobox_on_changed(uiEditableCombobox *c, void *data) {
+    if (janet_ui_handler_wants_value(data)) {
+        janet_ui_handler_value(data, janet_ui_take_text(uiEditableComboboxText(c)));
+    } else {
+        janet_ui_handler(data);
+    }
+}
+
+static Janet janet_ui_editable_combobox_on_changed(int32_t argc, Janet *argv) {
+    janet_arity(argc, 2, 3);
+    uiEditableCombobox *cbox = janet_getuitype(argv, 0, &editable_combobox_td);
+    void *handle = janet_ui_to_control_handler_data(argc, argv, 0);
+    uiEditableComboboxOnChanged(cbox, editable_combobox_on_changed, handle);
+    return argv[0];
+}
+
+/* Radio buttons */
+
+static Janet janet_ui_radio_buttons(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 0);
+    (void) argv;
+    assert_inited();
+    return janet_ui_handle_to_control(uiNewRadioButtons(), &radio_buttons_td);
+}
+
+static Janet janet_ui_radio_buttons_selected(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    uiRadioButtons *rb = janet_getuitype(argv, 0, &radio_buttons_td);
+    if (argc == 2) {
+        int selected = janet_getboolean(argv, 1);
+        uiRadioButtonsSetSelected(rb, selected);
+        return argv[0];
+    }
+    return janet_wrap_integer(uiRadioButtonsSelected(rb));
+}
+
+static Janet janet_ui_radio_buttons_append(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    uiRadioButtons *rb = janet_getuitype(argv, 0, &radio_buttons_td);
+    const uint8_t *text = janet_getstring(argv, 1);
+    uiRadioButtonsAppend(rb, (const char *)text);
+    janet_ui_state_push(janet_unwrap_abstract(argv[0]), argv[1]);
+    return argv[0];
+}
+
+static void radio_buttons_on_selected(uiRadioButtons *rb, void *data) {
+    if (janet_ui_handler_wants_value(data)) {
+        janet_ui_handler_value(data, janet_wrap_integer(uiRadioButtonsSelected(rb)));
+    } else {
+        janet_ui_handler(data);
+    }
+}
+
+static Janet janet_ui_radio_buttons_on_selected(int32_t argc, Janet *argv) {
+    janet_arity(argc, 2, 3);
+    uiRadioButtons *rb = janet_getuitype(argv, 0, &radio_buttons_td);
+    void *handle = janet_ui_to_control_handler_data(argc, argv, 0);
+    uiRadioButtonsOnSelected(rb, radio_buttons_on_selected, handle);
+    return argv[0];
+}
+
+/* Multiline Entry */
+
+static Janet janet_ui_multiline_entry(int32_t argc, Janet *argv) {
+    janet_arity(argc, 0, 1);
+    int nowrap = 0;
+    assert_inited();
+    if (argc == 1) nowrap = janet_getboolean(argv, 0);
+    Janet ret = janet_ui_handle_to_control(
+            nowrap ? uiNewNonWrappingMultilineEntry() : uiNewMultilineEntry(),
+            &multiline_entry_td);
+    ((UIControlWrapper *) janet_unwrap_abstract(ret))->kind = nowrap;
+    return ret;
+}
+
+static Janet janet_ui_multiline_entry_text(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    uiMultilineEntry *me = janet_getuitype(argv, 0, &multiline_entry_td);
+    if (argc == 2) {
+        const uint8_t *text = janet_getstring(argv, 1);
+        uiMultilineEntrySetText(me, (const char *)text);
+        return argv[0];
+    }
+    return janet_ui_take_text(uiMultilineEntryText(me));
+}
+
+static Janet janet_ui_multiline_entry_read_only(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    uiMultilineEntry *me = janet_getuitype(argv, 0, &multiline_entry_td);
+    if (argc == 2) {
+        int selected = janet_getboolean(argv, 1);
+        uiMultilineEntrySetReadOnly(me, selected);
+        return argv[0];
+    }
+    return janet_wrap_boolean(uiMultilineEntryReadOnly(me));
+}
+
+static Janet janet_ui_multiline_entry_append(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    uiMultilineEntry *me = janet_getuitype(argv, 0, &multiline_entry_td);
+    const uint8_t *text = janet_getstring(argv, 1);
+    uiMultilineEntryAppend(me, (const char *)text);
+    return argv[0];
+}
+
+static void multiline_entry_on_changed(uiMultilineEntry *e, void *data) {
+    if (janet_ui_handler_wants_value(data)) {
+        janet_ui_handler_value(data, janet_ui_take_text(uiMultilineEntryText(e)));
+    } else {
+        janet_ui_handler(data);
+    }
+}
+
+static Janet janet_ui_multiline_entry_on_changed(int32_t argc, Janet *argv) {
+    janet_arity(argc, 2, 3);
+    uiMultilineEntry *me = janet_getuitype(argv, 0, &multiline_entry_td);
+    void *handle = janet_ui_to_control_handler_data(argc, argv, 0);
+    uiMultilineEntryOnChanged(me, multiline_entry_on_changed, handle);
+    return argv[0];
+}
+
+/* Streaming loads. ui/multiline-entry/load-stream clears an entry and
+ * appends a source to it in chunks from an idle callback, up to the
+ * idle budget per main loop iteration, so a large document does not
+ * block input and redraws while it loads. A source is a string, a
+ * buffer, a file, or a function or fiber returning chunks and then
+ * nil. Chunks end on character boundaries, and invalid UTF-8 and NUL
+ * bytes are replaced with '?'. The entry is read only until the load
+ * ends, and a running load is a GC root. Files are read on the worker
+ * pool a chunk ahead of the appends, and the idle callback sleeps
+ * while a read is in flight, so a slow disk or pipe never blocks the
+ * UI thread. The file must stay open until the load ends. */
+
+#define UI_LOAD_DEFAULT_CHUNK 65536
+/* Returned by stream_load_read while a file read is in flight */
+#define UI_LOAD_WAIT (-2)
+
+typedef struct UIStreamLoad UIStreamLoad;
+struct UIStreamLoad {
+    Janet entry;
+    Janet source;
+    Janet on_progress;
+    /* Chunk being appended, and the read offset into it */
+    Janet pending;
+    int32_t offset;
+    int32_t chunk;
+    int64_t loaded;
+    /* Bytes expected, or -1 if unknown */
+    int64_t total;
+    int running;
+    int read_only;
+    /* Bytes of an incomplete character, appended with the next chunk */
+    uint8_t carry[4];
+    int32_t carry_len;
+    uint8_t *buf;
+    UIStreamLoad *next;
+    /* File reads. The worker owns file, rbuf and rlen while reading is
+     * set, and the UI thread otherwise. */
+    UIJob job;
+    FILE *file;
+    uint8_t *rbuf;
+    int32_t rlen;
+    int reading;
+    int ready;
+    /* Set while the idle callback is removed until a read lands */
+    int waiting;
+};
+
+static int stream_load_gc(void *p, size_t len) {
+    (void) len;
+    free(((UIStreamLoad *)p)->buf);
+    free(((UIStreamLoad *)p)->rbuf);
+    return 0;
+}
+
+static int stream_load_gcmark(void *p, size_t len) {
+    (void) len;
+    UIStreamLoad *l = (UIStreamLoad *)p;
+    janet_mark(l->entry);
+    janet_mark(l->source);
+    janet_mark(l->on_progress);
+    janet_mark(l->pending);
+    return 0;
+}
+
+static const JanetAbstractType stream_load_td = {"ui/stream-load", stream_load_gc, stream_load_gcmark, NULL, NULL, NULL, NULL, NULL};
+
+/* Running loads, so a new load into an entry cancels the old one */
+static JANET_THREAD_LOCAL UIStreamLoad *stream_loads = NULL;
+
+/* Get the next chunk of a function or fiber source. Returns 0 at the
+ * end of the source. */
+static int stream_load_pull(UIStreamLoad *l) {
+    Janet out = janet_wrap_nil();
+    if (janet_checktype(l->source, JANET_FIBER)) {
+        JanetFiber *fiber = janet_unwrap_fiber(l->source);
+        JanetFiberStatus status = janet_fiber_status(fiber);
+        if (status == JANET_STATUS_DEAD || status == JANET_STATUS_ERROR) return 0;
+        JanetSignal sig = janet_continue(fiber, janet_wrap_nil(), &out);
+        if (sig != JANET_SIGNAL_OK && sig != JANET_SIGNAL_YIELD) {
+            ui_report_error(fiber, out);
+            return 0;
+        }
+    } else if (janet_checktypes(l->source, JANET_TFLAG_CALLABLE)) {
+        janet_ui_call(l->source, 0, NULL, &out);
+    }
+    if (!janet_checktypes(out, JANET_TFLAG_BYTES)) return 0;
+    l->pending = out;
+    l->offset = 0;
+    return 1;
+}
+
+static int stream_load_idle(void *data);
+
+/* A read landed. Wake the idle callback if it was waiting for it. */
+static void stream_load_read_done(void *data) {
+    UIStreamLoad *l = (UIStreamLoad *)data;
+    l->reading = 0;
+    l->ready = 1;
+    if (l->waiting) {
+        l->waiting = 0;
+        ui_idle_add(UI_IDLE_DEFAULT, stream_load_idle, l);
+    }
+}
+
+static void stream_load_read_run(UIJob *job) {
+    UIStreamLoad *l = (UIStreamLoad *)((char *) job - offsetof(UIStreamLoad, job));
+    size_t n = fread(l->rbuf, 1, (size_t) l->chunk, l->file);
+    l->rlen = n ? (int32_t) n : -1;
+    uiQueueMain(stream_load_read_done, l);
+}
+
+/* Start reading the next chunk of a file. Without workers it is read
+ * here. */
+static void stream_load_read_ahead(UIStreamLoad *l) {
+    int flags;
+    FILE *f = janet_getfile(&l->source, 0, &flags);
+    if (flags & JANET_FILE_CLOSED) {
+        l->rlen = -1;
+        l->ready = 1;
+        return;
+    }
+    l->file = f;
+    l->reading = 1;
+    if (ui_pool_submit(&l->job)) return;
+    l->reading = 0;
+    size_t n = fread(l->rbuf, 1, (size_t) l->chunk, f);
+    l->rlen = n ? (int32_t) n : -1;
+    l->ready = 1;
+}
+
+/* Read up to cap bytes of the source. Returns -1 at the end of the
+ * source, or UI_LOAD_WAIT while a file read is in flight. */
+static int32_t stream_load_read(UIStreamLoad *l, uint8_t *dst, int32_t cap) {
+    if (janet_checktype(l->source, JANET_ABSTRACT)) {
+        if (l->reading) return UI_LOAD_WAIT;
+        if (!l->ready) {
+            stream_load_read_ahead(l);
+            if (l->reading) return UI_LOAD_WAIT;
+        }
+        l->ready = 0;
+        int32_t n = l->rlen;
+        if (n < 0) return -1;
+        if (n > cap) n = cap;
+        memcpy(dst, l->rbuf, n);
+        stream_load_read_ahead(l);
+        return n;
+    }
+    const uint8_t *bytes = NULL;
+    int32_t len = 0;
+    janet_bytes_view(l->pending, &bytes, &len);
+    if (l->offset >= len) {
+        if (!stream_load_pull(l)) return -1;
+        janet_bytes_view(l->pending, &bytes, &len);
+    }
+    int32_t n = len - l->offset;
+    if (n > cap) n = cap;
+    if (n < 0) n = 0;
+    memcpy(dst, bytes + l->offset, n);
+    l->offset += n;
+    return n;
+}
+
+/* Replace invalid UTF-8 and NUL bytes with '?'. Returns the length of
+ * the text up to an incomplete character at the end, which is left for
+ * the next chunk unless this is the last one. */
+static int32_t stream_load_validate(uint8_t *p, int32_t n, int last) {
+    int32_t i = 0;
+    while (i < n) {
+        uint8_t c = p[i];
+        if (c < 0x80) {
+            if (c == 0) p[i] = '?';
+            i++;
+            continue;
+        }
+        int len = c >= 0xC2 && c <= 0xDF ? 2 : c >= 0xE0 && c <= 0xEF ? 3 : c >= 0xF0 && c <= 0xF4 ? 4 : 0;
+        int valid = len > 0;
+        for (int k = 1; valid && k < len && i + k < n; k++) valid = (p[i + k] & 0xC0) == 0x80;
+        if (valid && len > 2 && i + 1 < n) {
+            uint8_t c1 = p[i + 1];
+            if ((c == 0xE0 && c1 < 0xA0) || (c == 0xED && c1 >= 0xA0) ||
+                    (c == 0xF0 && c1 < 0x90) || (c == 0xF4 && c1 >= 0x90)) valid = 0;
+        }
+        if (valid && i + len > n) {
+            if (!last) return i;
+            valid = 0;
+        }
+        if (valid) {
+            i += len;
+        } else {
+            p[i++] = '?';
+        }
+    }
+    return n;
+}
+
+static void stream_load_unlink(UIStreamLoad *l) {
+    for (UIStreamLoad **p = &stream_loads; NULL != *p; p = &(*p)->next) {
+        if (*p != l) continue;
+        *p = l->next;
+        ui_mem.stream_loads--;
+        break;
+    }
+}
+
+/* Stop a load and give the entry back its read only state */
+static void stream_load_stop(UIStreamLoad *l) {
+    UIControlWrapper *w = janet_unwrap_abstract(l->entry);
+    l->running = 0;
+    stream_load_unlink(l);
+    if (!(w->flags & UI_FLAG_DESTROYED)) uiMultilineEntrySetReadOnly((uiMultilineEntry *) w->control, l->read_only);
+}
+
+static int stream_load_idle(void *data) {
+    UIStreamLoad *l = (UIStreamLoad *)data;
+    UIControlWrapper *w = janet_unwrap_abstract(l->entry);
+    uint64_t begin = ui_now_us();
+    int last = 0;
+    if (w->flags & UI_FLAG_DESTROYED) stream_load_stop(l);
+    while (l->running && !last) {
+        memcpy(l->buf, l->carry, l->carry_len);
+        int32_t n = stream_load_read(l, l->buf + l->carry_len, l->chunk);
+        if (n == UI_LOAD_WAIT) {
+            l->waiting = 1;
+            break;
+        }
+        if (n < 0) {
+            last = 1;
+            n = 0;
+        }
+        int32_t len = l->carry_len + n;
+        int32_t cut = stream_load_validate(l->buf, len, last);
+        l->carry_len = len - cut;
+        memcpy(l->carry, l->buf + cut, l->carry_len);
+        l->buf[cut] = '\0';
+        l->loaded += n;
+        /* The append runs on-changed handlers, which may cancel the
+         * load or destroy the entry */
+        if (cut > 0 && l->running && !(w->flags & UI_FLAG_DESTROYED))
+            uiMultilineEntryAppend((uiMultilineEntry *) w->control, (const char *) l->buf);
+        if (w->flags & UI_FLAG_DESTROYED) stream_load_stop(l);
+        if (ui_now_us() - begin >= idle_budget_us) break;
+    }
+    if (NULL != trace_file) ui_trace_span("load", "multiline-entry/load-stream", -1, begin);
+    /* Cancelled loads are not reported */
+    int done = l->running && last;
+    if (done) stream_load_stop(l);
+    if ((l->running || done) && !janet_checktype(l->on_progress, JANET_NIL)) {
+        Janet args[3] = {
+            janet_wrap_number((double) l->loaded),
+            l->total < 0 ? janet_wrap_nil() : janet_wrap_number((double) l->total),
+            janet_wrap_boolean(done)
+        };
+        janet_ui_call(l->on_progress, 3, args, NULL);
+    }
+    if (l->running) return !l->waiting;
+    /* The worker still writes into the load, so free it after */
+    if (l->reading) {
+        l->waiting = 1;
+        return 0;
+    }
+    free(l->buf);
+    l->buf = NULL;
+    free(l->rbuf);
+    l->rbuf = NULL;
+    janet_gcunroot(janet_wrap_abstract(l));
+    return 0;
+}
+
+/* Size of the rest of a regular file, or -1 */
+static int64_t stream_load_file_size(FILE *f) {
+    struct stat st;
+    long at = ftell(f);
+    if (at < 0 || fstat(fileno(f), &st) || !S_ISREG(st.st_mode) || st.st_size < at) return -1;
+    return (int64_t) st.st_size - at;
+}
+
+static Janet janet_ui_multiline_entry_load_stream(int32_t argc, Janet *argv) {
+    janet_arity(argc, 2, 4);
+    uiMultilineEntry *me = janet_getuitype(argv, 0, &multiline_entry_td);
+    Janet source = argv[1];
+    int64_t total = -1;
+    if (janet_checktypes(source, JANET_TFLAG_BYTES)) {
+        total = janet_getbytes(argv, 1).len;
+    } else if (janet_checktype(source, JANET_ABSTRACT)) {
+        int flags;
+        FILE *f = janet_getfile(argv, 1, &flags);
+        if (flags & JANET_FILE_CLOSED) janet_panic("file is closed");
+        total = stream_load_file_size(f);
+    } else if (!janet_checktype(source, JANET_FIBER)) {
+        assert_callable(argv, 1);
+    }
+    if (argc >= 3 && !janet_checktype(argv[2], JANET_NIL)) assert_callable(argv, 2);
+    int32_t chunk = argc == 4 ? janet_getinteger(argv, 3) : UI_LOAD_DEFAULT_CHUNK;
+    if (chunk <= 0) janet_panic("expected positive chunk size");
+    uint8_t *buf = malloc((size_t) chunk + sizeof(((UIStreamLoad *)0)->carry) + 1);
+    uint8_t *rbuf = janet_checktype(source, JANET_ABSTRACT) ? malloc((size_t) chunk) : NULL;
+    if (NULL == buf || (janet_checktype(source, JANET_ABSTRACT) && NULL == rbuf)) {
+        free(buf);
+        free(rbuf);
+        janet_panic("out of memory");
+    }
+    for (UIStreamLoad *old = stream_loads; NULL != old; old = old->next) {
+        if (janet_unwrap_abstract(old->entry) == janet_unwrap_abstract(argv[0])) {
+            stream_load_stop(old);
+            break;
+        }
+    }
+    UIStreamLoad *l = janet_abstract(&stream_load_td, sizeof(UIStreamLoad));
+    l->entry = argv[0];
+    l->source = source;
+    l->on_progress = argc >= 3 ? argv[2] : janet_wrap_nil();
+    l->pending = janet_checktypes(source, JANET_TFLAG_BYTES) ? source : janet_wrap_nil();
+    l->offset = 0;
+    l->chunk = chunk;
+    l->loaded = 0;
+    l->total = total;
+    l->running = 1;
+    l->read_only = uiMultilineEntryReadOnly(me);
+    l->carry_len = 0;
+    l->buf = buf;
+    l->job.run = stream_load_read_run;
+    l->file = NULL;
+    l->rbuf = rbuf;
+    l->rlen = 0;
+    l->reading = 0;
+    l->ready = 0;
+    l->waiting = 0;
+    l->next = stream_loads;
+    stream_loads = l;
+    ui_mem.stream_loads++;
+    uiMultilineEntrySetText(me, "");
+    uiMultilineEntrySetReadOnly(me, 1);
+    janet_gcroot(janet_wrap_abstract(l));
+    ui_idle_add(UI_IDLE_DEFAULT, stream_load_idle, l);
+    return janet_wrap_abstract(l);
+}
+
+/* Cancel a load, keeping the text appended so far. Returns true if it
+ * was still running. */
+static Janet janet_ui_multiline_entry_cancel_load(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UIStreamLoad *l = janet_getabstract(argv, 0, &stream_load_td);
+    if (!l->running) return janet_wrap_false();
+    stream_load_stop(l);
+    return janet_wrap_true();
+}
+
+/* Menu Item */
+
+/* Menus and menu items live as long as the program, and are not
+ * reachable from any window, so their wrappers are GC roots. */
+static Janet janet_ui_handle_to_menu(void *handle, const JanetAbstractType *atype) {
+    Janet ret = janet_ui_handle_to_control(handle, atype);
+    janet_ui_root_wrapper(janet_unwrap_abstract(ret));
+    return ret;
+}
+
+static Janet janet_ui_menu_item_enable(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    uiMenuItem *mi = janet_getuitype(argv, 0, &menu_item_td);
+    uiMenuItemEnable(mi);
+    return argv[0];
+}
+
+static Janet janet_ui_menu_item_disable(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    uiMenuItem *mi = janet_getuitype(argv, 0, &menu_item_td);
+    uiMenuItemDisable(mi);
+    return argv[0];
+}
+
+static Janet janet_ui_menu_item_checked(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    uiMenuItem *mi = janet_getuitype(argv, 0, &menu_item_td);
+    if (argc == 2) {
+        int checked = janet_getboolean(argv, 1);
+        uiMenuItemSetChecked(mi, checked);
+        return argv[0];
+    }
+    return janet_wrap_boolean(uiMenuItemChecked(mi));
+}
+
+static void menu_item_on_clicked(uiMenuItem *sender, uiWindow *window, void *data) {
+    (void) window;
+    if (janet_ui_handler_wants_value(data)) {
+        janet_ui_handler_value(data, janet_wrap_boolean(uiMenuItemChecked(sender)));
+    } else {
+        janet_ui_handler(data);
+    }
+}
+
+static Janet janet_ui_menu_item_on_clicked(int32_t argc, Janet *argv) {
+    janet_arity(argc, 2, 3);
+    uiMenuItem *mi = janet_getuitype(argv, 0, &menu_item_td);
+    void *handle = janet_ui_to_control_handler_data(argc, argv, 0);
+    uiMenuItemOnClicked(mi, menu_item_on_clicked, handle);
+    return argv[0];
+}
+
+/* Menu */
+
+static Janet janet_ui_menu(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    const uint8_t *name = janet_getstring(argv, 0);
+    assert_inited();
+    return janet_ui_handle_to_menu(
+            uiNewMenu((const char *)name),
+            &menu_td);
+}
+
+static Janet janet_ui_menu_append_item(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    uiMenu *menu = janet_getuitype(argv, 0, &menu_td);
+    const uint8_t *name = janet_getstring(argv, 1);
+    return janet_ui_handle_to_menu(
+            uiMenuAppendItem(menu, (const char *)name),
+            &menu_item_td);
+}
+
+static Janet janet_ui_menu_append_check_item(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    uiMenu *menu = janet_getuitype(argv, 0, &menu_td);
+    const uint8_t *name = janet_getstring(argv, 1);
+    return janet_ui_handle_to_menu(
+            uiMenuAppendCheckItem(menu, (const char *)name),
+            &menu_item_td);
+}
+
+static Janet janet_ui_menu_append_quit_item(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    uiMenu *menu = janet_getuitype(argv, 0, &menu_td);
+    return janet_ui_handle_to_menu(
+            uiMenuAppendQuitItem(menu),
+            &menu_item_td);
+}
+
+static Janet janet_ui_menu_append_about_item(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    uiMenu *menu = janet_getuitype(argv, 0, &menu_td);
+    return janet_ui_handle_to_menu(
+            uiMenuAppendAboutItem(menu),
+            &menu_item_td);
+}
+
+static Janet janet_ui_menu_append_preferences_item(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    uiMenu *menu = janet_getuitype(argv, 0, &menu_td);
+    return janet_ui_handle_to_menu(
+            uiMenuAppendPreferencesItem(menu),
+            &menu_item_td);
+}
+
+static Janet janet_ui_menu_append_separator(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    uiMenu *menu = janet_getuitype(argv, 0, &menu_td);
+    uiMenuAppendSeparator(menu);
+    return argv[0];
+}
+
+/* Image */
+
+/* A resampled representation of an image, kept in a per image
+ * LRU list. The most recently used representation is at the head.
+ * Pixels live in an immutable Janet string so ui/image/scaled can
+ * return them without copying; the image marks every cached string. */
+typedef struct UIImageRep UIImageRep;
+struct UIImageRep {
+    UIImageRep *prev;
+    UIImageRep *next;
+    int32_t width;
+    int32_t height;
+    double scale;
+    int32_t pixel_width;
+    int32_t pixel_height;
+    JanetString pixels;
+};
+
+/* Largest appended representation, used as the resampling source.
+ * Pixels are tightly packed RGBA. Resampling jobs share it and only
+ * read it; the count is only touched on the UI thread. */
+typedef struct {
+    int refcount;
+    int32_t width;
+    int32_t height;
+    uint8_t pixels[];
+} UIImageSource;
+
+typedef struct UIImageJob UIImageJob;
+
+typedef struct {
+    /* Size in points, the size scaled to by default */
+    double width;
+    double height;
+    UIImageSource *source;
+    /* Cache of resampled representations */
+    UIImageRep *head;
+    UIImageRep *tail;
+    int32_t cache_count;
+    size_t cache_bytes;
+    size_t cache_limit;
+    /* Resampling jobs in flight. The image is rooted while there are
+     * any, so they can always deliver. */
+    UIImageJob *jobs;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} UIImage;
+
+/* A representation resampled on the worker pool */
+struct UIImageJob {
+    /* Must be first, so the pool finds the job */
+    UIJob job;
+    UIImageJob *next;
+    UIImage *image;
+    UIImageSource *source;
+    int32_t width;
+    int32_t height;
+    double scale;
+    int32_t pixel_width;
+    int32_t pixel_height;
+    /* Resampled pixels, or NULL if out of memory */
+    uint8_t *pixels;
+    /* Set once the result is being delivered */
+    int done;
+    /* Callbacks waiting for the representation */
+    JanetArray *waiters;
+};
+
+#define UI_IMAGE_DEFAULT_CACHE_LIMIT (16 * 1024 * 1024)
+
+static void image_source_release(UIImageSource *src) {
+    if (NULL == src || --src->refcount > 0) return;
+    ui_mem.image_source_bytes -= (int64_t) src->width * src->height * 4;
+    free(src);
+}
+
+static void image_rep_unlink(UIImage *img, UIImageRep *rep) {
+    if (rep->prev) rep->prev->next = rep->next;
+    else img->head = rep->next;
+    if (rep->next) rep->next->prev = rep->prev;
+    else img->tail = rep->prev;
+    rep->prev = rep->next = NULL;
+}
+
+static void image_rep_push_front(UIImage *img, UIImageRep *rep) {
+    rep->prev = NULL;
+    rep->next = img->head;
+    if (img->head) img->head->prev = rep;
+    img->head = rep;
+    if (NULL == img->tail) img->tail = rep;
+}
+
+static void image_rep_free(UIImage *img, UIImageRep *rep) {
+    image_rep_unlink(img, rep);
+    img->cache_bytes -= (size_t) rep->pixel_width * rep->pixel_height * 4;
+    ui_mem.image_cache_bytes -= (int64_t) rep->pixel_width * rep->pixel_height * 4;
+    img->cache_count--;
+    free(rep);
+}
+
+/* Evict least recently used representations until the cache fits
+ * in its byte limit, keeping at least `keep` entries. */
+static void image_cache_trim(UIImage *img, int32_t keep) {
+    while (img->cache_bytes > img->cache_limit && img->cache_count > keep) {
+        image_rep_free(img, img->tail);
+        img->evictions++;
+    }
+}
+
+static void image_cache_clear(UIImage *img) {
+    while (img->head) image_rep_free(img, img->head);
+}
+
+static int image_gc(void *p, size_t len) {
+    (void) len;
+    UIImage *img = (UIImage *)p;
+    image_cache_clear(img);
+    image_source_release(img->source);
+    return 0;
+}
+
+static int image_gcmark(void *p, size_t len) {
+    (void) len;
+    UIImage *img = (UIImage *)p;
+    for (UIImageRep *rep = img->head; rep; rep = rep->next) {
+        janet_mark(janet_wrap_string(rep->pixels));
+    }
+    for (UIImageJob *j = img->jobs; j; j = j->next) {
+        janet_mark(janet_wrap_array(j->waiters));
+    }
+    return 0;
+}
+
+static const JanetAbstractType image_td = {"ui/image", image_gc, image_gcmark, NULL, NULL, NULL, NULL, NULL};
+
+/* Catmull-Rom cubic, used for both up and down sampling. When
+ * downsampling the kernel is stretched so every source pixel
+ * contributes. */
+static float resample_kernel(float x) {
+    if (x < 0) x = -x;
+    if (x < 1.0f) return 1.5f * x * x * x - 2.5f * x * x + 1.0f;
+    if (x < 2.0f) return -0.5f * x * x * x + 2.5f * x * x - 4.0f * x + 2.0f;
+    return 0.0f;
+}
+
+typedef struct {
+    int32_t taps;
+    int32_t *start;
+    float *weights;
+} ResampleAxis;
+
+static int resample_axis_init(ResampleAxis *axis, int32_t src, int32_t dst) {
+    float ratio = (float) src / (float) dst;
+    float fscale = ratio > 1.0f ? ratio : 1.0f;
+    float support = 2.0f * fscale;
+    axis->taps = (int32_t)(2.0f * support) + 2;
+    axis->start = malloc(sizeof(int32_t) * dst);
+    axis->weights = malloc(sizeof(float) * dst * axis->taps);
+    if (NULL == axis->start || NULL == axis->weights) {
+        free(axis->start);
+        free(axis->weights);
+        return 0;
+    }
+    for (int32_t i = 0; i < dst; i++) {
+        float center = (i + 0.5f) * ratio - 0.5f;
+        float first = center - support;
+        int32_t left = (int32_t) first;
+        if ((float) left > first) left--;
+        left++;
+        float *w = axis->weights + (size_t) i * axis->taps;
+        float total = 0.0f;
+        for (int32_t t = 0; t < axis->taps; t++) {
+            w[t] = resample_kernel((left + t - center) / fscale);
+            total += w[t];
+        }
+        if (total != 0.0f) {
+            for (int32_t t = 0; t < axis->taps; t++) w[t] /= total;
+        }
+        axis->start[i] = left;
+    }
+    return 1;
+}
+
+static void resample_axis_deinit(ResampleAxis *axis) {
+    free(axis->start);
+    free(axis->weights);
+}
+
+static int32_t clamp_index(int32_t i, int32_t n) {
+    return i < 0 ? 0 : (i >= n ? n - 1 : i);
+}
+
+/* Resample a tightly packed RGBA image with a separable filter in
+ * premultiplied alpha. Returns 0 if out of memory. */
+static int resample_rgba(const uint8_t *src, int32_t sw, int32_t sh,
+                         uint8_t *dst, int32_t dw, int32_t dh) {
+    ResampleAxis ax, ay;
+    if (!resample_axis_init(&ax, sw, dw)) return 0;
+    if (!resample_axis_init(&ay, sh, dh)) {
+        resample_axis_deinit(&ax);
+        return 0;
+    }
+    float *tmp = malloc(sizeof(float) * 4 * (size_t) dw * sh);
+    if (NULL == tmp) {
+        resample_axis_deinit(&ax);
+        resample_axis_deinit(&ay);
+        return 0;
+    }
+
+    /* Horizontal pass into premultiplied floats */
+    for (int32_t y = 0; y < sh; y++) {
+        const uint8_t *row = src + (size_t) y * sw * 4;
+        float *out = tmp + (size_t) y * dw * 4;
+        for (int32_t x = 0; x < dw; x++) {
+            const float *w = ax.weights + (size_t) x * ax.taps;
+            float r = 0, g = 0, b = 0, a = 0;
+            for (int32_t t = 0; t < ax.taps; t++) {
+                if (w[t] == 0.0f) continue;
+                const uint8_t *px = row + clamp_index(ax.start[x] + t, sw) * 4;
+                float pa = px[3] * (1.0f / 255.0f);
+                r += w[t] * px[0] * pa;
+                g += w[t] * px[1] * pa;
+                b += w[t] * px[2] * pa;
+                a += w[t] * px[3];
+            }
+            out[x * 4 + 0] = r;
+            out[x * 4 + 1] = g;
+            out[x * 4 + 2] = b;
+            out[x * 4 + 3] = a;
+        }
+    }
+
+    /* Vertical pass, unpremultiply and pack */
+    for (int32_t y = 0; y < dh; y++) {
+        const float *w = ay.weights + (size_t) y * ay.taps;
+        uint8_t *out = dst + (size_t) y * dw * 4;
+        for (int32_t x = 0; x < dw; x++) {
+            float c[4] = {0, 0, 0, 0};
+            for (int32_t t = 0; t < ay.taps; t++) {
+                if (w[t] == 0.0f) continue;
+                const float *px = tmp + ((size_t) clamp_index(ay.start[y] + t, sh) * dw + x) * 4;
+                c[0] += w[t] * px[0];
+                c[1] += w[t] * px[1];
+                c[2] += w[t] * px[2];
+                c[3] += w[t] * px[3];
+            }
+            float a = c[3] < 0 ? 0 : (c[3] > 255.0f ? 255.0f : c[3]);
+            float inv = a > 0 ? 255.0f / a : 0;
+            for (int k = 0; k < 3; k++) {
+                float v = c[k] * inv;
+                out[x * 4 + k] = (uint8_t)(v < 0 ? 0 : (v > 255.0f ? 255 : v + 0.5f));
+            }
+            out[x * 4 + 3] = (uint8_t)(a + 0.5f);
+        }
+    }
+
+    free(tmp);
+    resample_axis_deinit(&ax);
+    resample_axis_deinit(&ay);
+    return 1;
+}
+
+/* Find a cached representation and move it to the front of the LRU
+ * list, or return NULL */
+static UIImageRep *image_cache_find(UIImage *img, int32_t width, int32_t height, double scale) {
+    for (UIImageRep *rep = img->head; rep; rep = rep->next) {
+        if (rep->width == width && rep->height == height && rep->scale == scale) {
+            img->hits++;
+            if (rep != img->head) {
+                image_rep_unlink(img, rep);
+                image_rep_push_front(img, rep);
+            }
+            return rep;
+        }
+    }
+    return NULL;
+}
+
+/* Cache pixels at the front of the LRU list. Returns NULL if out of
+ * memory. */
+static UIImageRep *image_cache_put(UIImage *img, int32_t width, int32_t height, double scale,
+                                   const uint8_t *pixels, int32_t pw, int32_t ph) {
+    UIImageRep *rep = malloc(sizeof(UIImageRep));
+    if (NULL == rep) return NULL;
+    uint8_t *copy = janet_string_begin(pw * ph * 4);
+    memcpy(copy, pixels, (size_t) pw * ph * 4);
+    rep->pixels = janet_string_end(copy);
+    rep->width = width;
+    rep->height = height;
+    rep->scale = scale;
+    rep->pixel_width = pw;
+    rep->pixel_height = ph;
+    image_rep_push_front(img, rep);
+    img->cache_count++;
+    img->cache_bytes += (size_t) pw * ph * 4;
+    ui_mem.image_cache_bytes += (int64_t) pw * ph * 4;
+    image_cache_trim(img, 1);
+    return rep;
+}
+
+static Janet image_rep_value(const UIImageRep *rep) {
+    Janet *tup = janet_tuple_begin(3);
+    tup[0] = janet_wrap_string(rep->pixels);
+    tup[1] = janet_wrap_integer(rep->pixel_width);
+    tup[2] = janet_wrap_integer(rep->pixel_height);
+    return janet_wrap_tuple(janet_tuple_end(tup));
+}
+
+/* Resample a source to pw by ph pixels. Returns NULL if out of
+ * memory. */
+static uint8_t *image_resample(const UIImageSource *src, int32_t pw, int32_t ph) {
+    uint8_t *pixels = malloc((size_t) pw * ph * 4);
+    if (NULL == pixels) return NULL;
+    if (pw == src->width && ph == src->height) {
+        memcpy(pixels, src->pixels, (size_t) pw * ph * 4);
+    } else if (!resample_rgba(src->pixels, src->width, src->height, pixels, pw, ph)) {
+        free(pixels);
+        return NULL;
+    }
+    return pixels;
+}
+
+static void image_job_done(void *data);
+
+static void image_job_run(UIJob *job) {
+    UIImageJob *j = (UIImageJob *) job;
+    j->pixels = image_resample(j->source, j->pixel_width, j->pixel_height);
+    uiQueueMain(image_job_done, j);
+}
+
+/* Deliver a resampled representation on the UI thread. It is cached
+ * unless more pixels were appended meanwhile; waiters get it anyway. */
+static void image_job_done(void *data) {
+    UIImageJob *j = (UIImageJob *)data;
+    UIImage *img = j->image;
+    j->done = 1;
+    Janet value = janet_wrap_nil();
+    if (NULL == j->pixels) {
+        ui_report_error(NULL, janet_wrap_string(janet_formatc("cannot scale image to %dx%d", j->width, j->height)));
+    } else if (j->source == img->source) {
+        UIImageRep *rep = image_cache_put(img, j->width, j->height, j->scale, j->pixels, j->pixel_width, j->pixel_height);
+        if (NULL != rep) value = image_rep_value(rep);
+    } else {
+        Janet *tup = janet_tuple_begin(3);
+        uint8_t *copy = janet_string_begin(j->pixel_width * j->pixel_height * 4);
+        memcpy(copy, j->pixels, (size_t) j->pixel_width * j->pixel_height * 4);
+        tup[0] = janet_wrap_string(janet_string_end(copy));
+        tup[1] = janet_wrap_integer(j->pixel_width);
+        tup[2] = janet_wrap_integer(j->pixel_height);
+        value = janet_wrap_tuple(janet_tuple_end(tup));
+    }
+    free(j->pixels);
+    j->pixels = NULL;
+    /* The job stays listed, so its waiters stay marked, until they
+     * have all been called */
+    for (int32_t i = 0; i < j->waiters->count; i++) janet_ui_call(j->waiters->data[i], 1, &value, NULL);
+    for (UIImageJob **p = &img->jobs; NULL != *p; p = &(*p)->next) {
+        if (*p != j) continue;
+        *p = j->next;
+        break;
+    }
+    image_source_release(j->source);
+    free(j);
+    if (NULL == img->jobs) janet_gcunroot(janet_wrap_abstract(img));
+}
+
+static Janet janet_ui_image(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    double width = janet_getnumber(argv, 0);
+    double height = janet_getnumber(argv, 1);
+    if (!(width > 0 && width <= INT32_MAX && height > 0 && height <= INT32_MAX)) {
+        janet_panicf("expected finite positive size, got %v by %v", argv[0], argv[1]);
+    }
+    UIImage *img = janet_abstract(&image_td, sizeof(UIImage));
+    memset(img, 0, sizeof(UIImage));
+    img->width = width;
+    img->height = height;
+    img->cache_limit = UI_IMAGE_DEFAULT_CACHE_LIMIT;
+    return janet_wrap_abstract(img);
+}
+
+static Janet janet_ui_image_append(int32_t argc, Janet *argv) {
+    janet_arity(argc, 4, 5);
+    UIImage *img = janet_getabstract(argv, 0, &image_td);
+    JanetByteView pixels = janet_getbytes(argv, 1);
+    int32_t pw = janet_getinteger(argv, 2);
+    int32_t ph = janet_getinteger(argv, 3);
+    if (pw <= 0 || ph <= 0) janet_panic("expected positive pixel dimensions");
+    if ((int64_t) pw * 4 > INT32_MAX) janet_panicf("width %d too large", pw);
+    int32_t stride = argc == 5 ? janet_getinteger(argv, 4) : pw * 4;
+    if (stride < pw * 4) janet_panicf("stride %d too small for width %d", stride, pw);
+    if ((int64_t) stride * (ph - 1) + (int64_t) pw * 4 > pixels.len) {
+        janet_panic("not enough pixel data");
+    }
+    /* Keep the largest representation as the resampling source. Jobs
+     * still reading the old one keep it until they finish. */
+    int64_t old = NULL == img->source ? 0 : (int64_t) img->source->width * img->source->height;
+    if ((int64_t) pw * ph > old) {
+        UIImageSource *src = malloc(sizeof(UIImageSource) + (size_t) pw * ph * 4);
+        if (NULL == src) janet_panic("out of memory");
+        src->refcount = 1;
+        src->width = pw;
+        src->height = ph;
+        for (int32_t y = 0; y < ph; y++) {
+            memcpy(src->pixels + (size_t) y * pw * 4, pixels.bytes + (size_t) y * stride, (size_t) pw * 4);
+        }
+        ui_mem.image_source_bytes += (int64_t) pw * ph * 4;
+        image_source_release(img->source);
+        img->source = src;
+        image_cache_clear(img);
+    }
+    return argv[0];
+}
+
+/* Pixels of the image at a size in points and a scale, as
+ * [pixels pixel-width pixel-height]. The size defaults to the size of
+ * the image. A representation that is not cached is resampled on the
+ * worker pool: this returns nil and calls on-ready with the tuple, or
+ * with nil if scaling failed, once it is done. Without workers it is
+ * resampled here and returned. */
+static Janet janet_ui_image_scaled(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 5);
+    UIImage *img = janet_getabstract(argv, 0, &image_td);
+    int32_t width = janet_optinteger(argv, argc, 1, (int32_t)(img->width + 0.5));
+    int32_t height = janet_optinteger(argv, argc, 2, (int32_t)(img->height + 0.5));
+    double scale = janet_optnumber(argv, argc, 3, 1.0);
+    Janet on_ready = argc == 5 ? argv[4] : janet_wrap_nil();
+    if (width <= 0 || height <= 0 || !(scale > 0) || isinf(scale)) janet_panic("expected positive size and scale");
+    if (NULL == img->source) janet_panic("image has no pixel data");
+    UIImageRep *rep = image_cache_find(img, width, height, scale);
+    if (NULL != rep) return image_rep_value(rep);
+    double dw = width * scale + 0.5;
+    double dh = height * scale + 0.5;
+    if (dw * dh * 4 > INT32_MAX) janet_panicf("cannot scale image to %dx%d", width, height);
+    int32_t pw = dw < 1 ? 1 : (int32_t) dw;
+    int32_t ph = dh < 1 ? 1 : (int32_t) dh;
+    /* Join a job already resampling this representation */
+    for (UIImageJob *j = img->jobs; j; j = j->next) {
+        if (j->done || j->width != width || j->height != height || j->scale != scale) continue;
+        if (!janet_checktype(on_ready, JANET_NIL)) janet_array_push(j->waiters, on_ready);
+        return janet_wrap_nil();
+    }
+    img->misses++;
+    UIImageJob *j = calloc(1, sizeof(UIImageJob));
+    if (NULL == j) janet_panic("out of memory");
+    j->job.run = image_job_run;
+    j->image = img;
+    j->source = img->source;
+    j->width = width;
+    j->height = height;
+    j->scale = scale;
+    j->pixel_width = pw;
+    j->pixel_height = ph;
+    j->waiters = janet_array(1);
+    if (!janet_checktype(on_ready, JANET_NIL)) janet_array_push(j->waiters, on_ready);
+    img->source->refcount++;
+    if (NULL == img->jobs) janet_gcroot(janet_wrap_abstract(img));
+    j->next = img->jobs;
+    img->jobs = j;
+    if (ui_pool_submit(&j->job)) return janet_wrap_nil();
+    /* Without workers, resample here and deliver right away */
+    img->jobs = j->next;
+    if (NULL == img->jobs) janet_gcunroot(janet_wrap_abstract(img));
+    img->source->refcount--;
+    free(j);
+    uint8_t *pixels = image_resample(img->source, pw, ph);
+    rep = NULL == pixels ? NULL : image_cache_put(img, width, height, scale, pixels, pw, ph);
+    free(pixels);
+    if (NULL == rep) janet_panicf("cannot scale image to %dx%d", width, height);
+    return image_rep_value(rep);
+}
+
+static Janet janet_ui_image_cache_limit(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    UIImage *img = janet_getabstract(argv, 0, &image_td);
+    if (argc == 2) {
+        img->cache_limit = janet_getsize(argv, 1);
+        image_cache_trim(img, 0);
+        return argv[0];
+    }
+    return janet_wrap_number((double) img->cache_limit);
+}
+
+static Janet janet_ui_image_cache_clear(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UIImage *img = janet_getabstract(argv, 0, &image_td);
+    image_cache_clear(img);
+    return argv[0];
+}
+
+static Janet janet_ui_image_cache_stats(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UIImage *img = janet_getabstract(argv, 0, &image_td);
+    JanetKV *st = janet_struct_begin(7);
+    janet_struct_put(st, janet_ckeywordv("entries"), janet_wrap_integer(img->cache_count));
+    janet_struct_put(st, janet_ckeywordv("bytes"), janet_wrap_number((double) img->cache_bytes));
+    janet_struct_put(st, janet_ckeywordv("limit"), janet_wrap_number((double) img->cache_limit));
+    janet_struct_put(st, janet_ckeywordv("source-bytes"),
+            janet_wrap_number(NULL == img->source ? 0 : (double) img->source->width * img->source->height * 4));
+    janet_struct_put(st, janet_ckeywordv("hits"), janet_wrap_number((double) img->hits));
+    janet_struct_put(st, janet_ckeywordv("misses"), janet_wrap_number((double) img->misses));
+    janet_struct_put(st, janet_ckeywordv("evictions"), janet_wrap_number((double) img->evictions));
+    return janet_wrap_struct(janet_struct_end(st));
+}
+
+/* Filter Index */
+
+#define UI_FILTER_FUZZY 0
+#define UI_FILTER_SUBSTRING 1
+
+typedef struct {
+    int32_t mode;
+    int32_t count;
+    /* Lower cased items, each NUL terminated */
+    uint8_t *text;
+    size_t *offsets;
+    /* Per item bitmask of the characters it contains */
+    uint64_t *masks;
+    /* Trigram index. Keys are sorted, and the postings for keys[i]
+     * are postings[starts[i]] up to postings[starts[i + 1]]. */
+    int32_t num_keys;
+    uint32_t *keys;
+    size_t *starts;
+    uint32_t *postings;
+    /* Result of the last query, sorted by descending score */
+    uint8_t *query;
+    int32_t query_len;
+    int32_t result_count;
+    int32_t *results;
+    int32_t *scores;
+    /* Bytes of native memory held, for ui/memory-report */
+    size_t bytes;
+} UIFilterIndex;
+
+static void filter_index_account(UIFilterIndex *fi) {
+    size_t bytes = 0;
+    if (fi->offsets) {
+        bytes += fi->offsets[fi->count];
+        bytes += sizeof(size_t) * ((size_t) fi->count + 1);
+        bytes += sizeof(uint64_t) * (size_t) fi->count;
+    }
+    if (fi->starts) {
+        bytes += sizeof(uint32_t) * (size_t) fi->num_keys;
+        bytes += sizeof(size_t) * ((size_t) fi->num_keys + 1);
+        bytes += sizeof(uint32_t) * fi->starts[fi->num_keys];
+    }
+    if (fi->scores) bytes += sizeof(int32_t) * (size_t) fi->count;
+    if (fi->results) bytes += sizeof(int32_t) * (size_t) fi->result_count;
+    if (fi->query) bytes += (size_t) fi->query_len + 1;
+    ui_mem.filter_index_bytes += (int64_t) bytes - (int64_t) fi->bytes;
+    fi->bytes = bytes;
+}
+
+static void filter_index_free_results(UIFilterIndex *fi) {
+    free(fi->query);
+    free(fi->results);
+    free(fi->scores);
+    fi->query = NULL;
+    fi->results = NULL;
+    fi->scores = NULL;
+    fi->query_len = -1;
+    fi->result_count = 0;
+}
+
+static int filter_index_gc(void *p, size_t len) {
+    (void) len;
+    UIFilterIndex *fi = (UIFilterIndex *)p;
+    filter_index_free_results(fi);
+    free(fi->text);
+    free(fi->offsets);
+    free(fi->masks);
+    free(fi->keys);
+    free(fi->starts);
+    free(fi->postings);
+    ui_mem.filter_index_bytes -= (int64_t) fi->bytes;
+    return 0;
+}
+
+static const JanetAbstractType filter_index_td = {"ui/filter-index", filter_index_gc, NULL, NULL, NULL, NULL, NULL, NULL};
+
+static uint8_t filter_lower(uint8_t c) {
+    return (c >= 'A' && c <= 'Z') ? (uint8_t)(c + 32) : c;
+}
+
+static int filter_is_word(uint8_t c) {
+    return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+static uint64_t filter_char_bit(uint8_t c) {
+    if (c >= 'a' && c <= 'z') return (uint64_t) 1 << (c - 'a');
+    if (c >= '0' && c <= '9') return (uint64_t) 1 << (26 + c - '0');
+    return (uint64_t) 1 << (36 + c % 28);
+}
+
+static uint64_t filter_mask(const uint8_t *s, int32_t len) {
+    uint64_t mask = 0;
+    for (int32_t i = 0; i < len; i++) mask |= filter_char_bit(s[i]);
+    return mask;
+}
+
+static uint32_t filter_trigram(const uint8_t *s) {
+    return ((uint32_t) s[0] << 16) | ((uint32_t) s[1] << 8) | s[2];
+}
+
+/* Stable LSD radix sort of (trigram << 32 | item) pairs on the 24 bit
+ * trigram. Items are generated in increasing order, so each posting
+ * list comes out sorted. */
+static void filter_sort_pairs(uint64_t *pairs, uint64_t *scratch, size_t n) {
+    for (int shift = 32; shift < 56; shift += 8) {
+        size_t counts[257] = {0};
+        for (size_t i = 0; i < n; i++) counts[((pairs[i] >> shift) & 0xFF) + 1]++;
+        for (int b = 0; b < 256; b++) counts[b + 1] += counts[b];
+        for (size_t i = 0; i < n; i++) scratch[counts[(pairs[i] >> shift) & 0xFF]++] = pairs[i];
+        memcpy(pairs, scratch, n * sizeof(uint64_t));
+    }
+}
+
+static int filter_cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int filter_index_build_trigrams(UIFilterIndex *fi) {
+    size_t npairs = 0, cap = 0;
+    uint64_t *pairs = NULL;
+    uint32_t *grams = NULL;
+    int32_t gram_cap = 0;
+    for (int32_t item = 0; item < fi->count; item++) {
+        const uint8_t *s = fi->text + fi->offsets[item];
+        int32_t len = (int32_t)(fi->offsets[item + 1] - fi->offsets[item] - 1);
+        if (len < 3) continue;
+        if (len - 2 > gram_cap) {
+            gram_cap = len - 2;
+            uint32_t *g = realloc(grams, sizeof(uint32_t) * gram_cap);
+            if (NULL == g) goto oom;
+            grams = g;
+        }
+        int32_t ngrams = 0;
+        for (int32_t i = 0; i + 2 < len; i++) grams[ngrams++] = filter_trigram(s + i);
+        qsort(grams, ngrams, sizeof(uint32_t), filter_cmp_u32);
+        for (int32_t i = 0; i < ngrams; i++) {
+            if (i > 0 && grams[i] == grams[i - 1]) continue;
+            if (npairs == cap) {
+                cap = cap ? cap * 2 : 1024;
+                uint64_t *np = realloc(pairs, sizeof(uint64_t) * cap);
+                if (NULL == np) goto oom;
+                pairs = np;
+            }
+            pairs[npairs++] = ((uint64_t) grams[i] << 32) | (uint32_t) item;
+        }
+    }
+    free(grams);
+    grams = NULL;
+
+    if (npairs) {
+        uint64_t *scratch = malloc(sizeof(uint64_t) * npairs);
+        if (NULL == scratch) goto oom;
+        filter_sort_pairs(pairs, scratch, npairs);
+        free(scratch);
+    }
+
+    int32_t nkeys = 0;
+    for (size_t i = 0; i < npairs; i++) {
+        if (i == 0 || (pairs[i] >> 32) != (pairs[i - 1] >> 32)) nkeys++;
+    }
+    fi->keys = malloc(sizeof(uint32_t) * (nkeys ? nkeys : 1));
+    fi->starts = malloc(sizeof(size_t) * ((size_t) nkeys + 1));
+    fi->postings = malloc(sizeof(uint32_t) * (npairs ? npairs : 1));
+    if (NULL == fi->keys || NULL == fi->starts || NULL == fi->postings) goto oom;
+    nkeys = 0;
+    for (size_t i = 0; i < npairs; i++) {
+        uint32_t key = (uint32_t)(pairs[i] >> 32);
+        if (i == 0 || key != fi->keys[nkeys - 1]) {
+            fi->keys[nkeys] = key;
+            fi->starts[nkeys] = i;
+            nkeys++;
+        }
+        fi->postings[i] = (uint32_t) pairs[i];
+    }
+    fi->starts[nkeys] = npairs;
+    fi->num_keys = nkeys;
+    free(pairs);
+    return 1;
+
+oom:
+    free(grams);
+    free(pairs);
+    return 0;
+}
+
+/* Look up the posting list of a trigram. Returns its length. */
+static int32_t filter_postings(UIFilterIndex *fi, uint32_t key, const uint32_t **out) {
+    int32_t lo = 0, hi = fi->num_keys;
+    while (lo < hi) {
+        int32_t mid = lo + (hi - lo) / 2;
+        if (fi->keys[mid] < key) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == fi->num_keys || fi->keys[lo] != key) return 0;
+    *out = fi->postings + fi->starts[lo];
+    return (int32_t)(fi->starts[lo + 1] - fi->starts[lo]);
+}
+
+/* Score a fuzzy match of q as a subsequence of s, or -1 if q is not
+ * a subsequence. Matches at word starts and runs of consecutive
+ * characters score higher; gaps and late first matches cost. */
+static int32_t filter_fuzzy_score(const uint8_t *s, int32_t slen, const uint8_t *q, int32_t qlen) {
+    int32_t score = 0, qi = 0, first = -1, last = -2;
+    for (int32_t i = 0; i < slen && qi < qlen; i++) {
+        if (s[i] != q[qi]) continue;
+        score += 16;
+        if (i == 0 || !filter_is_word(s[i - 1])) score += 24;
+        if (last == i - 1) score += 16;
+        if (first < 0) first = i;
+        last = i;
+        qi++;
+    }
+    if (qi < qlen) return -1;
+    if (qlen == 0) return 0;
+    score -= (last - first + 1 - qlen);
+    score -= first < 32 ? first : 32;
+    score -= slen / 16;
+    return score > 0 ? score : 1;
+}
+
+static int32_t filter_substring_score(const uint8_t *s, int32_t slen, const uint8_t *q, int32_t qlen) {
+    if (qlen == 0) return 0;
+    const uint8_t *hit = (const uint8_t *) strstr((const char *) s, (const char *) q);
+    if (NULL == hit) return -1;
+    int32_t pos = (int32_t)(hit - s);
+    int32_t score = 1024;
+    if (pos == 0) score += 512;
+    else if (!filter_is_word(s[pos - 1])) score += 256;
+    score -= pos < 256 ? pos : 256;
+    score -= (slen - qlen) < 256 ? (slen - qlen) : 256;
+    return score;
+}
+
+static int filter_cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Sort results by descending score, then by item. Each result is
+ * packed with its inverted score into one key, so the comparison
+ * needs no context. Returns 0 if out of memory. */
+static int filter_sort_results(const UIFilterIndex *fi, int32_t *results, int32_t n) {
+    uint64_t *keys = malloc(sizeof(uint64_t) * (n ? n : 1));
+    if (NULL == keys) return 0;
+    for (int32_t i = 0; i < n; i++) {
+        uint32_t rank = (uint32_t) INT32_MAX - (uint32_t) fi->scores[results[i]];
+        keys[i] = ((uint64_t) rank << 32) | (uint32_t) results[i];
+    }
+    qsort(keys, n, sizeof(uint64_t), filter_cmp_u64);
+    for (int32_t i = 0; i < n; i++) results[i] = (int32_t)(uint32_t) keys[i];
+    free(keys);
+    return 1;
+}
+
+/* Run a query, refining the previous result set when the new query
+ * extends the previous one. */
+static int filter_index_query(UIFilterIndex *fi, const uint8_t *raw, int32_t rawlen) {
+    uint8_t *q = malloc(rawlen + 1);
+    int32_t *cand = NULL;
+    int32_t ncand = 0;
+    int owned = 0;
+    if (NULL == q) return 0;
+    for (int32_t i = 0; i < rawlen; i++) q[i] = raw[i] ? filter_lower(raw[i]) : ' ';
+    q[rawlen] = 0;
+
+    if (fi->query_len == rawlen && 0 == memcmp(fi->query, q, rawlen)) {
+        free(q);
+        return 1;
+    }
+
+    if (fi->query_len >= 0 && fi->query_len <= rawlen && 0 == memcmp(fi->query, q, fi->query_len)) {
+        /* Every match of the new query also matched the old one */
+        cand = fi->results;
+        ncand = fi->result_count;
+    } else if (fi->mode == UI_FILTER_SUBSTRING && rawlen >= 3) {
+        /* Intersect the posting lists of every trigram in the query,
+         * starting from the rarest */
+        const uint32_t *best = NULL;
+        int32_t bestlen = INT32_MAX;
+        for (int32_t i = 0; i + 2 < rawlen; i++) {
+            const uint32_t *p = NULL;
+            int32_t n = filter_postings(fi, filter_trigram(q + i), &p);
+            if (n < bestlen) {
+                bestlen = n;
+                best = p;
+            }
+        }
+        cand = malloc(sizeof(int32_t) * (bestlen ? bestlen : 1));
+        if (NULL == cand) {
+            free(q);
+            return 0;
+        }
+        owned = 1;
+        for (int32_t i = 0; i < bestlen; i++) cand[i] = (int32_t) best[i];
+        ncand = bestlen;
+        for (int32_t i = 0; i + 2 < rawlen && ncand; i++) {
+            const uint32_t *p = NULL;
+            int32_t n = filter_postings(fi, filter_trigram(q + i), &p);
+            if (p == best) continue;
+            int32_t j = 0, k = 0, out = 0;
+            while (j < ncand && k < n) {
+                if ((uint32_t) cand[j] < p[k]) j++;
+                else if ((uint32_t) cand[j] > p[k]) k++;
+                else {
+                    cand[out++] = cand[j];
+                    j++;
+                    k++;
+                }
+            }
+            ncand = out;
+        }
+    } else {
+        ncand = fi->count;
+    }
+
+    int32_t *results = malloc(sizeof(int32_t) * (ncand ? ncand : 1));
+    if (NULL == results) {
+        if (owned) free(cand);
+        free(q);
+        return 0;
+    }
+    if (NULL == fi->scores) {
+        fi->scores = malloc(sizeof(int32_t) * (fi->count ? fi->count : 1));
+        if (NULL == fi->scores) {
+            if (owned) free(cand);
+            free(results);
+            free(q);
+            return 0;
+        }
+    }
+    uint64_t qmask = filter_mask(q, rawlen);
+    int32_t nresults = 0;
+    for (int32_t i = 0; i < ncand; i++) {
+        int32_t item = cand ? cand[i] : i;
+        if ((fi->masks[item] & qmask) != qmask) continue;
+        const uint8_t *s = fi->text + fi->offsets[item];
+        int32_t slen = (int32_t)(fi->offsets[item + 1] - fi->offsets[item] - 1);
+        int32_t score = fi->mode == UI_FILTER_SUBSTRING
+                        ? filter_substring_score(s, slen, q, rawlen)
+                        : filter_fuzzy_score(s, slen, q, rawlen);
+        if (score < 0) continue;
+        fi->scores[item] = score;
+        results[nresults++] = item;
+    }
+    if (rawlen > 0 && !filter_sort_results(fi, results, nresults)) {
+        if (owned) free(cand);
+        free(results);
+        free(q);
+        return 0;
+    }
+
+    if (owned) free(cand);
+    free(fi->results);
+    free(fi->query);
+    fi->results = results;
+    fi->result_count = nresults;
+    fi->query = q;
+    fi->query_len = rawlen;
+    filter_index_account(fi);
+    return 1;
+}
+
+static Janet janet_ui_filter_index(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    JanetView items = janet_getindexed(argv, 0);
+    int32_t mode = UI_FILTER_FUZZY;
+    if (argc == 2) {
+        const uint8_t *kw = janet_getkeyword(argv, 1);
+        if (!janet_cstrcmp(kw, "substring")) {
+            mode = UI_FILTER_SUBSTRING;
+        } else if (janet_cstrcmp(kw, "fuzzy")) {
+            janet_panicf("expected :fuzzy or :substring, got %v", argv[1]);
+        }
+    }
+    size_t total = 0;
+    for (int32_t i = 0; i < items.len; i++) {
+        const uint8_t *bytes;
+        int32_t len;
+        if (!janet_bytes_view(items.items[i], &bytes, &len)) {
+            janet_panicf("expected string item, got %v", items.items[i]);
+        }
+        total += (size_t) len + 1;
+    }
+    UIFilterIndex *fi = janet_abstract(&filter_index_td, sizeof(UIFilterIndex));
+    memset(fi, 0, sizeof(UIFilterIndex));
+    fi->mode = mode;
+    fi->query_len = -1;
+    fi->text = malloc(total ? total : 1);
+    fi->offsets = malloc(sizeof(size_t) * ((size_t) items.len + 1));
+    fi->masks = malloc(sizeof(uint64_t) * (items.len ? items.len : 1));
+    if (NULL == fi->text || NULL == fi->offsets || NULL == fi->masks) {
+        janet_panic("out of memory");
+    }
+    size_t pos = 0;
+    for (int32_t i = 0; i < items.len; i++) {
+        const uint8_t *bytes;
+        int32_t len;
+        janet_bytes_view(items.items[i], &bytes, &len);
+        fi->offsets[i] = pos;
+        for (int32_t j = 0; j < len; j++) {
+            uint8_t c = filter_lower(bytes[j]);
+            /* NUL terminates items, so map embedded NULs to spaces */
+            fi->text[pos + j] = c ? c : ' ';
+        }
+        fi->text[pos + len] = 0;
+        fi->masks[i] = filter_mask(fi->text + pos, len);
+        pos += (size_t) len + 1;
+    }
+    fi->offsets[items.len] = pos;
+    fi->count = items.len;
+    if (mode == UI_FILTER_SUBSTRING && !filter_index_build_trigrams(fi)) {
+        janet_panic("out of memory");
+    }
+    filter_index_account(fi);
+    return janet_wrap_abstract(fi);
+}
+
+static Janet janet_ui_filter_index_query(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    UIFilterIndex *fi = janet_getabstract(argv, 0, &filter_index_td);
+    JanetByteView q = janet_getbytes(argv, 1);
+    if (!filter_index_query(fi, q.bytes, q.len)) janet_panic("out of memory");
+    return janet_wrap_integer(fi->result_count);
+}
+
+static Janet janet_ui_filter_index_count(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UIFilterIndex *fi = janet_getabstract(argv, 0, &filter_index_td);
+    return janet_wrap_integer(fi->query_len < 0 ? fi->count : fi->result_count);
+}
+
+/* Get the item index of the nth result. Before any query every item
+ * matches, in order. */
+static int32_t filter_index_result(UIFilterIndex *fi, int32_t n) {
+    return fi->query_len < 0 ? n : fi->results[n];
+}
+
+static Janet janet_ui_filter_index_results(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 3);
+    UIFilterIndex *fi = janet_getabstract(argv, 0, &filter_index_td);
+    int32_t total = fi->query_len < 0 ? fi->count : fi->result_count;
+    int32_t start = argc >= 2 ? janet_getnat(argv, 1) : 0;
+    int32_t n = argc >= 3 ? janet_getnat(argv, 2) : total;
+    if (start > total) start = total;
+    if (n > total - start) n = total - start;
+    JanetArray *out = janet_array(n);
+    for (int32_t i = 0; i < n; i++) {
+        out->data[i] = janet_wrap_integer(filter_index_result(fi, start + i));
+    }
+    out->count = n;
+    return janet_wrap_array(out);
+}
+
+/* Tasks */
+
+/* ui/spawn-task runs a Janet function on a fixed set of worker
+ * threads, each with its own Janet VM, so long computations do not
+ * block the main loop. The function and its arguments are marshalled
+ * with the core environment and the metric functions as the registry,
+ * so they may close over data, core functions and metrics but not over
+ * controls. Every worker has its own queue, new tasks go to the queues
+ * in turn, and a worker with an empty queue steals the newest task of
+ * another. The result is marshalled back and on-done is called on the
+ * UI thread with :ok and the result, or :error and the error message.
+ * Destroying the control a task is attached to cancels it. A task that
+ * is already running cannot be interrupted, but its result is dropped.
+ * ui/uninit stops the workers after the tasks they are running, and
+ * drops the queued ones. */
+
+#define UI_TASK_MAX_WORKERS 8
+
+enum {
+    UI_TASK_QUEUED,
+    UI_TASK_RUNNING,
+    UI_TASK_DONE,
+    UI_TASK_CANCELLED
+};
+
+typedef struct UITask UITask;
+struct UITask {
+    /* Links in a worker queue, protected by its lock */
+    UITask *prev;
+    UITask *next;
+    /* Only changed by compare and swap. A task cancelled while queued
+     * or running is freed by the worker holding it. */
+    int state;
+    uint8_t *payload;
+    int32_t payload_len;
+    /* The marshalled result, or the error message */
+    uint8_t *result;
+    int32_t result_len;
+    int failed;
+    /* Only used on the UI thread */
+    UITask *live_next;
+    double id;
+    Janet on_done;
+    Janet control;
+    int cancelled;
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    UITask *head;
+    UITask *tail;
+} UITaskQueue;
+
+static UITaskQueue task_queues[UI_TASK_MAX_WORKERS];
+static pthread_t task_handles[UI_TASK_MAX_WORKERS];
+static int task_workers = 0;
+static int task_stopping = 0;
+static uint32_t task_next_queue = 0;
+/* Tasks in the queues, protected by task_lock */
+static pthread_mutex_t task_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t task_cond = PTHREAD_COND_INITIALIZER;
+static int64_t task_pending = 0;
+
+/* Tasks started from this thread that have not been delivered */
+static JANET_THREAD_LOCAL UITask *tasks = NULL;
+static JANET_THREAD_LOCAL double task_last_id = 0;
+/* Registries for marshalling and the function that delivers results,
+ * made on first use */
+static JANET_THREAD_LOCAL JanetTable *task_encode = NULL;
+static JANET_THREAD_LOCAL JanetTable *task_decode = NULL;
+static JANET_THREAD_LOCAL Janet task_deliver;
+
+/* Workers call tasks through this, so failing to unmarshal a task or
+ * marshal its result is reported like an error in the task */
+static const char task_runner_source[] =
+    "(fn [payload decode encode]"
+    "  (def [f args] (unmarshal payload decode))"
+    "  (marshal (f ;args) encode))";
+
+static const char task_deliver_source[] =
+    "(fn [on-done ok result decode]"
+    "  (def value (if ok (unmarshal result decode) result))"
+    "  (cond on-done (on-done (if ok :ok :error) value)"
+    "        (not ok) (error value)))";
+
+/* Table from values to keys, to unmarshal what was marshalled with a
+ * registry from janet_env_lookup */
+static JanetTable *task_invert(JanetTable *t) {
+    JanetTable *inverted = janet_table(t->count);
+    for (int32_t i = 0; i < t->capacity; i++) {
+        if (!janet_checktype(t->data[i].key, JANET_NIL)) janet_table_put(inverted, t->data[i].value, t->data[i].key);
+    }
+    return inverted;
+}
+
+static void task_free(UITask *t) {
+    free(t->payload);
+    free(t->result);
+    free(t);
+}
+
+static void task_queue_push(UITaskQueue *q, UITask *t) {
+    pthread_mutex_lock(&q->lock);
+    t->next = NULL;
+    t->prev = q->tail;
+    if (NULL != q->tail) q->tail->next = t;
+    else q->head = t;
+    q->tail = t;
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Take the oldest task of a queue, or the newest when stealing */
+static UITask *task_queue_pop(UITaskQueue *q, int steal) {
+    pthread_mutex_lock(&q->lock);
+    UITask *t = steal ? q->tail : q->head;
+    if (NULL != t) {
+        if (NULL != t->prev) t->prev->next = t->next;
+        else q->head = t->next;
+        if (NULL != t->next) t->next->prev = t->prev;
+        else q->tail = t->prev;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return t;
+}
+
+/* Wait for a task from a worker's own queue or stolen from another.
+ * Returns NULL once the workers are stopping. */
+static UITask *task_take(int index) {
+    for (;;) {
+        if (__atomic_load_n(&task_stopping, __ATOMIC_ACQUIRE)) return NULL;
+        int workers = __atomic_load_n(&task_workers, __ATOMIC_ACQUIRE);
+        UITask *t = task_queue_pop(task_queues + index, 0);
+        for (int i = 1; NULL == t && i < workers; i++) {
+            t = task_queue_pop(task_queues + (index + i) % workers, 1);
+        }
+        pthread_mutex_lock(&task_lock);
+        if (NULL != t) {
+            task_pending--;
+            pthread_mutex_unlock(&task_lock);
+            return t;
+        }
+        while (0 == task_pending && !task_stopping) pthread_cond_wait(&task_cond, &task_lock);
+        pthread_mutex_unlock(&task_lock);
+    }
+}
+
+static void task_complete(void *data);
+
+/* Run a task in the worker's VM and keep the result as bytes */
+static void task_run(UITask *t, Janet runner, Janet decode, Janet encode) {
+    Janet out;
+    JanetSignal sig = JANET_SIGNAL_ERROR;
+    if (janet_checktype(runner, JANET_FUNCTION)) {
+        Janet args[3] = {janet_wrap_string(janet_string(t->payload, t->payload_len)), decode, encode};
+        sig = janet_pcall(janet_unwrap_function(runner), 3, args, &out, NULL);
+    } else {
+        out = janet_cstringv("could not start a Janet VM for tasks");
+    }
+    t->failed = sig != JANET_SIGNAL_OK || !janet_checktypes(out, JANET_TFLAG_BYTES);
+    if (t->failed) out = janet_wrap_string(janet_to_string(out));
+    JanetByteView bytes;
+    janet_bytes_view(out, &bytes.bytes, &bytes.len);
+    t->result = malloc(bytes.len ? bytes.len : 1);
+    if (NULL == t->result) {
+        t->failed = 1;
+        t->result_len = 0;
+        return;
+    }
+    memcpy(t->result, bytes.bytes, bytes.len);
+    t->result_len = bytes.len;
+}
+
+static void *task_worker(void *arg) {
+    int index = (int)(intptr_t) arg;
+    Janet runner = janet_wrap_nil();
+    Janet encode = janet_wrap_nil();
+    Janet decode = janet_wrap_nil();
+    int inited = 0 == janet_init();
+    if (inited) {
+        JanetTable *env = janet_core_env(NULL);
+        janet_register_abstract_type(&metric_td);
+        janet_cfuns(env, "ui", metric_cfuns);
+        JanetTable *lookup = janet_env_lookup(env);
+        encode = janet_wrap_table(lookup);
+        decode = janet_wrap_table(task_invert(lookup));
+        janet_gcroot(encode);
+        janet_gcroot(decode);
+        if (janet_dostring(env, task_runner_source, "janetui", &runner)) runner = janet_wrap_nil();
+        janet_gcroot(runner);
+    }
+    for (;;) {
+        UITask *t = task_take(index);
+        if (NULL == t) break;
+        int expected = UI_TASK_QUEUED;
+        if (!__atomic_compare_exchange_n(&t->state, &expected, UI_TASK_RUNNING, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            task_free(t);
+            continue;
+        }
+        task_run(t, runner, decode, encode);
+        expected = UI_TASK_RUNNING;
+        if (!__atomic_compare_exchange_n(&t->state, &expected, UI_TASK_DONE, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            task_free(t);
+            continue;
+        }
+        uiQueueMain(task_complete, t);
+    }
+    if (inited) janet_deinit();
+    return NULL;
+}
+
+/* Start the workers, one per online processor. Must be called with
+ * task_lock held. */
+static void task_start_workers(void) {
+    if (task_stopping) return;
+    long n = ui_cpu_count();
+    if (n > UI_TASK_MAX_WORKERS) n = UI_TASK_MAX_WORKERS;
+    for (long i = 0; i < n; i++) pthread_mutex_init(&task_queues[i].lock, NULL);
+    for (long i = 0; i < n; i++) {
+        if (pthread_create(task_handles + i, NULL, task_worker, (void *)(intptr_t) i)) break;
+        __atomic_store_n(&task_workers, (int)(i + 1), __ATOMIC_RELEASE);
+    }
+}
+
+static void task_unlink(UITask *t) {
+    for (UITask **p = &tasks; NULL != *p; p = &(*p)->live_next) {
+        if (*p != t) continue;
+        *p = t->live_next;
+        ui_mem.tasks--;
+        if (!janet_checktype(t->on_done, JANET_NIL)) janet_gcunroot(t->on_done);
+        if (!janet_checktype(t->control, JANET_NIL)) janet_gcunroot(t->control);
+        break;
+    }
+}
+
+/* Deliver a result on the UI thread */
+static void task_complete(void *data) {
+    UITask *t = (UITask *)data;
+    if (!t->cancelled) {
+        Janet args[4] = {t->on_done, janet_wrap_boolean(!t->failed),
+                         janet_wrap_string(janet_string(t->result, t->result_len)),
+                         janet_wrap_table(task_decode)};
+        task_unlink(t);
+        janet_ui_call(task_deliver, 4, args, NULL);
+    }
+    task_free(t);
+}
+
+static void task_cancel(UITask *t) {
+    task_unlink(t);
+    int expected = UI_TASK_QUEUED;
+    if (__atomic_compare_exchange_n(&t->state, &expected, UI_TASK_CANCELLED, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return;
+    expected = UI_TASK_RUNNING;
+    if (__atomic_compare_exchange_n(&t->state, &expected, UI_TASK_CANCELLED, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return;
+    /* Done, with task_complete already queued */
+    t->cancelled = 1;
+}
+
+/* Cancel the tasks attached to a control that is being destroyed */
+static void task_cancel_control(uiControl *control) {
+    UITask *t = tasks;
+    while (NULL != t) {
+        UITask *next = t->live_next;
+        if (janet_checktype(t->control, JANET_ABSTRACT) &&
+                ((UIControlWrapper *) janet_unwrap_abstract(t->control))->control == control) {
+            task_cancel(t);
+        }
+        t = next;
+    }
+}
+
+/* Stop the workers once their running tasks end, join them and free
+ * the tasks still queued. Called on the UI thread. */
+static void task_pool_stop(void) {
+    pthread_mutex_lock(&task_lock);
+    __atomic_store_n(&task_stopping, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&task_cond);
+    int n = task_workers;
+    pthread_mutex_unlock(&task_lock);
+    for (int i = 0; i < n; i++) pthread_join(task_handles[i], NULL);
+    for (int i = 0; i < n; i++) {
+        UITask *t;
+        while (NULL != (t = task_queue_pop(task_queues + i, 0))) {
+            task_unlink(t);
+            task_free(t);
+        }
+    }
+    pthread_mutex_lock(&task_lock);
+    __atomic_store_n(&task_workers, 0, __ATOMIC_RELEASE);
+    task_pending = 0;
+    pthread_mutex_unlock(&task_lock);
+}
+
+/* Make the registries and the delivery function of this thread */
+static void task_setup(void) {
+    if (NULL != task_encode) return;
+    JanetTable *env = janet_core_env(NULL);
+    Janet deliver;
+    if (janet_dostring(env, task_deliver_source, "janetui", &deliver)) {
+        janet_panic("could not compile the task delivery function");
+    }
+    janet_cfuns(env, "ui", metric_cfuns);
+    task_encode = janet_env_lookup(env);
+    task_decode = task_invert(task_encode);
+    task_deliver = deliver;
+    janet_gcroot(janet_wrap_table(task_encode));
+    janet_gcroot(janet_wrap_table(task_decode));
+    janet_gcroot(task_deliver);
+}
+
+/* Run (f ;args) on a worker, and call on-done with the result on the
+ * UI thread. Returns an id for ui/cancel-task. */
+static Janet janet_ui_spawn_task(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 4);
+    janet_getfunction(argv, 0);
+    Janet args = janet_wrap_tuple(janet_tuple_n(NULL, 0));
+    if (argc > 1 && !janet_checktype(argv[1], JANET_NIL)) {
+        JanetView view = janet_getindexed(argv, 1);
+        args = janet_wrap_tuple(janet_tuple_n(view.items, view.len));
+    }
+    Janet on_done = janet_wrap_nil();
+    if (argc > 2 && !janet_checktype(argv[2], JANET_NIL)) {
+        assert_callable(argv, 2);
+        on_done = argv[2];
+    }
+    Janet control = janet_wrap_nil();
+    if (argc > 3 && !janet_checktype(argv[3], JANET_NIL)) {
+        janet_getcontrol(argv, 3);
+        control = argv[3];
+    }
+    task_setup();
+    Janet pair[2] = {argv[0], args};
+    JanetBuffer *payload = janet_buffer(64);
+    janet_marshal(payload, janet_wrap_tuple(janet_tuple_n(pair, 2)), task_encode, 0);
+    pthread_mutex_lock(&task_lock);
+    if (0 == task_workers) task_start_workers();
+    int workers = task_workers;
+    pthread_mutex_unlock(&task_lock);
+    if (0 == workers) janet_panic("could not start task workers");
+    UITask *t = calloc(1, sizeof(UITask));
+    uint8_t *bytes = malloc(payload->count);
+    if (NULL == t || NULL == bytes) {
+        free(t);
+        free(bytes);
+        janet_panic("out of memory");
+    }
+    memcpy(bytes, payload->data, payload->count);
+    t->payload = bytes;
+    t->payload_len = payload->count;
+    t->state = UI_TASK_QUEUED;
+    t->id = ++task_last_id;
+    t->on_done = on_done;
+    t->control = control;
+    if (!janet_checktype(on_done, JANET_NIL)) janet_gcroot(on_done);
+    if (!janet_checktype(control, JANET_NIL)) janet_gcroot(control);
+    t->live_next = tasks;
+    tasks = t;
+    ui_mem.tasks++;
+    /* Pushing under task_lock keeps a worker that takes the task from
+     * counting it off before it is counted */
+    pthread_mutex_lock(&task_lock);
+    task_queue_push(task_queues + __atomic_fetch_add(&task_next_queue, 1, __ATOMIC_RELAXED) % workers, t);
+    task_pending++;
+    pthread_cond_signal(&task_cond);
+    pthread_mutex_unlock(&task_lock);
+    return janet_wrap_number(t->id);
+}
+
+/* Cancel a task. Returns true if its result was still to come. */
+static Janet janet_ui_cancel_task(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    double id = janet_getnumber(argv, 0);
+    for (UITask *t = tasks; NULL != t; t = t->live_next) {
+        if (t->id != id) continue;
+        task_cancel(t);
+        return janet_wrap_true();
+    }
+    return janet_wrap_false();
+}
+
+/* Draw Lists */
+
+/* A draw command. Coordinates depend on the operation:
+ * rect is x, y, w, h; line is x1, y1, x2, y2; circle is cx, cy, r;
+ * text is x, y, size in points, with the top left corner of the text
+ * at x, y. */
+#define UI_DRAW_RECT 0
+#define UI_DRAW_LINE 1
+#define UI_DRAW_CIRCLE 2
+#define UI_DRAW_TEXT 3
+#define UI_PI 3.14159265358979323846
+
+typedef struct {
+    float r, g, b, a;
+} UIColor;
+
+typedef struct {
+    int32_t op;
+    /* Line width, or 0 to fill */
+    float stroke;
+    double x, y, w, h;
+    UIColor color;
+    /* Offset of the text in the string pool */
+    int32_t text;
+} UIDrawCmd;
+
+/* Draw commands recorded from Janet with the ui/draw functions, and
+ * replayed on the UI thread or rasterized by the tile workers. Texts
+ * are NUL terminated in a single string pool. */
+typedef struct {
+    UIDrawCmd *cmds;
+    int32_t count;
+    int32_t capacity;
+    char *text;
+    int32_t text_len;
+    int32_t text_capacity;
+} UIDrawList;
+
+/* The active draw context of an area. Params are only set while a
+ * draw handler runs. */
+typedef struct {
+    uiAreaDrawParams *params;
+} UIDrawContext;
+
+static int draw_list_gc(void *p, size_t len) {
+    (void) len;
+    UIDrawList *dl = (UIDrawList *)p;
+    free(dl->cmds);
+    free(dl->text);
+    return 0;
+}
+
+static const JanetAbstractType draw_list_td = {"ui/draw-list", draw_list_gc, NULL, NULL, NULL, NULL, NULL, NULL};
+static const JanetAbstractType draw_context_td = {"ui/draw-context", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+
+static void draw_list_push(UIDrawList *dl, const UIDrawCmd *cmd, const char *text) {
+    if (dl->count == dl->capacity) {
+        int32_t newcap = dl->capacity ? 2 * dl->capacity : 64;
+        UIDrawCmd *cmds = realloc(dl->cmds, sizeof(UIDrawCmd) * newcap);
+        if (NULL == cmds) janet_panic("out of memory");
+        dl->cmds = cmds;
+        dl->capacity = newcap;
+    }
+    UIDrawCmd *c = dl->cmds + dl->count;
+    *c = *cmd;
+    if (NULL != text) {
+        int32_t len = (int32_t) strlen(text) + 1;
+        if (dl->text_len + len > dl->text_capacity) {
+            int32_t newcap = dl->text_capacity ? dl->text_capacity : 256;
+            while (newcap < dl->text_len + len) newcap *= 2;
+            char *pool = realloc(dl->text, newcap);
+            if (NULL == pool) janet_panic("out of memory");
+            dl->text = pool;
+            dl->text_capacity = newcap;
+        }
+        memcpy(dl->text + dl->text_len, text, len);
+        c->text = dl->text_len;
+        dl->text_len += len;
+    }
+    dl->count++;
+}
+
+/* Parse a color, either a number 0xRRGGBB or [r g b &opt a] with
+ * components from 0 to 1 */
+static UIColor janet_getcolor(const Janet *argv, int32_t n) {
+    UIColor c;
+    if (janet_checktype(argv[n], JANET_NUMBER)) {
+        uint32_t rgb = (uint32_t) janet_unwrap_number(argv[n]);
+        c.r = ((rgb >> 16) & 0xFF) / 255.0f;
+        c.g = ((rgb >> 8) & 0xFF) / 255.0f;
+        c.b = (rgb & 0xFF) / 255.0f;
+        c.a = 1.0f;
+        return c;
+    }
+    JanetView v = janet_getindexed(argv, n);
+    if (v.len != 3 && v.len != 4) janet_panicf("expected color [r g b &opt a], got %v", argv[n]);
+    for (int32_t i = 0; i < v.len; i++) {
+        if (!janet_checktype(v.items[i], JANET_NUMBER)) janet_panicf("expected color [r g b &opt a], got %v", argv[n]);
+    }
+    c.r = (float) janet_unwrap_number(v.items[0]);
+    c.g = (float) janet_unwrap_number(v.items[1]);
+    c.b = (float) janet_unwrap_number(v.items[2]);
+    c.a = v.len == 4 ? (float) janet_unwrap_number(v.items[3]) : 1.0f;
+    return c;
+}
+
+/* Get the text of a text command in a string pool */
+static const char *draw_cmd_text(const UIDrawCmd *cmd, const char *pool) {
+    return cmd->op == UI_DRAW_TEXT ? pool + cmd->text : NULL;
+}
+
+/* Bounding box of a command, used to skip commands outside a tile.
+ * Text extents are not known without a font, so they are bounded by
+ * two ems per byte and two ems tall, which also covers the points to
+ * pixels scale of the font size. */
+static void draw_cmd_bounds(const UIDrawCmd *cmd, const char *text, double *x0, double *y0, double *x1, double *y1) {
+    double pad = cmd->stroke / 2 + 1;
+    switch (cmd->op) {
+        default:
+        case UI_DRAW_RECT:
+            *x0 = cmd->x - pad;
+            *y0 = cmd->y - pad;
+            *x1 = cmd->x + cmd->w + pad;
+            *y1 = cmd->y + cmd->h + pad;
+            break;
+        case UI_DRAW_LINE:
+            *x0 = (cmd->x < cmd->w ? cmd->x : cmd->w) - pad;
+            *y0 = (cmd->y < cmd->h ? cmd->y : cmd->h) - pad;
+            *x1 = (cmd->x > cmd->w ? cmd->x : cmd->w) + pad;
+            *y1 = (cmd->y > cmd->h ? cmd->y : cmd->h) + pad;
+            break;
+        case UI_DRAW_CIRCLE:
+            *x0 = cmd->x - cmd->w - pad;
+            *y0 = cmd->y - cmd->w - pad;
+            *x1 = cmd->x + cmd->w + pad;
+            *y1 = cmd->y + cmd->w + pad;
+            break;
+        case UI_DRAW_TEXT:
+            *x0 = cmd->x;
+            *y0 = cmd->y;
+            *x1 = cmd->x + cmd->w * 2 * strlen(text);
+            *y1 = cmd->y + cmd->w * 2;
+            break;
+    }
+}
+
+/* Draw an attributed string with its top left corner at x, y, and
+ * free it */
+static void draw_attributed_libui(uiDrawContext *ctx, uiAttributedString *str, const char *family,
+                                  double size, double x, double y) {
+    uiFontDescriptor font;
+    font.Family = (char *) family;
+    font.Size = size;
+    font.Weight = uiTextWeightNormal;
+    font.Italic = uiTextItalicNormal;
+    font.Stretch = uiTextStretchNormal;
+    uiDrawTextLayoutParams params;
+    params.String = str;
+    params.DefaultFont = &font;
+    params.Width = -1;
+    params.Align = uiDrawTextAlignLeft;
+    uiDrawTextLayout *layout = uiDrawNewTextLayout(&params);
+    uiDrawText(ctx, layout, x, y);
+    uiDrawFreeTextLayout(layout);
+    uiFreeAttributedString(str);
+}
+
+/* Draw a line of text with its top left corner at x, y */
+static void draw_text_libui(uiDrawContext *ctx, const char *text, const char *family,
+                            double size, double x, double y, UIColor color) {
+    uiAttributedString *str = uiNewAttributedString(text);
+    uiAttributedStringSetAttribute(str,
+            uiNewColorAttribute(color.r, color.g, color.b, color.a),
+            0, uiAttributedStringLen(str));
+    draw_attributed_libui(ctx, str, family, size, x, y);
+}
+
+/* End a path and stroke or fill it with the color of a command */
+static void draw_path_libui(uiDrawContext *ctx, uiDrawPath *path, const UIDrawCmd *cmd) {
+    uiDrawBrush brush;
+    memset(&brush, 0, sizeof(brush));
+    brush.Type = uiDrawBrushTypeSolid;
+    brush.R = cmd->color.r;
+    brush.G = cmd->color.g;
+    brush.B = cmd->color.b;
+    brush.A = cmd->color.a;
+    uiDrawPathEnd(path);
+    if (cmd->stroke > 0) {
+        uiDrawStrokeParams sp;
+        memset(&sp, 0, sizeof(sp));
+        sp.Cap = uiDrawLineCapFlat;
+        sp.Join = uiDrawLineJoinMiter;
+        sp.Thickness = cmd->stroke;
+        sp.MiterLimit = uiDrawDefaultMiterLimit;
+        uiDrawStroke(ctx, path, &brush, &sp);
+    } else {
+        uiDrawFill(ctx, path, &brush);
+    }
+    uiDrawFreePath(path);
+}
+
+/* Run a command with libui, on the UI thread */
+static void draw_cmd_libui(uiDrawContext *ctx, const UIDrawCmd *cmd, const char *text) {
+    if (cmd->op == UI_DRAW_TEXT) {
+        draw_text_libui(ctx, text, "sans", cmd->w, cmd->x, cmd->y, cmd->color);
+        return;
+    }
+    uiDrawPath *path = uiDrawNewPath(uiDrawFillModeWinding);
+    switch (cmd->op) {
+        case UI_DRAW_RECT:
+            uiDrawPathAddRectangle(path, cmd->x, cmd->y, cmd->w, cmd->h);
+            break;
+        case UI_DRAW_LINE:
+            uiDrawPathNewFigure(path, cmd->x, cmd->y);
+            uiDrawPathLineTo(path, cmd->w, cmd->h);
+            break;
+        case UI_DRAW_CIRCLE:
+            uiDrawPathNewFigureWithArc(path, cmd->x, cmd->y, cmd->w, 0, 2 * UI_PI, 0);
+            uiDrawPathCloseFigure(path);
+            break;
+    }
+    draw_path_libui(ctx, path, cmd);
+}
+
+#ifdef UI_GTK
+/* Run a command with cairo, on any thread. Text is laid out with pango
+ * like libui does on the UI thread, with sizes in points at pango's 96
+ * dpi. Pango's cairo font map is per thread, so workers can use it. */
+static void draw_cmd_cairo(cairo_t *cr, const UIDrawCmd *cmd, const char *text) {
+    cairo_set_source_rgba(cr, cmd->color.r, cmd->color.g, cmd->color.b, cmd->color.a);
+    cairo_new_path(cr);
+    switch (cmd->op) {
+        case UI_DRAW_RECT:
+            cairo_rectangle(cr, cmd->x, cmd->y, cmd->w, cmd->h);
+            break;
+        case UI_DRAW_LINE:
+            cairo_move_to(cr, cmd->x, cmd->y);
+            cairo_line_to(cr, cmd->w, cmd->h);
+            break;
+        case UI_DRAW_CIRCLE:
+            cairo_arc(cr, cmd->x, cmd->y, cmd->w, 0, 2 * UI_PI);
+            cairo_close_path(cr);
+            break;
+        case UI_DRAW_TEXT: {
+            PangoLayout *layout = pango_cairo_create_layout(cr);
+            PangoFontDescription *font = pango_font_description_new();
+            pango_font_description_set_family(font, "sans");
+            pango_font_description_set_size(font, (gint)(cmd->w * PANGO_SCALE));
+            pango_layout_set_font_description(layout, font);
+            pango_layout_set_text(layout, text, -1);
+            cairo_move_to(cr, cmd->x, cmd->y);
+            pango_cairo_show_layout(cr, layout);
+            pango_font_description_free(font);
+            g_object_unref(layout);
+            return;
+        }
+    }
+    if (cmd->stroke > 0) {
+        cairo_set_line_width(cr, cmd->stroke);
+        cairo_stroke(cr);
+    } else {
+        cairo_fill(cr);
+    }
+}
+#endif
+
+/* Run a command built by a ui/draw function on its target, the first
+ * argument, which is either an active draw context or a draw list.
+ * Text is only used by text commands. */
+static void draw_emit(const Janet *argv, const UIDrawCmd *cmd, const char *text) {
+    Janet x = argv[0];
+    if (janet_checktype(x, JANET_ABSTRACT)) {
+        void *abst = janet_unwrap_abstract(x);
+        const JanetAbstractType *at = janet_abstract_type(abst);
+        if (at == &draw_list_td) {
+            draw_list_push((UIDrawList *) abst, cmd, text);
+            return;
+        }
+        if (at == &draw_context_td) {
+            UIDrawContext *ctx = (UIDrawContext *) abst;
+            if (NULL == ctx->params) janet_panic("draw context is not active");
+            draw_cmd_libui(ctx->params->Context, cmd, text);
+            return;
+        }
+    }
+    janet_panicf("expected draw context or draw list, got %v", x);
+}
+
+static Janet janet_ui_draw_list(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 0);
+    (void) argv;
+    UIDrawList *dl = janet_abstract(&draw_list_td, sizeof(UIDrawList));
+    memset(dl, 0, sizeof(UIDrawList));
+    return janet_wrap_abstract(dl);
+}
+
+static Janet janet_ui_draw_list_clear(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UIDrawList *dl = janet_getabstract(argv, 0, &draw_list_td);
+    dl->count = 0;
+    dl->text_len = 0;
+    return argv[0];
+}
+
+static Janet janet_ui_draw_list_count(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UIDrawList *dl = janet_getabstract(argv, 0, &draw_list_td);
+    return janet_wrap_integer(dl->count);
+}
+
+static Janet janet_ui_draw_rect(int32_t argc, Janet *argv) {
+    janet_arity(argc, 6, 7);
+    UIDrawCmd cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.op = UI_DRAW_RECT;
+    cmd.x = janet_getnumber(argv, 1);
+    cmd.y = janet_getnumber(argv, 2);
+    cmd.w = janet_getnumber(argv, 3);
+    cmd.h = janet_getnumber(argv, 4);
+    cmd.color = janet_getcolor(argv, 5);
+    cmd.stroke = (float) janet_optnumber(argv, argc, 6, 0);
+    draw_emit(argv, &cmd, NULL);
+    return argv[0];
+}
+
+static Janet janet_ui_draw_line(int32_t argc, Janet *argv) {
+    janet_arity(argc, 6, 7);
+    UIDrawCmd cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.op = UI_DRAW_LINE;
+    cmd.x = janet_getnumber(argv, 1);
+    cmd.y = janet_getnumber(argv, 2);
+    cmd.w = janet_getnumber(argv, 3);
+    cmd.h = janet_getnumber(argv, 4);
+    cmd.color = janet_getcolor(argv, 5);
+    cmd.stroke = (float) janet_optnumber(argv, argc, 6, 1);
+    if (cmd.stroke <= 0) janet_panic("expected positive line width");
+    draw_emit(argv, &cmd, NULL);
+    return argv[0];
+}
+
+static Janet janet_ui_draw_circle(int32_t argc, Janet *argv) {
+    janet_arity(argc, 5, 6);
+    UIDrawCmd cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.op = UI_DRAW_CIRCLE;
+    cmd.x = janet_getnumber(argv, 1);
+    cmd.y = janet_getnumber(argv, 2);
+    cmd.w = janet_getnumber(argv, 3);
+    cmd.color = janet_getcolor(argv, 4);
+    cmd.stroke = (float) janet_optnumber(argv, argc, 5, 0);
+    draw_emit(argv, &cmd, NULL);
+    return argv[0];
+}
+
+static Janet janet_ui_draw_text(int32_t argc, Janet *argv) {
+    janet_arity(argc, 5, 6);
+    UIDrawCmd cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.op = UI_DRAW_TEXT;
+    cmd.x = janet_getnumber(argv, 1);
+    cmd.y = janet_getnumber(argv, 2);
+    const char *text = (const char *) janet_getstring(argv, 3);
+    cmd.color = janet_getcolor(argv, 4);
+    cmd.w = janet_optnumber(argv, argc, 5, 12);
+    draw_emit(argv, &cmd, text);
+    return argv[0];
+}
+
+/* Replay a draw list onto a draw context or append it to another list */
+static Janet janet_ui_draw_list_replay(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    UIDrawList *dl = janet_getabstract(argv, 1, &draw_list_td);
+    if (janet_checktype(argv[0], JANET_ABSTRACT) && janet_unwrap_abstract(argv[0]) == dl) {
+        janet_panic("cannot replay a draw list into itself");
+    }
+    for (int32_t i = 0; i < dl->count; i++) {
+        const UIDrawCmd *cmd = dl->cmds + i;
+        draw_emit(argv, cmd, draw_cmd_text(cmd, dl->text));
+    }
+    return argv[0];
+}
+
+static Janet janet_ui_draw_size(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UIDrawContext *ctx = janet_getabstract(argv, 0, &draw_context_td);
+    if (NULL == ctx->params) janet_panic("draw context is not active");
+    Janet *tup = janet_tuple_begin(2);
+    tup[0] = janet_wrap_number(ctx->params->AreaWidth);
+    tup[1] = janet_wrap_number(ctx->params->AreaHeight);
+    return janet_wrap_tuple(janet_tuple_end(tup));
+}
+
+/* Area */
+
+/* Areas can render a draw list off the UI thread. The list is copied
+ * into a scene, which the workers rasterize into fixed size tiles with
+ * cairo. The Draw callback only blits finished tiles, drawing stale
+ * tiles or the background where the current scene is not rendered yet,
+ * and a worker queues a redraw when it finishes a tile. Blitting needs
+ * the cairo context inside libui's draw context, so without GTK the
+ * scene is drawn with libui in the Draw callback instead. */
+#define UI_TILE_SIZE 256
+#define UI_TILE_BYTES (UI_TILE_SIZE * UI_TILE_SIZE * 4)
+#define UI_TILE_MAX 256
+
+/* Immutable copy of a draw list, shared by the tile jobs rendering it */
+typedef struct {
+    int32_t refcount;
+    int32_t count;
+    UIDrawCmd *cmds;
+    char *text;
+} UIScene;
+
+typedef struct {
+    int32_t tx;
+    int32_t ty;
+    /* Scene generation of the pixels, 0 if none */
+    uint64_t generation;
+    /* Scene generation being rendered, 0 if none */
+    uint64_t pending;
+    /* Frame the tile was last drawn in */
+    uint64_t used;
+    uint32_t *pixels;
+} UITile;
+
+/* Tile renderer of an area, shared with the workers. Everything but
+ * frame is guarded by lock. */
+typedef struct {
+    pthread_mutex_t lock;
+    int32_t refcount;
+    int redraw_queued;
+    /* NULL once the area is destroyed */
+    uiArea *area;
+    UIScene *scene;
+    uint64_t generation;
+    UIColor background;
+    UITile *tiles;
+    int32_t tile_count;
+    uint64_t frame;
+    uint64_t rendered;
+    uint64_t blitted;
+    uint64_t placeholders;
+} UITiler;
+
+typedef struct {
+    UIJob job;
+    UITiler *tiler;
+    UIScene *scene;
+    uint64_t generation;
+    UIColor background;
+    int32_t tx;
+    int32_t ty;
+} UITileJob;
+
+#define UI_AREA_DRAW 0
+#define UI_AREA_MOUSE_EVENT 1
+#define UI_AREA_MOUSE_CROSSED 2
+#define UI_AREA_DRAG_BROKEN 3
+#define UI_AREA_KEY_EVENT 4
+
+#define UI_DIRTY_MAX 8
+
+typedef struct {
+    double x, y, w, h;
+} UIRect;
+
+typedef struct UISceneGraph UISceneGraph;
+
+typedef struct {
+    UIControlWrapper base;
+    uiAreaHandler handler;
+    /* Draw context passed to the draw handler, reused every frame */
+    Janet draw_context;
+    UITiler *tiler;
+    /* Rectangles invalidated since the last flush to GTK */
+    UIRect dirty[UI_DIRTY_MAX];
+    int32_t dirty_count;
+    int flush_queued;
+    /* Scene graph shown by the area, or NULL */
+    UISceneGraph *scene;
+} UIArea;
+
+static void scene_graph_draw(UISceneGraph *g, uiAreaDrawParams *p);
+static Janet scene_graph_hit(UISceneGraph *g, double x, double y);
+
+#ifdef UI_GTK
+/* libui's draw context is private. This mirrors struct uiDrawContext
+ * from unix/draw.h of libui 4.0.0-alpha4 (the GTK backend), and only
+ * the cairo context is read, to blit tiles. Check it when the libui
+ * submodule is updated. */
+struct uiDrawContextGtk {
+    cairo_t *cr;
+    GtkStyleContext *style;
+};
+
+static cairo_t *ui_draw_cairo(uiAreaDrawParams *p) {
+    return ((struct uiDrawContextGtk *) p->Context)->cr;
+}
+#endif
+
+static UIScene *scene_new(const UIDrawList *dl) {
+    UIScene *scene = malloc(sizeof(UIScene));
+    if (NULL == scene) return NULL;
+    scene->refcount = 1;
+    scene->count = dl->count;
+    scene->cmds = malloc(sizeof(UIDrawCmd) * (dl->count ? dl->count : 1));
+    scene->text = malloc(dl->text_len ? dl->text_len : 1);
+    if (NULL == scene->cmds || NULL == scene->text) {
+        free(scene->cmds);
+        free(scene->text);
+        free(scene);
+        return NULL;
+    }
+    memcpy(scene->cmds, dl->cmds, sizeof(UIDrawCmd) * dl->count);
+    memcpy(scene->text, dl->text, dl->text_len);
+    return scene;
+}
+
+/* Must be called with the lock of the tiler rendering the scene */
+static void scene_release(UIScene *scene) {
+    if (NULL == scene || --scene->refcount) return;
+    free(scene->cmds);
+    free(scene->text);
+    free(scene);
+}
+
+/* Drop a reference to a tiler. Must be called with its lock held,
+ * which is released. */
+static void tiler_unlock_release(UITiler *t) {
+    int last = --t->refcount == 0;
+    pthread_mutex_unlock(&t->lock);
+    if (!last) return;
+    scene_release(t->scene);
+    for (int32_t i = 0; i < t->tile_count; i++) free(t->tiles[i].pixels);
+    free(t->tiles);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+}
+
+#ifdef UI_GTK
+static UITile *tiler_find(UITiler *t, int32_t tx, int32_t ty) {
+    for (int32_t i = 0; i < t->tile_count; i++) {
+        if (t->tiles[i].tx == tx && t->tiles[i].ty == ty) return t->tiles + i;
+    }
+    return NULL;
+}
+
+/* Find or create a tile, evicting the least recently drawn tile that
+ * is not being rendered when the cache is full. Returns NULL if every
+ * tile is in use. */
+static UITile *tiler_get(UITiler *t, int32_t tx, int32_t ty) {
+    UITile *tile = tiler_find(t, tx, ty);
+    if (NULL != tile) return tile;
+    if (t->tile_count < UI_TILE_MAX) {
+        tile = t->tiles + t->tile_count++;
+        ui_mem.tile_bytes += UI_TILE_BYTES;
+    } else {
+        for (int32_t i = 0; i < t->tile_count; i++) {
+            UITile *c = t->tiles + i;
+            if (c->pending || c->used == t->frame) continue;
+            if (NULL == tile || c->used < tile->used) tile = c;
+        }
+        if (NULL == tile) return NULL;
+        free(tile->pixels);
+    }
+    memset(tile, 0, sizeof(UITile));
+    tile->tx = tx;
+    tile->ty = ty;
+    return tile;
+}
+
+/* Rasterize the part of a scene covered by a tile */
+static uint32_t *tile_render(const UIScene *scene, int32_t tx, int32_t ty, UIColor bg) {
+    uint32_t *pixels = malloc(UI_TILE_BYTES);
+    if (NULL == pixels) return NULL;
+    cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char *) pixels,
+            CAIRO_FORMAT_ARGB32, UI_TILE_SIZE, UI_TILE_SIZE, UI_TILE_SIZE * 4);
+    cairo_t *cr = cairo_create(surface);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_rgba(cr, bg.r, bg.g, bg.b, bg.a);
+    cairo_paint(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+    double ox = (double) tx * UI_TILE_SIZE;
+    double oy = (double) ty * UI_TILE_SIZE;
+    cairo_translate(cr, -ox, -oy);
+    for (int32_t i = 0; i < scene->count; i++) {
+        const UIDrawCmd *cmd = scene->cmds + i;
+        const char *text = draw_cmd_text(cmd, scene->text);
+        double x0, y0, x1, y1;
+        draw_cmd_bounds(cmd, text, &x0, &y0, &x1, &y1);
+        if (x1 < ox || y1 < oy || x0 > ox + UI_TILE_SIZE || y0 > oy + UI_TILE_SIZE) continue;
+        draw_cmd_cairo(cr, cmd, text);
+    }
+    cairo_destroy(cr);
+    cairo_surface_flush(surface);
+    cairo_surface_destroy(surface);
+    return pixels;
+}
+
+static void tiler_redraw(void *data) {
+    UITiler *t = (UITiler *)data;
+    pthread_mutex_lock(&t->lock);
+    t->redraw_queued = 0;
+    if (NULL != t->area) uiAreaQueueRedrawAll(t->area);
+    tiler_unlock_release(t);
+}
+
+static void tile_job_run(UIJob *job) {
+    UITileJob *tj = (UITileJob *)job;
+    UITiler *t = tj->tiler;
+    uint32_t *pixels = NULL;
+    pthread_mutex_lock(&t->lock);
+    int stale = NULL == t->area || t->generation != tj->generation;
+    pthread_mutex_unlock(&t->lock);
+    if (!stale) pixels = tile_render(tj->scene, tj->tx, tj->ty, tj->background);
+    pthread_mutex_lock(&t->lock);
+    UITile *tile = tiler_find(t, tj->tx, tj->ty);
+    if (NULL != tile && tile->pending == tj->generation) {
+        tile->pending = 0;
+        if (NULL != pixels) {
+            uint32_t *old = tile->pixels;
+            tile->pixels = pixels;
+            tile->generation = tj->generation;
+            pixels = old;
+            t->rendered++;
+            if (NULL != t->area && !t->redraw_queued) {
+                t->redraw_queued = 1;
+                t->refcount++;
+                uiQueueMain(tiler_redraw, t);
+            }
+        }
+    }
+    scene_release(tj->scene);
+    tiler_unlock_release(t);
+    free(pixels);
+    free(tj);
+}
+
+/* Queue a tile of the current scene. Must be called with the lock held. */
+static void tiler_submit(UITiler *t, UITile *tile) {
+    UITileJob *tj = malloc(sizeof(UITileJob));
+    if (NULL == tj) return;
+    tj->job.run = tile_job_run;
+    tj->tiler = t;
+    tj->scene = t->scene;
+    tj->generation = t->generation;
+    tj->background = t->background;
+    tj->tx = tile->tx;
+    tj->ty = tile->ty;
+    if (!ui_pool_submit(&tj->job)) {
+        free(tj);
+        return;
+    }
+    t->refcount++;
+    t->scene->refcount++;
+    tile->pending = t->generation;
+}
+
+static void tiler_fill(cairo_t *cr, UIColor c, double x, double y, double w, double h) {
+    cairo_set_source_rgba(cr, c.r, c.g, c.b, c.a);
+    cairo_rectangle(cr, x, y, w, h);
+    cairo_fill(cr);
+}
+
+/* Blit the tiles covering the clip rectangle, queueing the ones that
+ * are missing or stale */
+static void tiler_draw(UITiler *t, uiAreaDrawParams *p) {
+    cairo_t *cr = ui_draw_cairo(p);
+    double cx0 = p->ClipX > 0 ? p->ClipX : 0;
+    double cy0 = p->ClipY > 0 ? p->ClipY : 0;
+    double cx1 = p->ClipX + p->ClipWidth;
+    double cy1 = p->ClipY + p->ClipHeight;
+    if (cx1 <= cx0 || cy1 <= cy0) return;
+    int32_t tx0 = (int32_t)(cx0 / UI_TILE_SIZE);
+    int32_t ty0 = (int32_t)(cy0 / UI_TILE_SIZE);
+    int32_t tx1 = (int32_t)((cx1 - 1) / UI_TILE_SIZE);
+    int32_t ty1 = (int32_t)((cy1 - 1) / UI_TILE_SIZE);
+    cairo_save(cr);
+    pthread_mutex_lock(&t->lock);
+    t->frame++;
+    for (int32_t ty = ty0; ty <= ty1; ty++) {
+        for (int32_t tx = tx0; tx <= tx1; tx++) {
+            double x = (double) tx * UI_TILE_SIZE;
+            double y = (double) ty * UI_TILE_SIZE;
+            UITile *tile = tiler_get(t, tx, ty);
+            if (NULL == tile) {
+                tiler_fill(cr, t->background, x, y, UI_TILE_SIZE, UI_TILE_SIZE);
+                t->placeholders++;
+                continue;
+            }
+            tile->used = t->frame;
+            if (tile->generation != t->generation && tile->pending != t->generation) {
+                tiler_submit(t, tile);
+            }
+            if (NULL == tile->pixels) {
+                tiler_fill(cr, t->background, x, y, UI_TILE_SIZE, UI_TILE_SIZE);
+                t->placeholders++;
+                continue;
+            }
+            cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char *) tile->pixels,
+                    CAIRO_FORMAT_ARGB32, UI_TILE_SIZE, UI_TILE_SIZE, UI_TILE_SIZE * 4);
+            cairo_set_source_surface(cr, surface, x, y);
+            cairo_rectangle(cr, x, y, UI_TILE_SIZE, UI_TILE_SIZE);
+            cairo_fill(cr);
+            cairo_surface_destroy(surface);
+            t->blitted++;
+        }
+    }
+    pthread_mutex_unlock(&t->lock);
+    cairo_restore(cr);
+}
+#else
+/* Draw the commands of the scene that cross the clip rectangle */
+static void tiler_draw(UITiler *t, uiAreaDrawParams *p) {
+    UIDrawCmd bg;
+    memset(&bg, 0, sizeof(bg));
+    bg.op = UI_DRAW_RECT;
+    bg.x = p->ClipX;
+    bg.y = p->ClipY;
+    bg.w = p->ClipWidth;
+    bg.h = p->ClipHeight;
+    pthread_mutex_lock(&t->lock);
+    t->frame++;
+    bg.color = t->background;
+    draw_cmd_libui(p->Context, &bg, NULL);
+    const UIScene *scene = t->scene;
+    for (int32_t i = 0; i < scene->count; i++) {
+        const UIDrawCmd *cmd = scene->cmds + i;
+        const char *text = draw_cmd_text(cmd, scene->text);
+        double x0, y0, x1, y1;
+        draw_cmd_bounds(cmd, text, &x0, &y0, &x1, &y1);
+        if (x1 < p->ClipX || y1 < p->ClipY || x0 > p->ClipX + p->ClipWidth || y0 > p->ClipY + p->ClipHeight) continue;
+        draw_cmd_libui(p->Context, cmd, text);
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+#endif
+
+/* Detach a tiler from its area, freeing the tiles. Jobs still running
+ * drop their results. */
+static void tiler_detach(UITiler *t) {
+    pthread_mutex_lock(&t->lock);
+    t->area = NULL;
+    for (int32_t i = 0; i < t->tile_count; i++) free(t->tiles[i].pixels);
+    ui_mem.tile_bytes -= (int64_t) t->tile_count * UI_TILE_BYTES;
+    t->tile_count = 0;
+    tiler_unlock_release(t);
+}
+
+static UIArea *area_from_handler(uiAreaHandler *ah) {
+    return (UIArea *)((char *) ah - offsetof(UIArea, handler));
+}
+
+static void area_release(UIControlWrapper *w) {
+    UIArea *a = (UIArea *)w;
+    if (NULL != a->tiler) {
+        tiler_detach(a->tiler);
+        a->tiler = NULL;
+    }
+}
+
+static int area_gcmark(void *p, size_t len) {
+    UIArea *a = (UIArea *)p;
+    janet_mark(a->draw_context);
+    if (NULL != a->scene) janet_mark(janet_wrap_abstract(a->scene));
+    return control_gcmark(p, len);
+}
+
+static void area_draw_handler(uiAreaHandler *ah, uiArea *area, uiAreaDrawParams *p) {
+    (void) area;
+    UIArea *a = area_from_handler(ah);
+    if (NULL != a->tiler) tiler_draw(a->tiler, p);
+    if (NULL != a->scene) scene_graph_draw(a->scene, p);
+    void *data = a->base.handlers[UI_AREA_DRAW];
+    if (NULL != data) {
+        UIDrawContext *ctx = janet_unwrap_abstract(a->draw_context);
+        ctx->params = p;
+        janet_ui_handler_value(data, a->draw_context);
+        ctx->params = NULL;
+    }
+}
+
+static Janet janet_ui_modifiers(uiModifiers m) {
+    Janet mods[4];
+    int32_t n = 0;
+    if (m & uiModifierCtrl) mods[n++] = janet_ckeywordv("ctrl");
+    if (m & uiModifierAlt) mods[n++] = janet_ckeywordv("alt");
+    if (m & uiModifierShift) mods[n++] = janet_ckeywordv("shift");
+    if (m & uiModifierSuper) mods[n++] = janet_ckeywordv("super");
+    return janet_wrap_tuple(janet_tuple_n(mods, n));
+}
+
+static void area_mouse_event_handler(uiAreaHandler *ah, uiArea *area, uiAreaMouseEvent *e) {
+    (void) area;
+    UIArea *a = area_from_handler(ah);
+    void *data = a->base.handlers[UI_AREA_MOUSE_EVENT];
+    if (NULL == data) return;
+    JanetKV *st = janet_struct_begin(NULL != a->scene ? 10 : 9);
+    janet_struct_put(st, janet_ckeywordv("x"), janet_wrap_number(e->X));
+    janet_struct_put(st, janet_ckeywordv("y"), janet_wrap_number(e->Y));
+    janet_struct_put(st, janet_ckeywordv("width"), janet_wrap_number(e->AreaWidth));
+    janet_struct_put(st, janet_ckeywordv("height"), janet_wrap_number(e->AreaHeight));
+    janet_struct_put(st, janet_ckeywordv("down"), janet_wrap_integer(e->Down));
+    janet_struct_put(st, janet_ckeywordv("up"), janet_wrap_integer(e->Up));
+    janet_struct_put(st, janet_ckeywordv("count"), janet_wrap_integer(e->Count));
+    janet_struct_put(st, janet_ckeywordv("modifiers"), janet_ui_modifiers(e->Modifiers));
+    janet_struct_put(st, janet_ckeywordv("held"), janet_wrap_number((double) e->Held1To64));
+    if (NULL != a->scene) janet_struct_put(st, janet_ckeywordv("shape"), scene_graph_hit(a->scene, e->X, e->Y));
+    janet_ui_handler_value(data, janet_wrap_struct(janet_struct_end(st)));
+}
+
+static void area_mouse_crossed_handler(uiAreaHandler *ah, uiArea *area, int left) {
+    (void) area;
+    UIArea *a = area_from_handler(ah);
+    void *data = a->base.handlers[UI_AREA_MOUSE_CROSSED];
+    if (NULL != data) janet_ui_handler_value(data, janet_wrap_boolean(left));
+}
+
+static void area_drag_broken_handler(uiAreaHandler *ah, uiArea *area) {
+    (void) area;
+    UIArea *a = area_from_handler(ah);
+    void *data = a->base.handlers[UI_AREA_DRAG_BROKEN];
+    if (NULL != data) janet_ui_handler(data);
+}
+
+/* Names of uiExtKey values, indexed by value */
+static const char *const ext_key_names[] = {
+    NULL, "escape", "insert", "delete", "home", "end", "page-up", "page-down",
+    "up", "down", "left", "right",
+    "f1", "f2", "f3", "f4", "f5", "f6", "f7", "f8", "f9", "f10", "f11", "f12",
+    "n0", "n1", "n2", "n3", "n4", "n5", "n6", "n7", "n8", "n9",
+    "n-dot", "n-enter", "n-add", "n-subtract", "n-multiply", "n-divide"
+};
+
+/* Key handlers return a truthy value if they handled the event */
+static int area_key_event_handler(uiAreaHandler *ah, uiArea *area, uiAreaKeyEvent *e) {
+    (void) area;
+    UIArea *a = area_from_handler(ah);
+    void *data = a->base.handlers[UI_AREA_KEY_EVENT];
+    if (NULL == data) return 0;
+    int ext = (int) e->ExtKey;
+    JanetKV *st = janet_struct_begin(5);
+    janet_struct_put(st, janet_ckeywordv("key"),
+            e->Key ? janet_stringv((const uint8_t *) &e->Key, 1) : janet_wrap_nil());
+    janet_struct_put(st, janet_ckeywordv("ext-key"),
+            ext > 0 && ext < (int)(sizeof(ext_key_names) / sizeof(ext_key_names[0]))
+            ? janet_ckeywordv(ext_key_names[ext]) : janet_wrap_nil());
+    janet_struct_put(st, janet_ckeywordv("modifier"), janet_ui_modifiers(e->Modifier));
+    janet_struct_put(st, janet_ckeywordv("modifiers"), janet_ui_modifiers(e->Modifiers));
+    janet_struct_put(st, janet_ckeywordv("up"), janet_wrap_boolean(e->Up));
+    Janet result;
+    janet_ui_dispatch(data, 1, janet_wrap_struct(janet_struct_end(st)), &result);
+    return janet_truthy(result);
+}
+
+static Janet janet_ui_area(int32_t argc, Janet *argv) {
+    assert_inited();
+    if (argc != 0 && argc != 2) janet_panicf("expected 0 or 2 arguments, got %d", argc);
+    UIArea *a = janet_abstract(&area_td, sizeof(UIArea));
+    memset(a, 0, sizeof(UIArea));
+    a->handler.Draw = area_draw_handler;
+    a->handler.MouseEvent = area_mouse_event_handler;
+    a->handler.MouseCrossed = area_mouse_crossed_handler;
+    a->handler.DragBroken = area_drag_broken_handler;
+    a->handler.KeyEvent = area_key_event_handler;
+    UIDrawContext *ctx = janet_abstract(&draw_context_td, sizeof(UIDrawContext));
+    ctx->params = NULL;
+    a->draw_context = janet_wrap_abstract(ctx);
+    if (argc == 2) {
+        int32_t width = janet_getinteger(argv, 0);
+        int32_t height = janet_getinteger(argv, 1);
+        a->base.control = uiControl(uiNewScrollingArea(&a->handler, width, height));
+        a->base.kind = 1;
+        janet_ui_state_push(&a->base, argv[0]);
+        janet_ui_state_push(&a->base, argv[1]);
+    } else {
+        a->base.control = uiControl(uiNewArea(&a->handler));
+    }
+    wrapper_cache_put(&a->base);
+    a->base.release = area_release;
+    ui_mem.controls[control_type_index(&area_td)]++;
+    UI_PROBE2(control__create, area_td.name, a->base.control);
+    return janet_wrap_abstract(a);
+}
+
+/* Area handlers are always called with the area, and the event for
+ * events that have one */
+static Janet janet_ui_area_on(int32_t argc, Janet *argv, int slot) {
+    janet_fixarity(argc, 2);
+    janet_getuitype(argv, 0, &area_td);
+    UIHandler *h = janet_ui_to_control_handler_data(argc, argv, slot);
+    h->flags |= UI_HANDLER_ARGS;
+    return argv[0];
+}
+
+static Janet janet_ui_area_on_draw(int32_t argc, Janet *argv) {
+    return janet_ui_area_on(argc, argv, UI_AREA_DRAW);
+}
+
+static Janet janet_ui_area_on_mouse_event(int32_t argc, Janet *argv) {
+    return janet_ui_area_on(argc, argv, UI_AREA_MOUSE_EVENT);
+}
+
+static Janet janet_ui_area_on_mouse_crossed(int32_t argc, Janet *argv) {
+    return janet_ui_area_on(argc, argv, UI_AREA_MOUSE_CROSSED);
+}
+
+static Janet janet_ui_area_on_drag_broken(int32_t argc, Janet *argv) {
+    return janet_ui_area_on(argc, argv, UI_AREA_DRAG_BROKEN);
+}
+
+static Janet janet_ui_area_on_key_event(int32_t argc, Janet *argv) {
+    return janet_ui_area_on(argc, argv, UI_AREA_KEY_EVENT);
+}
+
+static Janet janet_ui_area_queue_redraw_all(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    uiArea *area = janet_getuitype(argv, 0, &area_td);
+    uiAreaQueueRedrawAll(area);
+    /* Pending rectangles are covered by the full redraw */
+    ((UIArea *) janet_unwrap_abstract(argv[0]))->dirty_count = 0;
+    return argv[0];
+}
+
+/* Dirty rectangles. Invalidated rectangles are merged in C into a set
+ * of at most UI_DIRTY_MAX and handed to GTK once per frame, from an
+ * idle callback that runs just before GTK redraws. GTK then clips the
+ * next draw to their union, and ui/draw/clip lists the rectangles so
+ * draw handlers can skip everything outside them. */
+
+/* Area of the union of a and b */
+static double rect_union_area(const UIRect *a, const UIRect *b) {
+    double x0 = a->x < b->x ? a->x : b->x;
+    double y0 = a->y < b->y ? a->y : b->y;
+    double x1 = a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w;
+    double y1 = a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h;
+    return (x1 - x0) * (y1 - y0);
+}
+
+static void rect_union(UIRect *a, const UIRect *b) {
+    double x1 = a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w;
+    double y1 = a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h;
+    if (b->x < a->x) a->x = b->x;
+    if (b->y < a->y) a->y = b->y;
+    a->w = x1 - a->x;
+    a->h = y1 - a->y;
+}
+
+/* Add a rectangle to the dirty set. Rectangles whose union wastes no
+ * more than their separate areas are merged, and when the set is full
+ * the new rectangle joins the one it grows least. */
+static void area_add_dirty(UIArea *a, UIRect r) {
+    for (;;) {
+        int32_t merge = -1;
+        for (int32_t i = 0; i < a->dirty_count && merge < 0; i++) {
+            const UIRect *d = a->dirty + i;
+            if (rect_union_area(d, &r) <= d->w * d->h + r.w * r.h) merge = i;
+        }
+        if (merge < 0 && a->dirty_count == UI_DIRTY_MAX) {
+            double best = 0;
+            for (int32_t i = 0; i < a->dirty_count; i++) {
+                const UIRect *d = a->dirty + i;
+                double growth = rect_union_area(d, &r) - d->w * d->h;
+                if (merge < 0 || growth < best) {
+                    merge = i;
+                    best = growth;
+                }
+            }
+        }
+        if (merge < 0) break;
+        rect_union(&r, a->dirty + merge);
+        a->dirty[merge] = a->dirty[--a->dirty_count];
+    }
+    a->dirty[a->dirty_count++] = r;
+}
+
+static int area_flush_dirty(void *data) {
+    UIArea *a = (UIArea *)data;
+    a->flush_queued = 0;
+#ifdef UI_GTK
+    if (!(a->base.flags & UI_FLAG_DESTROYED)) {
+        GtkWidget *widget = GTK_WIDGET(uiControlHandle(a->base.control));
+        for (int32_t i = 0; i < a->dirty_count; i++) {
+            const UIRect *d = a->dirty + i;
+            gint x0 = (gint) d->x;
+            gint y0 = (gint) d->y;
+            gint x1 = (gint)(d->x + d->w);
+            gint y1 = (gint)(d->y + d->h);
+            if (x1 < d->x + d->w) x1++;
+            if (y1 < d->y + d->h) y1++;
+            gtk_widget_queue_draw_area(widget, x0, y0, x1 - x0, y1 - y0);
+        }
+    }
+#else
+    /* libui can only redraw a whole area */
+    if (!(a->base.flags & UI_FLAG_DESTROYED) && a->dirty_count) {
+        uiAreaQueueRedrawAll((uiArea *) a->base.control);
+    }
+#endif
+    a->dirty_count = 0;
+    janet_gcunroot(janet_wrap_abstract(a));
+    return 0;
+}
+
+/* Queue a redraw of part of an area. Scrolling areas are redrawn
+ * whole, as their GTK widget is not in area coordinates. */
+static void area_invalidate(UIArea *a, UIRect r) {
+    if (r.x < 0) {
+        r.w += r.x;
+        r.x = 0;
+    }
+    if (r.y < 0) {
+        r.h += r.y;
+        r.y = 0;
+    }
+    if (r.w <= 0 || r.h <= 0) return;
+    if (a->base.kind) {
+        uiAreaQueueRedrawAll((uiArea *) a->base.control);
+        return;
+    }
+    area_add_dirty(a, r);
+    if (!a->flush_queued) {
+        a->flush_queued = 1;
+        janet_gcroot(janet_wrap_abstract(a));
+        ui_idle_add(UI_IDLE_REDRAW, area_flush_dirty, a);
+    }
+}
+
+static Janet janet_ui_area_invalidate_rect(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 5);
+    janet_getuitype(argv, 0, &area_td);
+    UIRect r;
+    r.x = janet_getnumber(argv, 1);
+    r.y = janet_getnumber(argv, 2);
+    r.w = janet_getnumber(argv, 3);
+    r.h = janet_getnumber(argv, 4);
+    area_invalidate(janet_unwrap_abstract(argv[0]), r);
+    return argv[0];
+}
+
+/* The rectangles being redrawn, as [x y w h] tuples */
+static Janet janet_ui_draw_clip(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UIDrawContext *ctx = janet_getabstract(argv, 0, &draw_context_td);
+    if (NULL == ctx->params) janet_panic("draw context is not active");
+    uiAreaDrawParams *p = ctx->params;
+    JanetArray *rects = janet_array(1);
+#ifdef UI_GTK
+    cairo_rectangle_list_t *list = cairo_copy_clip_rectangle_list(ui_draw_cairo(p));
+    if (list->status == CAIRO_STATUS_SUCCESS) {
+        for (int i = 0; i < list->num_rectangles; i++) {
+            const cairo_rectangle_t *c = list->rectangles + i;
+            Janet *tup = janet_tuple_begin(4);
+            tup[0] = janet_wrap_number(c->x);
+            tup[1] = janet_wrap_number(c->y);
+            tup[2] = janet_wrap_number(c->width);
+            tup[3] = janet_wrap_number(c->height);
+            janet_array_push(rects, janet_wrap_tuple(janet_tuple_end(tup)));
+        }
+    } else {
+        /* Not representable as rectangles, so use the bounds */
+        Janet *tup = janet_tuple_begin(4);
+        tup[0] = janet_wrap_number(p->ClipX);
+        tup[1] = janet_wrap_number(p->ClipY);
+        tup[2] = janet_wrap_number(p->ClipWidth);
+        tup[3] = janet_wrap_number(p->ClipHeight);
+        janet_array_push(rects, janet_wrap_tuple(janet_tuple_end(tup)));
+    }
+    cairo_rectangle_list_destroy(list);
+#else
+    /* libui only reports the bounds of the clip */
+    Janet *tup = janet_tuple_begin(4);
+    tup[0] = janet_wrap_number(p->ClipX);
+    tup[1] = janet_wrap_number(p->ClipY);
+    tup[2] = janet_wrap_number(p->ClipWidth);
+    tup[3] = janet_wrap_number(p->ClipHeight);
+    janet_array_push(rects, janet_wrap_tuple(janet_tuple_end(tup)));
+#endif
+    return janet_wrap_array(rects);
+}
+
+static Janet janet_ui_area_set_size(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 3);
+    uiArea *area = janet_getuitype(argv, 0, &area_td);
+    int32_t width = janet_getinteger(argv, 1);
+    int32_t height = janet_getinteger(argv, 2);
+    uiAreaSetSize(area, width, height);
+    UIControlWrapper *w = janet_unwrap_abstract(argv[0]);
+    if (NULL != w->state && w->state->count == 2) {
+        w->state->data[0] = argv[1];
+        w->state->data[1] = argv[2];
+    }
+    return argv[0];
+}
+
+static Janet janet_ui_area_scroll_to(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 5);
+    uiArea *area = janet_getuitype(argv, 0, &area_td);
+    uiAreaScrollTo(area, janet_getnumber(argv, 1), janet_getnumber(argv, 2),
+            janet_getnumber(argv, 3), janet_getnumber(argv, 4));
+    return argv[0];
+}
+
+/* Render a draw list in tiles on the worker pool. The list is copied,
+ * so it can be changed and set again for the next frame. A nil list
+ * turns tiled rendering off. */
+static Janet janet_ui_area_set_scene(int32_t argc, Janet *argv) {
+    janet_arity(argc, 2, 3);
+    uiArea *area = janet_getuitype(argv, 0, &area_td);
+    UIArea *a = janet_unwrap_abstract(argv[0]);
+    if (janet_checktype(argv[1], JANET_NIL)) {
+        if (NULL != a->tiler) {
+            tiler_detach(a->tiler);
+            a->tiler = NULL;
+        }
+        uiAreaQueueRedrawAll(area);
+        return argv[0];
+    }
+    UIDrawList *dl = janet_getabstract(argv, 1, &draw_list_td);
+    UIColor background = {1.0f, 1.0f, 1.0f, 1.0f};
+    if (argc == 3) background = janet_getcolor(argv, 2);
+    UIScene *scene = scene_new(dl);
+    if (NULL == scene) janet_panic("out of memory");
+    UITiler *t = a->tiler;
+    if (NULL == t) {
+        t = malloc(sizeof(UITiler));
+        if (NULL == t) {
+            free(scene->cmds);
+            free(scene->text);
+            free(scene);
+            janet_panic("out of memory");
+        }
+        memset(t, 0, sizeof(UITiler));
+        t->tiles = malloc(sizeof(UITile) * UI_TILE_MAX);
+        if (NULL == t->tiles) {
+            free(t);
+            free(scene->cmds);
+            free(scene->text);
+            free(scene);
+            janet_panic("out of memory");
+        }
+        pthread_mutex_init(&t->lock, NULL);
+        t->refcount = 1;
+        t->area = area;
+        a->tiler = t;
+    }
+    pthread_mutex_lock(&t->lock);
+    scene_release(t->scene);
+    t->scene = scene;
+    t->generation++;
+    t->background = background;
+    pthread_mutex_unlock(&t->lock);
+    uiAreaQueueRedrawAll(area);
+    return argv[0];
+}
+
+static Janet janet_ui_area_tile_stats(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    janet_getuitype(argv, 0, &area_td);
+    UITiler *t = ((UIArea *) janet_unwrap_abstract(argv[0]))->tiler;
+    if (NULL == t) return janet_wrap_nil();
+    pthread_mutex_lock(&t->lock);
+    int32_t pending = 0;
+    for (int32_t i = 0; i < t->tile_count; i++) {
+        if (t->tiles[i].pending) pending++;
+    }
+    JanetKV *st = janet_struct_begin(7);
+    janet_struct_put(st, janet_ckeywordv("tiles"), janet_wrap_integer(t->tile_count));
+    janet_struct_put(st, janet_ckeywordv("pending"), janet_wrap_integer(pending));
+    janet_struct_put(st, janet_ckeywordv("generation"), janet_wrap_number((double) t->generation));
+    janet_struct_put(st, janet_ckeywordv("rendered"), janet_wrap_number((double) t->rendered));
+    janet_struct_put(st, janet_ckeywordv("blitted"), janet_wrap_number((double) t->blitted));
+    janet_struct_put(st, janet_ckeywordv("placeholders"), janet_wrap_number((double) t->placeholders));
+    janet_struct_put(st, janet_ckeywordv("workers"), janet_wrap_integer(pool_threads));
+    pthread_mutex_unlock(&t->lock);
+    return janet_wrap_struct(janet_struct_end(st));
+}
+
+/* Scene Graph */
+
+/* A ui/scene is a retained set of shapes kept in C, each with a Janet
+ * id and a z order, and indexed by an R-tree on their bounding boxes.
+ * An area showing a scene with ui/area/attach-scene draws only the
+ * shapes in its clip rectangle, redraws only the bounds of shapes that
+ * change, and adds the id of the topmost shape under the pointer to
+ * mouse events as :shape. Hit tests and region queries visit O(log n)
+ * nodes, so scenes of tens of thousands of shapes stay interactive.
+ *
+ * The tree is a Guttman R-tree with quadratic splits. Leaves hold shape
+ * slots, and each shape points back at its leaf, so removing a shape
+ * does not search the tree. Underfull nodes left by a removal are
+ * dissolved and their shapes inserted again. */
+
+#define UI_DRAW_PATH 4
+#define UI_RTREE_MAX 16
+#define UI_RTREE_MIN 6
+/* Distance in pixels within which the pointer hits a stroke */
+#define UI_SCENE_HIT_SLOP 2
+
+typedef struct {
+    double x0, y0, x1, y1;
+} UIBox;
+
+typedef struct UIRNode UIRNode;
+
+typedef struct {
+    UIBox box;
+    /* The child of an inner node, or NULL in leaves */
+    UIRNode *child;
+    /* The shape slot of a leaf entry */
+    int32_t shape;
+} UIREntry;
+
+struct UIRNode {
+    UIRNode *parent;
+    int leaf;
+    int32_t count;
+    /* One more than the maximum, for the entry that overflows a node
+     * before it is split */
+    UIREntry entries[UI_RTREE_MAX + 1];
+};
+
+typedef struct {
+    /* A rect, circle or text command, or UI_DRAW_PATH */
+    UIDrawCmd cmd;
+    Janet id;
+    double z;
+    /* Order among shapes of equal z */
+    uint64_t seq;
+    /* Drawn bounds, grown by the hit slop */
+    UIBox box;
+    /* Leaf holding the shape, or NULL if the slot is free */
+    UIRNode *leaf;
+    char *text;
+    /* Points of a path, as x y pairs */
+    double *points;
+    int32_t point_count;
+    int closed;
+    int32_t next_free;
+} UISceneShape;
+
+struct UISceneGraph {
+    UISceneShape *shapes;
+    int32_t slot_count;
+    int32_t slot_capacity;
+    /* First free slot, or -1 */
+    int32_t free_slot;
+    int32_t live;
+    uint64_t seq;
+    /* Maps ids to slots */
+    JanetTable *ids;
+    UIRNode *root;
+    /* Area showing the scene, or NULL */
+    UIArea *area;
+    /* Slots found by the last query */
+    int32_t *hits;
+    int32_t hit_count;
+    int32_t hit_capacity;
+    int64_t bytes;
+};
+
+static void scene_account(UISceneGraph *g, int64_t bytes) {
+    g->bytes += bytes;
+    ui_mem.scene_bytes += bytes;
+}
+
+static UIRNode *rnode_new(UISceneGraph *g, int leaf) {
+    UIRNode *n = malloc(sizeof(UIRNode));
+    if (NULL == n) janet_panic("out of memory");
+    n->parent = NULL;
+    n->leaf = leaf;
+    n->count = 0;
+    scene_account(g, sizeof(UIRNode));
+    return n;
+}
+
+static void rnode_free(UISceneGraph *g, UIRNode *n) {
+    free(n);
+    scene_account(g, -(int64_t) sizeof(UIRNode));
+}
+
+static void rnode_free_all(UISceneGraph *g, UIRNode *n) {
+    if (!n->leaf) {
+        for (int32_t i = 0; i < n->count; i++) rnode_free_all(g, n->entries[i].child);
+    }
+    rnode_free(g, n);
+}
+
+static double box_area(const UIBox *b) {
+    return (b->x1 - b->x0) * (b->y1 - b->y0);
+}
+
+static UIBox box_union(const UIBox *a, const UIBox *b) {
+    UIBox u;
+    u.x0 = a->x0 < b->x0 ? a->x0 : b->x0;
+    u.y0 = a->y0 < b->y0 ? a->y0 : b->y0;
+    u.x1 = a->x1 > b->x1 ? a->x1 : b->x1;
+    u.y1 = a->y1 > b->y1 ? a->y1 : b->y1;
+    return u;
+}
+
+static int box_overlaps(const UIBox *a, const UIBox *b) {
+    return a->x0 <= b->x1 && b->x0 <= a->x1 && a->y0 <= b->y1 && b->y0 <= a->y1;
+}
+
+/* Growth of the area of a when it is extended to cover b */
+static double box_enlargement(const UIBox *a, const UIBox *b) {
+    UIBox u = box_union(a, b);
+    return box_area(&u) - box_area(a);
+}
+
+static UIBox rnode_bounds(const UIRNode *n) {
+    UIBox b = n->entries[0].box;
+    for (int32_t i = 1; i < n->count; i++) b = box_union(&b, &n->entries[i].box);
+    return b;
+}
+
+static int32_t rnode_index(const UIRNode *parent, const UIRNode *child) {
+    int32_t i = 0;
+    while (parent->entries[i].child != child) i++;
+    return i;
+}
+
+/* Point the shapes or children of a node's entries back at it */
+static void rnode_adopt(UISceneGraph *g, UIRNode *n) {
+    for (int32_t i = 0; i < n->count; i++) {
+        if (n->leaf) g->shapes[n->entries[i].shape].leaf = n;
+        else n->entries[i].child->parent = n;
+    }
+}
+
+/* Quadratic split of an overflowing node. Returns the new sibling. */
+static UIRNode *rnode_split(UISceneGraph *g, UIRNode *n) {
+    UIRNode *s = rnode_new(g, n->leaf);
+    UIREntry all[UI_RTREE_MAX + 1];
+    char used[UI_RTREE_MAX + 1];
+    int32_t total = n->count;
+    memcpy(all, n->entries, sizeof(UIREntry) * total);
+    memset(used, 0, sizeof(used));
+    /* Seed the groups with the pair that wastes the most area */
+    int32_t s1 = 0, s2 = 1;
+    double worst = -1;
+    for (int32_t i = 0; i < total; i++) {
+        for (int32_t j = i + 1; j < total; j++) {
+            UIBox u = box_union(&all[i].box, &all[j].box);
+            double waste = box_area(&u) - box_area(&all[i].box) - box_area(&all[j].box);
+            if (worst < 0 || waste > worst) {
+                worst = waste;
+                s1 = i;
+                s2 = j;
+            }
+        }
+    }
+    n->count = 0;
+    n->entries[n->count++] = all[s1];
+    s->entries[s->count++] = all[s2];
+    used[s1] = used[s2] = 1;
+    UIBox b1 = all[s1].box;
+    UIBox b2 = all[s2].box;
+    for (int32_t left = total - 2; left > 0; left--) {
+        /* Give a group the rest if it needs them all to be full enough */
+        UIRNode *fill = n->count + left == UI_RTREE_MIN ? n : s->count + left == UI_RTREE_MIN ? s : NULL;
+        if (NULL != fill) {
+            for (int32_t i = 0; i < total; i++) {
+                if (!used[i]) fill->entries[fill->count++] = all[i];
+            }
+            break;
+        }
+        /* Place the entry with the strongest preference next, or the
+         * first one left if no preference compares */
+        int32_t pick = -1;
+        double best = -1, d1 = 0, d2 = 0;
+        for (int32_t i = 0; i < total; i++) {
+            if (used[i]) continue;
+            double e1 = box_enlargement(&b1, &all[i].box);
+            double e2 = box_enlargement(&b2, &all[i].box);
+            double diff = e1 > e2 ? e1 - e2 : e2 - e1;
+            if (pick < 0 || diff > best) {
+                best = diff;
+                pick = i;
+                d1 = e1;
+                d2 = e2;
+            }
+        }
+        if (pick < 0) break;
+        used[pick] = 1;
+        int first = d1 < d2 || (d1 == d2 && (box_area(&b1) < box_area(&b2) ||
+                    (box_area(&b1) == box_area(&b2) && n->count <= s->count)));
+        if (first) {
+            n->entries[n->count++] = all[pick];
+            b1 = box_union(&b1, &all[pick].box);
+        } else {
+            s->entries[s->count++] = all[pick];
+            b2 = box_union(&b2, &all[pick].box);
+        }
+    }
+    rnode_adopt(g, n);
+    rnode_adopt(g, s);
+    return s;
+}
+
+/* Update the boxes above a changed node, splitting nodes that
+ * overflow on the way up */
+static void rtree_adjust(UISceneGraph *g, UIRNode *n) {
+    while (NULL != n) {
+        UIRNode *split = n->count > UI_RTREE_MAX ? rnode_split(g, n) : NULL;
+        UIRNode *p = n->parent;
+        if (NULL == p) {
+            if (NULL != split) {
+                UIRNode *root = rnode_new(g, 0);
+                root->entries[0].box = rnode_bounds(n);
+                root->entries[0].child = n;
+                root->entries[1].box = rnode_bounds(split);
+                root->entries[1].child = split;
+                root->count = 2;
+                n->parent = split->parent = root;
+                g->root = root;
+            }
+            return;
+        }
+        p->entries[rnode_index(p, n)].box = rnode_bounds(n);
+        if (NULL != split) {
+            UIREntry *e = p->entries + p->count++;
+            e->box = rnode_bounds(split);
+            e->child = split;
+            split->parent = p;
+        }
+        n = p;
+    }
+}
+
+static void rtree_insert(UISceneGraph *g, int32_t slot) {
+    UISceneShape *sh = g->shapes + slot;
+    UIRNode *n = g->root;
+    while (!n->leaf) {
+        int32_t best = 0;
+        double best_growth = 0, best_area = 0;
+        for (int32_t i = 0; i < n->count; i++) {
+            double growth = box_enlargement(&n->entries[i].box, &sh->box);
+            double area = box_area(&n->entries[i].box);
+            if (i == 0 || growth < best_growth || (growth == best_growth && area < best_area)) {
+                best = i;
+                best_growth = growth;
+                best_area = area;
+            }
+        }
+        n = n->entries[best].child;
+    }
+    UIREntry *e = n->entries + n->count++;
+    e->box = sh->box;
+    e->child = NULL;
+    e->shape = slot;
+    sh->leaf = n;
+    rtree_adjust(g, n);
+}
+
+/* Make room for n query results, returning 0 if out of memory */
+static int scene_reserve_hits(UISceneGraph *g, int32_t n) {
+    if (n <= g->hit_capacity) return 1;
+    int32_t newcap = g->hit_capacity ? g->hit_capacity : 64;
+    while (newcap < n) newcap *= 2;
+    int32_t *hits = realloc(g->hits, sizeof(int32_t) * newcap);
+    if (NULL == hits) return 0;
+    scene_account(g, (int64_t)(newcap - g->hit_capacity) * sizeof(int32_t));
+    g->hits = hits;
+    g->hit_capacity = newcap;
+    return 1;
+}
+
+/* Add the shapes below a node to the hits and free the nodes. The hits
+ * must have room for every shape. */
+static void rnode_dissolve(UISceneGraph *g, UIRNode *n) {
+    for (int32_t i = 0; i < n->count; i++) {
+        if (n->leaf) g->hits[g->hit_count++] = n->entries[i].shape;
+        else rnode_dissolve(g, n->entries[i].child);
+    }
+    rnode_free(g, n);
+}
+
+static void rtree_remove(UISceneGraph *g, int32_t slot) {
+    UISceneShape *sh = g->shapes + slot;
+    UIRNode *n = sh->leaf;
+    int32_t i = 0;
+    while (n->entries[i].shape != slot) i++;
+    n->entries[i] = n->entries[--n->count];
+    sh->leaf = NULL;
+    g->hit_count = 0;
+    /* Dissolve underfull nodes, and shrink the boxes of the rest */
+    while (NULL != n->parent) {
+        UIRNode *p = n->parent;
+        int32_t k = rnode_index(p, n);
+        if (n->count < UI_RTREE_MIN) {
+            p->entries[k] = p->entries[--p->count];
+            rnode_dissolve(g, n);
+        } else {
+            p->entries[k].box = rnode_bounds(n);
+        }
+        n = p;
+    }
+    while (!g->root->leaf && g->root->count == 1) {
+        UIRNode *child = g->root->entries[0].child;
+        rnode_free(g, g->root);
+        child->parent = NULL;
+        g->root = child;
+    }
+    if (!g->root->leaf && g->root->count == 0) g->root->leaf = 1;
+    int32_t orphans = g->hit_count;
+    for (int32_t j = 0; j < orphans; j++) rtree_insert(g, g->hits[j]);
+    g->hit_count = 0;
+}
+
+static int rtree_query(UISceneGraph *g, const UIRNode *n, const UIBox *b) {
+    for (int32_t i = 0; i < n->count; i++) {
+        const UIREntry *e = n->entries + i;
+        if (!box_overlaps(&e->box, b)) continue;
+        if (n->leaf) {
+            if (!scene_reserve_hits(g, g->hit_count + 1)) return 0;
+            g->hits[g->hit_count++] = e->shape;
+        } else if (!rtree_query(g, e->child, b)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static JANET_THREAD_LOCAL const UISceneShape *scene_sort_shapes = NULL;
+
+static int scene_order(const void *a, const void *b) {
+    const UISceneShape *x = scene_sort_shapes + *(const int32_t *)a;
+    const UISceneShape *y = scene_sort_shapes + *(const int32_t *)b;
+    if (x->z != y->z) return x->z < y->z ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* Find the shapes whose bounds overlap a box, bottom to top. Returns 0
+ * if out of memory. */
+static int scene_query(UISceneGraph *g, const UIBox *b) {
+    g->hit_count = 0;
+    if (!rtree_query(g, g->root, b)) return 0;
+    scene_sort_shapes = g->shapes;
+    qsort(g->hits, g->hit_count, sizeof(int32_t), scene_order);
+    return 1;
+}
+
+/* Squared distance from a point to a segment */
+static double segment_dist2(double px, double py, double ax, double ay, double bx, double by) {
+    double dx = bx - ax, dy = by - ay;
+    double len2 = dx * dx + dy * dy;
+    double t = len2 > 0 ? ((px - ax) * dx + (py - ay) * dy) / len2 : 0;
+    if (t < 0) t = 0;
+    if (t > 1) t = 1;
+    double ex = ax + t * dx - px, ey = ay + t * dy - py;
+    return ex * ex + ey * ey;
+}
+
+/* Whether a point is on a shape. Filled shapes are hit inside, and
+ * stroked shapes near their outline. */
+static int scene_shape_contains(const UISceneShape *sh, double x, double y) {
+    const UIDrawCmd *c = &sh->cmd;
+    double slop = c->stroke / 2 + UI_SCENE_HIT_SLOP;
+    switch (c->op) {
+        default:
+        case UI_DRAW_TEXT:
+            return 1;
+        case UI_DRAW_RECT: {
+            int outside = x < c->x - slop || y < c->y - slop || x > c->x + c->w + slop || y > c->y + c->h + slop;
+            if (outside) return 0;
+            if (c->stroke <= 0) return 1;
+            return x <= c->x + slop || y <= c->y + slop || x >= c->x + c->w - slop || y >= c->y + c->h - slop;
+        }
+        case UI_DRAW_CIRCLE: {
+            double d2 = (x - c->x) * (x - c->x) + (y - c->y) * (y - c->y);
+            double outer = c->w + (c->stroke > 0 ? slop : 0);
+            double inner = c->stroke > 0 && c->w > slop ? c->w - slop : 0;
+            return d2 <= outer * outer && d2 >= inner * inner;
+        }
+        case UI_DRAW_PATH: {
+            const double *p = sh->points;
+            int32_t n = sh->point_count;
+            if (sh->closed && c->stroke <= 0) {
+                /* Even-odd rule */
+                int inside = 0;
+                for (int32_t i = 0, j = n - 1; i < n; j = i++) {
+                    double xi = p[2 * i], yi = p[2 * i + 1], xj = p[2 * j], yj = p[2 * j + 1];
+                    if ((yi > y) != (yj > y) && x < (xj - xi) * (y - yi) / (yj - yi) + xi) inside = !inside;
+                }
+                return inside;
+            }
+            int32_t segments = sh->closed ? n : n - 1;
+            for (int32_t i = 0; i < segments; i++) {
+                int32_t j = (i + 1) % n;
+                if (segment_dist2(x, y, p[2 * i], p[2 * i + 1], p[2 * j], p[2 * j + 1]) <= slop * slop) return 1;
+            }
+            return n == 1 && segment_dist2(x, y, p[0], p[1], p[0], p[1]) <= slop * slop;
+        }
+    }
+}
+
+static void scene_shape_bounds(UISceneShape *sh) {
+    double pad = sh->cmd.stroke / 2 + 1;
+    if (sh->cmd.op == UI_DRAW_PATH) {
+        const double *p = sh->points;
+        sh->box.x0 = sh->box.x1 = p[0];
+        sh->box.y0 = sh->box.y1 = p[1];
+        for (int32_t i = 1; i < sh->point_count; i++) {
+            if (p[2 * i] < sh->box.x0) sh->box.x0 = p[2 * i];
+            if (p[2 * i] > sh->box.x1) sh->box.x1 = p[2 * i];
+            if (p[2 * i + 1] < sh->box.y0) sh->box.y0 = p[2 * i + 1];
+            if (p[2 * i + 1] > sh->box.y1) sh->box.y1 = p[2 * i + 1];
+        }
+        sh->box.x0 -= pad;
+        sh->box.y0 -= pad;
+        sh->box.x1 += pad;
+        sh->box.y1 += pad;
+    } else {
+        draw_cmd_bounds(&sh->cmd, sh->text, &sh->box.x0, &sh->box.y0, &sh->box.x1, &sh->box.y1);
+    }
+    sh->box.x0 -= UI_SCENE_HIT_SLOP;
+    sh->box.y0 -= UI_SCENE_HIT_SLOP;
+    sh->box.x1 += UI_SCENE_HIT_SLOP;
+    sh->box.y1 += UI_SCENE_HIT_SLOP;
+}
+
+static void scene_shape_draw(uiDrawContext *ctx, const UISceneShape *sh) {
+    if (sh->cmd.op != UI_DRAW_PATH) {
+        draw_cmd_libui(ctx, &sh->cmd, sh->text);
+        return;
+    }
+    uiDrawPath *path = uiDrawNewPath(uiDrawFillModeWinding);
+    uiDrawPathNewFigure(path, sh->points[0], sh->points[1]);
+    for (int32_t i = 1; i < sh->point_count; i++) uiDrawPathLineTo(path, sh->points[2 * i], sh->points[2 * i + 1]);
+    if (sh->closed) uiDrawPathCloseFigure(path);
+    draw_path_libui(ctx, path, &sh->cmd);
+}
+
+static void scene_invalidate(UISceneGraph *g, const UIBox *b) {
+    if (NULL == g->area || (g->area->base.flags & UI_FLAG_DESTROYED)) return;
+    UIRect r;
+    r.x = b->x0;
+    r.y = b->y0;
+    r.w = b->x1 - b->x0;
+    r.h = b->y1 - b->y0;
+    area_invalidate(g->area, r);
+}
+
+static void scene_graph_draw(UISceneGraph *g, uiAreaDrawParams *p) {
+    UIBox clip;
+    clip.x0 = p->ClipX;
+    clip.y0 = p->ClipY;
+    clip.x1 = p->ClipX + p->ClipWidth;
+    clip.y1 = p->ClipY + p->ClipHeight;
+    if (!scene_query(g, &clip)) return;
+    for (int32_t i = 0; i < g->hit_count; i++) scene_shape_draw(p->Context, g->shapes + g->hits[i]);
+}
+
+/* Id of the topmost shape at a point, or nil */
+static Janet scene_graph_hit(UISceneGraph *g, double x, double y) {
+    UIBox b = {x, y, x, y};
+    if (!scene_query(g, &b)) return janet_wrap_nil();
+    for (int32_t i = g->hit_count - 1; i >= 0; i--) {
+        const UISceneShape *sh = g->shapes + g->hits[i];
+        if (scene_shape_contains(sh, x, y)) return sh->id;
+    }
+    return janet_wrap_nil();
+}
+
+static void scene_shape_free(UISceneGraph *g, UISceneShape *sh) {
+    if (NULL != sh->text) scene_account(g, -(int64_t)(strlen(sh->text) + 1));
+    if (NULL != sh->points) scene_account(g, -(int64_t)(sizeof(double) * 2 * sh->point_count));
+    free(sh->text);
+    free(sh->points);
+    sh->text = NULL;
+    sh->points = NULL;
+}
+
+static int scene_graph_gc(void *p, size_t len) {
+    (void) len;
+    UISceneGraph *g = (UISceneGraph *)p;
+    for (int32_t i = 0; i < g->slot_count; i++) scene_shape_free(g, g->shapes + i);
+    if (NULL != g->root) rnode_free_all(g, g->root);
+    free(g->shapes);
+    free(g->hits);
+    ui_mem.scene_bytes -= g->bytes;
+    return 0;
+}
+
+static int scene_graph_gcmark(void *p, size_t len) {
+    (void) len;
+    UISceneGraph *g = (UISceneGraph *)p;
+    janet_mark(janet_wrap_table(g->ids));
+    if (NULL != g->area) janet_mark(janet_wrap_abstract(g->area));
+    return 0;
+}
+
+static const JanetAbstractType scene_graph_td = {"ui/scene", scene_graph_gc, scene_graph_gcmark, NULL, NULL, NULL, NULL, NULL};
+
+static int32_t scene_find(UISceneGraph *g, Janet id) {
+    Janet slot = janet_table_get(g->ids, id);
+    return janet_checktype(slot, JANET_NUMBER) ? (int32_t) janet_unwrap_number(slot) : -1;
+}
+
+static int32_t scene_getshape(UISceneGraph *g, const Janet *argv, int32_t n) {
+    int32_t slot = scene_find(g, argv[n]);
+    if (slot < 0) janet_panicf("no shape with id %v", argv[n]);
+    return slot;
+}
+
+/* Add a shape, or replace the shape with the same id, keeping its z
+ * order. Takes ownership of the text and points of the shape, which
+ * are freed if this panics. */
+static void scene_put(UISceneGraph *g, Janet id, UISceneShape *shape) {
+    int32_t slot = scene_find(g, id);
+    int ok = scene_reserve_hits(g, g->live + 1);
+    if (ok && slot < 0 && g->free_slot < 0 && g->slot_count == g->slot_capacity) {
+        int32_t newcap = g->slot_capacity ? 2 * g->slot_capacity : 64;
+        UISceneShape *shapes = realloc(g->shapes, sizeof(UISceneShape) * newcap);
+        ok = NULL != shapes;
+        if (ok) {
+            scene_account(g, (int64_t)(newcap - g->slot_capacity) * sizeof(UISceneShape));
+            g->shapes = shapes;
+            g->slot_capacity = newcap;
+        }
+    }
+    if (!ok) {
+        free(shape->text);
+        free(shape->points);
+        janet_panic("out of memory");
+    }
+    if (NULL != shape->text) scene_account(g, (int64_t) strlen(shape->text) + 1);
+    if (NULL != shape->points) scene_account(g, (int64_t)(sizeof(double) * 2 * shape->point_count));
+    scene_shape_bounds(shape);
+    shape->id = id;
+    if (slot >= 0) {
+        UISceneShape *old = g->shapes + slot;
+        scene_invalidate(g, &old->box);
+        rtree_remove(g, slot);
+        scene_shape_free(g, old);
+        shape->z = old->z;
+        shape->seq = old->seq;
+    } else {
+        if (g->free_slot >= 0) {
+            slot = g->free_slot;
+            g->free_slot = g->shapes[slot].next_free;
+        } else {
+            slot = g->slot_count++;
+        }
+        shape->z = 0;
+        shape->seq = g->seq++;
+        janet_table_put(g->ids, id, janet_wrap_integer(slot));
+        g->live++;
+    }
+    g->shapes[slot] = *shape;
+    rtree_insert(g, slot);
+    scene_invalidate(g, &shape->box);
+}
+
+static void scene_delete(UISceneGraph *g, int32_t slot) {
+    UISceneShape *sh = g->shapes + slot;
+    if (!scene_reserve_hits(g, g->live)) janet_panic("out of memory");
+    scene_invalidate(g, &sh->box);
+    rtree_remove(g, slot);
+    janet_table_remove(g->ids, sh->id);
+    scene_shape_free(g, sh);
+    sh->id = janet_wrap_nil();
+    sh->next_free = g->free_slot;
+    g->free_slot = slot;
+    g->live--;
+}
+
+/* Coordinates and sizes must be finite, so shapes have bounds */
+static double janet_getcoord(const Janet *argv, int32_t n) {
+    double d = janet_getnumber(argv, n);
+    if (!isfinite(d)) janet_panicf("expected finite number, got %v", argv[n]);
+    return d;
+}
+
+static double janet_optcoord(const Janet *argv, int32_t argc, int32_t n, double dflt) {
+    return n < argc && !janet_checktype(argv[n], JANET_NIL) ? janet_getcoord(argv, n) : dflt;
+}
+
+/* Start a shape with the arguments shared by all shapes */
+static UISceneGraph *scene_shape_begin(const Janet *argv, UISceneShape *shape, int32_t op) {
+    UISceneGraph *g = janet_getabstract(argv, 0, &scene_graph_td);
+    if (janet_checktype(argv[1], JANET_NIL)) janet_panic("expected non-nil shape id");
+    memset(shape, 0, sizeof(UISceneShape));
+    shape->cmd.op = op;
+    return g;
+}
+
+static Janet janet_ui_scene(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 0);
+    (void) argv;
+    UISceneGraph *g = janet_abstract(&scene_graph_td, sizeof(UISceneGraph));
+    memset(g, 0, sizeof(UISceneGraph));
+    g->free_slot = -1;
+    g->ids = janet_table(0);
+    g->root = rnode_new(g, 1);
+    return janet_wrap_abstract(g);
+}
+
+static Janet janet_ui_scene_rect(int32_t argc, Janet *argv) {
+    janet_arity(argc, 7, 8);
+    UISceneShape shape;
+    UISceneGraph *g = scene_shape_begin(argv, &shape, UI_DRAW_RECT);
+    shape.cmd.x = janet_getcoord(argv, 2);
+    shape.cmd.y = janet_getcoord(argv, 3);
+    shape.cmd.w = janet_getcoord(argv, 4);
+    shape.cmd.h = janet_getcoord(argv, 5);
+    shape.cmd.color = janet_getcolor(argv, 6);
+    shape.cmd.stroke = (float) janet_optcoord(argv, argc, 7, 0);
+    scene_put(g, argv[1], &shape);
+    return argv[0];
+}
+
+static Janet janet_ui_scene_circle(int32_t argc, Janet *argv) {
+    janet_arity(argc, 6, 7);
+    UISceneShape shape;
+    UISceneGraph *g = scene_shape_begin(argv, &shape, UI_DRAW_CIRCLE);
+    shape.cmd.x = janet_getcoord(argv, 2);
+    shape.cmd.y = janet_getcoord(argv, 3);
+    shape.cmd.w = janet_getcoord(argv, 4);
+    shape.cmd.color = janet_getcolor(argv, 5);
+    shape.cmd.stroke = (float) janet_optcoord(argv, argc, 6, 0);
+    scene_put(g, argv[1], &shape);
+    return argv[0];
+}
+
+/* A path is a flat list of coordinates [x0 y0 x1 y1 ...]. It is
+ * stroked with width 1 unless a width is given, and filled when it is
+ * closed with width 0. */
+static Janet janet_ui_scene_path(int32_t argc, Janet *argv) {
+    janet_arity(argc, 4, 6);
+    UISceneShape shape;
+    UISceneGraph *g = scene_shape_begin(argv, &shape, UI_DRAW_PATH);
+    JanetView coords = janet_getindexed(argv, 2);
+    if (coords.len < 2 || coords.len % 2) janet_panicf("expected even number of coordinates, got %v", argv[2]);
+    for (int32_t i = 0; i < coords.len; i++) {
+        if (!janet_checktype(coords.items[i], JANET_NUMBER) || !isfinite(janet_unwrap_number(coords.items[i]))) {
+            janet_panicf("expected finite number, got %v", coords.items[i]);
+        }
+    }
+    shape.cmd.color = janet_getcolor(argv, 3);
+    shape.cmd.stroke = (float) janet_optcoord(argv, argc, 4, 1);
+    shape.closed = argc == 6 && janet_truthy(argv[5]);
+    if (shape.cmd.stroke < 0) janet_panic("expected non-negative line width");
+    if (shape.cmd.stroke == 0 && !shape.closed) janet_panic("only closed paths can be filled");
+    shape.points = malloc(sizeof(double) * coords.len);
+    if (NULL == shape.points) janet_panic("out of memory");
+    for (int32_t i = 0; i < coords.len; i++) shape.points[i] = janet_unwrap_number(coords.items[i]);
+    shape.point_count = coords.len / 2;
+    scene_put(g, argv[1], &shape);
+    return argv[0];
+}
+
+static Janet janet_ui_scene_text(int32_t argc, Janet *argv) {
+    janet_arity(argc, 6, 7);
+    UISceneShape shape;
+    UISceneGraph *g = scene_shape_begin(argv, &shape, UI_DRAW_TEXT);
+    shape.cmd.x = janet_getcoord(argv, 2);
+    shape.cmd.y = janet_getcoord(argv, 3);
+    const char *text = (const char *) janet_getstring(argv, 4);
+    shape.cmd.color = janet_getcolor(argv, 5);
+    shape.cmd.w = janet_optcoord(argv, argc, 6, 12);
+    shape.text = strdup(text);
+    if (NULL == shape.text) janet_panic("out of memory");
+    scene_put(g, argv[1], &shape);
+    return argv[0];
+}
+
+/* Remove a shape. Returns true if it was in the scene. */
+static Janet janet_ui_scene_remove(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    UISceneGraph *g = janet_getabstract(argv, 0, &scene_graph_td);
+    int32_t slot = scene_find(g, argv[1]);
+    if (slot < 0) return janet_wrap_false();
+    scene_delete(g, slot);
+    return janet_wrap_true();
+}
+
+static Janet janet_ui_scene_clear(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UISceneGraph *g = janet_getabstract(argv, 0, &scene_graph_td);
+    UIRNode *root = rnode_new(g, 1);
+    for (int32_t i = 0; i < g->slot_count; i++) scene_shape_free(g, g->shapes + i);
+    rnode_free_all(g, g->root);
+    g->root = root;
+    g->slot_count = 0;
+    g->free_slot = -1;
+    g->live = 0;
+    g->ids = janet_table(0);
+    if (NULL != g->area && !(g->area->base.flags & UI_FLAG_DESTROYED)) {
+        uiAreaQueueRedrawAll((uiArea *) g->area->base.control);
+    }
+    return argv[0];
+}
+
+/* Move a shape by dx, dy */
+static Janet janet_ui_scene_move(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 4);
+    UISceneGraph *g = janet_getabstract(argv, 0, &scene_graph_td);
+    int32_t slot = scene_getshape(g, argv, 1);
+    double dx = janet_getcoord(argv, 2);
+    double dy = janet_getcoord(argv, 3);
+    if (!scene_reserve_hits(g, g->live)) janet_panic("out of memory");
+    UISceneShape *sh = g->shapes + slot;
+    scene_invalidate(g, &sh->box);
+    rtree_remove(g, slot);
+    sh->cmd.x += dx;
+    sh->cmd.y += dy;
+    for (int32_t i = 0; i < sh->point_count; i++) {
+        sh->points[2 * i] += dx;
+        sh->points[2 * i + 1] += dy;
+    }
+    scene_shape_bounds(sh);
+    rtree_insert(g, slot);
+    scene_invalidate(g, &sh->box);
+    return argv[0];
+}
+
+/* Get or set the z order of a shape. Higher shapes are drawn later and
+ * hit first. Setting it also raises the shape above the others with the
+ * same z. */
+static Janet janet_ui_scene_z(int32_t argc, Janet *argv) {
+    janet_arity(argc, 2, 3);
+    UISceneGraph *g = janet_getabstract(argv, 0, &scene_graph_td);
+    UISceneShape *sh = g->shapes + scene_getshape(g, argv, 1);
+    if (argc == 2) return janet_wrap_number(sh->z);
+    sh->z = janet_getcoord(argv, 2);
+    sh->seq = g->seq++;
+    scene_invalidate(g, &sh->box);
+    return argv[0];
+}
+
+static Janet janet_ui_scene_count(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UISceneGraph *g = janet_getabstract(argv, 0, &scene_graph_td);
+    return janet_wrap_integer(g->live);
+}
+
+/* Id of the topmost shape at a point, or nil */
+static Janet janet_ui_scene_hit(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 3);
+    UISceneGraph *g = janet_getabstract(argv, 0, &scene_graph_td);
+    return scene_graph_hit(g, janet_getcoord(argv, 1), janet_getcoord(argv, 2));
+}
+
+/* Ids of the shapes whose bounds overlap a rectangle, bottom to top */
+static Janet janet_ui_scene_query(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 5);
+    UISceneGraph *g = janet_getabstract(argv, 0, &scene_graph_td);
+    UIBox b;
+    b.x0 = janet_getcoord(argv, 1);
+    b.y0 = janet_getcoord(argv, 2);
+    b.x1 = b.x0 + janet_getcoord(argv, 3);
+    b.y1 = b.y0 + janet_getcoord(argv, 4);
+    if (!scene_query(g, &b)) janet_panic("out of memory");
+    JanetArray *ids = janet_array(g->hit_count);
+    for (int32_t i = 0; i < g->hit_count; i++) janet_array_push(ids, g->shapes[g->hits[i]].id);
+    return janet_wrap_array(ids);
+}
+
+/* Bounds of a shape as [x y w h], including the hit slop */
+static Janet janet_ui_scene_bounds(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    UISceneGraph *g = janet_getabstract(argv, 0, &scene_graph_td);
+    int32_t slot = scene_find(g, argv[1]);
+    if (slot < 0) return janet_wrap_nil();
+    const UIBox *b = &g->shapes[slot].box;
+    Janet *tup = janet_tuple_begin(4);
+    tup[0] = janet_wrap_number(b->x0);
+    tup[1] = janet_wrap_number(b->y0);
+    tup[2] = janet_wrap_number(b->x1 - b->x0);
+    tup[3] = janet_wrap_number(b->y1 - b->y0);
+    return janet_wrap_tuple(janet_tuple_end(tup));
+}
+
+/* Show a scene in an area, or stop showing one with nil. A scene is
+ * shown by at most one area. */
+static Janet janet_ui_area_attach_scene(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    uiArea *area = janet_getuitype(argv, 0, &area_td);
+    UIArea *a = janet_unwrap_abstract(argv[0]);
+    UISceneGraph *g = janet_checktype(argv[1], JANET_NIL) ? NULL : janet_getabstract(argv, 1, &scene_graph_td);
+    if (NULL != a->scene) a->scene->area = NULL;
+    if (NULL != g && NULL != g->area && g->area != a) {
+        UIArea *old = g->area;
+        old->scene = NULL;
+        if (!(old->base.flags & UI_FLAG_DESTROYED)) uiAreaQueueRedrawAll((uiArea *) old->base.control);
+    }
+    a->scene = g;
+    if (NULL != g) g->area = a;
+    uiAreaQueueRedrawAll(area);
+    return argv[0];
+}
+
+/* Virtual List */
+
+/* A list drawn on a uiArea that only renders visible rows, so it
+ * scales to millions of rows. The render callback is called with a
+ * row index and returns a string, a draw list drawn at the row origin,
+ * or [content height] when the row height is only an estimate. Rows
+ * are kept in a direct mapped cache with room for twice the rows on
+ * the page, so Janet is only queried for rows entering the viewport.
+ * The callback runs when the list changes or scrolls, never inside the
+ * Draw callback, which only draws cached rows.
+ * Scrolling is anchored on the top row and an offset into it, which
+ * keeps scrolling smooth without knowing the height of every row. */
+
+#define UI_VLIST_SCROLLBAR 10
+#define UI_VLIST_MIN_THUMB 20
+#define UI_VLIST_PADDING 4
+/* Longest native row drawn, in bytes */
+#define UI_VLIST_LINE_MAX 1024
+/* Most rows cached, which bounds the rows drawn on a page */
+#define UI_VLIST_MAX_ROWS (1 << 16)
+
+typedef struct {
+    /* Row index, or -1 if the entry is empty */
+    int64_t index;
+    double height;
+    Janet content;
+} UIVirtualRow;
+
+typedef struct UIVirtualList UIVirtualList;
+struct UIVirtualList {
+    /* Must be first, so area callbacks find the list */
+    UIArea area;
+    Janet render;
+    /* Rows drawn from native data, instead of calling render. Draws
+     * the content of a row with its top at y. */
+    void (*native_row)(UIVirtualList *vl, uiDrawContext *ctx, int64_t index, double y);
+    /* Called before native rows are drawn with the rows on the page,
+     * which all have the row height, or NULL */
+    void (*native_page)(UIVirtualList *vl, int64_t first, int64_t count);
+    int64_t count;
+    double row_height;
+    int estimated;
+    int64_t top;
+    double top_offset;
+    int64_t selected;
+    UIVirtualRow *rows;
+    int32_t row_capacity;
+    double width;
+    double height;
+    int dragging;
+    /* Set while the render callback fills the page */
+    int filling;
+    /* Set while a fill for the Draw callback is queued, and after it
+     * ran until the next draw, so missing rows refill only once */
+    int fill_queued;
+    int refilled;
+    uint64_t queries;
+    uint64_t hits;
+};
+
+static int virtual_list_gcmark(void *p, size_t len) {
+    UIVirtualList *vl = (UIVirtualList *)p;
+    janet_mark(vl->render);
+    for (int32_t i = 0; i < vl->row_capacity; i++) {
+        if (vl->rows[i].index >= 0) janet_mark(vl->rows[i].content);
+    }
+    return area_gcmark(p, len);
+}
+
+static void virtual_list_release(UIControlWrapper *w) {
+    UIVirtualList *vl = (UIVirtualList *)w;
+    free(vl->rows);
+    vl->rows = NULL;
+    vl->row_capacity = 0;
+}
+
+static void virtual_list_clear(UIVirtualList *vl) {
+    for (int32_t i = 0; i < vl->row_capacity; i++) vl->rows[i].index = -1;
+}
+
+/* Grow the cache to hold at least n rows without collisions */
+static void virtual_list_reserve(UIVirtualList *vl, int32_t n) {
+    if (n <= vl->row_capacity) return;
+    int32_t cap = vl->row_capacity ? vl->row_capacity : 64;
+    while (cap < n) cap *= 2;
+    UIVirtualRow *rows = malloc(sizeof(UIVirtualRow) * cap);
+    if (NULL == rows) return;
+    for (int32_t i = 0; i < cap; i++) rows[i].index = -1;
+    for (int32_t i = 0; i < vl->row_capacity; i++) {
+        UIVirtualRow *old = vl->rows + i;
+        if (old->index >= 0) rows[old->index % cap] = *old;
+    }
+    free(vl->rows);
+    vl->rows = rows;
+    vl->row_capacity = cap;
+}
+
+static UIVirtualRow *virtual_list_cached(UIVirtualList *vl, int64_t index) {
+    if (0 == vl->row_capacity) return NULL;
+    UIVirtualRow *row = vl->rows + index % vl->row_capacity;
+    return row->index == index ? row : NULL;
+}
+
+/* Height of a row, from the cache or the estimate */
+static double virtual_list_row_height(UIVirtualList *vl, int64_t index) {
+    if (!vl->estimated) return vl->row_height;
+    UIVirtualRow *row = virtual_list_cached(vl, index);
+    return NULL != row ? row->height : vl->row_height;
+}
+
+/* Get a row, calling the render callback if it is not cached */
+static UIVirtualRow *virtual_list_row(UIVirtualList *vl, int64_t index) {
+    UIVirtualRow *row = virtual_list_cached(vl, index);
+    if (NULL != row) {
+        vl->hits++;
+        return row;
+    }
+    if (0 == vl->row_capacity) return NULL;
+    Janet arg = janet_wrap_number((double) index);
+    Janet content;
+    vl->queries++;
+    janet_ui_call(vl->render, 1, &arg, &content);
+    /* The callback may have destroyed the list */
+    if (0 == vl->row_capacity) return NULL;
+    row = vl->rows + index % vl->row_capacity;
+    row->index = index;
+    row->height = vl->row_height;
+    row->content = content;
+    const Janet *items;
+    int32_t len;
+    if (vl->estimated && janet_checktype(content, JANET_TUPLE) &&
+            janet_indexed_view(content, &items, &len) && len == 2 &&
+            janet_checktype(items[1], JANET_NUMBER) && janet_unwrap_number(items[1]) > 0) {
+        row->content = items[0];
+        row->height = janet_unwrap_number(items[1]);
+    }
+    return row;
+}
+
+/* Render the rows on the page that are not cached, growing the cache
+ * to twice the rows the page really holds, which with estimated
+ * heights can be more than the estimate suggests */
+static void virtual_list_fill(UIVirtualList *vl) {
+    if (NULL != vl->native_row || vl->filling || (vl->area.base.flags & UI_FLAG_DESTROYED)) return;
+    vl->filling = 1;
+    double y = -vl->top_offset;
+    for (int64_t r = vl->top; r < vl->count && y < vl->height; r++) {
+        int64_t n = 2 * (r - vl->top + 1);
+        if (n > vl->row_capacity) {
+            if (n > UI_VLIST_MAX_ROWS) break;
+            virtual_list_reserve(vl, (int32_t) n);
+            if (n > vl->row_capacity) break;
+        }
+        UIVirtualRow *row = virtual_list_cached(vl, r);
+        if (NULL == row) row = virtual_list_row(vl, r);
+        if (NULL == row) break;
+        y += row->height;
+    }
+    vl->filling = 0;
+}
+
+/* Move the anchor by dy pixels, clamped to the first and last rows */
+static void virtual_list_scroll(UIVirtualList *vl, double dy) {
+    if (vl->count <= 0) {
+        vl->top = 0;
+        vl->top_offset = 0;
+        return;
+    }
+    vl->top_offset += dy;
+    while (vl->top_offset < 0 && vl->top > 0) {
+        vl->top--;
+        vl->top_offset += virtual_list_row_height(vl, vl->top);
+    }
+    if (vl->top_offset < 0) vl->top_offset = 0;
+    while (vl->top < vl->count - 1 && vl->top_offset >= virtual_list_row_height(vl, vl->top)) {
+        vl->top_offset -= virtual_list_row_height(vl, vl->top);
+        vl->top++;
+    }
+    /* Keep the last page full */
+    double below = -vl->top_offset;
+    int64_t last = vl->top;
+    while (last < vl->count && below < vl->height) below += virtual_list_row_height(vl, last++);
+    if (below < vl->height && (vl->top > 0 || vl->top_offset > 0)) {
+        double missing = vl->height - below;
+        if (missing > 0) {
+            vl->top_offset -= missing;
+            while (vl->top_offset < 0 && vl->top > 0) {
+                vl->top--;
+                vl->top_offset += virtual_list_row_height(vl, vl->top);
+            }
+            if (vl->top_offset < 0) vl->top_offset = 0;
+        }
+    }
+}
+
+/* Scroll so a row is fully visible */
+static void virtual_list_reveal(UIVirtualList *vl, int64_t index) {
+    if (index < vl->top || (index == vl->top && vl->top_offset > 0)) {
+        vl->top = index;
+        vl->top_offset = 0;
+        return;
+    }
+    double y = -vl->top_offset;
+    for (int64_t r = vl->top; r < index && y < vl->height; r++) y += virtual_list_row_height(vl, r);
+    double bottom = y + virtual_list_row_height(vl, index);
+    if (y >= vl->height) {
+        /* Far below, put the row at the bottom */
+        vl->top = index;
+        vl->top_offset = 0;
+        virtual_list_scroll(vl, -(vl->height - virtual_list_row_height(vl, index)));
+    } else if (bottom > vl->height) {
+        virtual_list_scroll(vl, bottom - vl->height);
+    }
+}
+
+static int virtual_list_fill_idle(void *data) {
+    UIVirtualList *vl = (UIVirtualList *)data;
+    vl->fill_queued = 0;
+    if (!(vl->area.base.flags & UI_FLAG_DESTROYED)) {
+        virtual_list_fill(vl);
+        vl->refilled = 1;
+        uiAreaQueueRedrawAll((uiArea *) vl->area.base.control);
+    }
+    janet_gcunroot(janet_wrap_abstract(vl));
+    return 0;
+}
+
+static void virtual_list_draw_handler(uiAreaHandler *ah, uiArea *area, uiAreaDrawParams *p) {
+    (void) area;
+    UIVirtualList *vl = (UIVirtualList *) area_from_handler(ah);
+    uiDrawContext *ctx = p->Context;
+    vl->width = p->AreaWidth;
+    vl->height = p->AreaHeight;
+    double row_width = vl->width - UI_VLIST_SCROLLBAR;
+    int64_t visible = 0;
+    int missing = 0;
+    double y = -vl->top_offset;
+    if (NULL != vl->native_page) {
+        vl->native_page(vl, vl->top, (int64_t)((p->AreaHeight + vl->top_offset) / vl->row_height) + 1);
+    }
+    for (int64_t r = vl->top; r < vl->count && y < p->AreaHeight; r++, visible++) {
+        UIVirtualRow *row = NULL;
+        if (NULL == vl->native_row) {
+            row = virtual_list_cached(vl, r);
+            if (NULL == row) missing = 1;
+            else vl->hits++;
+        }
+        double h = NULL != row ? row->height : vl->row_height;
+        if (y + h > p->ClipY && y < p->ClipY + p->ClipHeight) {
+            uiDrawSave(ctx);
+            uiDrawPath *clip = uiDrawNewPath(uiDrawFillModeWinding);
+            uiDrawPathAddRectangle(clip, 0, y, row_width, h);
+            uiDrawPathEnd(clip);
+            uiDrawClip(ctx, clip);
+            uiDrawFreePath(clip);
+            if (r == vl->selected) {
+                UIDrawCmd sel;
+                memset(&sel, 0, sizeof(sel));
+                sel.op = UI_DRAW_RECT;
+                sel.y = y;
+                sel.w = row_width;
+                sel.h = h;
+                sel.color.r = 0.2f;
+                sel.color.g = 0.4f;
+                sel.color.b = 0.9f;
+                sel.color.a = 0.3f;
+                draw_cmd_libui(ctx, &sel, NULL);
+            }
+            if (NULL != vl->native_row) {
+                vl->native_row(vl, ctx, r, y);
+            } else if (NULL == row) {
+                /* Rendered by the queued fill */
+            } else if (janet_checktype(row->content, JANET_STRING)) {
+                UIDrawCmd text;
+                memset(&text, 0, sizeof(text));
+                text.op = UI_DRAW_TEXT;
+                text.x = UI_VLIST_PADDING;
+                text.y = y + UI_VLIST_PADDING / 2;
+                text.w = 10;
+                text.color.a = 1.0f;
+                draw_cmd_libui(ctx, &text, (const char *) janet_unwrap_string(row->content));
+            } else if (janet_checktype(row->content, JANET_ABSTRACT) &&
+                    janet_abstract_type(janet_unwrap_abstract(row->content)) == &draw_list_td) {
+                UIDrawList *dl = janet_unwrap_abstract(row->content);
+                uiDrawMatrix m;
+                uiDrawMatrixSetIdentity(&m);
+                uiDrawMatrixTranslate(&m, 0, y);
+                uiDrawTransform(ctx, &m);
+                for (int32_t i = 0; i < dl->count; i++) {
+                    draw_cmd_libui(ctx, dl->cmds + i, draw_cmd_text(dl->cmds + i, dl->text));
+                }
+            }
+            uiDrawRestore(ctx);
+        }
+        y += h;
+    }
+    /* Rows scrolled in by a resize are rendered after the draw */
+    if (missing && !vl->refilled && !vl->fill_queued) {
+        vl->fill_queued = 1;
+        janet_gcroot(janet_wrap_abstract(vl));
+        ui_idle_add(UI_IDLE_REDRAW, virtual_list_fill_idle, vl);
+    }
+    vl->refilled = 0;
+    /* Scroll bar, with the thumb placed by the top row */
+    if (vl->count > 0) {
+        double thumb = vl->height * visible / (double) vl->count;
+        if (thumb < UI_VLIST_MIN_THUMB) thumb = UI_VLIST_MIN_THUMB;
+        if (thumb > vl->height) thumb = vl->height;
+        double pos = (vl->height - thumb) * (vl->top / (double) (vl->count > 1 ? vl->count - 1 : 1));
+        UIDrawCmd bar;
+        memset(&bar, 0, sizeof(bar));
+        bar.op = UI_DRAW_RECT;
+        bar.x = row_width;
+        bar.w = UI_VLIST_SCROLLBAR;
+        bar.h = vl->height;
+        bar.color.r = bar.color.g = bar.color.b = 0.5f;
+        bar.color.a = 0.15f;
+        draw_cmd_libui(ctx, &bar, NULL);
+        bar.x = row_width + 2;
+        bar.y = pos;
+        bar.w = UI_VLIST_SCROLLBAR - 4;
+        bar.h = thumb;
+        bar.color.a = 0.5f;
+        draw_cmd_libui(ctx, &bar, NULL);
+    }
+}
+
+static void virtual_list_redraw(UIVirtualList *vl) {
+    virtual_list_fill(vl);
+    uiAreaQueueRedrawAll((uiArea *) vl->area.base.control);
+}
+
+static void virtual_list_select(UIVirtualList *vl, int64_t index) {
+    if (vl->count <= 0) return;
+    if (index < 0) index = 0;
+    if (index >= vl->count) index = vl->count - 1;
+    virtual_list_reveal(vl, index);
+    virtual_list_redraw(vl);
+    if (index == vl->selected) return;
+    vl->selected = index;
+    void *data = vl->area.base.handlers[0];
+    if (NULL != data) janet_ui_handler_value(data, janet_wrap_number((double) index));
+}
+
+/* Row under a point, or -1 */
+static int64_t virtual_list_hit(UIVirtualList *vl, double py) {
+    double y = -vl->top_offset;
+    for (int64_t r = vl->top; r < vl->count && y < vl->height; r++) {
+        double h = virtual_list_row_height(vl, r);
+        if (py >= y && py < y + h) return r;
+        y += h;
+    }
+    return -1;
+}
+
+static void virtual_list_drag_to(UIVirtualList *vl, double py) {
+    double f = vl->height > 0 ? py / vl->height : 0;
+    if (f < 0) f = 0;
+    if (f > 1) f = 1;
+    vl->top = (int64_t)(f * (vl->count - 1));
+    vl->top_offset = 0;
+    virtual_list_scroll(vl, 0);
+    virtual_list_redraw(vl);
+}
+
+static void virtual_list_mouse_event_handler(uiAreaHandler *ah, uiArea *area, uiAreaMouseEvent *e) {
+    (void) area;
+    UIVirtualList *vl = (UIVirtualList *) area_from_handler(ah);
+    if (e->Up) vl->dragging = 0;
+    if (e->Down == 1) {
+        if (e->X >= vl->width - UI_VLIST_SCROLLBAR) {
+            vl->dragging = 1;
+            virtual_list_drag_to(vl, e->Y);
+        } else {
+            int64_t r = virtual_list_hit(vl, e->Y);
+            if (r >= 0) virtual_list_select(vl, r);
+        }
+    } else if (vl->dragging && (e->Held1To64 & 1)) {
+        virtual_list_drag_to(vl, e->Y);
+    }
+}
+
+static void virtual_list_mouse_crossed_handler(uiAreaHandler *ah, uiArea *area, int left) {
+    (void) ah;
+    (void) area;
+    (void) left;
+}
+
+static void virtual_list_drag_broken_handler(uiAreaHandler *ah, uiArea *area) {
+    (void) area;
+    ((UIVirtualList *) area_from_handler(ah))->dragging = 0;
+}
+
+static int virtual_list_key_event_handler(uiAreaHandler *ah, uiArea *area, uiAreaKeyEvent *e) {
+    (void) area;
+    UIVirtualList *vl = (UIVirtualList *) area_from_handler(ah);
+    if (e->Up) return 0;
+    int64_t page = (int64_t)(vl->height / (vl->row_height > 1 ? vl->row_height : 1));
+    if (page < 1) page = 1;
+    int64_t cur = vl->selected < 0 ? vl->top : vl->selected;
+    switch (e->ExtKey) {
+        case uiExtKeyUp: virtual_list_select(vl, cur - 1); return 1;
+        case uiExtKeyDown: virtual_list_select(vl, vl->selected < 0 ? cur : cur + 1); return 1;
+        case uiExtKeyPageUp: virtual_list_select(vl, cur - page); return 1;
+        case uiExtKeyPageDown: virtual_list_select(vl, cur + page); return 1;
+        case uiExtKeyHome: virtual_list_select(vl, 0); return 1;
+        case uiExtKeyEnd: virtual_list_select(vl, vl->count - 1); return 1;
+        default: return 0;
+    }
+}
+
+#ifdef UI_GTK
+/* libui areas do not report the mouse wheel, so take scroll events
+ * from the GTK widget directly. Elsewhere lists scroll with the
+ * keyboard and the selection. */
+static gboolean virtual_list_scroll_event(GtkWidget *widget, GdkEventScroll *e, gpointer data) {
+    (void) widget;
+    UIVirtualList *vl = (UIVirtualList *)data;
+    double step = 3 * vl->row_height;
+    double dy = 0;
+    switch (e->direction) {
+        case GDK_SCROLL_UP: dy = -step; break;
+        case GDK_SCROLL_DOWN: dy = step; break;
+        case GDK_SCROLL_SMOOTH: dy = e->delta_y * step; break;
+        default: return FALSE;
+    }
+    virtual_list_scroll(vl, dy);
+    virtual_list_redraw(vl);
+    return TRUE;
+}
+#endif
+
+/* Create the area of a list allocated with janet_abstract */
+static void virtual_list_init(UIVirtualList *vl, double row_height) {
+    vl->area.handler.Draw = virtual_list_draw_handler;
+    vl->area.handler.MouseEvent = virtual_list_mouse_event_handler;
+    vl->area.handler.MouseCrossed = virtual_list_mouse_crossed_handler;
+    vl->area.handler.DragBroken = virtual_list_drag_broken_handler;
+    vl->area.handler.KeyEvent = virtual_list_key_event_handler;
+    vl->area.draw_context = janet_wrap_nil();
+    vl->render = janet_wrap_nil();
+    vl->row_height = row_height;
+    vl->selected = -1;
+    uiArea *area = uiNewArea(&vl->area.handler);
+    vl->area.base.control = uiControl(area);
+    wrapper_cache_put(&vl->area.base);
+    vl->area.base.release = virtual_list_release;
+#ifdef UI_GTK
+    gtk_widget_add_events(GTK_WIDGET(uiControlHandle(uiControl(area))), GDK_SCROLL_MASK | GDK_SMOOTH_SCROLL_MASK);
+    janet_ui_connect(&vl->area.base, "scroll-event", G_CALLBACK(virtual_list_scroll_event));
+#endif
+}
+
+static Janet janet_ui_virtual_list(int32_t argc, Janet *argv) {
+    janet_arity(argc, 3, 4);
+    assert_inited();
+    int64_t count = janet_getinteger64(argv, 0);
+    double row_height = janet_getnumber(argv, 1);
+    assert_callable(argv, 2);
+    if (count < 0 || !(row_height > 0) || isinf(row_height)) {
+        janet_panic("expected non-negative count and finite positive row height");
+    }
+    UIVirtualList *vl = janet_abstract(&virtual_list_td, sizeof(UIVirtualList));
+    memset(vl, 0, sizeof(UIVirtualList));
+    virtual_list_init(vl, row_height);
+    vl->render = argv[2];
+    vl->count = count;
+    vl->estimated = argc == 4 && janet_truthy(argv[3]);
+    ui_mem.controls[control_type_index(&virtual_list_td)]++;
+    UI_PROBE2(control__create, virtual_list_td.name, vl->area.base.control);
+    return janet_wrap_abstract(vl);
+}
+
+/* Get a virtual list, a file view, which is a virtual list over the
+ * lines of a file, a text view or a tree view */
+static UIVirtualList *janet_getvirtuallist(const Janet *argv, int32_t n) {
+    const JanetAbstractType *at = janet_checktype(argv[n], JANET_ABSTRACT) ?
+                                  janet_abstract_type(janet_unwrap_abstract(argv[n])) : NULL;
+    if (at == &file_view_td || at == &text_view_td || at == &tree_view_td) {
+        janet_getuitype(argv, n, at);
+    } else {
+        janet_getuitype(argv, n, &virtual_list_td);
+    }
+    return janet_unwrap_abstract(argv[n]);
+}
+
+/* Get or set the row count. Cached rows past the end are dropped. */
+static Janet janet_ui_virtual_list_count(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    UIVirtualList *vl = janet_getvirtuallist(argv, 0);
+    if (argc == 1) return janet_wrap_number((double) vl->count);
+    if (NULL != vl->native_row) janet_panicf("cannot set the row count of a %s", janet_abstract_type(vl)->name);
+    int64_t count = janet_getinteger64(argv, 1);
+    if (count < 0) janet_panic("expected non-negative count");
+    vl->count = count;
+    for (int32_t i = 0; i < vl->row_capacity; i++) {
+        if (vl->rows[i].index >= vl->count) vl->rows[i].index = -1;
+    }
+    if (vl->selected >= vl->count) vl->selected = -1;
+    if (vl->top >= vl->count) {
+        vl->top = vl->count > 0 ? vl->count - 1 : 0;
+        vl->top_offset = 0;
+    }
+    virtual_list_scroll(vl, 0);
+    virtual_list_redraw(vl);
+    return argv[0];
+}
+
+/* Drop one or all cached rows, so they are rendered again */
+static Janet janet_ui_virtual_list_invalidate(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    UIVirtualList *vl = janet_getvirtuallist(argv, 0);
+    if (argc == 2) {
+        UIVirtualRow *row = virtual_list_cached(vl, janet_getinteger64(argv, 1));
+        if (NULL != row) row->index = -1;
+    } else {
+        virtual_list_clear(vl);
+    }
+    virtual_list_redraw(vl);
+    return argv[0];
+}
+
+static Janet janet_ui_virtual_list_scroll_to(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    UIVirtualList *vl = janet_getvirtuallist(argv, 0);
+    int64_t index = janet_getinteger64(argv, 1);
+    if (vl->count > 0) {
+        if (index < 0) index = 0;
+        if (index >= vl->count) index = vl->count - 1;
+        vl->top = index;
+        vl->top_offset = 0;
+        virtual_list_scroll(vl, 0);
+    }
+    virtual_list_redraw(vl);
+    return argv[0];
+}
+
+static Janet janet_ui_virtual_list_selected(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    UIVirtualList *vl = janet_getvirtuallist(argv, 0);
+    if (argc == 2) {
+        if (janet_checktype(argv[1], JANET_NIL)) {
+            vl->selected = -1;
+            virtual_list_redraw(vl);
+        } else {
+            int64_t index = janet_getinteger64(argv, 1);
+            if (index < 0 || index >= vl->count) janet_panicf("row %v out of range", argv[1]);
+            vl->selected = index;
+            virtual_list_reveal(vl, index);
+            virtual_list_redraw(vl);
+        }
+        return argv[0];
+    }
+    return vl->selected < 0 ? janet_wrap_nil() : janet_wrap_number((double) vl->selected);
+}
+
+static Janet janet_ui_virtual_list_on_selected(int32_t argc, Janet *argv) {
+    janet_arity(argc, 2, 3);
+    janet_getvirtuallist(argv, 0);
+    janet_ui_to_control_handler_data(argc, argv, 0);
+    return argv[0];
+}
+
+static Janet janet_ui_virtual_list_stats(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UIVirtualList *vl = janet_getvirtuallist(argv, 0);
+    int32_t cached = 0;
+    for (int32_t i = 0; i < vl->row_capacity; i++) {
+        if (vl->rows[i].index >= 0) cached++;
+    }
+    JanetKV *st = janet_struct_begin(5);
+    janet_struct_put(st, janet_ckeywordv("queries"), janet_wrap_number((double) vl->queries));
+    janet_struct_put(st, janet_ckeywordv("hits"), janet_wrap_number((double) vl->hits));
+    janet_struct_put(st, janet_ckeywordv("cached"), janet_wrap_integer(cached));
+    janet_struct_put(st, janet_ckeywordv("top"), janet_wrap_number((double) vl->top));
+    janet_struct_put(st, janet_ckeywordv("top-offset"), janet_wrap_number(vl->top_offset));
+    return janet_wrap_struct(janet_struct_end(st));
+}
+
+/* File View */
+
+/* A virtual list over the lines of a file, for logs too large to load.
+ * A worker reads the file in chunks and builds an index of line
+ * starts, so the view can show the first lines while the rest is
+ * still being scanned. Only visible lines are ever read again. When
+ * following, a timer checks the file size and the index is extended
+ * with the appended bytes, like tail -f. Reads are positioned reads,
+ * never a mapping, so a file truncated in place only yields short
+ * lines until the scan notices and indexes it again from the start. */
+
+/* Bytes scanned by each job, so tile jobs can interleave */
+#define UI_FILE_SCAN_CHUNK (8 << 20)
+/* Most bytes of the visible lines read at once for a Draw */
+#define UI_FILE_PAGE_MAX (1 << 20)
+/* Milliseconds before retrying a scan no worker could take */
+#define UI_FILE_RETRY_MS 100
+#define UI_FILE_ROW_HEIGHT 16
+#define UI_FILE_TAB_WIDTH 8
+
+typedef struct UIFileView UIFileView;
+
+/* The line index, shared by the view, the scan job, a queued update
+ * and the follow timer. Everything but the view pointer and the job
+ * is protected by the lock. */
+typedef struct {
+    pthread_mutex_t lock;
+    int refcount;
+    int fd;
+    /* Buffer of the scan job while it runs, which is once at a time */
+    char *chunk;
+    /* Offsets of line starts. The first is always 0. */
+    uint64_t *offsets;
+    int64_t offset_count;
+    int64_t offset_capacity;
+    /* Bytes indexed so far */
+    uint64_t scanned;
+    uint64_t size;
+    /* Bumped when the file was truncated and the index restarted */
+    uint64_t generation;
+    int scanning;
+    int update_queued;
+    int retry_queued;
+    /* The view, or NULL once it is destroyed */
+    UIFileView *view;
+    UIJob job;
+} UIFileIndex;
+
+struct UIFileView {
+    /* Must be first, so virtual list code finds the list */
+    UIVirtualList list;
+    UIFileIndex *index;
+    int follow;
+    /* Index generation and bytes last seen by the UI thread */
+    uint64_t generation;
+    int64_t accounted;
+    /* The visible lines, read in one go at the start of each Draw */
+    char *page;
+    uint64_t page_capacity;
+    uint64_t page_offset;
+    uint64_t page_len;
+};
+
+static void file_index_unlock_release(UIFileIndex *fi) {
+    int last = --fi->refcount == 0;
+    pthread_mutex_unlock(&fi->lock);
+    if (!last) return;
+    free(fi->chunk);
+    close(fi->fd);
+    free(fi->offsets);
+    pthread_mutex_destroy(&fi->lock);
+    free(fi);
+}
+
+/* Append a line start. Returns 0 if out of memory. Must be called
+ * with the lock held. */
+static int file_index_push(UIFileIndex *fi, uint64_t offset) {
+    if (fi->offset_count == fi->offset_capacity) {
+        int64_t newcap = 2 * fi->offset_capacity;
+        uint64_t *offsets = realloc(fi->offsets, sizeof(uint64_t) * newcap);
+        if (NULL == offsets) return 0;
+        fi->offsets = offsets;
+        fi->offset_capacity = newcap;
+    }
+    fi->offsets[fi->offset_count++] = offset;
+    return 1;
+}
+
+/* Read up to n bytes at an offset without moving the file position,
+ * so the scan job and the UI thread can share the descriptor. Returns
+ * the bytes read, short or 0 past the end of the file, or -1. */
+static int64_t file_read_at(int fd, void *buf, uint64_t n, uint64_t offset) {
+#ifdef _WIN32
+    OVERLAPPED ov;
+    DWORD got = 0;
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD) offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    if (!ReadFile((HANDLE) _get_osfhandle(fd), buf, (DWORD) n, &got, &ov)) {
+        return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+    }
+    return got;
+#else
+    ssize_t got;
+    do got = pread(fd, buf, (size_t) n, (off_t) offset); while (got < 0 && errno == EINTR);
+    return got;
+#endif
+}
+
+/* Line starts found by a scan, collected without holding the lock */
+typedef struct {
+    uint64_t *data;
+    int64_t count;
+    int64_t capacity;
+} UILineStarts;
+
+static int line_starts_push(UILineStarts *ls, uint64_t offset) {
+    if (ls->count == ls->capacity) {
+        int64_t newcap = ls->capacity ? 2 * ls->capacity : 4096;
+        uint64_t *data = realloc(ls->data, sizeof(uint64_t) * newcap);
+        if (NULL == data) return 0;
+        ls->data = data;
+        ls->capacity = newcap;
+    }
+    ls->data[ls->count++] = offset;
+    return 1;
+}
+
+/* Find the line starts in p[start, end). SSE2 compares 16 bytes at a
+ * time; other targets use memchr, which libc vectorizes. */
+static int scan_newlines(const char *p, uint64_t start, uint64_t end, UILineStarts *ls) {
+    uint64_t i = start;
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= end; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        while (mask) {
+            if (!line_starts_push(ls, i + (unsigned) __builtin_ctz(mask) + 1)) return 0;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    while (i < end) {
+        const char *hit = memchr(p + i, '\n', end - i);
+        if (NULL == hit) break;
+        i = (uint64_t)(hit - p) + 1;
+        if (!line_starts_push(ls, i)) return 0;
+    }
+    return 1;
+}
+
+/* Lines indexed so far, counting a final line without a newline. Must
+ * be called with the lock held. */
+static int64_t file_index_lines(UIFileIndex *fi) {
+    int64_t n = fi->offset_count - 1;
+    if (fi->scanned > fi->offsets[fi->offset_count - 1]) n++;
+    return n;
+}
+
+/* Byte range of a line, without its newline. Must be called with the
+ * lock held. */
+static int file_index_line(UIFileIndex *fi, int64_t index, uint64_t *start, uint64_t *end) {
+    if (index < 0 || index >= file_index_lines(fi)) return 0;
+    *start = fi->offsets[index];
+    *end = index + 1 < fi->offset_count ? fi->offsets[index + 1] - 1 : fi->scanned;
+    return 1;
+}
+
+/* Read the first n bytes of a line, or fewer if the file shrank, and
+ * drop a carriage return ending the line. Returns the length read. */
+static int64_t file_index_read(UIFileIndex *fi, uint64_t start, uint64_t end, char *buf, uint64_t n) {
+    if (n > end - start) n = end - start;
+    int64_t got = file_read_at(fi->fd, buf, n, start);
+    if (got < 0) return 0;
+    if ((uint64_t) got == end - start && got > 0 && buf[got - 1] == '\r') got--;
+    return got;
+}
+
+static void file_view_update(void *data);
+
+static void file_scan_run(UIJob *job) {
+    UIFileIndex *fi = (UIFileIndex *)((char *) job - offsetof(UIFileIndex, job));
+    for (;;) {
+        pthread_mutex_lock(&fi->lock);
+        struct stat st;
+        uint64_t size = fstat(fi->fd, &st) ? fi->scanned : (uint64_t) st.st_size;
+        if (size < fi->scanned) {
+            fi->offset_count = 1;
+            fi->scanned = 0;
+            fi->generation++;
+        }
+        fi->size = size;
+        if (NULL == fi->chunk) fi->chunk = malloc(UI_FILE_SCAN_CHUNK);
+        if (NULL == fi->view || NULL == fi->chunk || fi->scanned >= size) break;
+        uint64_t start = fi->scanned;
+        uint64_t want = size - start > UI_FILE_SCAN_CHUNK ? UI_FILE_SCAN_CHUNK : size - start;
+        pthread_mutex_unlock(&fi->lock);
+        /* A read cut short by truncation indexes what it got, and the
+         * next round sees the smaller size */
+        int64_t got = file_read_at(fi->fd, fi->chunk, want, start);
+        UILineStarts found = {NULL, 0, 0};
+        int ok = got > 0 && scan_newlines(fi->chunk, 0, (uint64_t) got, &found);
+        pthread_mutex_lock(&fi->lock);
+        for (int64_t i = 0; ok && i < found.count; i++) ok = file_index_push(fi, start + found.data[i]);
+        free(found.data);
+        if (!ok) break;
+        uint64_t end = start + (uint64_t) got;
+        fi->scanned = end;
+        if (NULL != fi->view && !fi->update_queued) {
+            fi->update_queued = 1;
+            fi->refcount++;
+            uiQueueMain(file_view_update, fi);
+        }
+        /* Requeue for the next chunk. Without workers, keep going on
+         * this thread. */
+        if (end < size && ui_pool_submit(job)) {
+            pthread_mutex_unlock(&fi->lock);
+            return;
+        }
+        pthread_mutex_unlock(&fi->lock);
+    }
+    free(fi->chunk);
+    fi->chunk = NULL;
+    fi->scanning = 0;
+    file_index_unlock_release(fi);
+}
+
+static void file_index_poll(UIFileIndex *fi);
+
+static int file_index_retry(void *data) {
+    UIFileIndex *fi = (UIFileIndex *)data;
+    pthread_mutex_lock(&fi->lock);
+    fi->retry_queued = 0;
+    int live = NULL != fi->view;
+    file_index_unlock_release(fi);
+    /* The view holds its own reference */
+    if (live) file_index_poll(fi);
+    return 0;
+}
+
+/* Start indexing if the size of the file changed. If no worker takes
+ * the scan it is retried from a timer, never run on the UI thread.
+ * Must be called on the UI thread, without the lock held. */
+static void file_index_poll(UIFileIndex *fi) {
+    struct stat st;
+    pthread_mutex_lock(&fi->lock);
+    if (fi->scanning || fstat(fi->fd, &st) || (uint64_t) st.st_size == fi->scanned) {
+        pthread_mutex_unlock(&fi->lock);
+        return;
+    }
+    fi->scanning = 1;
+    fi->refcount++;
+    if (!ui_pool_submit(&fi->job)) {
+        fi->scanning = 0;
+        fi->refcount--;
+        if (!fi->retry_queued) {
+            fi->retry_queued = 1;
+            fi->refcount++;
+            uiTimer(UI_FILE_RETRY_MS, file_index_retry, fi);
+        }
+    }
+    pthread_mutex_unlock(&fi->lock);
+}
+
+/* Read the bytes of the visible lines with one positioned read, so
+ * drawing a page does not read once per row */
+static void file_view_read_page(UIVirtualList *vl, int64_t first, int64_t count) {
+    UIFileView *fv = (UIFileView *) vl;
+    UIFileIndex *fi = fv->index;
+    uint64_t start, end, last_start;
+    fv->page_len = 0;
+    pthread_mutex_lock(&fi->lock);
+    int64_t lines = file_index_lines(fi);
+    int64_t last = first + count - 1 < lines ? first + count - 1 : lines - 1;
+    int found = count > 0 && file_index_line(fi, first, &start, &end) &&
+                file_index_line(fi, last, &last_start, &end);
+    pthread_mutex_unlock(&fi->lock);
+    if (!found || end <= start) return;
+    uint64_t n = end - start > UI_FILE_PAGE_MAX ? UI_FILE_PAGE_MAX : end - start;
+    if (n > fv->page_capacity) {
+        char *page = realloc(fv->page, n);
+        if (NULL == page) return;
+        fv->page = page;
+        fv->page_capacity = n;
+    }
+    int64_t got = file_read_at(fi->fd, fv->page, n, start);
+    if (got <= 0) return;
+    fv->page_offset = start;
+    fv->page_len = (uint64_t) got;
+}
+
+/* Copy a line as valid UTF-8, expanding tabs and replacing control
+ * characters and invalid sequences with '?' */
+static void file_view_row(UIVirtualList *vl, int64_t index, char *buf, int32_t cap) {
+    UIFileView *fv = (UIFileView *) vl;
+    UIFileIndex *fi = fv->index;
+    int32_t n = 0;
+    uint64_t start, end;
+    char raw[UI_VLIST_LINE_MAX];
+    pthread_mutex_lock(&fi->lock);
+    int found = file_index_line(fi, index, &start, &end);
+    pthread_mutex_unlock(&fi->lock);
+    if (found) {
+        /* Every byte read makes at least one byte of output */
+        const unsigned char *p = (const unsigned char *) raw;
+        uint64_t i = 0;
+        uint64_t want = cap < UI_VLIST_LINE_MAX ? (uint64_t) cap : UI_VLIST_LINE_MAX;
+        if (fv->page_len > 0 && start >= fv->page_offset && end <= fv->page_offset + fv->page_len) {
+            /* Sliced from the page, dropping a carriage return the
+             * way file_index_read does */
+            p = (const unsigned char *) fv->page + (start - fv->page_offset);
+            uint64_t len = end - start;
+            if (len > want) len = want;
+            else if (len > 0 && p[len - 1] == '\r') len--;
+            end = len;
+        } else {
+            end = (uint64_t) file_index_read(fi, start, end, raw, want);
+        }
+        while (i < end && n < cap - 4) {
+            unsigned char c = p[i];
+            int len = c < 0x80 ? 1 : c >= 0xC2 && c <= 0xDF ? 2 : c >= 0xE0 && c <= 0xEF ? 3 :
+                      c >= 0xF0 && c <= 0xF4 ? 4 : 0;
+            int valid = len > 0 && i + len <= end;
+            for (int k = 1; valid && k < len; k++) valid = (p[i + k] & 0xC0) == 0x80;
+            if (valid && len > 2) {
+                unsigned char c1 = p[i + 1];
+                if ((c == 0xE0 && c1 < 0xA0) || (c == 0xED && c1 >= 0xA0) ||
+                        (c == 0xF0 && c1 < 0x90) || (c == 0xF4 && c1 >= 0x90)) valid = 0;
+            }
+            if (c == '\t') {
+                do buf[n++] = ' '; while (n % UI_FILE_TAB_WIDTH && n < cap - 4);
+                i++;
+            } else if (!valid || c < 0x20 || c == 0x7F) {
+                buf[n++] = '?';
+                i++;
+            } else {
+                memcpy(buf + n, p + i, len);
+                n += len;
+                i += len;
+            }
+        }
+    }
+    buf[n] = '\0';
+}
+
+static void file_view_draw_row(UIVirtualList *vl, uiDrawContext *ctx, int64_t index, double y) {
+    char line[UI_VLIST_LINE_MAX];
+    UIColor black = {0.0f, 0.0f, 0.0f, 1.0f};
+    file_view_row(vl, index, line, (int32_t) sizeof(line));
+    draw_text_libui(ctx, line, "monospace", 10, UI_VLIST_PADDING, y + UI_VLIST_PADDING / 2, black);
+}
+
+/* Publish index progress to the list on the UI thread */
+static void file_view_update(void *data) {
+    UIFileIndex *fi = (UIFileIndex *)data;
+    UIFileView *fv = fi->view;
+    pthread_mutex_lock(&fi->lock);
+    fi->update_queued = 0;
+    int64_t lines = file_index_lines(fi);
+    uint64_t generation = fi->generation;
+    int64_t bytes = fi->offset_capacity * (int64_t) sizeof(uint64_t);
+    pthread_mutex_unlock(&fi->lock);
+    if (NULL != fv) {
+        UIVirtualList *vl = &fv->list;
+        ui_mem.file_index_bytes += bytes - fv->accounted;
+        fv->accounted = bytes;
+        int64_t bottom = virtual_list_hit(vl, vl->height - 1);
+        int at_end = bottom < 0 || bottom >= vl->count - 1;
+        if (generation != fv->generation) {
+            fv->generation = generation;
+            vl->top = 0;
+            vl->top_offset = 0;
+            vl->selected = -1;
+        }
+        vl->count = lines;
+        if (vl->selected >= lines) vl->selected = -1;
+        if (fv->follow && at_end && lines > 0) {
+            vl->top = lines - 1;
+            vl->top_offset = 0;
+        }
+        virtual_list_scroll(vl, 0);
+        virtual_list_redraw(vl);
+    }
+    pthread_mutex_lock(&fi->lock);
+    file_index_unlock_release(fi);
+}
+
+static int file_view_follow(void *data) {
+    UIFileIndex *fi = (UIFileIndex *)data;
+    if (NULL == fi->view) {
+        pthread_mutex_lock(&fi->lock);
+        file_index_unlock_release(fi);
+        return 0;
+    }
+    file_index_poll(fi);
+    return 1;
+}
+
+static void file_view_release(UIControlWrapper *w) {
+    UIFileView *fv = (UIFileView *)w;
+    if (NULL != fv->index) {
+        UIFileIndex *fi = fv->index;
+        pthread_mutex_lock(&fi->lock);
+        fi->view = NULL;
+        file_index_unlock_release(fi);
+        fv->index = NULL;
+        ui_mem.file_index_bytes -= fv->accounted;
+        fv->accounted = 0;
+    }
+    free(fv->page);
+    fv->page = NULL;
+    fv->page_capacity = fv->page_len = 0;
+    virtual_list_release(w);
+}
+
+static Janet janet_ui_file_view(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    assert_inited();
+    const char *path = janet_getcstring(argv, 0);
+    int32_t follow = 0;
+    if (argc == 2 && !janet_checktype(argv[1], JANET_NIL)) follow = janet_getinteger(argv, 1);
+    if (follow < 0) janet_panic("expected non-negative follow interval");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) janet_panicf("could not open %s: %s", path, strerror(errno));
+    UIFileIndex *fi = calloc(1, sizeof(UIFileIndex));
+    uint64_t *offsets = malloc(sizeof(uint64_t) * 1024);
+    if (NULL == fi || NULL == offsets) {
+        free(fi);
+        free(offsets);
+        close(fd);
+        janet_panic("out of memory");
+    }
+    pthread_mutex_init(&fi->lock, NULL);
+    fi->refcount = 1;
+    fi->fd = fd;
+    fi->offsets = offsets;
+    fi->offsets[0] = 0;
+    fi->offset_count = 1;
+    fi->offset_capacity = 1024;
+    fi->job.run = file_scan_run;
+    UIFileView *fv = janet_abstract(&file_view_td, sizeof(UIFileView));
+    memset(fv, 0, sizeof(UIFileView));
+    virtual_list_init(&fv->list, UI_FILE_ROW_HEIGHT);
+    fv->list.native_row = file_view_draw_row;
+    fv->list.native_page = file_view_read_page;
+    fv->list.area.base.release = file_view_release;
+    fv->index = fi;
+    fv->follow = follow > 0;
+    fi->view = fv;
+    janet_ui_state_push(&fv->list.area.base, argv[0]);
+    janet_ui_state_push(&fv->list.area.base, janet_wrap_integer(follow));
+    ui_mem.controls[control_type_index(&file_view_td)]++;
+    UI_PROBE2(control__create, file_view_td.name, fv->list.area.base.control);
+    if (follow > 0) {
+        fi->refcount++;
+        uiTimer(follow, file_view_follow, fi);
+    }
+    file_index_poll(fi);
+    return janet_wrap_abstract(fv);
+}
+
+static UIFileIndex *janet_getfileindex(const Janet *argv, int32_t n) {
+    janet_getuitype(argv, n, &file_view_td);
+    return ((UIFileView *) janet_unwrap_abstract(argv[n]))->index;
+}
+
+/* Text of an indexed line, or nil */
+static Janet janet_ui_file_view_line(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    UIFileIndex *fi = janet_getfileindex(argv, 0);
+    int64_t index = janet_getinteger64(argv, 1);
+    uint64_t start, end;
+    pthread_mutex_lock(&fi->lock);
+    int found = file_index_line(fi, index, &start, &end);
+    pthread_mutex_unlock(&fi->lock);
+    if (!found) return janet_wrap_nil();
+    if (end - start > INT32_MAX) janet_panicf("line %v is too long", argv[1]);
+    char *text = malloc(end - start + 1);
+    if (NULL == text) janet_panic("out of memory");
+    int64_t len = file_index_read(fi, start, end, text, end - start);
+    Janet ret = janet_wrap_string(janet_string((const uint8_t *) text, (int32_t) len));
+    free(text);
+    return ret;
+}
+
+static Janet janet_ui_file_view_progress(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UIFileIndex *fi = janet_getfileindex(argv, 0);
+    pthread_mutex_lock(&fi->lock);
+    JanetKV *st = janet_struct_begin(4);
+    janet_struct_put(st, janet_ckeywordv("lines"), janet_wrap_number((double) file_index_lines(fi)));
+    janet_struct_put(st, janet_ckeywordv("indexed"), janet_wrap_number((double) fi->scanned));
+    janet_struct_put(st, janet_ckeywordv("size"), janet_wrap_number((double) fi->size));
+    janet_struct_put(st, janet_ckeywordv("scanning"), janet_wrap_boolean(fi->scanning));
+    pthread_mutex_unlock(&fi->lock);
+    return janet_wrap_struct(janet_struct_end(st));
+}
+
+/* Check for appended bytes now, as the follow timer does */
+static Janet janet_ui_file_view_refresh(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    file_index_poll(janet_getfileindex(argv, 0));
+    return argv[0];
+}
+
+/* Text View */
+
+/* A read only view of text with syntax highlighting, drawn as a
+ * virtual list of lines. Rules map state names to lists of
+ * [pattern color &opt next-state], where patterns are POSIX extended
+ * regular expressions and each line starts in the state the previous
+ * one ended in, the first in :root. At each position the earliest
+ * match of the current state's rules wins, the first rule breaking
+ * ties, and text no rule matches is drawn black. Lines keep the state
+ * they were tokenized from and the state they ended in, so after an
+ * edit tokenizing stops at the first line that ends in the same state
+ * as before, and the rest of the text keeps its highlighting. Colored
+ * spans are only computed for lines as they are drawn. */
+
+#define UI_TEXT_ROW_HEIGHT 16
+/* Most rules in one state */
+#define UI_TEXT_MAX_RULES 64
+
+typedef struct {
+    regex_t re;
+    UIColor color;
+    /* State after a match, or -1 to stay */
+    int32_t next;
+} UITextRule;
+
+typedef struct {
+    UITextRule *rules;
+    int32_t rule_count;
+    /* The rules of state s are rules[state_first[s]] up to
+     * rules[state_first[s + 1]]. State 0 is :root. */
+    int32_t *state_first;
+    int32_t state_count;
+} UITextRules;
+
+typedef struct {
+    int32_t start;
+    int32_t end;
+    int32_t rule;
+} UITextSpan;
+
+typedef struct {
+    /* Valid UTF-8, NUL terminated */
+    char *text;
+    int32_t len;
+    /* State the line was tokenized from, or -1 if it has not been */
+    int32_t start_state;
+    int32_t end_state;
+    /* State the spans were computed from, or -1 if there are none */
+    int32_t span_state;
+    int32_t span_count;
+    UITextSpan *spans;
+} UITextLine;
+
+typedef struct {
+    /* Must be first, so list callbacks find the view */
+    UIVirtualList list;
+    UITextRules rules;
+    UITextLine *lines;
+    int64_t line_capacity;
+    /* The last line had no newline, so appended text continues it */
+    int partial;
+    /* Lines before valid were tokenized from the state the line before
+     * them ends in. Lines from dirty to known were valid before the
+     * last edits, so once tokenizing has passed dirty and ends a line
+     * in the state the next one was tokenized from, all of them are
+     * valid again. */
+    int64_t valid;
+    int64_t dirty;
+    int64_t known;
+    uint64_t tokenized;
+    int64_t bytes;
+} UITextView;
+
+static void text_view_account(UITextView *tv, int64_t delta) {
+    tv->bytes += delta;
+    ui_mem.text_view_bytes += delta;
+}
+
+static void text_rules_free(UITextRules *tr) {
+    for (int32_t i = 0; i < tr->rule_count; i++) regfree(&tr->rules[i].re);
+    free(tr->rules);
+    free(tr->state_first);
+    memset(tr, 0, sizeof(UITextRules));
+}
+
+/* Number of a state in a rule table, or -1. :root is 0 and the other
+ * states follow in table order. */
+static int32_t text_rules_state(JanetDictView d, Janet name) {
+    if (janet_keyeq(name, "root")) return 0;
+    int32_t s = 1;
+    for (int32_t i = 0; i < d.cap; i++) {
+        if (janet_checktype(d.kvs[i].key, JANET_NIL) || janet_keyeq(d.kvs[i].key, "root")) continue;
+        if (janet_equals(d.kvs[i].key, name)) return s;
+        s++;
+    }
+    return -1;
+}
+
+static UITextRules text_rules_compile(const Janet *argv, int32_t n) {
+    JanetDictView d = janet_getdictionary(argv, n);
+    UITextRules tr;
+    memset(&tr, 0, sizeof(tr));
+    int has_root = 0;
+    for (int32_t i = 0; i < d.cap; i++) {
+        const JanetKV *kv = d.kvs + i;
+        if (janet_checktype(kv->key, JANET_NIL)) continue;
+        if (!janet_checktype(kv->key, JANET_KEYWORD)) janet_panicf("expected keyword state, got %v", kv->key);
+        if (janet_keyeq(kv->key, "root")) has_root = 1;
+        JanetView list = janet_getindexed(&kv->value, 0);
+        if (list.len > UI_TEXT_MAX_RULES) janet_panicf("state %v has more than %d rules", kv->key, UI_TEXT_MAX_RULES);
+        for (int32_t j = 0; j < list.len; j++) {
+            JanetView rule = janet_getindexed(list.items, j);
+            if (rule.len != 2 && rule.len != 3) {
+                janet_panicf("expected rule [pattern color &opt next-state], got %v", list.items[j]);
+            }
+            janet_getcstring(rule.items, 0);
+            janet_getcolor(rule.items, 1);
+            if (rule.len == 3 && !janet_checktype(rule.items[2], JANET_NIL) &&
+                    text_rules_state(d, rule.items[2]) < 0) {
+                janet_panicf("unknown state %v", rule.items[2]);
+            }
+        }
+        tr.state_count++;
+        tr.rule_count += list.len;
+    }
+    if (!has_root) janet_panic("expected rules for a :root state");
+    tr.rules = calloc(tr.rule_count ? tr.rule_count : 1, sizeof(UITextRule));
+    tr.state_first = malloc(sizeof(int32_t) * (tr.state_count + 1));
+    if (NULL == tr.rules || NULL == tr.state_first) {
+        free(tr.rules);
+        free(tr.state_first);
+        janet_panic("out of memory");
+    }
+    int32_t s = 0;
+    int32_t compiled = tr.rule_count;
+    tr.rule_count = 0;
+    /* :root first, then the others in the order text_rules_state
+     * numbers them */
+    for (int pass = 0; pass < 2; pass++) {
+        for (int32_t i = 0; i < d.cap; i++) {
+            const JanetKV *kv = d.kvs + i;
+            if (janet_checktype(kv->key, JANET_NIL)) continue;
+            if ((janet_keyeq(kv->key, "root") != 0) != (pass == 0)) continue;
+            JanetView list = janet_getindexed(&kv->value, 0);
+            tr.state_first[s++] = tr.rule_count;
+            for (int32_t j = 0; j < list.len; j++) {
+                JanetView rule = janet_getindexed(list.items, j);
+                UITextRule *r = tr.rules + tr.rule_count;
+                int err = regcomp(&r->re, janet_getcstring(rule.items, 0), REG_EXTENDED);
+                if (err) {
+                    char msg[128];
+                    regerror(err, &r->re, msg, sizeof(msg));
+                    text_rules_free(&tr);
+                    janet_panicf("bad pattern %v: %s", rule.items[0], msg);
+                }
+                tr.rule_count++;
+                r->color = janet_getcolor(rule.items, 1);
+                r->next = rule.len == 3 && !janet_checktype(rule.items[2], JANET_NIL) ?
+                          text_rules_state(d, rule.items[2]) : -1;
+            }
+        }
+    }
+    tr.state_first[s] = compiled;
+    return tr;
+}
+
+/* Tokenize a line from a state, and return the state it ends in. If
+ * spans is not NULL, it is set to a new array of the matched ranges. */
+static int32_t text_view_tokenize(UITextView *tv, const UITextLine *line, int32_t state,
+                                  UITextSpan **spans, int32_t *span_count) {
+    const UITextRules *tr = &tv->rules;
+    int32_t match_start[UI_TEXT_MAX_RULES];
+    int32_t match_end[UI_TEXT_MAX_RULES];
+    UITextSpan *out = NULL;
+    int32_t count = 0, cap = 0;
+    int record = NULL != spans;
+    int32_t first = tr->state_first[state];
+    int32_t n = tr->state_first[state + 1] - first;
+    for (int32_t i = 0; i < n; i++) match_start[i] = -2;
+    int32_t pos = 0, stuck = 0;
+    tv->tokenized++;
+    /* Also run at the end of the line, so "$" can change the state */
+    while (pos <= line->len) {
+        int32_t best = -1;
+        for (int32_t i = 0; i < n; i++) {
+            /* A match found from an earlier position is still the
+             * first one as long as it starts at or after pos, and no
+             * match then means no match now */
+            if (match_start[i] == -2 || (match_start[i] >= 0 && match_start[i] < pos)) {
+                regmatch_t m;
+                if (regexec(&tr->rules[first + i].re, line->text + pos, 1, &m, pos > 0 ? REG_NOTBOL : 0)) {
+                    match_start[i] = -1;
+                } else {
+                    match_start[i] = pos + (int32_t) m.rm_so;
+                    match_end[i] = pos + (int32_t) m.rm_eo;
+                }
+            }
+            if (match_start[i] >= 0 && (best < 0 || match_start[i] < match_start[best])) best = i;
+        }
+        if (best < 0) break;
+        const UITextRule *rule = tr->rules + first + best;
+        int32_t s = match_start[best], e = match_end[best];
+        if (e > s && record) {
+            if (count == cap) {
+                int32_t newcap = cap ? 2 * cap : 8;
+                UITextSpan *grown = realloc(out, sizeof(UITextSpan) * newcap);
+                if (NULL == grown) {
+                    record = 0;
+                } else {
+                    out = grown;
+                    cap = newcap;
+                }
+            }
+            if (record) {
+                out[count].start = s;
+                out[count].end = e;
+                out[count].rule = first + best;
+                count++;
+            }
+        }
+        pos = e;
+        int changed = rule->next >= 0 && rule->next != state;
+        if (changed) {
+            state = rule->next;
+            first = tr->state_first[state];
+            n = tr->state_first[state + 1] - first;
+            for (int32_t i = 0; i < n; i++) match_start[i] = -2;
+        }
+        if (e > s) {
+            stuck = 0;
+        } else if (!changed || ++stuck > tr->state_count) {
+            /* Step over a character, so empty matches make progress */
+            pos = s + 1;
+            while (pos < line->len && (line->text[pos] & 0xC0) == 0x80) pos++;
+            stuck = 0;
+        }
+    }
+    if (NULL != spans) {
+        if (0 == count) {
+            free(out);
+            out = NULL;
+        } else if (count < cap) {
+            UITextSpan *shrunk = realloc(out, sizeof(UITextSpan) * count);
+            if (NULL != shrunk) out = shrunk;
+        }
+        *spans = out;
+        *span_count = count;
+    }
+    return state;
+}
+
+static void text_line_drop_spans(UITextView *tv, UITextLine *line) {
+    text_view_account(tv, -(int64_t) sizeof(UITextSpan) * line->span_count);
+    free(line->spans);
+    line->spans = NULL;
+    line->span_count = 0;
+    line->span_state = -1;
+}
+
+static void text_line_free(UITextView *tv, UITextLine *line) {
+    text_line_drop_spans(tv, line);
+    text_view_account(tv, -(int64_t)(line->len + 1));
+    free(line->text);
+}
+
+/* Tokenize lines until the first n are valid */
+static void text_view_advance(UITextView *tv, int64_t n) {
+    while (tv->valid < n) {
+        UITextLine *line = tv->lines + tv->valid;
+        int32_t state = tv->valid > 0 ? line[-1].end_state : 0;
+        if (line->start_state != state) {
+            line->end_state = text_view_tokenize(tv, line, state, NULL, NULL);
+            line->start_state = state;
+        }
+        tv->valid++;
+        if (tv->valid >= tv->dirty && tv->valid < tv->known &&
+                tv->lines[tv->valid].start_state == line->end_state) {
+            tv->valid = tv->known;
+        }
+    }
+    if (tv->valid > tv->known) tv->known = tv->dirty = tv->valid;
+}
+
+/* Number of lines in text, where a newline ends a line */
+static int64_t text_line_count(const uint8_t *text, int32_t len) {
+    int64_t n = 0;
+    const uint8_t *p = text, *end = text + len;
+    while (p < end) {
+        const uint8_t *nl = memchr(p, '\n', end - p);
+        n++;
+        if (NULL == nl) break;
+        p = nl + 1;
+    }
+    return n;
+}
+
+/* Replace count lines at start with the lines of text. Returns 0 if
+ * out of memory, leaving the view unchanged. */
+static int text_view_splice(UITextView *tv, int64_t start, int64_t count, const uint8_t *text, int32_t len) {
+    UIVirtualList *vl = &tv->list;
+    int64_t m = text_line_count(text, len);
+    int64_t total = vl->count - count + m;
+    UITextLine *fresh = m ? malloc(sizeof(UITextLine) * m) : NULL;
+    if (m && NULL == fresh) return 0;
+    const uint8_t *p = text, *end = text + len;
+    int64_t bytes = 0;
+    for (int64_t i = 0; i < m; i++) {
+        const uint8_t *nl = memchr(p, '\n', end - p);
+        int32_t n = (int32_t)((NULL != nl ? nl : end) - p);
+        if (n > 0 && p[n - 1] == '\r') n--;
+        char *s = malloc(n + 1);
+        if (NULL == s) {
+            while (i-- > 0) free(fresh[i].text);
+            free(fresh);
+            return 0;
+        }
+        memcpy(s, p, n);
+        stream_load_validate((uint8_t *) s, n, 1);
+        s[n] = '\0';
+        memset(fresh + i, 0, sizeof(UITextLine));
+        fresh[i].text = s;
+        fresh[i].len = n;
+        fresh[i].start_state = -1;
+        fresh[i].span_state = -1;
+        bytes += n + 1;
+        p = NULL != nl ? nl + 1 : end;
+    }
+    if (total > tv->line_capacity) {
+        int64_t cap = tv->line_capacity ? tv->line_capacity : 64;
+        while (cap < total) cap *= 2;
+        UITextLine *lines = realloc(tv->lines, sizeof(UITextLine) * cap);
+        if (NULL == lines) {
+            for (int64_t i = 0; i < m; i++) free(fresh[i].text);
+            free(fresh);
+            return 0;
+        }
+        bytes += (cap - tv->line_capacity) * (int64_t) sizeof(UITextLine);
+        tv->lines = lines;
+        tv->line_capacity = cap;
+    }
+    text_view_account(tv, bytes);
+    for (int64_t i = start; i < start + count; i++) text_line_free(tv, tv->lines + i);
+    if (m != count) {
+        memmove(tv->lines + start + m, tv->lines + start + count,
+                sizeof(UITextLine) * (vl->count - start - count));
+    }
+    if (m) memcpy(tv->lines + start, fresh, sizeof(UITextLine) * m);
+    free(fresh);
+    /* Lines after the edit keep their states, so tokenizing can stop
+     * once it meets them again. An edit among the valid lines makes the
+     * rest of them known. Otherwise the known lines move with an edit
+     * before them, and shrink to what follows an edit inside them. */
+    int64_t delta = m - count;
+    if (start + count < tv->valid) {
+        tv->dirty = start + m;
+        tv->known = tv->valid + delta;
+    } else if (start + count < tv->dirty) {
+        tv->dirty += delta;
+        tv->known += delta;
+    } else if (start < tv->known) {
+        tv->dirty = start + m;
+        tv->known = tv->known > start + count ? tv->known + delta : start + m;
+    }
+    if (tv->valid > start) tv->valid = start;
+    vl->count = total;
+    if (vl->selected >= total) vl->selected = -1;
+    if (vl->top >= total) {
+        vl->top = total > 0 ? total - 1 : 0;
+        vl->top_offset = 0;
+    }
+    virtual_list_scroll(vl, 0);
+    return 1;
+}
+
+static void text_view_draw_row(UIVirtualList *vl, uiDrawContext *ctx, int64_t index, double y) {
+    UITextView *tv = (UITextView *) vl;
+    text_view_advance(tv, index + 1);
+    UITextLine *line = tv->lines + index;
+    if (line->span_state != line->start_state) {
+        text_line_drop_spans(tv, line);
+        text_view_tokenize(tv, line, line->start_state, &line->spans, &line->span_count);
+        line->span_state = line->start_state;
+        text_view_account(tv, (int64_t) sizeof(UITextSpan) * line->span_count);
+    }
+    /* Cut long lines at a character boundary */
+    char buf[UI_VLIST_LINE_MAX];
+    int32_t n = line->len;
+    if (n >= UI_VLIST_LINE_MAX) {
+        n = UI_VLIST_LINE_MAX - 1;
+        while (n > 0 && (line->text[n] & 0xC0) == 0x80) n--;
+    }
+    memcpy(buf, line->text, n);
+    buf[n] = '\0';
+    uiAttributedString *str = uiNewAttributedString(buf);
+    if (n > 0) uiAttributedStringSetAttribute(str, uiNewColorAttribute(0, 0, 0, 1), 0, n);
+    for (int32_t i = 0; i < line->span_count && line->spans[i].start < n; i++) {
+        const UITextSpan *sp = line->spans + i;
+        UIColor c = tv->rules.rules[sp->rule].color;
+        uiAttributedStringSetAttribute(str, uiNewColorAttribute(c.r, c.g, c.b, c.a),
+                sp->start, sp->end < n ? sp->end : n);
+    }
+    draw_attributed_libui(ctx, str, "monospace", 10, UI_VLIST_PADDING, y + UI_VLIST_PADDING / 2);
+}
+
+static void text_view_release(UIControlWrapper *w) {
+    UITextView *tv = (UITextView *)w;
+    for (int64_t i = 0; i < tv->list.count; i++) {
+        free(tv->lines[i].text);
+        free(tv->lines[i].spans);
+    }
+    free(tv->lines);
+    tv->lines = NULL;
+    tv->line_capacity = 0;
+    tv->list.count = 0;
+    text_rules_free(&tv->rules);
+    text_view_account(tv, -tv->bytes);
+    virtual_list_release(w);
+}
+
+static UITextView *janet_gettextview(const Janet *argv, int32_t n) {
+    janet_getuitype(argv, n, &text_view_td);
+    return janet_unwrap_abstract(argv[n]);
+}
+
+static int text_ends_partial(JanetByteView text) {
+    return text.len > 0 && text.bytes[text.len - 1] != '\n';
+}
+
+static Janet janet_ui_text_view(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    assert_inited();
+    JanetByteView text = {NULL, 0};
+    if (argc == 2) text = janet_getbytes(argv, 1);
+    UITextRules rules = text_rules_compile(argv, 0);
+    UITextView *tv = janet_abstract(&text_view_td, sizeof(UITextView));
+    memset(tv, 0, sizeof(UITextView));
+    virtual_list_init(&tv->list, UI_TEXT_ROW_HEIGHT);
+    tv->list.native_row = text_view_draw_row;
+    tv->list.area.base.release = text_view_release;
+    tv->rules = rules;
+    janet_ui_state_push(&tv->list.area.base, argv[0]);
+    ui_mem.controls[control_type_index(&text_view_td)]++;
+    UI_PROBE2(control__create, text_view_td.name, tv->list.area.base.control);
+    if (!text_view_splice(tv, 0, 0, text.bytes, text.len)) janet_panic("out of memory");
+    tv->partial = text_ends_partial(text);
+    return janet_wrap_abstract(tv);
+}
+
+/* Replace the rules. Every line is tokenized again as it is drawn. */
+static Janet janet_ui_text_view_set_rules(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    UITextView *tv = janet_gettextview(argv, 0);
+    UITextRules rules = text_rules_compile(argv, 1);
+    text_rules_free(&tv->rules);
+    tv->rules = rules;
+    for (int64_t i = 0; i < tv->list.count; i++) {
+        tv->lines[i].start_state = -1;
+        text_line_drop_spans(tv, tv->lines + i);
+    }
+    tv->valid = tv->dirty = tv->known = 0;
+    tv->list.area.base.state->data[0] = argv[1];
+    virtual_list_redraw(&tv->list);
+    return argv[0];
+}
+
+static Janet janet_ui_text_view_set_text(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    UITextView *tv = janet_gettextview(argv, 0);
+    JanetByteView text = janet_getbytes(argv, 1);
+    if (!text_view_splice(tv, 0, tv->list.count, text.bytes, text.len)) janet_panic("out of memory");
+    tv->partial = text_ends_partial(text);
+    tv->list.top = 0;
+    tv->list.top_offset = 0;
+    virtual_list_redraw(&tv->list);
+    return argv[0];
+}
+
+/* Append text, continuing the last line if it had no newline. A view
+ * scrolled to the bottom stays there. */
+static Janet janet_ui_text_view_append(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    UITextView *tv = janet_gettextview(argv, 0);
+    JanetByteView text = janet_getbytes(argv, 1);
+    UIVirtualList *vl = &tv->list;
+    if (text.len == 0) return argv[0];
+    int64_t bottom = virtual_list_hit(vl, vl->height - 1);
+    int at_end = bottom < 0 || bottom >= vl->count - 1;
+    int ok;
+    if (tv->partial && vl->count > 0) {
+        UITextLine *last = tv->lines + vl->count - 1;
+        JanetBuffer *joined = janet_buffer(last->len + text.len);
+        janet_buffer_push_bytes(joined, (const uint8_t *) last->text, last->len);
+        janet_buffer_push_bytes(joined, text.bytes, text.len);
+        ok = text_view_splice(tv, vl->count - 1, 1, joined->data, joined->count);
+    } else {
+        ok = text_view_splice(tv, vl->count, 0, text.bytes, text.len);
+    }
+    if (!ok) janet_panic("out of memory");
+    tv->partial = text_ends_partial(text);
+    if (at_end && vl->count > 0) {
+        vl->top = vl->count - 1;
+        vl->top_offset = 0;
+        virtual_list_scroll(vl, 0);
+    }
+    virtual_list_redraw(vl);
+    return argv[0];
+}
+
+/* Replace count lines at start with the lines of text */
+static Janet janet_ui_text_view_replace_lines(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 4);
+    UITextView *tv = janet_gettextview(argv, 0);
+    int64_t start = janet_getinteger64(argv, 1);
+    int64_t count = janet_getinteger64(argv, 2);
+    JanetByteView text = janet_getbytes(argv, 3);
+    int64_t lines = tv->list.count;
+    if (start < 0 || start > lines) janet_panicf("line %v out of range", argv[1]);
+    if (count < 0) janet_panic("expected non-negative count");
+    if (count > lines - start) count = lines - start;
+    if (!text_view_splice(tv, start, count, text.bytes, text.len)) janet_panic("out of memory");
+    if (start + count == lines) tv->partial = text_ends_partial(text);
+    virtual_list_redraw(&tv->list);
+    return argv[0];
+}
+
+/* Text of a line, or nil */
+static Janet janet_ui_text_view_line(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    UITextView *tv = janet_gettextview(argv, 0);
+    int64_t index = janet_getinteger64(argv, 1);
+    if (index < 0 || index >= tv->list.count) return janet_wrap_nil();
+    UITextLine *line = tv->lines + index;
+    return janet_wrap_string(janet_string((const uint8_t *) line->text, line->len));
+}
+
+static Janet janet_ui_text_view_stats(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UITextView *tv = janet_gettextview(argv, 0);
+    JanetKV *st = janet_struct_begin(4);
+    janet_struct_put(st, janet_ckeywordv("lines"), janet_wrap_number((double) tv->list.count));
+    janet_struct_put(st, janet_ckeywordv("valid"), janet_wrap_number((double) tv->valid));
+    janet_struct_put(st, janet_ckeywordv("tokenized"), janet_wrap_number((double) tv->tokenized));
+    janet_struct_put(st, janet_ckeywordv("bytes"), janet_wrap_number((double) tv->bytes));
+    return janet_wrap_struct(janet_struct_end(st));
+}
+
+/* Tree View */
+
+/* A lazy tree drawn as a virtual list. The fetch callback gets the key
+ * of a node, or the root key for the top level, and returns its
+ * children. A child is either a label, for a leaf, or
+ * [label expandable &opt key], where the key defaults to the label.
+ * Children are fetched the first time a node is expanded and kept
+ * while it is collapsed. Nodes are stored natively, the children of a
+ * node next to each other, and each node counts the rows below it
+ * while it is expanded. The rows of the children of a node are summed
+ * in a Fenwick tree kept in the children. A row is found by stepping
+ * from the row found last, or by walking down from the root, skipping
+ * whole subtrees in logarithmic time at each level, so only visible
+ * rows are ever flattened. Clicking the triangle, double clicking a row or the
+ * left and right keys collapse and expand nodes. */
+
+#define UI_TREE_ROW_HEIGHT 18
+#define UI_TREE_INDENT 16
+/* Rows stepped from the last lookup before walking from the root */
+#define UI_TREE_MAX_STEP 256
+
+typedef struct {
+    /* Offset of the label in the label pool */
+    int64_t label;
+    /* Rows below the node while it is expanded */
+    int64_t visible;
+    /* Entry of the Fenwick tree of the parent over the rows of its
+     * children, each child holding 1 + visible rows */
+    int64_t sum;
+    int32_t parent;
+    int32_t first_child;
+    /* -1 until the children are fetched */
+    int32_t child_count;
+    int32_t label_len;
+    int32_t depth;
+    uint8_t expandable;
+    uint8_t expanded;
+} UITreeNode;
+
+typedef struct {
+    /* Must be first, so list callbacks find the view */
+    UIVirtualList list;
+    /* Key of each node, node 0 being the hidden root. The fetch
+     * callback and the keys are kept in the state of the control. */
+    JanetArray *keys;
+    UITreeNode *nodes;
+    int32_t node_count;
+    int32_t node_capacity;
+    char *labels;
+    int64_t label_len;
+    int64_t label_capacity;
+    /* Row and node of the last lookup, or -1 */
+    int64_t anchor_row;
+    int32_t anchor_node;
+    int fetching;
+    uint64_t fetches;
+    int64_t bytes;
+} UITreeView;
+
+static void tree_view_account(UITreeView *tv, int64_t delta) {
+    tv->bytes += delta;
+    ui_mem.tree_view_bytes += delta;
+}
+
+/* Add a node. Returns its index, or -1 if out of memory. */
+static int32_t tree_view_add(UITreeView *tv, int32_t parent, const uint8_t *label, int32_t len, Janet key,
+                             int expandable) {
+    if (tv->node_count == INT32_MAX) return -1;
+    if (tv->node_count == tv->node_capacity) {
+        int32_t cap = tv->node_capacity ? (tv->node_capacity > INT32_MAX / 2 ? INT32_MAX : 2 * tv->node_capacity) : 256;
+        UITreeNode *nodes = realloc(tv->nodes, sizeof(UITreeNode) * cap);
+        if (NULL == nodes) return -1;
+        tree_view_account(tv, (int64_t)(cap - tv->node_capacity) * (int64_t) sizeof(UITreeNode));
+        tv->nodes = nodes;
+        tv->node_capacity = cap;
+    }
+    if (tv->label_len + len > tv->label_capacity) {
+        int64_t cap = tv->label_capacity ? tv->label_capacity : 4096;
+        while (cap < tv->label_len + len) cap *= 2;
+        char *labels = realloc(tv->labels, cap);
+        if (NULL == labels) return -1;
+        tree_view_account(tv, cap - tv->label_capacity);
+        tv->labels = labels;
+        tv->label_capacity = cap;
+    }
+    /* Labels are drawn on one line */
+    uint8_t *p = (uint8_t *) tv->labels + tv->label_len;
+    if (len > 0) memcpy(p, label, len);
+    stream_load_validate(p, len, 1);
+    for (int32_t i = 0; i < len; i++) {
+        if (p[i] < 0x20 || p[i] == 0x7F) p[i] = ' ';
+    }
+    int32_t id = tv->node_count++;
+    UITreeNode *n = tv->nodes + id;
+    memset(n, 0, sizeof(UITreeNode));
+    n->label = tv->label_len;
+    n->label_len = len;
+    n->parent = parent;
+    n->child_count = -1;
+    n->depth = parent >= 0 ? tv->nodes[parent].depth + 1 : 0;
+    n->expandable = expandable != 0;
+    tv->label_len += len;
+    janet_array_push(tv->keys, key);
+    return id;
+}
+
+/* Start the Fenwick tree of a node with every child collapsed */
+static void tree_view_sum_init(UITreeView *tv, int32_t id) {
+    const UITreeNode *n = tv->nodes + id;
+    for (int32_t i = 1; i <= n->child_count; i++) tv->nodes[n->first_child + i - 1].sum = i & -i;
+}
+
+/* Add to the rows of a node in the Fenwick tree of its parent */
+static void tree_view_sum_add(UITreeView *tv, int32_t id, int64_t delta) {
+    const UITreeNode *p = tv->nodes + tv->nodes[id].parent;
+    for (int32_t i = id - p->first_child + 1; i <= p->child_count; i += i & -i) {
+        tv->nodes[p->first_child + i - 1].sum += delta;
+    }
+}
+
+/* Rows of all the children of a node */
+static int64_t tree_view_sum_total(UITreeView *tv, int32_t id) {
+    const UITreeNode *n = tv->nodes + id;
+    int64_t total = 0;
+    for (int32_t i = n->child_count; i > 0; i -= i & -i) total += tv->nodes[n->first_child + i - 1].sum;
+    return total;
+}
+
+/* The child of an expanded node holding row r of the rows below it.
+ * r becomes the row within the child, 0 being the child itself. */
+static int32_t tree_view_sum_find(UITreeView *tv, int32_t id, int64_t *r) {
+    const UITreeNode *n = tv->nodes + id;
+    int32_t pos = 0;
+    int32_t step = 1;
+    while (step <= n->child_count >> 1) step <<= 1;
+    for (; step > 0; step >>= 1) {
+        if (pos + step <= n->child_count && tv->nodes[n->first_child + pos + step - 1].sum <= *r) {
+            pos += step;
+            *r -= tv->nodes[n->first_child + pos - 1].sum;
+        }
+    }
+    return n->first_child + pos;
+}
+
+/* Call the fetch callback for the children of a node */
+static void tree_view_fetch(UITreeView *tv, int32_t id) {
+    Janet key = tv->keys->data[id];
+    Janet fetch = tv->list.area.base.state->data[0];
+    Janet items;
+    tv->fetching = 1;
+    tv->fetches++;
+    janet_ui_call(fetch, 1, &key, &items);
+    tv->fetching = 0;
+    if (tv->list.area.base.flags & UI_FLAG_DESTROYED) return;
+    const Janet *children = NULL;
+    int32_t count = 0;
+    if (!janet_checktype(items, JANET_NIL) && !janet_indexed_view(items, &children, &count)) {
+        ui_report_error(NULL, janet_cstringv("expected tree-view children to be an array or tuple"));
+        count = 0;
+    }
+    int32_t first = tv->node_count;
+    for (int32_t i = 0; i < count; i++) {
+        Janet label = children[i];
+        Janet child_key = children[i];
+        int expandable = 0;
+        const Janet *parts;
+        int32_t len;
+        if (janet_indexed_view(children[i], &parts, &len) && len >= 1 && len <= 3) {
+            label = parts[0];
+            expandable = len > 1 && janet_truthy(parts[1]);
+            child_key = len > 2 ? parts[2] : parts[0];
+        }
+        JanetByteView text;
+        if (!janet_bytes_view(label, &text.bytes, &text.len)) {
+            label = janet_wrap_string(janet_to_string(label));
+            janet_bytes_view(label, &text.bytes, &text.len);
+        }
+        if (tree_view_add(tv, id, text.bytes, text.len, child_key, expandable) < 0) {
+            ui_report_error(NULL, janet_cstringv("out of memory in tree-view"));
+            break;
+        }
+    }
+    UITreeNode *n = tv->nodes + id;
+    n->first_child = first;
+    n->child_count = tv->node_count - first;
+    if (0 == n->child_count) n->expandable = 0;
+    tree_view_sum_init(tv, id);
+}
+
+/* The node of the next visible row, or -1 */
+static int32_t tree_view_next(UITreeView *tv, int32_t id) {
+    const UITreeNode *n = tv->nodes + id;
+    if (n->expanded && n->child_count > 0) return n->first_child;
+    while (id > 0) {
+        const UITreeNode *p = tv->nodes + tv->nodes[id].parent;
+        if (id + 1 < p->first_child + p->child_count) return id + 1;
+        id = tv->nodes[id].parent;
+    }
+    return -1;
+}
+
+/* The node of the previous visible row, or -1 */
+static int32_t tree_view_prev(UITreeView *tv, int32_t id) {
+    int32_t parent = tv->nodes[id].parent;
+    if (id == tv->nodes[parent].first_child) return parent > 0 ? parent : -1;
+    id--;
+    while (tv->nodes[id].expanded && tv->nodes[id].child_count > 0) {
+        id = tv->nodes[id].first_child + tv->nodes[id].child_count - 1;
+    }
+    return id;
+}
+
+/* The node shown in a row, or -1 */
+static int32_t tree_view_find(UITreeView *tv, int64_t row) {
+    if (row < 0 || tv->node_count == 0 || row >= tv->nodes[0].visible) return -1;
+    int32_t id;
+    int64_t step = row - tv->anchor_row;
+    if (tv->anchor_row >= 0 && step <= UI_TREE_MAX_STEP && step >= -UI_TREE_MAX_STEP) {
+        id = tv->anchor_node;
+        for (; step > 0; step--) id = tree_view_next(tv, id);
+        for (; step < 0; step++) id = tree_view_prev(tv, id);
+    } else {
+        /* Skip whole subtrees on the way down */
+        int64_t r = row;
+        id = tree_view_sum_find(tv, 0, &r);
+        while (r > 0) {
+            r--;
+            id = tree_view_sum_find(tv, id, &r);
+        }
+    }
+    tv->anchor_row = row;
+    tv->anchor_node = id;
+    return id;
+}
+
+/* Expand or collapse the node in a row, fetching its children the
+ * first time. Returns 1 if the view changed. */
+static int tree_view_set_expanded(UITreeView *tv, int64_t row, int expand) {
+    UIVirtualList *vl = &tv->list;
+    int32_t id = tree_view_find(tv, row);
+    if (id < 0 || tv->fetching) return 0;
+    UITreeNode *n = tv->nodes + id;
+    if (!n->expandable || n->expanded == (expand != 0)) return 0;
+    if (expand && n->child_count < 0) {
+        tree_view_fetch(tv, id);
+        if (vl->area.base.flags & UI_FLAG_DESTROYED) return 0;
+        n = tv->nodes + id;
+        if (0 == n->child_count) return 1;
+    }
+    int64_t before = n->visible;
+    int64_t after = expand ? tree_view_sum_total(tv, id) : 0;
+    n->expanded = expand != 0;
+    n->visible = after;
+    int64_t delta = after - before;
+    for (int32_t a = id; a > 0; a = tv->nodes[a].parent) {
+        tree_view_sum_add(tv, a, delta);
+        tv->nodes[tv->nodes[a].parent].visible += delta;
+    }
+    vl->count = tv->nodes[0].visible;
+    /* Keep the rows above the anchor and the selection in place */
+    if (vl->top > row) {
+        if (!expand && vl->top <= row + before) {
+            vl->top = row;
+            vl->top_offset = 0;
+        } else {
+            vl->top += delta;
+        }
+    }
+    if (vl->selected > row) {
+        if (!expand && vl->selected <= row + before) vl->selected = row;
+        else vl->selected += delta;
+    }
+    tv->anchor_row = -1;
+    virtual_list_scroll(vl, 0);
+    return 1;
+}
+
+/* Start over with a hidden root holding the top level */
+static void tree_view_load(UITreeView *tv, Janet root) {
+    tree_view_account(tv, -tv->bytes);
+    free(tv->nodes);
+    free(tv->labels);
+    tv->nodes = NULL;
+    tv->labels = NULL;
+    tv->node_count = tv->node_capacity = 0;
+    tv->label_len = tv->label_capacity = 0;
+    tv->keys->count = 0;
+    tv->anchor_row = -1;
+    tv->list.count = 0;
+    tv->list.top = 0;
+    tv->list.top_offset = 0;
+    tv->list.selected = -1;
+    if (tree_view_add(tv, -1, NULL, 0, root, 1) < 0) janet_panic("out of memory");
+    tree_view_fetch(tv, 0);
+    if (tv->list.area.base.flags & UI_FLAG_DESTROYED) return;
+    tv->nodes[0].expanded = 1;
+    tv->nodes[0].visible = tv->nodes[0].child_count;
+    tv->list.count = tv->nodes[0].visible;
+}
+
+static void tree_view_draw_row(UIVirtualList *vl, uiDrawContext *ctx, int64_t index, double y) {
+    UITreeView *tv = (UITreeView *) vl;
+    int32_t id = tree_view_find(tv, index);
+    if (id < 0) return;
+    const UITreeNode *n = tv->nodes + id;
+    double x = UI_VLIST_PADDING + (n->depth - 1) * UI_TREE_INDENT;
+    if (n->expandable) {
+        UIDrawCmd cmd;
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.color.r = cmd.color.g = cmd.color.b = 0.4f;
+        cmd.color.a = 1.0f;
+        double cy = y + vl->row_height / 2;
+        uiDrawPath *path = uiDrawNewPath(uiDrawFillModeWinding);
+        if (n->expanded) {
+            uiDrawPathNewFigure(path, x + 2, cy - 3);
+            uiDrawPathLineTo(path, x + 10, cy - 3);
+            uiDrawPathLineTo(path, x + 6, cy + 3);
+        } else {
+            uiDrawPathNewFigure(path, x + 3, cy - 4);
+            uiDrawPathLineTo(path, x + 9, cy);
+            uiDrawPathLineTo(path, x + 3, cy + 4);
+        }
+        uiDrawPathCloseFigure(path);
+        draw_path_libui(ctx, path, &cmd);
+    }
+    /* Cut long labels at a character boundary */
+    char buf[UI_VLIST_LINE_MAX];
+    const char *label = tv->labels + n->label;
+    int32_t len = n->label_len;
+    if (len >= UI_VLIST_LINE_MAX) {
+        len = UI_VLIST_LINE_MAX - 1;
+        while (len > 0 && (label[len] & 0xC0) == 0x80) len--;
+    }
+    memcpy(buf, label, len);
+    buf[len] = '\0';
+    UIColor black = {0.0f, 0.0f, 0.0f, 1.0f};
+    draw_text_libui(ctx, buf, "sans", 10, x + UI_TREE_INDENT, y + UI_VLIST_PADDING / 2, black);
+}
+
+static void tree_view_mouse_event_handler(uiAreaHandler *ah, uiArea *area, uiAreaMouseEvent *e) {
+    UITreeView *tv = (UITreeView *) area_from_handler(ah);
+    if (e->Down == 1 && e->X < tv->list.width - UI_VLIST_SCROLLBAR) {
+        int64_t row = virtual_list_hit(&tv->list, e->Y);
+        int32_t id = tree_view_find(tv, row);
+        if (id >= 0) {
+            const UITreeNode *n = tv->nodes + id;
+            double x = UI_VLIST_PADDING + (n->depth - 1) * UI_TREE_INDENT;
+            if ((e->X >= x && e->X < x + UI_TREE_INDENT) || e->Count == 2) {
+                if (tree_view_set_expanded(tv, row, !n->expanded)) virtual_list_redraw(&tv->list);
+                if (tv->list.area.base.flags & UI_FLAG_DESTROYED) return;
+            }
+        }
+    }
+    virtual_list_mouse_event_handler(ah, area, e);
+}
+
+static int tree_view_key_event_handler(uiAreaHandler *ah, uiArea *area, uiAreaKeyEvent *e) {
+    UITreeView *tv = (UITreeView *) area_from_handler(ah);
+    if (!e->Up && tv->list.selected >= 0 && (e->ExtKey == uiExtKeyLeft || e->ExtKey == uiExtKeyRight)) {
+        if (tree_view_set_expanded(tv, tv->list.selected, e->ExtKey == uiExtKeyRight)) {
+            virtual_list_redraw(&tv->list);
+        }
+        return 1;
+    }
+    return virtual_list_key_event_handler(ah, area, e);
+}
+
+static void tree_view_release(UIControlWrapper *w) {
+    UITreeView *tv = (UITreeView *)w;
+    free(tv->nodes);
+    free(tv->labels);
+    tv->nodes = NULL;
+    tv->labels = NULL;
+    tv->node_count = tv->node_capacity = 0;
+    tv->label_len = tv->label_capacity = 0;
+    tv->list.count = 0;
+    tree_view_account(tv, -tv->bytes);
+    virtual_list_release(w);
+}
+
+static UITreeView *janet_gettreeview(const Janet *argv, int32_t n) {
+    janet_getuitype(argv, n, &tree_view_td);
+    return janet_unwrap_abstract(argv[n]);
+}
+
+static Janet janet_ui_tree_view(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    assert_inited();
+    assert_callable(argv, 0);
+    UITreeView *tv = janet_abstract(&tree_view_td, sizeof(UITreeView));
+    memset(tv, 0, sizeof(UITreeView));
+    virtual_list_init(&tv->list, UI_TREE_ROW_HEIGHT);
+    tv->list.area.handler.MouseEvent = tree_view_mouse_event_handler;
+    tv->list.area.handler.KeyEvent = tree_view_key_event_handler;
+    tv->list.native_row = tree_view_draw_row;
+    tv->list.area.base.release = tree_view_release;
+    tv->keys = janet_array(64);
+    janet_ui_state_push(&tv->list.area.base, argv[0]);
+    janet_ui_state_push(&tv->list.area.base, janet_wrap_array(tv->keys));
+    ui_mem.controls[control_type_index(&tree_view_td)]++;
+    UI_PROBE2(control__create, tree_view_td.name, tv->list.area.base.control);
+    tree_view_load(tv, argc == 2 ? argv[1] : janet_wrap_nil());
+    return janet_wrap_abstract(tv);
+}
+
+/* Expand or collapse the node in a row, or toggle it. Returns whether
+ * it is expanded. */
+static Janet janet_ui_tree_view_toggle(int32_t argc, Janet *argv) {
+    janet_arity(argc, 2, 3);
+    UITreeView *tv = janet_gettreeview(argv, 0);
+    int64_t row = janet_getinteger64(argv, 1);
+    int32_t id = tree_view_find(tv, row);
+    if (id < 0) janet_panicf("row %v out of range", argv[1]);
+    int expand = argc == 3 ? janet_truthy(argv[2]) : !tv->nodes[id].expanded;
+    if (tree_view_set_expanded(tv, row, expand)) virtual_list_redraw(&tv->list);
+    if (tv->list.area.base.flags & UI_FLAG_DESTROYED) return janet_wrap_false();
+    return janet_wrap_boolean(tv->nodes[id].expanded);
+}
+
+/* Key of the node in a row, or nil */
+static Janet janet_ui_tree_view_key(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    UITreeView *tv = janet_gettreeview(argv, 0);
+    int32_t id = tree_view_find(tv, janet_getinteger64(argv, 1));
+    return id < 0 ? janet_wrap_nil() : tv->keys->data[id];
+}
+
+/* Keys from the top level down to the node in a row, or nil */
+static Janet janet_ui_tree_view_path(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    UITreeView *tv = janet_gettreeview(argv, 0);
+    int32_t id = tree_view_find(tv, janet_getinteger64(argv, 1));
+    if (id < 0) return janet_wrap_nil();
+    int32_t depth = tv->nodes[id].depth;
+    Janet *path = janet_tuple_begin(depth);
+    for (int32_t i = depth - 1; i >= 0; i--, id = tv->nodes[id].parent) path[i] = tv->keys->data[id];
+    return janet_wrap_tuple(janet_tuple_end(path));
+}
+
+/* Drop every node and fetch the top level again */
+static Janet janet_ui_tree_view_reload(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UITreeView *tv = janet_gettreeview(argv, 0);
+    if (tv->fetching) janet_panic("cannot reload a tree-view while fetching");
+    tree_view_load(tv, tv->keys->data[0]);
+    if (!(tv->list.area.base.flags & UI_FLAG_DESTROYED)) virtual_list_redraw(&tv->list);
+    return argv[0];
+}
+
+static Janet janet_ui_tree_view_stats(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UITreeView *tv = janet_gettreeview(argv, 0);
+    JanetKV *st = janet_struct_begin(4);
+    janet_struct_put(st, janet_ckeywordv("nodes"), janet_wrap_integer(tv->node_count > 0 ? tv->node_count - 1 : 0));
+    janet_struct_put(st, janet_ckeywordv("rows"), janet_wrap_number((double) tv->list.count));
+    janet_struct_put(st, janet_ckeywordv("fetches"), janet_wrap_number((double) tv->fetches));
+    janet_struct_put(st, janet_ckeywordv("bytes"), janet_wrap_number((double) tv->bytes));
+    return janet_wrap_struct(janet_struct_end(st));
+}
+
+/* Graph View */
+
+/* A force directed layout of a graph, drawn on an area. Nodes are a
+ * buffer of 32 bit little endian colors 0xRRGGBB, one per node, as
+ * written by buffer/push-word, and edges a buffer of pairs of node
+ * indices in the same format. The layout runs on the worker pool in
+ * steps. Each step builds a quadtree of the positions, and splits the
+ * nodes into chunks that are each pushed apart by the other nodes,
+ * with far cells of the tree taken as one body, and pulled together
+ * by their edges, moving at most the current temperature. The job
+ * that finishes a step last cools the layout and starts the next step,
+ * until the layout has cooled down, and the view redraws as each step
+ * lands. Dragging pans, the mouse wheel zooms around the pointer, + and
+ * - zoom, and 0 fits the graph to the view again. */
+
+#define UI_GRAPH_EDGE_LENGTH 30.0
+/* Cells smaller than theta times their distance count as one body */
+#define UI_GRAPH_THETA 0.8
+#define UI_GRAPH_GRAVITY 0.1
+#define UI_GRAPH_COOLING 0.99
+/* The layout stops at this temperature */
+#define UI_GRAPH_MIN_TEMPERATURE (UI_GRAPH_EDGE_LENGTH / 20)
+#define UI_GRAPH_MAX_DEPTH 32
+#define UI_GRAPH_STACK 128
+/* Fewest nodes worth a job of their own */
+#define UI_GRAPH_CHUNK 1024
+/* Segments and nodes drawn per cairo path */
+#define UI_GRAPH_BATCH 4096
+
+typedef struct {
+    /* Center of mass, summed while the tree is built */
+    double x, y;
+    double mass;
+    double size;
+    int32_t parent;
+    int32_t child[4];
+    /* First body of a leaf, chained through next_body, or -1 for
+     * cells with children */
+    int32_t body;
+} UIQuadCell;
+
+typedef struct UIGraphLayout UIGraphLayout;
+
+typedef struct {
+    UIJob job;
+    UIGraphLayout *layout;
+    int32_t start;
+    int32_t end;
+} UIGraphJob;
+
+/* Layout shared with the workers. The graph is immutable, and the
+ * positions, the tree and the jobs belong to the step in flight, which
+ * writes the positions into pos[!cur]. Everything else is guarded by
+ * lock. */
+struct UIGraphLayout {
+    pthread_mutex_t lock;
+    int32_t refcount;
+    int redraw_queued;
+    /* NULL once the view is destroyed */
+    uiArea *area;
+    /* Start another step when one ends */
+    int running;
+    int stepping;
+    int32_t node_count;
+    /* Neighbours of node i are adj[adj_first[i]] up to adj[adj_first[i + 1]] */
+    int32_t *adj_first;
+    int32_t *adj;
+    /* x, y pairs. pos[cur] holds the last finished step. */
+    double *pos[2];
+    int cur;
+    UIQuadCell *cells;
+    int32_t cell_count;
+    int32_t cell_capacity;
+    int32_t *next_body;
+    double temperature;
+    /* Temperature of the step in flight */
+    double step_temperature;
+    int32_t chunk_count;
+    int32_t chunks_left;
+    UIGraphJob jobs[UI_POOL_MAX_THREADS];
+    uint64_t steps;
+};
+
+typedef struct {
+    /* Must be first, so area callbacks find the view */
+    UIArea area;
+    UIGraphLayout *layout;
+    int32_t node_count;
+    int32_t edge_count;
+    uint32_t *colors;
+    /* Copy of the positions of step shown_step, drawn by the UI thread */
+    double *shown;
+    uint64_t shown_step;
+    /* Layout point at the center of the view, and pixels per unit */
+    double cx, cy;
+    double zoom;
+    /* Fit the graph to the view on every draw, until it is panned or zoomed */
+    int fit;
+    double width;
+    double height;
+    int dragging;
+    double press_x, press_y;
+    double last_x, last_y;
+    uint64_t frames;
+    int64_t bytes;
+} UIGraphView;
+
+/* Drop a reference to a layout. Must be called with its lock held,
+ * which is released. */
+static void graph_layout_unlock_release(UIGraphLayout *g) {
+    int last = --g->refcount == 0;
+    pthread_mutex_unlock(&g->lock);
+    if (!last) return;
+    free(g->adj_first);
+    free(g->adj);
+    free(g->pos[0]);
+    free(g->pos[1]);
+    free(g->cells);
+    free(g->next_body);
+    pthread_mutex_destroy(&g->lock);
+    free(g);
+}
+
+static int32_t graph_cell_new(UIGraphLayout *g, int32_t parent, double size) {
+    UIQuadCell *c = g->cells + g->cell_count;
+    c->x = c->y = c->mass = 0;
+    c->size = size;
+    c->parent = parent;
+    c->child[0] = c->child[1] = c->child[2] = c->child[3] = -1;
+    c->body = -1;
+    return g->cell_count++;
+}
+
+/* Build the quadtree of pos[cur]. Bodies closer than the deepest
+ * cells, or added once every cell is taken, share a leaf. */
+static void graph_build(UIGraphLayout *g) {
+    const double *p = g->pos[g->cur];
+    int32_t n = g->node_count;
+    double x0 = p[0], y0 = p[1], x1 = p[0], y1 = p[1];
+    for (int32_t i = 1; i < n; i++) {
+        if (p[2 * i] < x0) x0 = p[2 * i];
+        if (p[2 * i] > x1) x1 = p[2 * i];
+        if (p[2 * i + 1] < y0) y0 = p[2 * i + 1];
+        if (p[2 * i + 1] > y1) y1 = p[2 * i + 1];
+    }
+    double size = (x1 - x0 > y1 - y0 ? x1 - x0 : y1 - y0) + 1;
+    g->cell_count = 0;
+    graph_cell_new(g, -1, size);
+    for (int32_t b = 0; b < n; b++) {
+        double bx = p[2 * b], by = p[2 * b + 1];
+        int32_t c = 0;
+        double cx = x0, cy = y0, s = size;
+        for (int depth = 0;; depth++) {
+            UIQuadCell *cell = g->cells + c;
+            if (cell->child[0] < 0 && cell->child[1] < 0 && cell->child[2] < 0 && cell->child[3] < 0) {
+                if (cell->body >= 0 && depth < UI_GRAPH_MAX_DEPTH && g->cell_count < g->cell_capacity) {
+                    /* Split the leaf, moving its body down */
+                    int32_t old = cell->body;
+                    int q = (p[2 * old] >= cx + s / 2) + 2 * (p[2 * old + 1] >= cy + s / 2);
+                    cell->child[q] = graph_cell_new(g, c, s / 2);
+                    g->cells[cell->child[q]].body = old;
+                    cell->body = -1;
+                } else {
+                    g->next_body[b] = cell->body;
+                    cell->body = b;
+                    break;
+                }
+            }
+            int qx = bx >= cx + s / 2;
+            int qy = by >= cy + s / 2;
+            int q = qx + 2 * qy;
+            if (cell->child[q] < 0) {
+                if (g->cell_count < g->cell_capacity) {
+                    cell->child[q] = graph_cell_new(g, c, s / 2);
+                } else {
+                    /* Out of cells, share a leaf of a neighbouring quadrant */
+                    for (q = 0; cell->child[q] < 0; q++);
+                }
+            }
+            c = cell->child[q];
+            s /= 2;
+            if (q & 1) cx += s;
+            if (q & 2) cy += s;
+        }
+    }
+    /* Children come after their parents, so sum from the leaves up */
+    for (int32_t i = g->cell_count - 1; i >= 0; i--) {
+        UIQuadCell *cell = g->cells + i;
+        for (int32_t b = cell->body; b >= 0; b = g->next_body[b]) {
+            cell->x += p[2 * b];
+            cell->y += p[2 * b + 1];
+            cell->mass += 1;
+        }
+        if (cell->parent >= 0) {
+            UIQuadCell *parent = g->cells + cell->parent;
+            parent->x += cell->x;
+            parent->y += cell->y;
+            parent->mass += cell->mass;
+        }
+        if (cell->mass > 0) {
+            cell->x /= cell->mass;
+            cell->y /= cell->mass;
+        }
+    }
+}
+
+static void graph_redraw(void *data) {
+    UIGraphLayout *g = (UIGraphLayout *)data;
+    pthread_mutex_lock(&g->lock);
+    g->redraw_queued = 0;
+    if (NULL != g->area) uiAreaQueueRedrawAll(g->area);
+    graph_layout_unlock_release(g);
+}
+
+static void graph_step_start(UIGraphLayout *g);
+
+/* Move the nodes of a chunk */
+static void graph_job_run(UIJob *job) {
+    UIGraphJob *gj = (UIGraphJob *)job;
+    UIGraphLayout *g = gj->layout;
+    const double *p = g->pos[g->cur];
+    double *out = g->pos[!g->cur];
+    const double k = UI_GRAPH_EDGE_LENGTH;
+    const double t = g->step_temperature;
+    int32_t stack[UI_GRAPH_STACK];
+    for (int32_t i = gj->start; i < gj->end; i++) {
+        double xi = p[2 * i], yi = p[2 * i + 1];
+        double fx = -UI_GRAPH_GRAVITY * xi;
+        double fy = -UI_GRAPH_GRAVITY * yi;
+        int32_t top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const UIQuadCell *cell = g->cells + stack[--top];
+            if (cell->body >= 0) {
+                for (int32_t b = cell->body; b >= 0; b = g->next_body[b]) {
+                    if (b == i) continue;
+                    double dx = xi - p[2 * b], dy = yi - p[2 * b + 1];
+                    double d2 = dx * dx + dy * dy;
+                    if (d2 < 1e-9) {
+                        /* Separate nodes on the same spot */
+                        double a = (double)(i - b) * 2.399963;
+                        fx += cos(a) * k / 10;
+                        fy += sin(a) * k / 10;
+                        continue;
+                    }
+                    fx += dx * k * k / d2;
+                    fy += dy * k * k / d2;
+                }
+                continue;
+            }
+            double dx = xi - cell->x, dy = yi - cell->y;
+            double d2 = dx * dx + dy * dy;
+            if (cell->size * cell->size < UI_GRAPH_THETA * UI_GRAPH_THETA * d2 ||
+                    top + 4 > UI_GRAPH_STACK) {
+                if (d2 > 1e-9) {
+                    fx += dx * k * k * cell->mass / d2;
+                    fy += dy * k * k * cell->mass / d2;
+                }
+                continue;
+            }
+            for (int q = 0; q < 4; q++) {
+                if (cell->child[q] >= 0) stack[top++] = cell->child[q];
+            }
+        }
+        for (int32_t e = g->adj_first[i]; e < g->adj_first[i + 1]; e++) {
+            int32_t j = g->adj[e];
+            double dx = p[2 * j] - xi, dy = p[2 * j + 1] - yi;
+            double d = sqrt(dx * dx + dy * dy);
+            fx += dx * d / k;
+            fy += dy * d / k;
+        }
+        double len = sqrt(fx * fx + fy * fy);
+        if (len > t) {
+            fx *= t / len;
+            fy *= t / len;
+        }
+        out[2 * i] = xi + fx;
+        out[2 * i + 1] = yi + fy;
+    }
+    pthread_mutex_lock(&g->lock);
+    if (--g->chunks_left > 0) {
+        pthread_mutex_unlock(&g->lock);
+        return;
+    }
+    /* Last chunk of the step */
+    g->cur = !g->cur;
+    g->steps++;
+    g->temperature *= UI_GRAPH_COOLING;
+    if (g->temperature < UI_GRAPH_MIN_TEMPERATURE) g->running = 0;
+    if (NULL != g->area && !g->redraw_queued) {
+        g->redraw_queued = 1;
+        g->refcount++;
+        uiQueueMain(graph_redraw, g);
+    }
+    if (NULL != g->area && g->running) {
+        graph_step_start(g);
+        return;
+    }
+    g->stepping = 0;
+    graph_layout_unlock_release(g);
+}
+
+/* Start a step. Must be called with the lock held and a reference for
+ * the step, and releases the lock. */
+static void graph_step_start(UIGraphLayout *g) {
+    g->stepping = 1;
+    g->step_temperature = g->temperature;
+    g->chunks_left = g->chunk_count;
+    pthread_mutex_unlock(&g->lock);
+    graph_build(g);
+    int32_t n = g->node_count;
+    for (int32_t i = 0; i < g->chunk_count; i++) {
+        g->jobs[i].start = (int32_t)((int64_t) n * i / g->chunk_count);
+        g->jobs[i].end = (int32_t)((int64_t) n * (i + 1) / g->chunk_count);
+    }
+    if (!ui_pool_submit(&g->jobs[0].job)) {
+        pthread_mutex_lock(&g->lock);
+        g->stepping = 0;
+        g->running = 0;
+        graph_layout_unlock_release(g);
+        return;
+    }
+    /* The pool may stop in between; a chunk it refuses runs here */
+    for (int32_t i = 1; i < g->chunk_count; i++) {
+        if (!ui_pool_submit(&g->jobs[i].job)) graph_job_run(&g->jobs[i].job);
+    }
+}
+
+/* Run the layout from a temperature. Called on the UI thread. */
+static void graph_layout_run(UIGraphLayout *g, double temperature) {
+    pthread_mutex_lock(&g->lock);
+    g->temperature = temperature;
+    g->running = g->node_count > 0 && temperature >= UI_GRAPH_MIN_TEMPERATURE;
+    if (g->stepping || !g->running) {
+        pthread_mutex_unlock(&g->lock);
+        return;
+    }
+    g->refcount++;
+    graph_step_start(g);
+}
+
+static double graph_start_temperature(int32_t n) {
+    double t = UI_GRAPH_EDGE_LENGTH * sqrt((double) n) / 10;
+    return t > UI_GRAPH_EDGE_LENGTH ? t : UI_GRAPH_EDGE_LENGTH;
+}
+
+static uint32_t graph_word(const uint8_t *p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* Make a layout with the nodes on a spiral. Returns NULL if out of
+ * memory. */
+static UIGraphLayout *graph_layout_new(int32_t n, const uint8_t *edges, int32_t m) {
+    UIGraphLayout *g = malloc(sizeof(UIGraphLayout));
+    if (NULL == g) return NULL;
+    memset(g, 0, sizeof(UIGraphLayout));
+    g->node_count = n;
+    g->cell_capacity = 3 * n + 64;
+    g->adj_first = calloc((size_t) n + 1, sizeof(int32_t));
+    g->adj = malloc(sizeof(int32_t) * 2 * ((size_t) m + 1));
+    g->pos[0] = malloc(sizeof(double) * 2 * ((size_t) n + 1));
+    g->pos[1] = malloc(sizeof(double) * 2 * ((size_t) n + 1));
+    g->cells = malloc(sizeof(UIQuadCell) * (size_t) g->cell_capacity);
+    g->next_body = malloc(sizeof(int32_t) * ((size_t) n + 1));
+    if (NULL == g->adj_first || NULL == g->adj || NULL == g->pos[0] || NULL == g->pos[1] ||
+            NULL == g->cells || NULL == g->next_body) {
+        pthread_mutex_init(&g->lock, NULL);
+        pthread_mutex_lock(&g->lock);
+        g->refcount = 1;
+        graph_layout_unlock_release(g);
+        return NULL;
+    }
+    /* Both ends of an edge list it, so each chunk only writes its own nodes */
+    for (int32_t e = 0; e < m; e++) {
+        uint32_t a = graph_word(edges + 8 * e), b = graph_word(edges + 8 * e + 4);
+        if (a == b) continue;
+        g->adj_first[a + 1]++;
+        g->adj_first[b + 1]++;
+    }
+    for (int32_t i = 0; i < n; i++) g->adj_first[i + 1] += g->adj_first[i];
+    int32_t *fill = g->next_body;
+    memcpy(fill, g->adj_first, sizeof(int32_t) * n);
+    for (int32_t e = 0; e < m; e++) {
+        uint32_t a = graph_word(edges + 8 * e), b = graph_word(edges + 8 * e + 4);
+        if (a == b) continue;
+        g->adj[fill[a]++] = (int32_t) b;
+        g->adj[fill[b]++] = (int32_t) a;
+    }
+    for (int32_t i = 0; i < n; i++) {
+        double r = UI_GRAPH_EDGE_LENGTH * sqrt(i + 0.5);
+        g->pos[0][2 * i] = r * cos(i * 2.399963);
+        g->pos[0][2 * i + 1] = r * sin(i * 2.399963);
+    }
+    int32_t chunks = n / UI_GRAPH_CHUNK;
+    if (chunks < 1) chunks = 1;
+    if (chunks > UI_POOL_MAX_THREADS) chunks = UI_POOL_MAX_THREADS;
+    g->chunk_count = chunks;
+    for (int32_t i = 0; i < chunks; i++) {
+        g->jobs[i].job.run = graph_job_run;
+        g->jobs[i].layout = g;
+    }
+    pthread_mutex_init(&g->lock, NULL);
+    g->refcount = 1;
+    return g;
+}
+
+static void graph_view_account(UIGraphView *gv, int64_t delta) {
+    gv->bytes += delta;
+    ui_mem.graph_view_bytes += delta;
+}
+
+/* Copy the positions of the last finished step */
+static void graph_view_sync(UIGraphView *gv) {
+    UIGraphLayout *g = gv->layout;
+    pthread_mutex_lock(&g->lock);
+    if (g->steps != gv->shown_step) {
+        memcpy(gv->shown, g->pos[g->cur], sizeof(double) * 2 * gv->node_count);
+        gv->shown_step = g->steps;
+    }
+    pthread_mutex_unlock(&g->lock);
+}
+
+static void graph_view_fit(UIGraphView *gv) {
+    if (gv->node_count == 0 || gv->width <= 0 || gv->height <= 0) return;
+    const double *p = gv->shown;
+    double x0 = p[0], y0 = p[1], x1 = p[0], y1 = p[1];
+    for (int32_t i = 1; i < gv->node_count; i++) {
+        if (p[2 * i] < x0) x0 = p[2 * i];
+        if (p[2 * i] > x1) x1 = p[2 * i];
+        if (p[2 * i + 1] < y0) y0 = p[2 * i + 1];
+        if (p[2 * i + 1] > y1) y1 = p[2 * i + 1];
+    }
+    double zx = gv->width / (x1 - x0 + 2 * UI_GRAPH_EDGE_LENGTH);
+    double zy = gv->height / (y1 - y0 + 2 * UI_GRAPH_EDGE_LENGTH);
+    gv->zoom = zx < zy ? zx : zy;
+    gv->cx = (x0 + x1) / 2;
+    gv->cy = (y0 + y1) / 2;
+}
+
+/* Zoom by a factor, keeping the layout point under px, py in place */
+static void graph_view_zoom(UIGraphView *gv, double factor, double px, double py) {
+    double wx = gv->cx + (px - gv->width / 2) / gv->zoom;
+    double wy = gv->cy + (py - gv->height / 2) / gv->zoom;
+    double zoom = gv->zoom * factor;
+    if (zoom < 1e-4) zoom = 1e-4;
+    if (zoom > 1e3) zoom = 1e3;
+    gv->zoom = zoom;
+    gv->cx = wx - (px - gv->width / 2) / zoom;
+    gv->cy = wy - (py - gv->height / 2) / zoom;
+    gv->fit = 0;
+}
+
+static double graph_view_radius(UIGraphView *gv) {
+    double r = gv->zoom * UI_GRAPH_EDGE_LENGTH / 6;
+    return r < 1.5 ? 1.5 : r > 8 ? 8 : r;
+}
+
+/* Node drawn under a point, or -1 */
+static int32_t graph_view_node_at(UIGraphView *gv, double px, double py) {
+    graph_view_sync(gv);
+    double r = graph_view_radius(gv);
+    double best = (r < 4 ? 4 : r) * (r < 4 ? 4 : r);
+    int32_t node = -1;
+    for (int32_t i = 0; i < gv->node_count; i++) {
+        double dx = (gv->shown[2 * i] - gv->cx) * gv->zoom + gv->width / 2 - px;
+        double dy = (gv->shown[2 * i + 1] - gv->cy) * gv->zoom + gv->height / 2 - py;
+        if (dx * dx + dy * dy <= best) {
+            best = dx * dx + dy * dy;
+            node = i;
+        }
+    }
+    return node;
+}
+
+/* Batches of lines or dots filled or stroked in one color. On GTK they
+ * go straight to cairo, as building libui paths costs more than the
+ * drawing; elsewhere they are libui paths. */
+typedef struct {
+#ifdef UI_GTK
+    cairo_t *cr;
+#else
+    uiDrawContext *ctx;
+    uiDrawPath *path;
+#endif
+    UIDrawCmd style;
+} UIGraphPen;
+
+static void graph_pen_begin(UIGraphPen *pen, UIColor color, float stroke) {
+    pen->style.color = color;
+    pen->style.stroke = stroke;
+#ifndef UI_GTK
+    pen->path = uiDrawNewPath(uiDrawFillModeWinding);
+#endif
+}
+
+static void graph_pen_line(UIGraphPen *pen, double ax, double ay, double bx, double by) {
+#ifdef UI_GTK
+    cairo_move_to(pen->cr, ax, ay);
+    cairo_line_to(pen->cr, bx, by);
+#else
+    uiDrawPathNewFigure(pen->path, ax, ay);
+    uiDrawPathLineTo(pen->path, bx, by);
+#endif
+}
+
+static void graph_pen_rect(UIGraphPen *pen, double x, double y, double w, double h) {
+#ifdef UI_GTK
+    cairo_rectangle(pen->cr, x, y, w, h);
+#else
+    uiDrawPathAddRectangle(pen->path, x, y, w, h);
+#endif
+}
+
+/* Small dots are squares, which are much cheaper to fill */
+static void graph_pen_dot(UIGraphPen *pen, double x, double y, double r) {
+    if (r < 3) {
+        graph_pen_rect(pen, x - r, y - r, 2 * r, 2 * r);
+        return;
+    }
+#ifdef UI_GTK
+    cairo_move_to(pen->cr, x + r, y);
+    cairo_arc(pen->cr, x, y, r, 0, 2 * UI_PI);
+#else
+    uiDrawPathNewFigureWithArc(pen->path, x, y, r, 0, 2 * UI_PI, 0);
+    uiDrawPathCloseFigure(pen->path);
+#endif
+}
+
+static void graph_pen_end(UIGraphPen *pen) {
+#ifdef UI_GTK
+    const UIColor *c = &pen->style.color;
+    cairo_set_source_rgba(pen->cr, c->r, c->g, c->b, c->a);
+    if (pen->style.stroke > 0) {
+        cairo_set_line_width(pen->cr, pen->style.stroke);
+        cairo_stroke(pen->cr);
+    } else {
+        cairo_fill(pen->cr);
+    }
+#else
+    draw_path_libui(pen->ctx, pen->path, &pen->style);
+    pen->path = NULL;
+#endif
+}
+
+static UIColor graph_color(uint32_t rgb) {
+    UIColor c = {((rgb >> 16) & 0xFF) / 255.0f, ((rgb >> 8) & 0xFF) / 255.0f, (rgb & 0xFF) / 255.0f, 1.0f};
+    return c;
+}
+
+static void graph_view_draw_handler(uiAreaHandler *ah, uiArea *area, uiAreaDrawParams *p) {
+    (void) area;
+    UIGraphView *gv = (UIGraphView *) area_from_handler(ah);
+    UIGraphPen pen;
+    memset(&pen, 0, sizeof(pen));
+#ifdef UI_GTK
+    pen.cr = ui_draw_cairo(p);
+    cairo_save(pen.cr);
+#else
+    pen.ctx = p->Context;
+#endif
+    gv->width = p->AreaWidth;
+    gv->height = p->AreaHeight;
+    graph_view_sync(gv);
+    if (gv->fit) graph_view_fit(gv);
+    gv->frames++;
+    const double *pos = gv->shown;
+    const UIGraphLayout *g = gv->layout;
+    double ox = gv->width / 2 - gv->cx * gv->zoom;
+    double oy = gv->height / 2 - gv->cy * gv->zoom;
+    double r = graph_view_radius(gv);
+    double x0 = p->ClipX - r, y0 = p->ClipY - r;
+    double x1 = p->ClipX + p->ClipWidth + r, y1 = p->ClipY + p->ClipHeight + r;
+    UIColor white = {1.0f, 1.0f, 1.0f, 1.0f};
+    UIColor grey = {0.5f, 0.5f, 0.5f, 0.6f};
+    graph_pen_begin(&pen, white, 0);
+    graph_pen_rect(&pen, p->ClipX, p->ClipY, p->ClipWidth, p->ClipHeight);
+    graph_pen_end(&pen);
+    /* Edges, each once, from the end with the lower index */
+    graph_pen_begin(&pen, grey, 1);
+    int32_t batch = 0;
+    for (int32_t i = 0; i < gv->node_count; i++) {
+        double ax = pos[2 * i] * gv->zoom + ox, ay = pos[2 * i + 1] * gv->zoom + oy;
+        for (int32_t e = g->adj_first[i]; e < g->adj_first[i + 1]; e++) {
+            int32_t j = g->adj[e];
+            if (j < i) continue;
+            double bx = pos[2 * j] * gv->zoom + ox, by = pos[2 * j + 1] * gv->zoom + oy;
+            if ((ax < x0 && bx < x0) || (ax > x1 && bx > x1) || (ay < y0 && by < y0) || (ay > y1 && by > y1)) continue;
+            graph_pen_line(&pen, ax, ay, bx, by);
+            if (++batch == UI_GRAPH_BATCH) {
+                graph_pen_end(&pen);
+                graph_pen_begin(&pen, grey, 1);
+                batch = 0;
+            }
+        }
+    }
+    graph_pen_end(&pen);
+    /* Nodes, filled once per run of the same color */
+    uint32_t color = 0;
+    batch = 0;
+    for (int32_t i = 0; i < gv->node_count; i++) {
+        double x = pos[2 * i] * gv->zoom + ox, y = pos[2 * i + 1] * gv->zoom + oy;
+        if (x < x0 || x > x1 || y < y0 || y > y1) continue;
+        if (batch == 0 || gv->colors[i] != color || batch == UI_GRAPH_BATCH) {
+            if (batch) graph_pen_end(&pen);
+            color = gv->colors[i];
+            graph_pen_begin(&pen, graph_color(color), 0);
+            batch = 0;
+        }
+        graph_pen_dot(&pen, x, y, r);
+        batch++;
+    }
+    if (batch) graph_pen_end(&pen);
+#ifdef UI_GTK
+    cairo_restore(pen.cr);
+#endif
+}
+
+static void graph_view_redraw(UIGraphView *gv) {
+    uiAreaQueueRedrawAll((uiArea *) gv->area.base.control);
+}
+
+static void graph_view_mouse_event_handler(uiAreaHandler *ah, uiArea *area, uiAreaMouseEvent *e) {
+    (void) area;
+    UIGraphView *gv = (UIGraphView *) area_from_handler(ah);
+    if (e->Down == 1) {
+        gv->dragging = 1;
+        gv->press_x = gv->last_x = e->X;
+        gv->press_y = gv->last_y = e->Y;
+    } else if (e->Up == 1 && gv->dragging) {
+        gv->dragging = 0;
+        /* A press that did not move is a click */
+        if (fabs(e->X - gv->press_x) + fabs(e->Y - gv->press_y) < 4) {
+            int32_t node = graph_view_node_at(gv, e->X, e->Y);
+            void *data = gv->area.base.handlers[0];
+            if (node >= 0 && NULL != data) janet_ui_handler_value(data, janet_wrap_integer(node));
+        }
+    } else if (gv->dragging && (e->Held1To64 & 1)) {
+        gv->cx -= (e->X - gv->last_x) / gv->zoom;
+        gv->cy -= (e->Y - gv->last_y) / gv->zoom;
+        gv->last_x = e->X;
+        gv->last_y = e->Y;
+        gv->fit = 0;
+        graph_view_redraw(gv);
+    }
+}
+
+static void graph_view_mouse_crossed_handler(uiAreaHandler *ah, uiArea *area, int left) {
+    (void) ah;
+    (void) area;
+    (void) left;
+}
+
+static void graph_view_drag_broken_handler(uiAreaHandler *ah, uiArea *area) {
+    (void) area;
+    ((UIGraphView *) area_from_handler(ah))->dragging = 0;
+}
+
+static int graph_view_key_event_handler(uiAreaHandler *ah, uiArea *area, uiAreaKeyEvent *e) {
+    (void) area;
+    UIGraphView *gv = (UIGraphView *) area_from_handler(ah);
+    if (e->Up) return 0;
+    double step = 50 / gv->zoom;
+    switch (e->ExtKey) {
+        case uiExtKeyLeft: gv->cx -= step; break;
+        case uiExtKeyRight: gv->cx += step; break;
+        case uiExtKeyUp: gv->cy -= step; break;
+        case uiExtKeyDown: gv->cy += step; break;
+        default:
+            if (e->Key == '+' || e->Key == '=') {
+                graph_view_zoom(gv, 1.25, gv->width / 2, gv->height / 2);
+            } else if (e->Key == '-') {
+                graph_view_zoom(gv, 0.8, gv->width / 2, gv->height / 2);
+            } else if (e->Key == '0') {
+                gv->fit = 1;
+            } else {
+                return 0;
+            }
+            graph_view_redraw(gv);
+            return 1;
+    }
+    gv->fit = 0;
+    graph_view_redraw(gv);
+    return 1;
+}
+
+#ifdef UI_GTK
+/* libui areas do not report the mouse wheel, so take scroll events
+ * from the GTK widget directly. Elsewhere the view zooms with the
+ * keyboard. */
+static gboolean graph_view_scroll_event(GtkWidget *widget, GdkEventScroll *e, gpointer data) {
+    (void) widget;
+    UIGraphView *gv = (UIGraphView *)data;
+    double dy;
+    switch (e->direction) {
+        case GDK_SCROLL_UP: dy = -1; break;
+        case GDK_SCROLL_DOWN: dy = 1; break;
+        case GDK_SCROLL_SMOOTH: dy = e->delta_y; break;
+        default: return FALSE;
+    }
+    graph_view_zoom(gv, pow(1.1, -dy), e->x, e->y);
+    graph_view_redraw(gv);
+    return TRUE;
+}
+#endif
+
+static void graph_view_release(UIControlWrapper *w) {
+    UIGraphView *gv = (UIGraphView *)w;
+    UIGraphLayout *g = gv->layout;
+    pthread_mutex_lock(&g->lock);
+    g->area = NULL;
+    g->running = 0;
+    graph_layout_unlock_release(g);
+    free(gv->colors);
+    free(gv->shown);
+    gv->colors = NULL;
+    gv->shown = NULL;
+    gv->node_count = 0;
+    graph_view_account(gv, -gv->bytes);
+}
+
+static UIGraphView *janet_getgraphview(const Janet *argv, int32_t n) {
+    janet_getuitype(argv, n, &graph_view_td);
+    return janet_unwrap_abstract(argv[n]);
+}
+
+static Janet janet_ui_graph_view(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    assert_inited();
+    JanetByteView nodes = janet_getbytes(argv, 0);
+    JanetByteView edges = janet_getbytes(argv, 1);
+    if (nodes.len % 4) janet_panic("expected nodes as 32 bit words");
+    if (edges.len % 8) janet_panic("expected edges as pairs of 32 bit words");
+    int32_t n = nodes.len / 4;
+    int32_t m = edges.len / 8;
+    for (int32_t e = 0; e < 2 * m; e++) {
+        uint32_t node = graph_word(edges.bytes + 4 * e);
+        if (node >= (uint32_t) n) janet_panicf("edge %d refers to node %d, out of range", e / 2, (int32_t) node);
+    }
+    UIGraphLayout *g = graph_layout_new(n, edges.bytes, m);
+    uint32_t *colors = malloc(sizeof(uint32_t) * ((size_t) n + 1));
+    double *shown = malloc(sizeof(double) * 2 * ((size_t) n + 1));
+    if (NULL == g || NULL == colors || NULL == shown) {
+        if (NULL != g) {
+            pthread_mutex_lock(&g->lock);
+            graph_layout_unlock_release(g);
+        }
+        free(colors);
+        free(shown);
+        janet_panic("out of memory");
+    }
+    for (int32_t i = 0; i < n; i++) colors[i] = graph_word(nodes.bytes + 4 * i);
+    memcpy(shown, g->pos[0], sizeof(double) * 2 * n);
+    UIGraphView *gv = janet_abstract(&graph_view_td, sizeof(UIGraphView));
+    memset(gv, 0, sizeof(UIGraphView));
+    gv->layout = g;
+    gv->node_count = n;
+    gv->edge_count = m;
+    gv->colors = colors;
+    gv->shown = shown;
+    gv->zoom = 1;
+    gv->fit = 1;
+    graph_view_account(gv, (int64_t) n * (sizeof(uint32_t) + 6 * sizeof(double) + 2 * sizeof(int32_t)) +
+                       (int64_t) g->adj_first[n] * (int64_t) sizeof(int32_t) +
+                       (int64_t) g->cell_capacity * (int64_t) sizeof(UIQuadCell));
+    gv->area.handler.Draw = graph_view_draw_handler;
+    gv->area.handler.MouseEvent = graph_view_mouse_event_handler;
+    gv->area.handler.MouseCrossed = graph_view_mouse_crossed_handler;
+    gv->area.handler.DragBroken = graph_view_drag_broken_handler;
+    gv->area.handler.KeyEvent = graph_view_key_event_handler;
+    gv->area.draw_context = janet_wrap_nil();
+    uiArea *area = uiNewArea(&gv->area.handler);
+    gv->area.base.control = uiControl(area);
+    wrapper_cache_put(&gv->area.base);
+    gv->area.base.release = graph_view_release;
+#ifdef UI_GTK
+    gtk_widget_add_events(GTK_WIDGET(uiControlHandle(uiControl(area))), GDK_SCROLL_MASK | GDK_SMOOTH_SCROLL_MASK);
+    janet_ui_connect(&gv->area.base, "scroll-event", G_CALLBACK(graph_view_scroll_event));
+#endif
+    janet_ui_state_push(&gv->area.base, argv[0]);
+    janet_ui_state_push(&gv->area.base, argv[1]);
+    ui_mem.controls[control_type_index(&graph_view_td)]++;
+    UI_PROBE2(control__create, graph_view_td.name, gv->area.base.control);
+    g->area = area;
+    graph_layout_run(g, graph_start_temperature(n));
+    return janet_wrap_abstract(gv);
 }
 
-static Janet janet_ui_combobox_append(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 2);
-    uiCombobox *cbox = janet_getuitype(argv, 0, &combobox_td);
-    const uint8_t *text = janet_getstring(argv, 1);
-    uiComboboxAppend(cbox, (const char *)text);
+/* Call a handler with the index of a clicked node */
+static Janet janet_ui_graph_view_on_node_clicked(int32_t argc, Janet *argv) {
+    janet_arity(argc, 2, 3);
+    janet_getgraphview(argv, 0);
+    janet_ui_to_control_handler_data(argc, argv, 0);
     return argv[0];
 }
 
-static void combobox_on_selected(uiCombobox *c, void *data) {
-    (void) c;
-    janet_ui_handler(data);
+/* Run the layout again from the current positions, by default as hot
+ * as a new layout */
+static Janet janet_ui_graph_view_reheat(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    UIGraphView *gv = janet_getgraphview(argv, 0);
+    double t = argc == 2 ? janet_getnumber(argv, 1) : graph_start_temperature(gv->node_count);
+    if (!isfinite(t)) janet_panicf("expected finite temperature, got %v", argv[1]);
+    graph_layout_run(gv->layout, t);
+    return argv[0];
 }
 
-static Janet janet_ui_combobox_on_selected(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 2);
-    uiCombobox *cbox = janet_getuitype(argv, 0, &combobox_td);
-    assert_callable(argv, 1);
-    void *handle = janet_ui_to_handler_data(argv[1]);
-    uiComboboxOnSelected(cbox, combobox_on_selected, handle);
+/* Stop the layout after the step in flight */
+static Janet janet_ui_graph_view_stop(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UIGraphView *gv = janet_getgraphview(argv, 0);
+    pthread_mutex_lock(&gv->layout->lock);
+    gv->layout->running = 0;
+    pthread_mutex_unlock(&gv->layout->lock);
     return argv[0];
 }
 
-/* Editable Combobox */
-
-static Janet janet_ui_editable_combobox(int32_t argc, Janet *argv) {
-    assert_inited();
-    return janet_ui_handle_to_control(uiNewEditableCombobox(), &editable_combobox_td);
+/* Fit the graph to the view, following the layout as it moves */
+static Janet janet_ui_graph_view_fit(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UIGraphView *gv = janet_getgraphview(argv, 0);
+    gv->fit = 1;
+    graph_view_redraw(gv);
+    return argv[0];
 }
 
-static Janet janet_ui_editable_combobox_text(int32_t argc, Janet *argv) {
-    janet_arity(argc, 1, 2);
-    uiEditableCombobox *cbox = janet_getuitype(argv, 0, &editable_combobox_td);
-    if (argc == 2) {
-        const uint8_t *text = janet_getstring(argv, 1);
-        uiEditableComboboxSetText(cbox, (const char *)text);
+/* Get or set the layout point at the center of the view and the zoom,
+ * as [x y zoom] */
+static Janet janet_ui_graph_view_view(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 4);
+    UIGraphView *gv = janet_getgraphview(argv, 0);
+    if (argc > 1) {
+        if (argc < 3) janet_panic("expected x and y");
+        gv->cx = janet_getnumber(argv, 1);
+        gv->cy = janet_getnumber(argv, 2);
+        if (argc == 4) {
+            double zoom = janet_getnumber(argv, 3);
+            if (!(zoom > 0)) janet_panic("expected positive zoom");
+            gv->zoom = zoom;
+        }
+        gv->fit = 0;
+        graph_view_redraw(gv);
         return argv[0];
     }
-    return janet_cstringv(uiEditableComboboxText(cbox));
+    Janet *tup = janet_tuple_begin(3);
+    tup[0] = janet_wrap_number(gv->cx);
+    tup[1] = janet_wrap_number(gv->cy);
+    tup[2] = janet_wrap_number(gv->zoom);
+    return janet_wrap_tuple(janet_tuple_end(tup));
 }
 
-static Janet janet_ui_editable_combobox_append(int32_t argc, Janet *argv) {
+/* Position of a node after the last finished step, as [x y] */
+static Janet janet_ui_graph_view_position(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 2);
-    uiEditableCombobox *cbox = janet_getuitype(argv, 0, &editable_combobox_td);
-    const uint8_t *text = janet_getstring(argv, 1);
-    uiEditableComboboxAppend(cbox, (const char *)text);
-    return argv[0];
+    UIGraphView *gv = janet_getgraphview(argv, 0);
+    int32_t node = janet_getinteger(argv, 1);
+    if (node < 0 || node >= gv->node_count) janet_panicf("node %d out of range", node);
+    graph_view_sync(gv);
+    Janet *tup = janet_tuple_begin(2);
+    tup[0] = janet_wrap_number(gv->shown[2 * node]);
+    tup[1] = janet_wrap_number(gv->shown[2 * node + 1]);
+    return janet_wrap_tuple(janet_tuple_end(tup));
 }
 
-static void editable_combobox_on_changed(uiEditableCombobox *c, void *data) {
-    (void) c;
-    janet_ui_handler(data);
+/* Node drawn under a point of the view, or nil */
+static Janet janet_ui_graph_view_node_at(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 3);
+    UIGraphView *gv = janet_getgraphview(argv, 0);
+    int32_t node = graph_view_node_at(gv, janet_getnumber(argv, 1), janet_getnumber(argv, 2));
+    return node < 0 ? janet_wrap_nil() : janet_wrap_integer(node);
 }
 
-static Janet janet_ui_editable_combobox_on_changed(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 2);
-    uiEditableCombobox *cbox = janet_getuitype(argv, 0, &editable_combobox_td);
-    assert_callable(argv, 1);
-    void *handle = janet_ui_to_handler_data(argv[1]);
-    uiEditableComboboxOnChanged(cbox, editable_combobox_on_changed, handle);
-    return argv[0];
+static Janet janet_ui_graph_view_stats(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UIGraphView *gv = janet_getgraphview(argv, 0);
+    UIGraphLayout *g = gv->layout;
+    pthread_mutex_lock(&g->lock);
+    uint64_t steps = g->steps;
+    double temperature = g->temperature;
+    int running = g->running;
+    pthread_mutex_unlock(&g->lock);
+    JanetKV *st = janet_struct_begin(7);
+    janet_struct_put(st, janet_ckeywordv("nodes"), janet_wrap_integer(gv->node_count));
+    janet_struct_put(st, janet_ckeywordv("edges"), janet_wrap_integer(gv->edge_count));
+    janet_struct_put(st, janet_ckeywordv("steps"), janet_wrap_number((double) steps));
+    janet_struct_put(st, janet_ckeywordv("temperature"), janet_wrap_number(temperature));
+    janet_struct_put(st, janet_ckeywordv("running"), janet_wrap_boolean(running));
+    janet_struct_put(st, janet_ckeywordv("frames"), janet_wrap_number((double) gv->frames));
+    janet_struct_put(st, janet_ckeywordv("bytes"), janet_wrap_number((double) gv->bytes));
+    return janet_wrap_struct(janet_struct_end(st));
 }
 
-/* Radio buttons */
+/* Snapshot */
 
-static Janet janet_ui_radio_buttons(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 0);
-    (void) argv;
-    assert_inited();
-    return janet_ui_handle_to_control(uiNewRadioButtons(), &radio_buttons_td);
+/* ui/snapshot captures a control tree as plain Janet data, which can
+ * be marshalled into an image, and ui/restore rebuilds it in one
+ * native pass through the same bindings that built it. Handlers are
+ * kept as the functions they were registered with. Menus are not
+ * captured, as libui only allows creating them before any window.
+ * Date-time pickers have no binding to restore them with, and aliases
+ * found through ui/parent have no state of their own, so trees holding
+ * either are rejected rather than restored with holes. */
+
+/* The on-* binding that registers the handler in each event slot */
+typedef struct {
+    const JanetAbstractType *type;
+    int slot;
+    JanetCFunction setter;
+} UIHandlerSetter;
+
+static const UIHandlerSetter handler_setters[] = {
+    {&window_td, 0, janet_ui_window_on_closing},
+    {&window_td, 1, janet_ui_window_on_content_size_changed},
+    {&button_td, 0, janet_ui_button_on_clicked},
+    {&box_td, 0, janet_ui_box_on_first_shown},
+    {&checkbox_td, 0, janet_ui_checkbox_on_toggled},
+    {&entry_td, 0, janet_ui_entry_on_changed},
+    {&spinbox_td, 0, janet_ui_spinbox_on_changed},
+    {&slider_td, 0, janet_ui_slider_on_changed},
+    {&combobox_td, 0, janet_ui_combobox_on_selected},
+    {&editable_combobox_td, 0, janet_ui_editable_combobox_on_changed},
+    {&radio_buttons_td, 0, janet_ui_radio_buttons_on_selected},
+    {&multiline_entry_td, 0, janet_ui_multiline_entry_on_changed},
+    {&area_td, UI_AREA_DRAW, janet_ui_area_on_draw},
+    {&area_td, UI_AREA_MOUSE_EVENT, janet_ui_area_on_mouse_event},
+    {&area_td, UI_AREA_MOUSE_CROSSED, janet_ui_area_on_mouse_crossed},
+    {&area_td, UI_AREA_DRAG_BROKEN, janet_ui_area_on_drag_broken},
+    {&area_td, UI_AREA_KEY_EVENT, janet_ui_area_on_key_event},
+    {&virtual_list_td, 0, janet_ui_virtual_list_on_selected},
+    {&file_view_td, 0, janet_ui_virtual_list_on_selected},
+    {&text_view_td, 0, janet_ui_virtual_list_on_selected},
+    {&tree_view_td, 0, janet_ui_virtual_list_on_selected},
+    {&graph_view_td, 0, janet_ui_graph_view_on_node_clicked}
+};
+
+#define UI_NUM_HANDLER_SETTERS ((int32_t)(sizeof(handler_setters) / sizeof(handler_setters[0])))
+
+static const UIHandlerSetter *handler_setter(const JanetAbstractType *at, int slot) {
+    for (int32_t i = 0; i < UI_NUM_HANDLER_SETTERS; i++) {
+        if (handler_setters[i].type == at && handler_setters[i].slot == slot) return handler_setters + i;
+    }
+    return NULL;
 }
 
-static Janet janet_ui_radio_buttons_selected(int32_t argc, Janet *argv) {
-    janet_arity(argc, 1, 2);
-    uiRadioButtons *rb = janet_getuitype(argv, 0, &radio_buttons_td);
-    if (argc == 2) {
-        int selected = janet_getboolean(argv, 1);
-        uiRadioButtonsSetSelected(rb, selected);
-        return argv[0];
+static const char *const entry_kinds[] = {"entry", "password", "search"};
+
+static void snapshot_put(JanetTable *t, const char *key, Janet value) {
+    janet_table_put(t, janet_ckeywordv(key), value);
+}
+
+static Janet snapshot_state(UIControlWrapper *w) {
+    if (NULL == w->state) return janet_wrap_tuple(janet_tuple_n(NULL, 0));
+    return janet_wrap_tuple(janet_tuple_n(w->state->data, w->state->count));
+}
+
+static Janet snapshot_control(UIControlWrapper *w) {
+    const JanetAbstractType *at = janet_abstract_type(w);
+    if (at == &menu_td || at == &menu_item_td) return janet_wrap_nil();
+    if (at == &date_time_picker_td || (w->flags & UI_FLAG_ALIAS)) {
+        janet_panicf("cannot snapshot a control of type %s", at->name);
     }
-    return janet_wrap_integer(uiRadioButtonsSelected(rb));
+    void *c = w->control;
+    JanetTable *t = janet_table(8);
+    /* Skip the "ui/" prefix of the type name */
+    snapshot_put(t, "type", janet_ckeywordv(at->name + 3));
+    if (at != &window_td) {
+        if (!uiControlVisible(uiControl(c))) snapshot_put(t, "visible", janet_wrap_false());
+    } else {
+        snapshot_put(t, "visible", janet_wrap_boolean(uiControlVisible(uiControl(c))));
+    }
+    if (!uiControlEnabled(uiControl(c))) snapshot_put(t, "enabled", janet_wrap_false());
+    if (at == &window_td) {
+        int width = 0, height = 0;
+        uiWindowContentSize(c, &width, &height);
+        snapshot_put(t, "title", janet_ui_take_text(uiWindowTitle(c)));
+        snapshot_put(t, "width", janet_wrap_integer(width));
+        snapshot_put(t, "height", janet_wrap_integer(height));
+        snapshot_put(t, "menu-bar", janet_wrap_boolean(w->kind));
+        snapshot_put(t, "margined", janet_wrap_boolean(uiWindowMargined(c)));
+        snapshot_put(t, "borderless", janet_wrap_boolean(uiWindowBorderless(c)));
+        snapshot_put(t, "fullscreen", janet_wrap_boolean(uiWindowFullscreen(c)));
+    } else if (at == &button_td) {
+        snapshot_put(t, "text", janet_ui_take_text(uiButtonText(c)));
+    } else if (at == &box_td) {
+        snapshot_put(t, "vertical", janet_wrap_boolean(w->kind));
+        snapshot_put(t, "padded", janet_wrap_boolean(uiBoxPadded(c)));
+        Janet *stretchy = janet_tuple_begin(w->child_count);
+        for (int32_t i = 0; i < w->child_count; i++) stretchy[i] = janet_wrap_boolean(w->children[i]->stretchy);
+        snapshot_put(t, "stretchy", janet_wrap_tuple(janet_tuple_end(stretchy)));
+    } else if (at == &checkbox_td) {
+        snapshot_put(t, "text", janet_ui_take_text(uiCheckboxText(c)));
+        snapshot_put(t, "checked", janet_wrap_boolean(uiCheckboxChecked(c)));
+    } else if (at == &entry_td) {
+        snapshot_put(t, "kind", janet_ckeywordv(entry_kinds[w->kind]));
+        snapshot_put(t, "text", janet_ui_take_text(uiEntryText(c)));
+        snapshot_put(t, "read-only", janet_wrap_boolean(uiEntryReadOnly(c)));
+    } else if (at == &label_td) {
+        snapshot_put(t, "text", janet_ui_take_text(uiLabelText(c)));
+    } else if (at == &tab_td) {
+        int pages = uiTabNumPages(c);
+        Janet *margined = janet_tuple_begin(pages);
+        for (int i = 0; i < pages; i++) margined[i] = janet_wrap_boolean(uiTabMargined(c, i));
+        Janet *names = janet_tuple_begin(w->child_count);
+        for (int32_t i = 0; i < w->child_count; i++) {
+            JanetString name = w->children[i]->page_name;
+            names[i] = NULL == name ? janet_cstringv("") : janet_wrap_string(name);
+        }
+        snapshot_put(t, "pages", janet_wrap_tuple(janet_tuple_end(names)));
+        snapshot_put(t, "margined", janet_wrap_tuple(janet_tuple_end(margined)));
+    } else if (at == &group_td) {
+        snapshot_put(t, "title", janet_ui_take_text(uiGroupTitle(c)));
+        snapshot_put(t, "margined", janet_wrap_boolean(uiGroupMargined(c)));
+    } else if (at == &spinbox_td || at == &slider_td) {
+        snapshot_put(t, "min", w->state->data[0]);
+        snapshot_put(t, "max", w->state->data[1]);
+        snapshot_put(t, "value", janet_wrap_integer(at == &spinbox_td ? uiSpinboxValue(c) : uiSliderValue(c)));
+    } else if (at == &progress_bar_td) {
+        snapshot_put(t, "value", janet_wrap_integer(uiProgressBarValue(c)));
+    } else if (at == &separator_td) {
+        snapshot_put(t, "vertical", janet_wrap_boolean(w->kind));
+    } else if (at == &combobox_td) {
+        snapshot_put(t, "items", snapshot_state(w));
+        snapshot_put(t, "selected", janet_wrap_integer(uiComboboxSelected(c)));
+    } else if (at == &editable_combobox_td) {
+        snapshot_put(t, "items", snapshot_state(w));
+        snapshot_put(t, "text", janet_ui_take_text(uiEditableComboboxText(c)));
+    } else if (at == &radio_buttons_td) {
+        snapshot_put(t, "items", snapshot_state(w));
+        snapshot_put(t, "selected", janet_wrap_integer(uiRadioButtonsSelected(c)));
+    } else if (at == &multiline_entry_td) {
+        snapshot_put(t, "wrapping", janet_wrap_boolean(!w->kind));
+        snapshot_put(t, "text", janet_ui_take_text(uiMultilineEntryText(c)));
+        snapshot_put(t, "read-only", janet_wrap_boolean(uiMultilineEntryReadOnly(c)));
+    } else if (at == &area_td) {
+        if (w->kind) snapshot_put(t, "size", snapshot_state(w));
+    } else if (at == &virtual_list_td) {
+        UIVirtualList *vl = (UIVirtualList *)w;
+        snapshot_put(t, "count", janet_wrap_number((double) vl->count));
+        snapshot_put(t, "row-height", janet_wrap_number(vl->row_height));
+        snapshot_put(t, "render", vl->render);
+        snapshot_put(t, "estimated", janet_wrap_boolean(vl->estimated));
+        snapshot_put(t, "top", janet_wrap_number((double) vl->top));
+        if (vl->selected >= 0) snapshot_put(t, "selected", janet_wrap_number((double) vl->selected));
+    } else if (at == &file_view_td) {
+        snapshot_put(t, "path", w->state->data[0]);
+        snapshot_put(t, "follow", w->state->data[1]);
+    } else if (at == &text_view_td) {
+        UITextView *tv = (UITextView *)w;
+        JanetBuffer *text = janet_buffer(0);
+        for (int64_t i = 0; i < tv->list.count; i++) {
+            janet_buffer_push_bytes(text, (const uint8_t *) tv->lines[i].text, tv->lines[i].len);
+            if (i + 1 < tv->list.count || !tv->partial) janet_buffer_push_u8(text, '\n');
+        }
+        snapshot_put(t, "rules", w->state->data[0]);
+        snapshot_put(t, "text", janet_wrap_string(janet_string(text->data, text->count)));
+    } else if (at == &tree_view_td) {
+        snapshot_put(t, "fetch", w->state->data[0]);
+        snapshot_put(t, "root", ((UITreeView *)w)->keys->data[0]);
+    } else if (at == &graph_view_td) {
+        snapshot_put(t, "nodes", w->state->data[0]);
+        snapshot_put(t, "edges", w->state->data[1]);
+    }
+    JanetArray *handlers = janet_array(0);
+    for (int i = 0; i < UI_MAX_SLOTS; i++) {
+        UIHandler *h = (UIHandler *) w->handlers[i];
+        if (NULL == h) continue;
+        Janet *entry = janet_tuple_begin(3);
+        entry[0] = janet_wrap_integer(i);
+        entry[1] = h->function;
+        entry[2] = janet_wrap_boolean(h->flags & UI_HANDLER_ARGS);
+        janet_array_push(handlers, janet_wrap_tuple(janet_tuple_end(entry)));
+    }
+    if (handlers->count) snapshot_put(t, "handlers", janet_wrap_array(handlers));
+    if (w->child_count) {
+        JanetArray *children = janet_array(w->child_count);
+        for (int32_t i = 0; i < w->child_count; i++) {
+            janet_array_push(children, snapshot_control(w->children[i]));
+        }
+        snapshot_put(t, "children", janet_wrap_array(children));
+    }
+    return janet_wrap_struct(janet_table_to_struct(t));
 }
 
-static Janet janet_ui_radio_buttons_append(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 2);
-    uiRadioButtons *rb = janet_getuitype(argv, 0, &radio_buttons_td);
-    const uint8_t *text = janet_getstring(argv, 1);
-    uiRadioButtonsAppend(rb, (const char *)text);
-    return argv[0];
+static Janet janet_ui_snapshot(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    UIControlWrapper *w = janet_getcontrolwrapper(argv, 0);
+    if (w->flags & UI_FLAG_ALIAS) janet_panic("cannot snapshot a control through ui/parent");
+    return snapshot_control(w);
 }
 
-static void radio_buttons_on_selected(uiRadioButtons *rb, void *data) {
-    (void) rb;
-    janet_ui_handler(data);
+/* Get a field of a control spec, or nil */
+static Janet spec_get(Janet spec, const char *key) {
+    return janet_get(spec, janet_ckeywordv(key));
 }
 
-static Janet janet_ui_radio_buttons_on_selected(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 2);
-    uiRadioButtons *rb = janet_getuitype(argv, 0, &radio_buttons_td);
-    assert_callable(argv, 1);
-    void *handle = janet_ui_to_handler_data(argv[1]);
-    uiRadioButtonsOnSelected(rb, radio_buttons_on_selected, handle);
-    return argv[0];
+static int spec_flag(Janet spec, const char *key, int dflt) {
+    Janet x = spec_get(spec, key);
+    return janet_checktype(x, JANET_NIL) ? dflt : janet_truthy(x);
 }
 
-/* Multiline Entry */
+/* Call a binding with up to four arguments, returning its result */
+static Janet spec_call(JanetCFunction cfun, int32_t argc, Janet a, Janet b, Janet c, Janet d) {
+    Janet argv[4] = {a, b, c, d};
+    return cfun(argc, argv);
+}
 
-static Janet janet_ui_multiline_entry(int32_t argc, Janet *argv) {
-    janet_arity(argc, 0, 1);
-    int nowrap = 0;
-    assert_inited();
-    if (argc == 1) nowrap = janet_getboolean(argv, 0);
-    return janet_ui_handle_to_control(
-            nowrap ? uiNewNonWrappingMultilineEntry() : uiNewMultilineEntry(),
-            &multiline_entry_td);
+/* Get a sequence field of a control spec */
+static JanetView spec_view(Janet spec, const char *key) {
+    JanetView view = {NULL, 0};
+    Janet x = spec_get(spec, key);
+    if (!janet_checktype(x, JANET_NIL) && !janet_indexed_view(x, &view.items, &view.len)) {
+        janet_panicf("expected indexed :%s in control spec, got %v", key, x);
+    }
+    return view;
 }
 
-static Janet janet_ui_multiline_entry_text(int32_t argc, Janet *argv) {
-    janet_arity(argc, 1, 2);
-    uiMultilineEntry *me = janet_getuitype(argv, 0, &multiline_entry_td);
-    if (argc == 2) {
-        const uint8_t *text = janet_getstring(argv, 1);
-        uiMultilineEntrySetText(me, (const char *)text);
-        return argv[0];
+static Janet restore_control(Janet spec);
+
+/* Restore the children of a container spec into the container */
+static void restore_children(Janet ctl, Janet spec) {
+    const JanetAbstractType *at = janet_abstract_type(janet_unwrap_abstract(ctl));
+    JanetView children = spec_view(spec, "children");
+    JanetView extra = {NULL, 0};
+    JanetView margined = {NULL, 0};
+    if (at == &tab_td) {
+        extra = spec_view(spec, "pages");
+        margined = spec_view(spec, "margined");
+    } else if (at == &box_td) {
+        extra = spec_view(spec, "stretchy");
+    }
+    Janet nil = janet_wrap_nil();
+    for (int32_t i = 0; i < children.len; i++) {
+        if (janet_checktype(children.items[i], JANET_NIL)) continue;
+        Janet child = restore_control(children.items[i]);
+        Janet x = i < extra.len ? extra.items[i] : nil;
+        if (at == &window_td) {
+            spec_call(janet_ui_window_set_child, 2, ctl, child, nil, nil);
+        } else if (at == &group_td) {
+            spec_call(janet_ui_group_set_child, 2, ctl, child, nil, nil);
+        } else if (at == &box_td) {
+            spec_call(janet_ui_box_append, 3, ctl, child, janet_wrap_boolean(janet_truthy(x)), nil);
+        } else if (at == &tab_td) {
+            int32_t page = uiTabNumPages(janet_getuitype(&ctl, 0, &tab_td));
+            spec_call(janet_ui_tab_append, 3, ctl, janet_checktype(x, JANET_NIL) ? janet_cstringv("") : x, child, nil);
+            if (i < margined.len && janet_truthy(margined.items[i])) {
+                spec_call(janet_ui_tab_margined, 3, ctl, janet_wrap_integer(page), janet_wrap_true(), nil);
+            }
+        } else {
+            janet_panicf("control spec %v cannot have children", spec);
+        }
     }
-    return janet_cstringv(uiMultilineEntryText(me));
 }
 
-static Janet janet_ui_multiline_entry_read_only(int32_t argc, Janet *argv) {
-    janet_arity(argc, 1, 2);
-    uiMultilineEntry *me = janet_getuitype(argv, 0, &multiline_entry_td);
-    if (argc == 2) {
-        int selected = janet_getboolean(argv, 1);
-        uiMultilineEntrySetReadOnly(me, selected);
-        return argv[0];
+static Janet restore_control(Janet spec) {
+    Janet nil = janet_wrap_nil();
+    Janet type = spec_get(spec, "type");
+    if (!janet_checktype(type, JANET_KEYWORD)) janet_panicf("expected control spec, got %v", spec);
+    const char *name = (const char *) janet_unwrap_keyword(type);
+    const JanetAbstractType *at = NULL;
+    for (int i = 0; i < UI_NUM_CONTROL_TYPES; i++) {
+        if (!strcmp(control_types[i]->name + 3, name)) at = control_types[i];
     }
-    return janet_wrap_boolean(uiMultilineEntryReadOnly(me));
+    Janet ctl;
+    Janet text = spec_get(spec, "text");
+    if (!janet_checktype(text, JANET_NIL) && !janet_checktype(text, JANET_STRING)) {
+        janet_panicf("expected string :text in control spec, got %v", text);
+    }
+    if (janet_checktype(text, JANET_NIL)) text = janet_cstringv("");
+    if (at == &window_td) {
+        Janet title = spec_get(spec, "title");
+        Janet width = spec_get(spec, "width");
+        Janet height = spec_get(spec, "height");
+        ctl = spec_call(janet_ui_window, 4,
+                janet_checktype(title, JANET_NIL) ? janet_cstringv("") : title,
+                janet_checktype(width, JANET_NIL) ? janet_wrap_integer(800) : width,
+                janet_checktype(height, JANET_NIL) ? janet_wrap_integer(600) : height,
+                janet_wrap_boolean(spec_flag(spec, "menu-bar", 0)));
+        uiWindow *window = janet_getuitype(&ctl, 0, &window_td);
+        uiWindowSetMargined(window, spec_flag(spec, "margined", 0));
+        uiWindowSetBorderless(window, spec_flag(spec, "borderless", 0));
+        if (spec_flag(spec, "fullscreen", 0)) uiWindowSetFullscreen(window, 1);
+    } else if (at == &button_td) {
+        ctl = spec_call(janet_ui_button, 1, text, nil, nil, nil);
+    } else if (at == &box_td) {
+        ctl = spec_call(spec_flag(spec, "vertical", 0) ? janet_ui_vertical_box : janet_ui_horizontal_box,
+                0, nil, nil, nil, nil);
+        uiBoxSetPadded(janet_getuitype(&ctl, 0, &box_td), spec_flag(spec, "padded", 0));
+    } else if (at == &checkbox_td) {
+        ctl = spec_call(janet_ui_checkbox, 1, text, nil, nil, nil);
+        uiCheckboxSetChecked(janet_getuitype(&ctl, 0, &checkbox_td), spec_flag(spec, "checked", 0));
+    } else if (at == &entry_td) {
+        Janet kind = spec_get(spec, "kind");
+        JanetCFunction ctor = janet_ui_entry;
+        if (janet_keyeq(kind, "password")) ctor = janet_ui_password_entry;
+        if (janet_keyeq(kind, "search")) ctor = janet_ui_search_entry;
+        ctl = spec_call(ctor, 0, nil, nil, nil, nil);
+        uiEntry *entry = janet_getuitype(&ctl, 0, &entry_td);
+        uiEntrySetText(entry, (const char *) janet_unwrap_string(text));
+        uiEntrySetReadOnly(entry, spec_flag(spec, "read-only", 0));
+    } else if (at == &label_td) {
+        ctl = spec_call(janet_ui_label, 1, text, nil, nil, nil);
+    } else if (at == &tab_td) {
+        ctl = spec_call(janet_ui_tab, 0, nil, nil, nil, nil);
+    } else if (at == &group_td) {
+        Janet title = spec_get(spec, "title");
+        ctl = spec_call(janet_ui_group, 1, janet_checktype(title, JANET_NIL) ? janet_cstringv("") : title,
+                nil, nil, nil);
+        uiGroupSetMargined(janet_getuitype(&ctl, 0, &group_td), spec_flag(spec, "margined", 0));
+    } else if (at == &spinbox_td || at == &slider_td) {
+        ctl = spec_call(at == &spinbox_td ? janet_ui_spinbox : janet_ui_slider, 2,
+                spec_get(spec, "min"), spec_get(spec, "max"), nil, nil);
+        Janet value = spec_get(spec, "value");
+        if (!janet_checktype(value, JANET_NIL)) {
+            spec_call(at == &spinbox_td ? janet_ui_spinbox_value : janet_ui_slider_value, 2, ctl, value, nil, nil);
+        }
+    } else if (at == &progress_bar_td) {
+        ctl = spec_call(janet_ui_progress_bar, 0, nil, nil, nil, nil);
+        Janet value = spec_get(spec, "value");
+        if (!janet_checktype(value, JANET_NIL)) {
+            spec_call(janet_ui_progress_bar_value, 2, ctl, value, nil, nil);
+        }
+    } else if (at == &separator_td) {
+        ctl = spec_call(spec_flag(spec, "vertical", 0) ? janet_ui_vertical_separator : janet_ui_horizontal_separator,
+                0, nil, nil, nil, nil);
+    } else if (at == &combobox_td || at == &editable_combobox_td || at == &radio_buttons_td) {
+        JanetCFunction ctor = janet_ui_combobox, append = janet_ui_combobox_append;
+        if (at == &editable_combobox_td) {
+            ctor = janet_ui_editable_combobox;
+            append = janet_ui_editable_combobox_append;
+        } else if (at == &radio_buttons_td) {
+            ctor = janet_ui_radio_buttons;
+            append = janet_ui_radio_buttons_append;
+        }
+        ctl = spec_call(ctor, 0, nil, nil, nil, nil);
+        JanetView items = spec_view(spec, "items");
+        for (int32_t i = 0; i < items.len; i++) spec_call(append, 2, ctl, items.items[i], nil, nil);
+        Janet selected = spec_get(spec, "selected");
+        if (at == &editable_combobox_td) {
+            uiEditableComboboxSetText(janet_getuitype(&ctl, 0, at), (const char *) janet_unwrap_string(text));
+        } else if (janet_checkint(selected)) {
+            if (at == &combobox_td) {
+                uiComboboxSetSelected(janet_getuitype(&ctl, 0, at), janet_unwrap_integer(selected));
+            } else {
+                uiRadioButtonsSetSelected(janet_getuitype(&ctl, 0, at), janet_unwrap_integer(selected));
+            }
+        }
+    } else if (at == &multiline_entry_td) {
+        ctl = spec_call(janet_ui_multiline_entry, 1, janet_wrap_boolean(!spec_flag(spec, "wrapping", 1)),
+                nil, nil, nil);
+        uiMultilineEntry *me = janet_getuitype(&ctl, 0, &multiline_entry_td);
+        uiMultilineEntrySetText(me, (const char *) janet_unwrap_string(text));
+        uiMultilineEntrySetReadOnly(me, spec_flag(spec, "read-only", 0));
+    } else if (at == &area_td) {
+        JanetView size = spec_view(spec, "size");
+        if (size.len == 2) {
+            ctl = spec_call(janet_ui_area, 2, size.items[0], size.items[1], nil, nil);
+        } else {
+            ctl = spec_call(janet_ui_area, 0, nil, nil, nil, nil);
+        }
+    } else if (at == &virtual_list_td) {
+        ctl = spec_call(janet_ui_virtual_list, 4, spec_get(spec, "count"), spec_get(spec, "row-height"),
+                spec_get(spec, "render"), janet_wrap_boolean(spec_flag(spec, "estimated", 0)));
+        Janet top = spec_get(spec, "top");
+        Janet selected = spec_get(spec, "selected");
+        if (!janet_checktype(selected, JANET_NIL)) {
+            spec_call(janet_ui_virtual_list_selected, 2, ctl, selected, nil, nil);
+        }
+        if (!janet_checktype(top, JANET_NIL)) spec_call(janet_ui_virtual_list_scroll_to, 2, ctl, top, nil, nil);
+    } else if (at == &file_view_td) {
+        ctl = spec_call(janet_ui_file_view, 2, spec_get(spec, "path"), spec_get(spec, "follow"), nil, nil);
+    } else if (at == &text_view_td) {
+        ctl = spec_call(janet_ui_text_view, 2, spec_get(spec, "rules"), spec_get(spec, "text"), nil, nil);
+    } else if (at == &tree_view_td) {
+        ctl = spec_call(janet_ui_tree_view, 2, spec_get(spec, "fetch"), spec_get(spec, "root"), nil, nil);
+    } else if (at == &graph_view_td) {
+        ctl = spec_call(janet_ui_graph_view, 2, spec_get(spec, "nodes"), spec_get(spec, "edges"), nil, nil);
+    } else {
+        janet_panicf("cannot restore control of type %v", type);
+    }
+    JanetView handlers = spec_view(spec, "handlers");
+    for (int32_t i = 0; i < handlers.len; i++) {
+        const Janet *entry;
+        int32_t len;
+        if (!janet_indexed_view(handlers.items[i], &entry, &len) || len != 3 || !janet_checkint(entry[0])) {
+            janet_panicf("expected handler [slot function with-args], got %v", handlers.items[i]);
+        }
+        const UIHandlerSetter *hs = handler_setter(at, janet_unwrap_integer(entry[0]));
+        if (NULL == hs) janet_panicf("no handler slot %v for %v", entry[0], type);
+        spec_call(hs->setter, at == &area_td ? 2 : 3, ctl, entry[1], entry[2], nil);
+    }
+    restore_children(ctl, spec);
+    if (!spec_flag(spec, "enabled", 1)) uiControlDisable(janet_getcontrol(&ctl, 0));
+    if (at == &window_td) {
+        if (spec_flag(spec, "visible", 0)) uiControlShow(janet_getcontrol(&ctl, 0));
+    } else if (!spec_flag(spec, "visible", 1)) {
+        uiControlHide(janet_getcontrol(&ctl, 0));
+    }
+    return ctl;
 }
 
-static Janet janet_ui_multiline_entry_append(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 2);
-    uiMultilineEntry *me = janet_getuitype(argv, 0, &multiline_entry_td);
-    const uint8_t *text = janet_getstring(argv, 1);
-    uiMultilineEntryAppend(me, (const char *)text);
-    return argv[0];
+static Janet janet_ui_restore(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    assert_inited();
+    return restore_control(argv[0]);
 }
 
-static void multiline_entry_on_changed(uiMultilineEntry *e, void *data) {
-    (void) e;
-    janet_ui_handler(data);
+/* Recording */
+
+/* ui/record logs every handler dispatched for a control, with the time
+ * since recording started, the path of the control from its root, the
+ * event slot and the event value, so ui/replay can apply the values to
+ * the same controls and call their handlers again. The log is binary:
+ *
+ *   header "JUIR" 1
+ *   event  varint microseconds, varint path length, varint path...,
+ *          u8 slot, varint value length, marshalled value
+ *
+ * The first path element is the index of the root window or menu in
+ * creation order, and the rest are child indices. Replays are only
+ * deterministic if the program creates its roots in the same order. */
+
+#define UI_RECORD_MAGIC "JUIR"
+#define UI_RECORD_VERSION 1
+#define UI_RECORD_MAX_DEPTH 64
+
+static JANET_THREAD_LOCAL uint64_t record_start = 0;
+
+static void record_varint(JanetBuffer *buf, uint64_t x) {
+    while (x >= 0x80) {
+        janet_buffer_push_u8(buf, (uint8_t)(x | 0x80));
+        x >>= 7;
+    }
+    janet_buffer_push_u8(buf, (uint8_t) x);
 }
 
-static Janet janet_ui_multiline_entry_on_changed(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 2);
-    uiMultilineEntry *me = janet_getuitype(argv, 0, &multiline_entry_td);
-    assert_callable(argv, 1);
-    void *handle = janet_ui_to_handler_data(argv[1]);
-    uiMultilineEntryOnChanged(me, multiline_entry_on_changed, handle);
-    return argv[0];
+static uint64_t replay_varint(const uint8_t **p, const uint8_t *end) {
+    uint64_t x = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*p >= end) janet_panic("truncated event log");
+        uint8_t b = *(*p)++;
+        x |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return x;
+    }
+    janet_panic("bad varint in event log");
+    return 0;
 }
 
-/* Menu Item */
+/* Get the path of a control from its root. Returns the path length,
+ * or -1 if the control is not in a rooted tree. */
+static int32_t control_path(UIControlWrapper *w, int32_t *path) {
+    int32_t rev[UI_RECORD_MAX_DEPTH];
+    int32_t n = 0;
+    while (0 == w->root) {
+        UIControlWrapper *parent = w->parent;
+        if (NULL == parent || n == UI_RECORD_MAX_DEPTH - 1) return -1;
+        int32_t i = 0;
+        while (i < parent->child_count && parent->children[i] != w) i++;
+        rev[n++] = i;
+        w = parent;
+    }
+    rev[n++] = w->root - 1;
+    for (int32_t i = 0; i < n; i++) path[i] = rev[n - 1 - i];
+    return n;
+}
 
-static Janet janet_ui_menu_item_enable(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
-    uiMenuItem *mi = janet_getuitype(argv, 0, &menu_item_td);
-    uiMenuItemEnable(mi);
-    return argv[0];
+static UIControlWrapper *control_at_path(const int32_t *path, int32_t n) {
+    if (n < 1 || path[0] < 0 || path[0] >= ui_root_count) return NULL;
+    UIControlWrapper *w = ui_roots[path[0]];
+    for (int32_t i = 1; i < n && NULL != w; i++) {
+        w = path[i] >= 0 && path[i] < w->child_count ? w->children[path[i]] : NULL;
+    }
+    return w;
 }
 
-static Janet janet_ui_menu_item_disable(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
-    uiMenuItem *mi = janet_getuitype(argv, 0, &menu_item_td);
-    uiMenuItemDisable(mi);
-    return argv[0];
+/* The value of an event that is dispatched without one, read back
+ * from the control */
+static Janet control_event_value(UIControlWrapper *w, int slot) {
+    const JanetAbstractType *at = janet_abstract_type(w);
+    void *c = w->control;
+    if (at == &window_td && slot == 1) {
+        int width = 0, height = 0;
+        uiWindowContentSize(c, &width, &height);
+        Janet *tup = janet_tuple_begin(2);
+        tup[0] = janet_wrap_integer(width);
+        tup[1] = janet_wrap_integer(height);
+        return janet_wrap_tuple(janet_tuple_end(tup));
+    }
+    if (at == &checkbox_td) return janet_wrap_boolean(uiCheckboxChecked(c));
+    if (at == &entry_td) return janet_ui_take_text(uiEntryText(c));
+    if (at == &spinbox_td) return janet_wrap_integer(uiSpinboxValue(c));
+    if (at == &slider_td) return janet_wrap_integer(uiSliderValue(c));
+    if (at == &combobox_td) return janet_wrap_integer(uiComboboxSelected(c));
+    if (at == &editable_combobox_td) return janet_ui_take_text(uiEditableComboboxText(c));
+    if (at == &radio_buttons_td) return janet_wrap_integer(uiRadioButtonsSelected(c));
+    if (at == &multiline_entry_td) return janet_ui_take_text(uiMultilineEntryText(c));
+    if (at == &menu_item_td) return janet_wrap_boolean(uiMenuItemChecked(c));
+    if (at == &virtual_list_td || at == &file_view_td || at == &text_view_td ||
+            at == &tree_view_td) {
+        int64_t selected = ((UIVirtualList *) w)->selected;
+        return selected < 0 ? janet_wrap_nil() : janet_wrap_number((double) selected);
+    }
+    return janet_wrap_nil();
 }
 
-static Janet janet_ui_menu_item_checked(int32_t argc, Janet *argv) {
-    janet_arity(argc, 1, 2);
-    uiMenuItem *mi = janet_getuitype(argv, 0, &menu_item_td);
-    if (argc == 2) {
-        int checked = janet_getboolean(argv, 1);
-        uiMenuItemSetChecked(mi, checked);
-        return argv[0];
+/* Set a control to the value of a recorded event, as the user did */
+static void control_apply_value(UIControlWrapper *w, int slot, Janet v) {
+    const JanetAbstractType *at = janet_abstract_type(w);
+    void *c = w->control;
+    if (at == &window_td && slot == 1) {
+        const Janet *items;
+        int32_t len;
+        if (janet_indexed_view(v, &items, &len) && len == 2 &&
+                janet_checkint(items[0]) && janet_checkint(items[1])) {
+            uiWindowSetContentSize(c, janet_unwrap_integer(items[0]), janet_unwrap_integer(items[1]));
+        }
+    } else if (janet_checktype(v, JANET_STRING)) {
+        const char *text = (const char *) janet_unwrap_string(v);
+        if (at == &entry_td) uiEntrySetText(c, text);
+        else if (at == &editable_combobox_td) uiEditableComboboxSetText(c, text);
+        else if (at == &multiline_entry_td) uiMultilineEntrySetText(c, text);
+    } else if ((at == &virtual_list_td || at == &file_view_td || at == &text_view_td ||
+            at == &tree_view_td) && janet_checkint64(v)) {
+        UIVirtualList *vl = (UIVirtualList *) w;
+        int64_t index = (int64_t) janet_unwrap_number(v);
+        if (index >= 0 && index < vl->count) {
+            vl->selected = index;
+            virtual_list_reveal(vl, index);
+            virtual_list_redraw(vl);
+        }
+    } else if (janet_checkint(v)) {
+        int32_t x = janet_unwrap_integer(v);
+        if (at == &spinbox_td) uiSpinboxSetValue(c, x);
+        else if (at == &slider_td) uiSliderSetValue(c, x);
+        else if (at == &combobox_td) uiComboboxSetSelected(c, x);
+        else if (at == &radio_buttons_td) uiRadioButtonsSetSelected(c, x);
+    } else if (janet_checktype(v, JANET_BOOLEAN)) {
+        if (at == &checkbox_td) uiCheckboxSetChecked(c, janet_unwrap_boolean(v));
+        else if (at == &menu_item_td) uiMenuItemSetChecked(c, janet_unwrap_boolean(v));
     }
-    return janet_wrap_boolean(uiMenuItemChecked(mi));
 }
 
-static void menu_item_on_clicked(uiMenuItem *sender, uiWindow *window, void *data) {
-    (void) sender;
-    (void) window;
-    janet_ui_handler(data);
+static void ui_record_event(UIHandler *h, int has_value, Janet value) {
+    UIControlWrapper *w = janet_unwrap_abstract(h->control);
+    int slot = 0;
+    while (slot < UI_MAX_SLOTS && w->handlers[slot] != h) slot++;
+    if (slot == UI_MAX_SLOTS) return;
+    if (janet_abstract_type(w) == &area_td && slot == UI_AREA_DRAW) return;
+    int32_t path[UI_RECORD_MAX_DEPTH];
+    int32_t n = control_path(w, path);
+    if (n < 0) return;
+    if (!has_value) value = control_event_value(w, slot);
+    JanetBuffer *buf = record_buffer;
+    record_varint(buf, ui_now_us() - record_start);
+    record_varint(buf, (uint64_t) n);
+    for (int32_t i = 0; i < n; i++) record_varint(buf, (uint64_t) path[i]);
+    janet_buffer_push_u8(buf, (uint8_t) slot);
+    /* Marshal into a scratch buffer to prefix the length */
+    JanetBuffer *scratch = janet_buffer(16);
+    janet_marshal(scratch, value, NULL, 0);
+    record_varint(buf, (uint64_t) scratch->count);
+    janet_buffer_push_bytes(buf, scratch->data, scratch->count);
 }
 
-static Janet janet_ui_menu_item_on_clicked(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 2);
-    uiMenuItem *mi = janet_getuitype(argv, 0, &menu_item_td);
-    assert_callable(argv, 1);
-    void *handle = janet_ui_to_handler_data(argv[1]);
-    uiMenuItemOnClicked(mi, menu_item_on_clicked, handle);
-    return argv[0];
+/* Start recording into a new or given buffer */
+static Janet janet_ui_record(int32_t argc, Janet *argv) {
+    janet_arity(argc, 0, 1);
+    if (NULL != record_buffer) janet_panic("already recording");
+    JanetBuffer *buf = argc == 1 ? janet_getbuffer(argv, 0) : janet_buffer(1024);
+    janet_buffer_push_bytes(buf, (const uint8_t *) UI_RECORD_MAGIC, 4);
+    janet_buffer_push_u8(buf, UI_RECORD_VERSION);
+    janet_gcroot(janet_wrap_buffer(buf));
+    record_buffer = buf;
+    record_start = ui_now_us();
+    return janet_wrap_buffer(buf);
 }
 
-/* Menu */
+/* Stop recording, returning the log */
+static Janet janet_ui_record_stop(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 0);
+    (void) argv;
+    if (NULL == record_buffer) return janet_wrap_nil();
+    Janet ret = janet_wrap_buffer(record_buffer);
+    janet_gcunroot(ret);
+    record_buffer = NULL;
+    return ret;
+}
 
-static Janet janet_ui_menu(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
-    const uint8_t *name = janet_getstring(argv, 0);
-    assert_inited();
-    return janet_ui_handle_to_control(
-            uiNewMenu((const char *)name),
-            &menu_td);
+/* A replay in progress. Events are decoded up front, into tuples of
+ * [microseconds path slot value], so a bad log is reported to the
+ * caller of ui/replay rather than from a timer. */
+typedef struct {
+    JanetArray *events;
+    int32_t next;
+    /* Speed multiplier, or 0 to replay as fast as possible */
+    double speed;
+    uint64_t start;
+    uint64_t handler_time;
+    int32_t skipped;
+    void *done;
+} UIReplay;
+
+static void replay_step(UIReplay *r);
+
+static int replay_timer(void *data) {
+    replay_step((UIReplay *) data);
+    return 0;
 }
 
-static Janet janet_ui_menu_append_item(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 2);
-    uiMenu *menu = janet_getuitype(argv, 0, &menu_td);
-    const uint8_t *name = janet_getstring(argv, 1);
-    return janet_ui_handle_to_control(
-            uiMenuAppendItem(menu, (const char *)name),
-            &menu_item_td);
+static void replay_queued(void *data) {
+    replay_step((UIReplay *) data);
 }
 
-static Janet janet_ui_menu_append_check_item(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 2);
-    uiMenu *menu = janet_getuitype(argv, 0, &menu_td);
-    const uint8_t *name = janet_getstring(argv, 1);
-    return janet_ui_handle_to_control(
-            uiMenuAppendCheckItem(menu, (const char *)name),
-            &menu_item_td);
+/* Apply the value of an event and call the handler of its slot the way
+ * the libui callback would */
+static void replay_fire(UIControlWrapper *w, int slot, Janet value) {
+    UIHandler *h = (UIHandler *) w->handlers[slot];
+    if (NULL == h) return;
+    const JanetAbstractType *at = janet_abstract_type(w);
+    control_apply_value(w, slot, value);
+    if (at == &window_td && slot == 0) {
+        /* libui destroys the window unless the handler vetoed it */
+        if (window_closing_handler((uiWindow *) w->control, h)) uiControlDestroy(w->control);
+    } else if (at == &area_td) {
+        janet_ui_dispatch(h, slot != UI_AREA_DRAG_BROKEN, value, NULL);
+    } else {
+        janet_ui_dispatch(h, !janet_checktype(value, JANET_NIL), value, NULL);
+    }
 }
 
-static Janet janet_ui_menu_append_quit_item(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
-    uiMenu *menu = janet_getuitype(argv, 0, &menu_td);
-    return janet_ui_handle_to_control(
-            uiMenuAppendQuitItem(menu),
-            &menu_item_td);
+static void replay_finish(UIReplay *r) {
+    janet_gcunroot(janet_wrap_array(r->events));
+    if (NULL != r->done) {
+        JanetKV *st = janet_struct_begin(4);
+        janet_struct_put(st, janet_ckeywordv("events"), janet_wrap_integer(r->events->count));
+        janet_struct_put(st, janet_ckeywordv("skipped"), janet_wrap_integer(r->skipped));
+        janet_struct_put(st, janet_ckeywordv("elapsed"), janet_wrap_number((ui_now_us() - r->start) / 1e6));
+        janet_struct_put(st, janet_ckeywordv("handler-time"), janet_wrap_number(r->handler_time / 1e6));
+        Janet stats = janet_wrap_struct(janet_struct_end(st));
+        janet_ui_call(janet_ui_from_handler_data(r->done), 1, &stats, NULL);
+        janet_ui_release_handler_data(r->done);
+    }
+    free(r);
 }
 
-static Janet janet_ui_menu_append_about_item(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
-    uiMenu *menu = janet_getuitype(argv, 0, &menu_td);
-    return janet_ui_handle_to_control(
-            uiMenuAppendAboutItem(menu),
-            &menu_item_td);
+/* Fire every event that is due, then schedule the next one */
+static void replay_step(UIReplay *r) {
+    while (r->next < r->events->count) {
+        const Janet *ev = janet_unwrap_tuple(r->events->data[r->next]);
+        uint64_t due = r->start + (r->speed > 0 ? (uint64_t)(janet_unwrap_number(ev[0]) / r->speed) : 0);
+        uint64_t now = ui_now_us();
+        if (r->speed > 0 && due > now) {
+            uiTimer((int)((due - now + 999) / 1000), replay_timer, r);
+            return;
+        }
+        const Janet *pathv = janet_unwrap_tuple(ev[1]);
+        int32_t path[UI_RECORD_MAX_DEPTH];
+        int32_t n = janet_tuple_length(pathv);
+        for (int32_t i = 0; i < n; i++) path[i] = janet_unwrap_integer(pathv[i]);
+        UIControlWrapper *w = control_at_path(path, n);
+        r->next++;
+        if (NULL == w || (w->flags & UI_FLAG_DESTROYED)) {
+            r->skipped++;
+        } else {
+            replay_fire(w, janet_unwrap_integer(ev[2]), ev[3]);
+            r->handler_time += ui_now_us() - now;
+        }
+        /* Let the toolkit process the event before the next one */
+        if (r->speed <= 0 && r->next < r->events->count) {
+            uiQueueMain(replay_queued, r);
+            return;
+        }
+    }
+    replay_finish(r);
 }
 
-static Janet janet_ui_menu_append_preferences_item(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
-    uiMenu *menu = janet_getuitype(argv, 0, &menu_td);
-    return janet_ui_handle_to_control(
-            uiMenuAppendPreferencesItem(menu),
-            &menu_item_td);
+/* Decode an event log into tuples of [microseconds path slot value] */
+static JanetArray *replay_decode(JanetByteView log) {
+    const uint8_t *p = log.bytes;
+    const uint8_t *end = log.bytes + log.len;
+    if (log.len < 5 || memcmp(p, UI_RECORD_MAGIC, 4) || p[4] != UI_RECORD_VERSION) {
+        janet_panic("not an event log");
+    }
+    p += 5;
+    JanetArray *events = janet_array(0);
+    while (p < end) {
+        Janet *ev = janet_tuple_begin(4);
+        ev[0] = janet_wrap_number((double) replay_varint(&p, end));
+        uint64_t n = replay_varint(&p, end);
+        if (n < 1 || n > UI_RECORD_MAX_DEPTH) janet_panic("bad control path in event log");
+        Janet *path = janet_tuple_begin((int32_t) n);
+        for (uint64_t i = 0; i < n; i++) path[i] = janet_wrap_integer((int32_t) replay_varint(&p, end));
+        ev[1] = janet_wrap_tuple(janet_tuple_end(path));
+        if (p >= end) janet_panic("truncated event log");
+        uint8_t slot = *p++;
+        if (slot >= UI_MAX_SLOTS) janet_panic("bad event slot in event log");
+        ev[2] = janet_wrap_integer(slot);
+        uint64_t len = replay_varint(&p, end);
+        if (len > (uint64_t)(end - p)) janet_panic("truncated event log");
+        ev[3] = janet_unmarshal(p, (size_t) len, 0, NULL, NULL);
+        p += len;
+        janet_array_push(events, janet_wrap_tuple(janet_tuple_end(ev)));
+    }
+    return events;
 }
 
-static Janet janet_ui_menu_append_separator(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
-    uiMenu *menu = janet_getuitype(argv, 0, &menu_td);
-    uiMenuAppendSeparator(menu);
-    return argv[0];
+/* (ui/replay log &opt speed on-done) replays a log at a multiple of
+ * the recorded speed, or as fast as possible if speed is :max. on-done
+ * is called with the number of events, skipped events, elapsed
+ * seconds and seconds spent in handlers. */
+static Janet janet_ui_replay(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 3);
+    assert_inited();
+    JanetByteView log = janet_getbytes(argv, 0);
+    double speed = 1.0;
+    if (argc >= 2 && !janet_checktype(argv[1], JANET_NIL)) {
+        if (janet_keyeq(argv[1], "max")) {
+            speed = 0;
+        } else {
+            speed = janet_getnumber(argv, 1);
+            if (!(speed > 0) || isinf(speed)) {
+                janet_panicf("expected finite positive speed or :max, got %v", argv[1]);
+            }
+        }
+    }
+    if (argc == 3) assert_callable(argv, 2);
+    JanetArray *events = replay_decode(log);
+    UIReplay *r = malloc(sizeof(UIReplay));
+    if (NULL == r) janet_panic("out of memory");
+    r->events = events;
+    r->next = 0;
+    r->speed = speed;
+    r->start = ui_now_us();
+    r->handler_time = 0;
+    r->skipped = 0;
+    r->done = argc == 3 ? janet_ui_to_handler_data(argv[2]) : NULL;
+    janet_gcroot(janet_wrap_array(events));
+    uiQueueMain(replay_queued, r);
+    return janet_wrap_integer(events->count);
 }
 
 /*****************************************************************************/
@@ -1146,8 +10367,26 @@ static const JanetReg cfuns[] = {
     {"main-step", janet_ui_mainstep, NULL},
     {"main-steps", janet_ui_mainsteps, NULL},
     {"queue-main", janet_ui_queue_main, NULL},
+    {"schedule-idle", janet_ui_schedule_idle, NULL},
+    {"cancel-idle", janet_ui_cancel_idle, NULL},
+    {"idle-task-info", janet_ui_idle_task_info, NULL},
+    {"idle-budget", janet_ui_idle_budget, NULL},
+    {"spawn-task", janet_ui_spawn_task, NULL},
+    {"cancel-task", janet_ui_cancel_task, NULL},
+    {"trace-start", janet_ui_trace_start, NULL},
+    {"trace-stop", janet_ui_trace_stop, NULL},
     {"on-should-quit", janet_ui_on_should_quit, NULL},
+    {"on-error", janet_ui_on_error, NULL},
+    {"memory-report", janet_ui_memory_report, NULL},
+    {"snapshot", janet_ui_snapshot, NULL},
+    {"restore", janet_ui_restore, NULL},
+    {"record", janet_ui_record, NULL},
+    {"record-stop", janet_ui_record_stop, NULL},
+    {"replay", janet_ui_replay, NULL},
     {"timer", janet_ui_timer, NULL},
+    {"bind-metric", janet_ui_bind_metric, NULL},
+    {"unbind-metric", janet_ui_unbind_metric, NULL},
+    {"metric-refresh-rate", janet_ui_metric_refresh_rate, NULL},
     {"save-file", janet_ui_save_file, NULL},
     {"open-file", janet_ui_open_file, NULL},
     {"message-box", janet_ui_message_box, NULL},
@@ -1212,6 +10451,7 @@ static const JanetReg cfuns[] = {
     {"tab/append", janet_ui_tab_append, NULL},
     {"tab/insert-at", janet_ui_tab_insert_at, NULL},
     {"tab/delete", janet_ui_tab_delete, NULL},
+    {"tab/append-lazy", janet_ui_tab_append_lazy, NULL},
 
     /* Group */
     {"group", janet_ui_group, NULL},
@@ -1261,6 +10501,8 @@ static const JanetReg cfuns[] = {
     {"multiline-entry/read-only", janet_ui_multiline_entry_read_only, NULL},
     {"multiline-entry/append", janet_ui_multiline_entry_append, NULL},
     {"multiline-entry/on-changed", janet_ui_multiline_entry_on_changed, NULL},
+    {"multiline-entry/load-stream", janet_ui_multiline_entry_load_stream, NULL},
+    {"multiline-entry/cancel-load", janet_ui_multiline_entry_cancel_load, NULL},
 
     /* Menu Item */
     {"menu-item/enable", janet_ui_menu_item_enable, NULL},
@@ -1277,9 +10519,100 @@ static const JanetReg cfuns[] = {
     {"menu/append-preferences-item", janet_ui_menu_append_preferences_item, NULL},
     {"menu/append-separator", janet_ui_menu_append_separator, NULL},
 
+    /* Image */
+    {"image", janet_ui_image, NULL},
+    {"image/append", janet_ui_image_append, NULL},
+    {"image/scaled", janet_ui_image_scaled, NULL},
+    {"image/cache-limit", janet_ui_image_cache_limit, NULL},
+    {"image/cache-clear", janet_ui_image_cache_clear, NULL},
+    {"image/cache-stats", janet_ui_image_cache_stats, NULL},
+
+    /* Filter Index */
+    {"filter-index", janet_ui_filter_index, NULL},
+    {"filter-index/query", janet_ui_filter_index_query, NULL},
+    {"filter-index/count", janet_ui_filter_index_count, NULL},
+    {"filter-index/results", janet_ui_filter_index_results, NULL},
+
+    /* Draw */
+    {"draw-list", janet_ui_draw_list, NULL},
+    {"draw-list/clear", janet_ui_draw_list_clear, NULL},
+    {"draw-list/count", janet_ui_draw_list_count, NULL},
+    {"draw/rect", janet_ui_draw_rect, NULL},
+    {"draw/line", janet_ui_draw_line, NULL},
+    {"draw/circle", janet_ui_draw_circle, NULL},
+    {"draw/text", janet_ui_draw_text, NULL},
+    {"draw/list", janet_ui_draw_list_replay, NULL},
+    {"draw/size", janet_ui_draw_size, NULL},
+    {"draw/clip", janet_ui_draw_clip, NULL},
+
+    /* Area */
+    {"area", janet_ui_area, NULL},
+    {"area/on-draw", janet_ui_area_on_draw, NULL},
+    {"area/on-mouse-event", janet_ui_area_on_mouse_event, NULL},
+    {"area/on-mouse-crossed", janet_ui_area_on_mouse_crossed, NULL},
+    {"area/on-drag-broken", janet_ui_area_on_drag_broken, NULL},
+    {"area/on-key-event", janet_ui_area_on_key_event, NULL},
+    {"area/queue-redraw-all", janet_ui_area_queue_redraw_all, NULL},
+    {"area/invalidate-rect", janet_ui_area_invalidate_rect, NULL},
+    {"area/set-size", janet_ui_area_set_size, NULL},
+    {"area/scroll-to", janet_ui_area_scroll_to, NULL},
+    {"area/set-scene", janet_ui_area_set_scene, NULL},
+    {"area/attach-scene", janet_ui_area_attach_scene, NULL},
+    {"scene", janet_ui_scene, NULL},
+    {"scene/rect", janet_ui_scene_rect, NULL},
+    {"scene/circle", janet_ui_scene_circle, NULL},
+    {"scene/path", janet_ui_scene_path, NULL},
+    {"scene/text", janet_ui_scene_text, NULL},
+    {"scene/remove", janet_ui_scene_remove, NULL},
+    {"scene/clear", janet_ui_scene_clear, NULL},
+    {"scene/move", janet_ui_scene_move, NULL},
+    {"scene/z", janet_ui_scene_z, NULL},
+    {"scene/count", janet_ui_scene_count, NULL},
+    {"scene/hit", janet_ui_scene_hit, NULL},
+    {"scene/query", janet_ui_scene_query, NULL},
+    {"scene/bounds", janet_ui_scene_bounds, NULL},
+    {"area/tile-stats", janet_ui_area_tile_stats, NULL},
+
+    /* Virtual List */
+    {"virtual-list", janet_ui_virtual_list, NULL},
+    {"virtual-list/count", janet_ui_virtual_list_count, NULL},
+    {"virtual-list/invalidate", janet_ui_virtual_list_invalidate, NULL},
+    {"virtual-list/scroll-to", janet_ui_virtual_list_scroll_to, NULL},
+    {"virtual-list/selected", janet_ui_virtual_list_selected, NULL},
+    {"virtual-list/on-selected", janet_ui_virtual_list_on_selected, NULL},
+    {"virtual-list/stats", janet_ui_virtual_list_stats, NULL},
+    {"file-view", janet_ui_file_view, NULL},
+    {"file-view/line", janet_ui_file_view_line, NULL},
+    {"file-view/progress", janet_ui_file_view_progress, NULL},
+    {"file-view/refresh", janet_ui_file_view_refresh, NULL},
+    {"text-view", janet_ui_text_view, NULL},
+    {"text-view/set-rules", janet_ui_text_view_set_rules, NULL},
+    {"text-view/set-text", janet_ui_text_view_set_text, NULL},
+    {"text-view/append", janet_ui_text_view_append, NULL},
+    {"text-view/replace-lines", janet_ui_text_view_replace_lines, NULL},
+    {"text-view/line", janet_ui_text_view_line, NULL},
+    {"text-view/stats", janet_ui_text_view_stats, NULL},
+    {"tree-view", janet_ui_tree_view, NULL},
+    {"tree-view/toggle", janet_ui_tree_view_toggle, NULL},
+    {"tree-view/key", janet_ui_tree_view_key, NULL},
+    {"tree-view/path", janet_ui_tree_view_path, NULL},
+    {"tree-view/reload", janet_ui_tree_view_reload, NULL},
+    {"tree-view/stats", janet_ui_tree_view_stats, NULL},
+    {"graph-view", janet_ui_graph_view, NULL},
+    {"graph-view/on-node-clicked", janet_ui_graph_view_on_node_clicked, NULL},
+    {"graph-view/reheat", janet_ui_graph_view_reheat, NULL},
+    {"graph-view/stop", janet_ui_graph_view_stop, NULL},
+    {"graph-view/fit", janet_ui_graph_view_fit, NULL},
+    {"graph-view/view", janet_ui_graph_view_view, NULL},
+    {"graph-view/position", janet_ui_graph_view_position, NULL},
+    {"graph-view/node-at", janet_ui_graph_view_node_at, NULL},
+    {"graph-view/stats", janet_ui_graph_view_stats, NULL},
+
     {NULL, NULL, NULL}
 };
 
 JANET_MODULE_ENTRY(JanetTable *env) {
+    janet_register_abstract_type(&metric_td);
     janet_cfuns(env, "ui", cfuns);
+    janet_cfuns(env, "ui", metric_cfuns);
 }